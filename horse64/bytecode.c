@@ -2,6 +2,8 @@
 // also see LICENSE.md file.
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include "compileconfig.h"
+
 #include <assert.h>
 #include <inttypes.h>
 #include <stddef.h>
@@ -16,6 +18,7 @@
 #include "gcvalue.h"
 #include "hash.h"
 #include "uri.h"
+#include "vmstrings.h"
 
 
 static char _name_itype_invalid[] = "invalid_instruction";
@@ -35,12 +38,8 @@ static char _name_itype_condjump[] = "condjump";
 static char _name_itype_jump[] = "jump";
 static char _name_itype_newiterator[] = "newiterator";
 static char _name_itype_iterate[] = "iterate";
-static char _name_itype_pushcatchframe[] = "pushcatchframe";
-static char _name_itype_addcatchtypebyref[] = "addcatchtyperef";
-static char _name_itype_addcatchtype[] = "addcatchtype";
-static char _name_itype_popcatchframe[] = "popcatchframe";
+static char _name_itype_endfinally[] = "endfinally";
 static char _name_itype_getmember[] = "getmember";
-static char _name_itype_jumptofinally[] = "jumptofinally";
 static char _name_itype_newlist[] = "newlist";
 static char _name_itype_addtolist[] = "addtolist";
 static char _name_itype_newset[] = "newset";
@@ -49,6 +48,13 @@ static char _name_itype_newvector[] = "newvector";
 static char _name_itype_putvector[] = "putvector";
 static char _name_itype_newmap[] = "newmap";
 static char _name_itype_putmap[] = "putmap";
+static char _name_itype_binopcondjump[] = "binopcondjump";
+static char _name_itype_binopconst[] = "binopconst";
+static char _name_itype_callfunc[] = "callfunc";
+static char _name_itype_tailcall[] = "tailcall";
+static char _name_itype_tailcallfunc[] = "tailcallfunc";
+static char _name_itype_binopint[] = "binopint";
+static char _name_itype_binopfloat[] = "binopfloat";
 
 
 const char *bytecode_InstructionTypeToStr(instructiontype itype) {
@@ -87,18 +93,10 @@ const char *bytecode_InstructionTypeToStr(instructiontype itype) {
         return _name_itype_newiterator;
     case H64INST_ITERATE:
         return _name_itype_iterate;
-    case H64INST_PUSHCATCHFRAME:
-        return _name_itype_pushcatchframe;
-    case H64INST_ADDCATCHTYPEBYREF:
-        return _name_itype_addcatchtypebyref;
-    case H64INST_ADDCATCHTYPE:
-        return _name_itype_addcatchtype;
-    case H64INST_POPCATCHFRAME:
-        return _name_itype_popcatchframe;
+    case H64INST_ENDFINALLY:
+        return _name_itype_endfinally;
     case H64INST_GETMEMBER:
         return _name_itype_getmember;
-    case H64INST_JUMPTOFINALLY:
-        return _name_itype_jumptofinally;
     case H64INST_NEWLIST:
         return _name_itype_newlist;
     case H64INST_ADDTOLIST:
@@ -115,6 +113,20 @@ const char *bytecode_InstructionTypeToStr(instructiontype itype) {
         return _name_itype_newmap;
     case H64INST_PUTMAP:
         return _name_itype_putmap;
+    case H64INST_BINOPCONDJUMP:
+        return _name_itype_binopcondjump;
+    case H64INST_BINOPCONST:
+        return _name_itype_binopconst;
+    case H64INST_CALLFUNC:
+        return _name_itype_callfunc;
+    case H64INST_TAILCALL:
+        return _name_itype_tailcall;
+    case H64INST_TAILCALLFUNC:
+        return _name_itype_tailcallfunc;
+    case H64INST_BINOPINT:
+        return _name_itype_binopint;
+    case H64INST_BINOPFLOAT:
+        return _name_itype_binopfloat;
     default:
         fprintf(stderr, "bytecode_InstructionTypeToStr: called "
                 "on invalid value %d\n", itype);
@@ -256,9 +268,235 @@ int h64program_RegisterClassMemberEx(
     buckets[buckets_count + 1].methodorvaridx = -1;
     buckets[buckets_count].nameid = nameid;
     buckets[buckets_count].methodorvaridx = (
-        func_idx > 0 ?
+        func_idx >= 0 ?
         entry_idx : (H64CLASS_MAX_METHODS + entry_idx)
     );
+
+    // Any finalized lookup is outdated now:
+    free(p->classes[class_id].member_lookup_disp);
+    p->classes[class_id].member_lookup_disp = NULL;
+    p->classes[class_id].member_lookup_slots = NULL;
+    return 1;
+}
+
+static inline uint64_t _memberlookup_Hash(
+        int64_t nameid, uint32_t disp
+        ) {
+    // splitmix64 finalizer, seeded by the displacement:
+    uint64_t x = (
+        (uint64_t)nameid + (uint64_t)disp * 0x9E3779B97F4A7C15ULL
+    );
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static int _memberlookup_TryBuild(
+        h64classmemberinfo *members,
+        int *bucketstart, int *bucketorder,
+        int32_t *disp, uint32_t bucketmask,
+        h64classmemberinfo *slots, uint32_t slotmask
+        ) {
+    uint32_t i = 0;
+    while (i <= slotmask) {
+        slots[i].nameid = -1;
+        slots[i].methodorvaridx = -1;
+        i++;
+    }
+    // Place the biggest buckets first, while there's most room:
+    int k = 0;
+    while (k < (int)bucketmask + 1) {
+        int b = bucketorder[k];
+        int bstart = bucketstart[b];
+        int bcount = bucketstart[b + 1] - bstart;
+        disp[b] = 0;
+        if (bcount == 0) {
+            k++;
+            continue;
+        }
+        uint32_t d = 1;
+        while (d < (1U << 16)) {
+            int j = 0;
+            while (j < bcount) {
+                uint32_t slot = (uint32_t)(_memberlookup_Hash(
+                    members[bstart + j].nameid, d
+                ) & slotmask);
+                if (slots[slot].nameid >= 0)
+                    break;
+                // Also check the other members in this bucket:
+                int j2 = 0;
+                while (j2 < j) {
+                    if ((uint32_t)(_memberlookup_Hash(
+                            members[bstart + j2].nameid, d
+                            ) & slotmask) == slot)
+                        break;
+                    j2++;
+                }
+                if (j2 < j)
+                    break;
+                j++;
+            }
+            if (j >= bcount)
+                break;  // all of them fit
+            d++;
+        }
+        if (d >= (1U << 16))
+            return 0;
+        disp[b] = (int32_t)d;
+        int j = 0;
+        while (j < bcount) {
+            uint32_t slot = (uint32_t)(_memberlookup_Hash(
+                members[bstart + j].nameid, d
+            ) & slotmask);
+            memcpy(&slots[slot], &members[bstart + j], sizeof(*slots));
+            j++;
+        }
+        k++;
+    }
+    return 1;
+}
+
+int h64program_FinalizeClassMemberLookup(
+        h64program *p, int64_t class_id
+        ) {
+    h64class *c = &p->classes[class_id];
+    if (c->member_lookup_disp != NULL)
+        return 1;
+    int count = c->methods_count + c->vars_count;
+
+    // Collect all members from the registration buckets:
+    h64classmemberinfo *unsorted = malloc(
+        sizeof(*unsorted) * (count + 1)
+    );
+    if (!unsorted)
+        return 0;
+    int fill = 0;
+    int i = 0;
+    while (i < H64CLASS_HASH_SIZE) {
+        h64classmemberinfo *buckets = c->global_name_to_member_hashmap[i];
+        int k = 0;
+        while (buckets[k].nameid >= 0) {
+            assert(fill < count);
+            memcpy(&unsorted[fill], &buckets[k], sizeof(*unsorted));
+            fill++;
+            k++;
+        }
+        i++;
+    }
+    assert(fill == count);
+
+    // Roughly two members per displacement bucket, and at most
+    // 50% slot usage so a displacement is found quickly:
+    uint32_t bucketcount = 1;
+    while ((int)bucketcount * 2 < count)
+        bucketcount *= 2;
+    uint32_t slotcount = 1;
+    while ((int)slotcount < count * 2)
+        slotcount *= 2;
+    while (1) {
+        h64classmemberinfo *members = malloc(
+            sizeof(*members) * (count + 1)
+        );
+        int *bucketstart = malloc(
+            sizeof(*bucketstart) * (bucketcount + 1)
+        );
+        int *bucketorder = malloc(sizeof(*bucketorder) * bucketcount);
+        // Displacements and slots share one allocation:
+        size_t dispbytes = (
+            ((sizeof(int32_t) * bucketcount + sizeof(h64classmemberinfo)
+              - 1) / sizeof(h64classmemberinfo)) *
+            sizeof(h64classmemberinfo)
+        );
+        char *table = malloc(
+            dispbytes + sizeof(h64classmemberinfo) * slotcount
+        );
+        if (!members || !bucketstart || !bucketorder || !table) {
+            free(members);
+            free(bucketstart);
+            free(bucketorder);
+            free(table);
+            free(unsorted);
+            return 0;
+        }
+
+        // Sort members by displacement bucket (counting sort):
+        memset(bucketstart, 0, sizeof(*bucketstart) * (bucketcount + 1));
+        i = 0;
+        while (i < count) {
+            uint32_t b = (uint32_t)(_memberlookup_Hash(
+                unsorted[i].nameid, 0
+            ) & (bucketcount - 1));
+            bucketstart[b + 1]++;
+            i++;
+        }
+        uint32_t b = 0;
+        while (b < bucketcount) {
+            bucketstart[b + 1] += bucketstart[b];
+            b++;
+        }
+        int *bucketfill = bucketorder;  // reused as scratch first
+        memcpy(bucketfill, bucketstart, sizeof(*bucketfill) * bucketcount);
+        i = 0;
+        while (i < count) {
+            b = (uint32_t)(_memberlookup_Hash(
+                unsorted[i].nameid, 0
+            ) & (bucketcount - 1));
+            memcpy(&members[bucketfill[b]], &unsorted[i],
+                   sizeof(*members));
+            bucketfill[b]++;
+            i++;
+        }
+
+        // Order buckets by size, biggest first (insertion sort):
+        b = 0;
+        while (b < bucketcount) {
+            int size = bucketstart[b + 1] - bucketstart[b];
+            int k = (int)b;
+            while (k > 0 && bucketstart[bucketorder[k - 1] + 1] -
+                    bucketstart[bucketorder[k - 1]] < size) {
+                bucketorder[k] = bucketorder[k - 1];
+                k--;
+            }
+            bucketorder[k] = (int)b;
+            b++;
+        }
+
+        int32_t *disp = (int32_t *)table;
+        h64classmemberinfo *slots = (h64classmemberinfo *)(
+            table + dispbytes
+        );
+        int result = _memberlookup_TryBuild(
+            members, bucketstart, bucketorder,
+            disp, bucketcount - 1, slots, slotcount - 1
+        );
+        free(members);
+        free(bucketstart);
+        free(bucketorder);
+        if (result) {
+            c->member_lookup_disp = disp;
+            c->member_lookup_slots = slots;
+            c->member_lookup_bucketmask = bucketcount - 1;
+            c->member_lookup_slotmask = slotcount - 1;
+            break;
+        }
+        // Very unlikely, but just retry with more room:
+        free(table);
+        slotcount *= 2;
+    }
+    free(unsorted);
+    return 1;
+}
+
+int h64program_FinalizeAllClassMemberLookups(h64program *p) {
+    int64_t i = 0;
+    while (i < p->classes_count) {
+        if (!h64program_FinalizeClassMemberLookup(p, i))
+            return 0;
+        i++;
+    }
     return 1;
 }
 
@@ -267,6 +505,31 @@ void h64program_LookupClassMember(
         int *out_membervarid, int *out_memberfuncid
         ) {
     assert(p != NULL && p->symbols != NULL);
+    h64class *c = &p->classes[class_id];
+    if (likely(c->member_lookup_disp != NULL)) {
+        // Finalized, so one probe into the perfect hash table:
+        uint32_t bucket = (uint32_t)(
+            _memberlookup_Hash(nameid, 0) & c->member_lookup_bucketmask
+        );
+        h64classmemberinfo *slot = &c->member_lookup_slots[
+            _memberlookup_Hash(nameid, c->member_lookup_disp[bucket]) &
+            c->member_lookup_slotmask
+        ];
+        if (slot->nameid == nameid && nameid >= 0) {
+            int64_t result = slot->methodorvaridx;
+            if (result < H64CLASS_MAX_METHODS) {
+                *out_memberfuncid = result;
+                *out_membervarid = -1;
+            } else {
+                *out_memberfuncid = -1;
+                *out_membervarid = (result - H64CLASS_MAX_METHODS);
+            }
+            return;
+        }
+        *out_memberfuncid = -1;
+        *out_membervarid = -1;
+        return;
+    }
     int bucketindex = (nameid % (int64_t)H64CLASS_HASH_SIZE);
     h64classmemberinfo *buckets =
         (p->classes[class_id].
@@ -300,6 +563,7 @@ void h64program_LookupClassMemberByname(
     if (nameid < 0) {
         *out_membervarid = -1;
         *out_memberfuncid = -1;
+        return;
     }
     return h64program_LookupClassMember(
         p, class_id, nameid, out_membervarid, out_memberfuncid
@@ -387,7 +651,9 @@ void h64program_FreeInstructions(
         h64instructionany *inst = (h64instructionany*)p;
         if (inst->type == H64INST_SETCONST) {
             h64instruction_setconst *instsetconst = (void *)p;
-            valuecontent_Free(&instsetconst->content);
+            valuecontent content;
+            memcpy(&content, &instsetconst->content, sizeof(content));
+            valuecontent_Free(&content);
         }
         len -= (int)nextelement;
         p += (ptrdiff_t)nextelement;
@@ -413,6 +679,8 @@ size_t h64program_PtrToInstructionSize(char *ptr) {
     case H64INST_VALUECOPY:
         return sizeof(h64instruction_valuecopy);
     case H64INST_BINOP:
+    case H64INST_BINOPINT:
+    case H64INST_BINOPFLOAT:
         return sizeof(h64instruction_binop);
     case H64INST_UNOP:
         return sizeof(h64instruction_unop);
@@ -432,18 +700,10 @@ size_t h64program_PtrToInstructionSize(char *ptr) {
         return sizeof(h64instruction_newiterator);
     case H64INST_ITERATE:
         return sizeof(h64instruction_iterate);
-    case H64INST_PUSHCATCHFRAME:
-        return sizeof(h64instruction_pushcatchframe);
-    case H64INST_ADDCATCHTYPEBYREF:
-        return sizeof(h64instruction_addcatchtypebyref);
-    case H64INST_ADDCATCHTYPE:
-        return sizeof(h64instruction_addcatchtype);
-    case H64INST_POPCATCHFRAME:
-        return sizeof(h64instruction_popcatchframe);
+    case H64INST_ENDFINALLY:
+        return sizeof(h64instruction_endfinally);
     case H64INST_GETMEMBER:
         return sizeof(h64instruction_getmember);
-    case H64INST_JUMPTOFINALLY:
-        return sizeof(h64instruction_jumptofinally);
     case H64INST_NEWLIST:
         return sizeof(h64instruction_newlist);
     case H64INST_ADDTOLIST:
@@ -460,6 +720,16 @@ size_t h64program_PtrToInstructionSize(char *ptr) {
         return sizeof(h64instruction_newmap);
     case H64INST_PUTMAP:
         return sizeof(h64instruction_putmap);
+    case H64INST_BINOPCONDJUMP:
+        return sizeof(h64instruction_binopcondjump);
+    case H64INST_BINOPCONST:
+        return sizeof(h64instruction_binopconst);
+    case H64INST_CALLFUNC:
+        return sizeof(h64instruction_callfunc);
+    case H64INST_TAILCALL:
+        return sizeof(h64instruction_tailcall);
+    case H64INST_TAILCALLFUNC:
+        return sizeof(h64instruction_tailcallfunc);
     default:
         fprintf(
             stderr, "Invalid inst type for "
@@ -489,6 +759,7 @@ void h64program_Free(h64program *p) {
                 }
                 free(p->classes[i].global_name_to_member_hashmap);
             }
+            free(p->classes[i].member_lookup_disp);
             free(p->classes[i].method_func_idx);
             free(p->classes[i].method_global_name_idx);
             free(p->classes[i].vars_global_name_idx);
@@ -507,6 +778,14 @@ void h64program_Free(h64program *p) {
                     p->func[i].instructions,
                     p->func[i].instructions_bytes
                 );
+                free(p->func[i].threaded_instructions);
+                int k = 0;
+                while (k < p->func[i].exceptionhandlers_count) {
+                    free(p->func[i].exceptionhandlers[k].catchtypes);
+                    k++;
+                }
+                free(p->func[i].exceptionhandlers);
+                free(p->func[i].threaded_exceptionhandlers);
             }
             i++;
         }
@@ -514,12 +793,17 @@ void h64program_Free(h64program *p) {
     free(p->func);
     int i = 0;
     while (i < p->globalvar_count) {
-        h64program_ClearValueContent(
-            &p->globalvar[i].content, 0
-        );
+        valuecontent_Free(&p->globalvar[i].content);
         i++;
     }
     free(p->globalvar);
+    i = 0;
+    while (i < p->conststr_count) {
+        vmstrings_Free(NULL, &p->conststr[i]->str_val);
+        free(p->conststr[i]);
+        i++;
+    }
+    free(p->conststr);
 
     free(p);
 }
@@ -5,6 +5,8 @@
 #ifndef HORSE64_BYTECODE_H_
 #define HORSE64_BYTECODE_H_
 
+#include "compileconfig.h"
+
 #include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -34,12 +36,8 @@ typedef enum instructiontype {
     H64INST_JUMP,
     H64INST_NEWITERATOR,
     H64INST_ITERATE,
-    H64INST_PUSHCATCHFRAME,
-    H64INST_ADDCATCHTYPEBYREF,
-    H64INST_ADDCATCHTYPE,
-    H64INST_POPCATCHFRAME,
+    H64INST_ENDFINALLY,
     H64INST_GETMEMBER,
-    H64INST_JUMPTOFINALLY,
     H64INST_NEWLIST,
     H64INST_ADDTOLIST,
     H64INST_NEWSET,
@@ -48,6 +46,15 @@ typedef enum instructiontype {
     H64INST_PUTMAP,
     H64INST_NEWVECTOR,
     H64INST_PUTVECTOR,
+    // Superinstructions, fused by codegen_FinalBytecodeTransform():
+    H64INST_BINOPCONDJUMP,
+    H64INST_BINOPCONST,
+    H64INST_CALLFUNC,
+    H64INST_TAILCALL,
+    H64INST_TAILCALLFUNC,
+    // Never emitted by the compiler, only used by the VM when quickening:
+    H64INST_BINOPINT,
+    H64INST_BINOPFLOAT,
     H64INST_TOTAL_COUNT
 } instructiontype;
 
@@ -90,10 +97,50 @@ typedef enum valuetype {
     H64VALTYPE_SHORTSTR,
     H64VALTYPE_CONSTPREALLOCSTR,
     H64VALTYPE_UNSPECIFIED_KWARG,
+    H64VALTYPE_ITERATOR,  // only in the slot of a NEWITERATOR
 } valuetype;
 
 #define VALUECONTENT_SHORTSTRLEN 2
 
+#if H64VM_ALIGNEDVALUES
+// The type tag and short string length share the first 4 bytes with
+// the 32-bit fields, such that the 64-bit fields end up aligned and
+// the whole value fits into 16 bytes:
+typedef struct valuecontent {
+    union {
+        struct {
+            uint8_t type;
+            uint8_t shortstr_len;
+            unicodechar shortstr_value[
+                VALUECONTENT_SHORTSTRLEN + 1
+            ];
+        };
+        struct {
+            uint8_t _type_for_num;
+            union {
+                int64_t int_value;
+                double float_value;
+                void *ptr_value;
+            };
+        };
+        struct {
+            uint8_t _type_for_constpreallocstr;
+            int32_t constpreallocstr_len;
+            unicodechar *constpreallocstr_value;
+        };
+        struct {
+            uint8_t _type_for_exception;
+            int32_t exception_class_id;
+            h64exceptioninfo *einfo;
+        };
+        struct {
+            uint8_t _type_for_iterator;
+            int32_t iterator_pos;
+            h64gcvalue *iterator_container;  // same place as ptr_value
+        };
+    };
+} valuecontent;
+#else
 typedef struct valuecontent {
     uint8_t type;
     union {
@@ -114,8 +161,13 @@ typedef struct valuecontent {
             int64_t exception_class_id;
             h64exceptioninfo *einfo;
         };
+        struct {
+            h64gcvalue *iterator_container;  // same place as ptr_value
+            int32_t iterator_pos;
+        };
     };
 } __attribute__((packed)) valuecontent;
+#endif
 
 typedef struct h64instructionany {
     uint8_t type;
@@ -206,48 +258,42 @@ typedef struct h64instruction_newiterator {
     int16_t slotiteratorto, slotcontainerfrom;
 } __attribute__ ((packed)) h64instruction_newiterator;
 
+// Sets slotvalueto to the next element, or jumps by jumponend once
+// there are none left:
 typedef struct h64instruction_iterate {
     uint8_t type;
-    int16_t slotvalueto, slotiteratorfrom, jumponend;
+    int16_t slotvalueto, slotiteratorfrom;
+    int32_t jumponend;
 } __attribute__ ((packed)) h64instruction_iterate;
 
-#define CATCHMODE_JUMPONCATCH 1
-#define CATCHMODE_JUMPONFINALLY 2
-
-typedef struct h64instruction_pushcatchframe {
+// Marks the end of a finally block, where an exception that led into
+// it is raised again. Does nothing if the block was entered normally:
+typedef struct h64instruction_endfinally {
     uint8_t type;
-    uint8_t mode;
-    int16_t slotexceptionto, jumponcatch, jumponfinally;
-} __attribute__ ((packed)) h64instruction_pushcatchframe;
+} __attribute__ ((packed)) h64instruction_endfinally;
 
-typedef struct h64instruction_addcatchtypebyref {
-    uint8_t type;
-    int16_t slotfrom;
-} __attribute__ ((packed)) h64instruction_addcatchtypebyref;
+#define H64GETMEMBER_CACHE_SIZE 4
 
-typedef struct h64instruction_addcatchtype {
-    uint8_t type;
-    int64_t classid;
-} __attribute__ ((packed)) h64instruction_addcatchtype;
-
-typedef struct h64instruction_popcatchframe {
-    uint8_t type;
-} __attribute__ ((packed)) h64instruction_popcatchframe;
+typedef struct h64getmembercacheentry {
+    int32_t classid;
+    int32_t membervarid;  // -1 if a method
+    int32_t memberfuncid;  // -1 if a var
+} __attribute__ ((packed)) h64getmembercacheentry;
 
 typedef struct h64instruction_getmember {
     uint8_t type;
     int16_t slotto;
     int16_t objslotfrom;
     int64_t nameidx;
+    // Polymorphic inline cache, filled in by the VM on lookup:
+    uint8_t cache_fill;
+    h64getmembercacheentry cache[H64GETMEMBER_CACHE_SIZE];
 } __attribute__ ((packed)) h64instruction_getmember;
 
-typedef struct h64instruction_jumptofinally {
-    uint8_t type;
-} __attribute__ ((packed)) h64instruction_jumptofinally;
-
 typedef struct h64instruction_newlist {
     uint8_t type;
     int16_t slotto;
+    int64_t presize;  // how many ADDTOLIST follow, to allocate once
 } __attribute__ ((packed)) h64instruction_newlist;
 
 typedef struct h64instruction_addtolist {
@@ -259,6 +305,7 @@ typedef struct h64instruction_addtolist {
 typedef struct h64instruction_newset {
     uint8_t type;
     int16_t slotto;
+    int64_t presize;  // how many ADDTOSET follow, to allocate once
 } __attribute__ ((packed)) h64instruction_newset;
 
 typedef struct h64instruction_addtoset {
@@ -270,6 +317,7 @@ typedef struct h64instruction_addtoset {
 typedef struct h64instruction_newvector {
     uint8_t type;
     int16_t slotto;
+    int64_t size;  // the vector's entries are set with PUTVECTOR after
 } __attribute__ ((packed)) h64instruction_newvector;
 
 typedef struct h64instruction_putvector {
@@ -282,6 +330,7 @@ typedef struct h64instruction_putvector {
 typedef struct h64instruction_newmap {
     uint8_t type;
     int16_t slotto;
+    int64_t presize;  // how many PUTMAP follow, to allocate once
 } __attribute__ ((packed)) h64instruction_newmap;
 
 typedef struct h64instruction_putmap {
@@ -291,6 +340,43 @@ typedef struct h64instruction_putmap {
     int16_t slotputvaluefrom;
 } __attribute__ ((packed)) h64instruction_putmap;
 
+typedef struct h64instruction_binopcondjump {
+    uint8_t type;
+    uint8_t optype;  // always a comparison
+    int16_t arg1slotfrom, arg2slotfrom;
+    int32_t jumpbytesoffset;  // taken if comparison is true
+} __attribute__ ((packed)) h64instruction_binopcondjump;
+
+typedef struct h64instruction_binopconst {
+    uint8_t type;
+    uint8_t optype;
+    int16_t slotto, arg1slotfrom, arg2slotfrom;
+    valuecontent content;  // also stored to arg2slotfrom, int/float only
+} __attribute__ ((packed)) h64instruction_binopconst;
+
+typedef struct h64instruction_callfunc {
+    uint8_t type;
+    int16_t returnto;
+    int64_t funcfrom;
+    uint8_t expandlastposarg;
+    int16_t posargs, kwargs;
+} __attribute__ ((packed)) h64instruction_callfunc;
+
+// Call + return of its result, reusing the caller's frame:
+typedef struct h64instruction_tailcall {
+    uint8_t type;
+    int16_t slotcalledfrom;
+    uint8_t expandlastposarg;
+    int16_t posargs, kwargs;
+} __attribute__ ((packed)) h64instruction_tailcall;
+
+typedef struct h64instruction_tailcallfunc {
+    uint8_t type;
+    int64_t funcfrom;
+    uint8_t expandlastposarg;
+    int16_t posargs, kwargs;
+} __attribute__ ((packed)) h64instruction_tailcallfunc;
+
 
 #define H64CLASS_HASH_SIZE 16
 #define H64CLASS_MAX_METHODS (INT_MAX / 4)
@@ -311,9 +397,42 @@ typedef struct h64class {
 
     h64classmemberinfo **global_name_to_member_hashmap;
 
+    // Collision-free lookup built from the above once all members are
+    // known, see h64program_FinalizeClassMemberLookup(). Both arrays
+    // are in the same allocation starting at member_lookup_disp:
+    int32_t *member_lookup_disp;
+    h64classmemberinfo *member_lookup_slots;
+    uint32_t member_lookup_bucketmask, member_lookup_slotmask;
+
     int hasvarinitfunc;
 } h64class;
 
+// What a catch clause catches, looked up only once an exception is
+// raised. A class referenced by a global variable or stack slot is
+// checked to be an exception class at that point:
+#define H64CATCHTYPE_CLASS 0
+#define H64CATCHTYPE_GLOBALVAR 1
+#define H64CATCHTYPE_STACKSLOT 2
+
+typedef struct h64catchtype {
+    uint8_t kind;
+    int64_t id;
+} h64catchtype;
+
+// An entry of the static exception table of a function. Nothing of it
+// runs unless an exception is raised inside [try_start, try_end), all
+// offsets are byte offsets into the function's instructions:
+typedef struct h64exceptionhandler {
+    int32_t try_start, try_end;
+    int32_t catch_offset;  // -1 if no catch
+    int32_t finally_offset, finally_end;  // -1 if no finally,
+        // finally_end being the ENDFINALLY terminating it
+    int16_t slotexceptionto;  // -1 if the exception isn't stored
+
+    int catchtypes_count;  // 0 catches all exceptions
+    h64catchtype *catchtypes;
+} h64exceptionhandler;
+
 typedef struct h64func {
     int input_stack_size, inner_stack_size;
     int iscfunc, is_threadable;
@@ -326,6 +445,15 @@ typedef struct h64func {
         struct {
             int instructions_bytes;
             char *instructions;
+            int threaded_bytes;
+            char *threaded_instructions;  // see vmexec.c
+
+            // Inner handlers come before the handlers enclosing them:
+            int exceptionhandlers_count;
+            h64exceptionhandler *exceptionhandlers;
+            // Same with the offsets into threaded_instructions, sharing
+            // the catch types:
+            h64exceptionhandler *threaded_exceptionhandlers;
         };
         struct {
             void *cfunc_ptr;
@@ -360,6 +488,11 @@ typedef struct h64program {
     int64_t globalvar_count;
     h64globalvar *globalvar;
 
+    // Immortal string values the SETCONST string literals were turned
+    // into by vmexec_PrepareThreadedCode(), shared by all threads:
+    int64_t conststr_count;
+    h64gcvalue **conststr;
+
     h64debugsymbols *symbols;
 } h64program;
 
@@ -371,18 +504,6 @@ size_t h64program_PtrToInstructionSize(
     char *ptr
 );
 
-static inline void h64program_ClearValueContent(
-        valuecontent *content, int referencedfromnonheap
-        ) {
-    if (content->type == H64VALTYPE_GCVAL) {
-        if (referencedfromnonheap) {
-            ((h64gcvalue *)content->ptr_value)->externalreferencecount--;
-        } else {
-            ((h64gcvalue *)content->ptr_value)->heapreferencecount--;
-        }
-    }
-}
-
 void valuecontent_Free(valuecontent *content);
 
 void h64program_FreeInstructions(
@@ -394,6 +515,12 @@ void h64program_LookupClassMember(
     int *out_membervarid, int *out_memberfuncid
 );
 
+int h64program_FinalizeClassMemberLookup(
+    h64program *p, int64_t class_id
+);
+
+int h64program_FinalizeAllClassMemberLookups(h64program *p);
+
 int h64program_RegisterClassVariable(
     h64program *p,
     int64_t class_id,
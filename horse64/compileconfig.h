@@ -7,5 +7,19 @@
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+// Whether the VM runs from direct-threaded code prepared at load time,
+// rather than dispatching via the plain bytecode. Build with
+// -DH64VM_DIRECTTHREADED=0 to get the plain bytecode path for debugging.
+#ifndef H64VM_DIRECTTHREADED
+#define H64VM_DIRECTTHREADED 1
+#endif
+
+// Whether valuecontent uses an aligned 16-byte layout for the stack,
+// globals and member vars, rather than a packed 17-byte record with
+// unaligned payload. Build with -DH64VM_ALIGNEDVALUES=0 to compare.
+#ifndef H64VM_ALIGNEDVALUES
+#define H64VM_ALIGNEDVALUES 1
+#endif
+
 
 #endif  // HORSE64_COMPILECONFIG_H_
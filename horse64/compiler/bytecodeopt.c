@@ -0,0 +1,1039 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "compileconfig.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler/bytecodeopt.h"
+
+// Which stack slots an instruction reads and writes, as offsets of the
+// respective int16_t fields inside the instruction:
+typedef struct _slotusage {
+    int read_count;
+    size_t read_field[3];
+    int write_count;
+    size_t write_field[2];
+    int readsall;  // may read any slot, e.g. a call reading its arguments
+    int isbarrier;  // don't propagate copies into or across this
+    int haseffects;  // must be kept even if nothing uses what it writes
+} _slotusage;
+
+#define READS(insttype, field) \
+    u->read_field[u->read_count++] = offsetof(insttype, field)
+#define WRITES(insttype, field) \
+    u->write_field[u->write_count++] = offsetof(insttype, field)
+
+static int _getslotusage(h64instructionany *inst, _slotusage *u) {
+    memset(u, 0, sizeof(*u));
+    switch (inst->type) {
+    case H64INST_SETCONST:
+        WRITES(h64instruction_setconst, slot);
+        return 1;
+    case H64INST_SETGLOBAL:
+        READS(h64instruction_setglobal, slotfrom);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_GETGLOBAL:
+        WRITES(h64instruction_getglobal, slotto);
+        return 1;
+    case H64INST_GETFUNC:
+        WRITES(h64instruction_getfunc, slotto);
+        return 1;
+    case H64INST_GETCLASS:
+        WRITES(h64instruction_getclass, slotto);
+        return 1;
+    case H64INST_VALUECOPY:
+        READS(h64instruction_valuecopy, slotfrom);
+        WRITES(h64instruction_valuecopy, slotto);
+        return 1;
+    case H64INST_BINOP:
+    case H64INST_BINOPINT:
+    case H64INST_BINOPFLOAT:
+        READS(h64instruction_binop, arg1slotfrom);
+        READS(h64instruction_binop, arg2slotfrom);
+        WRITES(h64instruction_binop, slotto);
+        u->haseffects = 1;  // may raise an error
+        return 1;
+    case H64INST_UNOP:
+        READS(h64instruction_unop, argslotfrom);
+        WRITES(h64instruction_unop, slotto);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_CALL:
+        READS(h64instruction_call, slotcalledfrom);
+        WRITES(h64instruction_call, returnto);
+        u->readsall = 1;
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_CALLFUNC:
+        WRITES(h64instruction_callfunc, returnto);
+        u->readsall = 1;
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_TAILCALL:
+        READS(h64instruction_tailcall, slotcalledfrom);
+        u->readsall = 1;
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_TAILCALLFUNC:
+        u->readsall = 1;
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_SETTOP:
+        u->readsall = 1;
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_RETURNVALUE:
+        READS(h64instruction_returnvalue, returnslotfrom);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_CONDJUMP:
+        READS(h64instruction_condjump, conditionalslot);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_JUMP:
+        u->haseffects = 1;
+        return 1;
+    case H64INST_BINOPCONDJUMP:
+        READS(h64instruction_binopcondjump, arg1slotfrom);
+        READS(h64instruction_binopcondjump, arg2slotfrom);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_BINOPCONST:
+        READS(h64instruction_binopconst, arg1slotfrom);
+        WRITES(h64instruction_binopconst, arg2slotfrom);
+        WRITES(h64instruction_binopconst, slotto);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_NEWITERATOR:
+        READS(h64instruction_newiterator, slotcontainerfrom);
+        WRITES(h64instruction_newiterator, slotiteratorto);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_ITERATE:
+        // The iterator advances in place, and the value is only
+        // written if there is one left:
+        READS(h64instruction_iterate, slotiteratorfrom);
+        READS(h64instruction_iterate, slotvalueto);
+        WRITES(h64instruction_iterate, slotiteratorfrom);
+        WRITES(h64instruction_iterate, slotvalueto);
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_ENDFINALLY:
+        u->haseffects = 1;
+        return 1;
+    case H64INST_GETMEMBER:
+        READS(h64instruction_getmember, objslotfrom);
+        WRITES(h64instruction_getmember, slotto);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_NEWLIST:
+        WRITES(h64instruction_newlist, slotto);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_NEWSET:
+        WRITES(h64instruction_newset, slotto);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_NEWMAP:
+        WRITES(h64instruction_newmap, slotto);
+        u->haseffects = 1;
+        return 1;
+    case H64INST_NEWVECTOR:
+        WRITES(h64instruction_newvector, slotto);
+        u->haseffects = 1;
+        return 1;
+    // For the container modifications, we count the container as
+    // written to so no copy of it is assumed to stay identical:
+    case H64INST_ADDTOLIST:
+        READS(h64instruction_addtolist, slotlistto);
+        READS(h64instruction_addtolist, slotaddfrom);
+        WRITES(h64instruction_addtolist, slotlistto);
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_ADDTOSET:
+        READS(h64instruction_addtoset, slotsetto);
+        READS(h64instruction_addtoset, slotaddfrom);
+        WRITES(h64instruction_addtoset, slotsetto);
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_PUTVECTOR:
+        READS(h64instruction_putvector, slotvectorto);
+        READS(h64instruction_putvector, slotputfrom);
+        WRITES(h64instruction_putvector, slotvectorto);
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    case H64INST_PUTMAP:
+        READS(h64instruction_putmap, slotmapto);
+        READS(h64instruction_putmap, slotputkeyfrom);
+        READS(h64instruction_putmap, slotputvaluefrom);
+        WRITES(h64instruction_putmap, slotmapto);
+        u->isbarrier = 1;
+        u->haseffects = 1;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+#undef READS
+#undef WRITES
+
+static int16_t _getslot(h64instructionany *inst, size_t field) {
+    int16_t v;
+    memcpy(&v, ((char *)inst) + field, sizeof(v));
+    return v;
+}
+
+static void _setslot(h64instructionany *inst, size_t field, int16_t v) {
+    memcpy(((char *)inst) + field, &v, sizeof(v));
+}
+
+// Get the relative jump offset fields of an instruction, returns count:
+static int _getjumpfields(
+        h64instructionany *inst, size_t *out_field, int *out_fieldsize
+        ) {
+    switch (inst->type) {
+    case H64INST_CONDJUMP:
+        out_field[0] = offsetof(h64instruction_condjump, jumpbytesoffset);
+        out_fieldsize[0] = sizeof(int32_t);
+        return 1;
+    case H64INST_JUMP:
+        out_field[0] = offsetof(h64instruction_jump, jumpbytesoffset);
+        out_fieldsize[0] = sizeof(int32_t);
+        return 1;
+    case H64INST_BINOPCONDJUMP:
+        out_field[0] = offsetof(
+            h64instruction_binopcondjump, jumpbytesoffset
+        );
+        out_fieldsize[0] = sizeof(int32_t);
+        return 1;
+    case H64INST_ITERATE:
+        out_field[0] = offsetof(h64instruction_iterate, jumponend);
+        out_fieldsize[0] = sizeof(int32_t);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int64_t _getjumpoffset(
+        h64instructionany *inst, size_t field, int fieldsize
+        ) {
+    if (fieldsize == sizeof(int16_t)) {
+        int16_t v;
+        memcpy(&v, ((char *)inst) + field, sizeof(v));
+        return v;
+    }
+    int32_t v;
+    memcpy(&v, ((char *)inst) + field, sizeof(v));
+    return v;
+}
+
+static int _setjumpoffset(
+        h64instructionany *inst, size_t field, int fieldsize,
+        int64_t offset
+        ) {
+    if (fieldsize == sizeof(int16_t)) {
+        if (offset > INT16_MAX || offset < INT16_MIN)
+            return 0;
+        int16_t v = offset;
+        memcpy(((char *)inst) + field, &v, sizeof(v));
+        return 1;
+    }
+    if (offset > INT32_MAX || offset < INT32_MIN)
+        return 0;
+    int32_t v = offset;
+    memcpy(((char *)inst) + field, &v, sizeof(v));
+    return 1;
+}
+
+typedef struct _optstate {
+    h64func *f;
+    int count;
+    h64instructionany **inst;  // pointing into f->instructions
+    int64_t *offset;
+    _slotusage *usage;
+    int *target;  // two per instruction, -1 if unused
+    int *firstkept;  // next instruction not removed, or -1
+    char *removed;
+    char *isjumptarget;
+    int slot_count, slot_words;
+    uint64_t *livein;
+    // Where catch and finally blocks start, which are only entered by
+    // exceptions and therefore reachable without any jump there:
+    int handlerentry_count;
+    int *handlerentry;
+} _optstate;
+
+static void _freeoptstate(_optstate *st) {
+    free(st->inst);
+    free(st->offset);
+    free(st->usage);
+    free(st->target);
+    free(st->firstkept);
+    free(st->removed);
+    free(st->isjumptarget);
+    free(st->livein);
+    free(st->handlerentry);
+}
+
+static int _hasfallthrough(h64instructionany *inst) {
+    return (inst->type != H64INST_JUMP &&
+            inst->type != H64INST_RETURNVALUE &&
+            inst->type != H64INST_TAILCALL &&
+            inst->type != H64INST_TAILCALLFUNC);
+}
+
+static void _updatefirstkept(_optstate *st) {
+    int next = -1;
+    int i = st->count - 1;
+    while (i >= 0) {
+        if (!st->removed[i])
+            next = i;
+        st->firstkept[i] = next;
+        i--;
+    }
+}
+
+static int _keptsuccessor(_optstate *st, int i) {
+    if (i + 1 >= st->count)
+        return -1;
+    return st->firstkept[i + 1];
+}
+
+static int _jumptarget(_optstate *st, int i, int k) {
+    if (st->target[i * 2 + k] < 0)
+        return -1;
+    return st->firstkept[st->target[i * 2 + k]];
+}
+
+static void _updatejumptargets(_optstate *st) {
+    memset(st->isjumptarget, 0, st->count);
+    int i = 0;
+    while (i < st->count) {
+        if (!st->removed[i]) {
+            int k = 0;
+            while (k < 2) {
+                int t = _jumptarget(st, i, k);
+                if (t >= 0)
+                    st->isjumptarget[t] = 1;
+                k++;
+            }
+        }
+        i++;
+    }
+}
+
+static void _threadjumps(_optstate *st) {
+    int i = 0;
+    while (i < st->count) {
+        int type = st->inst[i]->type;
+        if (type != H64INST_JUMP && type != H64INST_CONDJUMP &&
+                type != H64INST_BINOPCONDJUMP) {
+            i++;
+            continue;
+        }
+        int t = st->target[i * 2];
+        int hops = 0;
+        while (st->inst[t]->type == H64INST_JUMP &&
+                st->target[t * 2] != t && hops < st->count) {
+            t = st->target[t * 2];
+            hops++;
+        }
+        st->target[i * 2] = t;
+        i++;
+    }
+}
+
+static int _removeunreachable(_optstate *st) {
+    char *reached = malloc(st->count);
+    int *queue = malloc(sizeof(*queue) * st->count);
+    if (!reached || !queue) {
+        free(reached);
+        free(queue);
+        return 0;
+    }
+    memset(reached, 0, st->count);
+    int queue_fill = 1;
+    queue[0] = 0;
+    reached[0] = 1;
+    int j = 0;
+    while (j < st->handlerentry_count) {
+        if (!reached[st->handlerentry[j]]) {
+            reached[st->handlerentry[j]] = 1;
+            queue[queue_fill] = st->handlerentry[j];
+            queue_fill++;
+        }
+        j++;
+    }
+    while (queue_fill > 0) {
+        queue_fill--;
+        int i = queue[queue_fill];
+        int next[3] = {-1, st->target[i * 2], st->target[i * 2 + 1]};
+        if (_hasfallthrough(st->inst[i]) && i + 1 < st->count)
+            next[0] = i + 1;
+        int k = 0;
+        while (k < 3) {
+            if (next[k] >= 0 && !reached[next[k]]) {
+                reached[next[k]] = 1;
+                queue[queue_fill] = next[k];
+                queue_fill++;
+            }
+            k++;
+        }
+    }
+    int i = 0;
+    while (i < st->count) {
+        if (!reached[i])
+            st->removed[i] = 1;
+        i++;
+    }
+    free(reached);
+    free(queue);
+    return 1;
+}
+
+static int _isvalidhandleroffset(
+        int *indexat, int64_t len, int64_t offset, int canbeend
+        ) {
+    if (offset == len)
+        return canbeend;
+    return (offset >= 0 && offset < len && indexat[offset] >= 0);
+}
+
+static int64_t _newhandleroffset(
+        int *indexat, int64_t *newoffset, int64_t len, int64_t newlen,
+        int64_t offset
+        ) {
+    if (offset < 0)
+        return offset;
+    if (offset == len)
+        return newlen;
+    return newoffset[indexat[offset]];
+}
+
+static void _handlermaxslot(h64func *f, int *maxslot) {
+    int i = 0;
+    while (i < f->exceptionhandlers_count) {
+        h64exceptionhandler *handler = &f->exceptionhandlers[i];
+        if (handler->slotexceptionto > *maxslot)
+            *maxslot = handler->slotexceptionto;
+        int k = 0;
+        while (k < handler->catchtypes_count) {
+            if (handler->catchtypes[k].kind == H64CATCHTYPE_STACKSLOT &&
+                    handler->catchtypes[k].id > *maxslot)
+                *maxslot = handler->catchtypes[k].id;
+            k++;
+        }
+        i++;
+    }
+}
+
+static void _propagatecopies(_optstate *st, int *copyof) {
+    int k = 0;
+    while (k < st->slot_count) {
+        copyof[k] = -1;
+        k++;
+    }
+    int i = 0;
+    while (i < st->count) {
+        if (st->removed[i]) {
+            i++;
+            continue;
+        }
+        h64instructionany *inst = st->inst[i];
+        _slotusage *u = &st->usage[i];
+        if (st->isjumptarget[i] || u->isbarrier) {
+            // Other paths lead here, or we can't tell what happens:
+            k = 0;
+            while (k < st->slot_count) {
+                copyof[k] = -1;
+                k++;
+            }
+            if (u->isbarrier) {
+                i++;
+                continue;
+            }
+        }
+        k = 0;
+        while (k < u->read_count) {
+            int16_t slot = _getslot(inst, u->read_field[k]);
+            if (copyof[slot] >= 0)
+                _setslot(inst, u->read_field[k], copyof[slot]);
+            k++;
+        }
+        k = 0;
+        while (k < u->write_count) {
+            int16_t slot = _getslot(inst, u->write_field[k]);
+            copyof[slot] = -1;
+            int j = 0;
+            while (j < st->slot_count) {
+                if (copyof[j] == slot)
+                    copyof[j] = -1;
+                j++;
+            }
+            k++;
+        }
+        if (inst->type == H64INST_VALUECOPY) {
+            h64instruction_valuecopy *vcopy = (
+                (h64instruction_valuecopy *)inst
+            );
+            if (vcopy->slotto != vcopy->slotfrom)
+                copyof[vcopy->slotto] = vcopy->slotfrom;
+        }
+        i++;
+    }
+}
+
+#define LIVEIN(st, i) (&(st)->livein[(i) * (st)->slot_words])
+
+static void _computeliveout(_optstate *st, int i, uint64_t *out) {
+    memset(out, 0, sizeof(*out) * st->slot_words);
+    int next[3] = {-1, _jumptarget(st, i, 0), _jumptarget(st, i, 1)};
+    if (_hasfallthrough(st->inst[i]))
+        next[0] = _keptsuccessor(st, i);
+    int k = 0;
+    while (k < 3) {
+        if (next[k] >= 0) {
+            uint64_t *in = LIVEIN(st, next[k]);
+            int w = 0;
+            while (w < st->slot_words) {
+                out[w] |= in[w];
+                w++;
+            }
+        }
+        k++;
+    }
+}
+
+static int _removedeadstores(_optstate *st) {
+    uint64_t *out = malloc(sizeof(*out) * st->slot_words);
+    if (!out)
+        return 0;
+
+    // Compute which slots are live when entering each instruction:
+    memset(st->livein, 0,
+           sizeof(*st->livein) * st->slot_words * st->count);
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        int i = st->count - 1;
+        while (i >= 0) {
+            if (st->removed[i]) {
+                i--;
+                continue;
+            }
+            _slotusage *u = &st->usage[i];
+            _computeliveout(st, i, out);
+            int k = 0;
+            while (k < u->write_count) {
+                int16_t slot = _getslot(st->inst[i], u->write_field[k]);
+                out[slot / 64] &= ~(((uint64_t)1) << (slot % 64));
+                k++;
+            }
+            k = 0;
+            while (k < u->read_count) {
+                int16_t slot = _getslot(st->inst[i], u->read_field[k]);
+                out[slot / 64] |= ((uint64_t)1) << (slot % 64);
+                k++;
+            }
+            if (u->readsall)
+                memset(out, 0xff, sizeof(*out) * st->slot_words);
+            if (memcmp(out, LIVEIN(st, i),
+                       sizeof(*out) * st->slot_words) != 0) {
+                memcpy(LIVEIN(st, i), out,
+                       sizeof(*out) * st->slot_words);
+                changed = 1;
+            }
+            i--;
+        }
+    }
+
+    // Remove side effect free instructions whose results are unused:
+    int removedany = 0;
+    int i = 0;
+    while (i < st->count) {
+        _slotusage *u = &st->usage[i];
+        if (st->removed[i] || u->haseffects || u->write_count == 0) {
+            i++;
+            continue;
+        }
+        int isdead = 1;
+        if (st->inst[i]->type != H64INST_VALUECOPY ||
+                ((h64instruction_valuecopy *)st->inst[i])->slotto !=
+                ((h64instruction_valuecopy *)st->inst[i])->slotfrom) {
+            _computeliveout(st, i, out);
+            int k = 0;
+            while (k < u->write_count) {
+                int16_t slot = _getslot(st->inst[i], u->write_field[k]);
+                if ((out[slot / 64] & (((uint64_t)1) << (slot % 64))) != 0)
+                    isdead = 0;
+                k++;
+            }
+        }
+        if (isdead) {
+            st->removed[i] = 1;
+            removedany = 1;
+        }
+        i++;
+    }
+    free(out);
+    return (removedany ? 2 : 1);
+}
+
+static void _removeuselessjumps(_optstate *st) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        _updatefirstkept(st);
+        int i = 0;
+        while (i < st->count) {
+            if (!st->removed[i] &&
+                    (st->inst[i]->type == H64INST_JUMP ||
+                     st->inst[i]->type == H64INST_CONDJUMP) &&
+                    _keptsuccessor(st, i) >= 0 &&
+                    _jumptarget(st, i, 0) == _keptsuccessor(st, i)) {
+                st->removed[i] = 1;
+                changed = 1;
+            }
+            i++;
+        }
+    }
+}
+
+int bytecodeopt_OptimizeFunc(h64program *pr, int func_id) {
+    assert(func_id >= 0 && func_id < pr->func_count);
+    h64func *f = &pr->func[func_id];
+    if (f->iscfunc || f->instructions_bytes <= 0)
+        return 1;
+
+    _optstate st = {0};
+    st.f = f;
+    int *indexat = malloc(sizeof(*indexat) * (f->instructions_bytes + 1));
+    if (!indexat)
+        return 0;
+    int64_t k = 0;
+    while (k <= f->instructions_bytes) {
+        indexat[k] = -1;
+        k++;
+    }
+
+    // Split up into instructions:
+    int alloc = 0;
+    k = 0;
+    while (k < f->instructions_bytes) {
+        if (st.count >= alloc) {
+            int newalloc = (alloc + 16) * 2;
+            h64instructionany **newinst = realloc(
+                st.inst, sizeof(*newinst) * newalloc
+            );
+            if (!newinst)
+                goto oom;
+            st.inst = newinst;
+            int64_t *newoffset = realloc(
+                st.offset, sizeof(*newoffset) * newalloc
+            );
+            if (!newoffset)
+                goto oom;
+            st.offset = newoffset;
+            alloc = newalloc;
+        }
+        h64instructionany *inst = (
+            (h64instructionany *)(f->instructions + k)
+        );
+        indexat[k] = st.count;
+        st.inst[st.count] = inst;
+        st.offset[st.count] = k;
+        st.count++;
+        k += (int64_t)h64program_PtrToInstructionSize((char *)inst);
+    }
+    st.usage = malloc(sizeof(*st.usage) * st.count);
+    st.target = malloc(sizeof(*st.target) * st.count * 2);
+    st.firstkept = malloc(sizeof(*st.firstkept) * st.count);
+    st.removed = malloc(st.count);
+    st.isjumptarget = malloc(st.count);
+    if (!st.usage || !st.target || !st.firstkept || !st.removed ||
+            !st.isjumptarget)
+        goto oom;
+    memset(st.removed, 0, st.count);
+
+    // Gather slot usage and jump targets. If anything is unexpected,
+    // we simply leave this function alone:
+    int maxslot = f->input_stack_size + f->inner_stack_size - 1;
+    int i = 0;
+    while (i < st.count) {
+        if (!_getslotusage(st.inst[i], &st.usage[i]))
+            goto leavealone;
+        _slotusage *u = &st.usage[i];
+        int j = 0;
+        while (j < u->read_count + u->write_count) {
+            int16_t slot = _getslot(st.inst[i], (j < u->read_count ?
+                u->read_field[j] : u->write_field[j - u->read_count]));
+            if (slot < 0)
+                goto leavealone;
+            if (slot > maxslot)
+                maxslot = slot;
+            j++;
+        }
+        st.target[i * 2] = -1;
+        st.target[i * 2 + 1] = -1;
+        size_t field[2] = {0};
+        int fieldsize[2] = {0};
+        int jumpcount = _getjumpfields(st.inst[i], field, fieldsize);
+        j = 0;
+        while (j < jumpcount) {
+            int64_t target = st.offset[i] + _getjumpoffset(
+                st.inst[i], field[j], fieldsize[j]
+            );
+            if (target < 0 || target >= f->instructions_bytes ||
+                    indexat[target] < 0)
+                goto leavealone;
+            st.target[i * 2 + j] = indexat[target];
+            j++;
+        }
+        i++;
+    }
+    st.slot_count = (maxslot >= 0 ? maxslot + 1 : 1);
+    st.slot_words = (st.slot_count + 63) / 64;
+    if (f->exceptionhandlers_count > 0) {
+        st.handlerentry = malloc(
+            sizeof(*st.handlerentry) * f->exceptionhandlers_count * 2
+        );
+        if (!st.handlerentry)
+            goto oom;
+    }
+    i = 0;
+    while (i < f->exceptionhandlers_count) {
+        h64exceptionhandler *handler = &f->exceptionhandlers[i];
+        int64_t len = f->instructions_bytes;
+        if (!_isvalidhandleroffset(indexat, len, handler->try_start, 1) ||
+                !_isvalidhandleroffset(
+                    indexat, len, handler->try_end, 1) ||
+                (handler->catch_offset >= 0 && !_isvalidhandleroffset(
+                    indexat, len, handler->catch_offset, 0)) ||
+                (handler->finally_offset >= 0 && (
+                    !_isvalidhandleroffset(
+                        indexat, len, handler->finally_offset, 0) ||
+                    !_isvalidhandleroffset(
+                        indexat, len, handler->finally_end, 0))))
+            goto leavealone;
+        if (handler->catch_offset >= 0)
+            st.handlerentry[st.handlerentry_count++] = (
+                indexat[handler->catch_offset]
+            );
+        if (handler->finally_offset >= 0)
+            st.handlerentry[st.handlerentry_count++] = (
+                indexat[handler->finally_offset]
+            );
+        i++;
+    }
+
+    // Run the actual optimizations:
+    _threadjumps(&st);
+    if (!_removeunreachable(&st))
+        goto oom;
+    _updatefirstkept(&st);
+    if (f->exceptionhandlers_count == 0) {
+        // (Exceptions can jump from anywhere to the catch and finally
+        // blocks, so we don't do data flow analysis in that case.)
+        _updatejumptargets(&st);
+        int *copyof = malloc(sizeof(*copyof) * st.slot_count);
+        if (!copyof)
+            goto oom;
+        _propagatecopies(&st, copyof);
+        free(copyof);
+        st.livein = malloc(
+            sizeof(*st.livein) * st.slot_words * st.count
+        );
+        if (!st.livein)
+            goto oom;
+        int result = 2;
+        while (result == 2) {
+            result = _removedeadstores(&st);
+            if (!result)
+                goto oom;
+            _updatefirstkept(&st);
+        }
+    }
+    _removeuselessjumps(&st);
+
+    // Lay out the remaining instructions, then fix up the jumps:
+    int64_t *newoffset = malloc(sizeof(*newoffset) * st.count);
+    if (!newoffset)
+        goto oom;
+    int64_t newlen = 0;
+    i = 0;
+    while (i < st.count) {
+        newoffset[i] = newlen;
+        if (!st.removed[i])
+            newlen += (int64_t)h64program_PtrToInstructionSize(
+                (char *)st.inst[i]
+            );
+        i++;
+    }
+    char *newinstructions = malloc(newlen);
+    if (!newinstructions) {
+        free(newoffset);
+        goto oom;
+    }
+    int maxsettop = 0;
+    maxslot = 0;
+    i = 0;
+    while (i < st.count) {
+        if (st.removed[i]) {
+            i++;
+            continue;
+        }
+        size_t instsize = h64program_PtrToInstructionSize(
+            (char *)st.inst[i]
+        );
+        h64instructionany *newinst = (
+            (h64instructionany *)(newinstructions + newoffset[i])
+        );
+        memcpy(newinst, st.inst[i], instsize);
+        size_t field[2] = {0};
+        int fieldsize[2] = {0};
+        int jumpcount = _getjumpfields(newinst, field, fieldsize);
+        int j = 0;
+        while (j < jumpcount) {
+            int t = _jumptarget(&st, i, j);
+            if (t < 0 || !_setjumpoffset(newinst, field[j], fieldsize[j],
+                    newoffset[t] - newoffset[i])) {
+                free(newoffset);
+                free(newinstructions);
+                goto leavealone;
+            }
+            j++;
+        }
+        _slotusage *u = &st.usage[i];
+        j = 0;
+        while (j < u->read_count + u->write_count) {
+            int16_t slot = _getslot(newinst, (j < u->read_count ?
+                u->read_field[j] : u->write_field[j - u->read_count]));
+            if (slot > maxslot)
+                maxslot = slot;
+            j++;
+        }
+        if (newinst->type == H64INST_SETTOP &&
+                ((h64instruction_settop *)newinst)->topto > maxsettop)
+            maxsettop = ((h64instruction_settop *)newinst)->topto;
+        i++;
+    }
+    _handlermaxslot(f, &maxslot);
+    i = 0;
+    while (i < f->exceptionhandlers_count) {
+        h64exceptionhandler *handler = &f->exceptionhandlers[i];
+        int64_t len = f->instructions_bytes;
+        handler->try_start = _newhandleroffset(
+            indexat, newoffset, len, newlen, handler->try_start
+        );
+        handler->try_end = _newhandleroffset(
+            indexat, newoffset, len, newlen, handler->try_end
+        );
+        handler->catch_offset = _newhandleroffset(
+            indexat, newoffset, len, newlen, handler->catch_offset
+        );
+        handler->finally_offset = _newhandleroffset(
+            indexat, newoffset, len, newlen, handler->finally_offset
+        );
+        handler->finally_end = _newhandleroffset(
+            indexat, newoffset, len, newlen, handler->finally_end
+        );
+        i++;
+    }
+    free(newoffset);
+
+    // Removed constants may own a preallocated string, which nothing
+    // else refers to now:
+    i = 0;
+    while (i < st.count) {
+        if (st.removed[i] && st.inst[i]->type == H64INST_SETCONST) {
+            valuecontent content;
+            memcpy(&content,
+                   &((h64instruction_setconst *)st.inst[i])->content,
+                   sizeof(content));
+            valuecontent_Free(&content);
+        }
+        i++;
+    }
+    free(f->instructions);
+    f->instructions = newinstructions;
+    f->instructions_bytes = newlen;
+
+    // See if we need fewer temporaries now:
+    int needed = maxslot + 1;
+    if (maxsettop > needed)
+        needed = maxsettop;
+    needed -= f->input_stack_size;
+    if (needed < 0)
+        needed = 0;
+    if (needed < f->inner_stack_size)
+        f->inner_stack_size = needed;
+
+    leavealone:
+    free(indexat);
+    _freeoptstate(&st);
+    return 1;
+
+    oom:
+    free(indexat);
+    _freeoptstate(&st);
+    return 0;
+}
+
+static int _queuepath(
+        int64_t target, int64_t len, char *visited,
+        int64_t **queue, int64_t *queue_count, int64_t *queue_alloc
+        ) {
+    // Returns 1 if queued or seen before, 0 if not a valid target,
+    // and -1 on out of memory:
+    if (target < 0 || target >= len)
+        return 0;
+    if (visited[target])
+        return 1;
+    visited[target] = 1;
+    if (*queue_count >= *queue_alloc) {
+        int64_t *newqueue = realloc(
+            *queue, sizeof(*newqueue) * (*queue_alloc) * 2
+        );
+        if (!newqueue)
+            return -1;
+        *queue = newqueue;
+        *queue_alloc *= 2;
+    }
+    (*queue)[*queue_count] = target;
+    (*queue_count)++;
+    return 1;
+}
+
+int bytecodeopt_IsSlotReadAfter(
+        h64func *f, int64_t offset, int16_t slot
+        ) {
+    // Walk all paths from the successors of the given instruction
+    // until each of them either reads or overwrites the slot:
+    int64_t len = f->instructions_bytes;
+    assert(offset >= 0 && offset < len);
+    char *visited = malloc(len);
+    int64_t queue_alloc = 64;
+    int64_t queue_count = 0;
+    int64_t *queue = malloc(sizeof(*queue) * queue_alloc);
+    if (!visited || !queue) {
+        free(visited);
+        free(queue);
+        return -1;
+    }
+    memset(visited, 0, len);
+    int result = 0;
+    int64_t k = offset;
+    int isstart = 1;
+    while (1) {
+        h64instructionany *inst = (h64instructionany *)(
+            f->instructions + k
+        );
+        _slotusage u;
+        if (!_getslotusage(inst, &u)) {
+            result = 1;
+            break;
+        }
+        int overwritten = 0;
+        if (!isstart) {
+            int j = 0;
+            while (j < u.read_count) {
+                if (_getslot(inst, u.read_field[j]) == slot)
+                    result = 1;
+                j++;
+            }
+            if (inst->type == H64INST_SETTOP) {
+                // All slots from here up are free temporaries that the
+                // upcoming call may clobber, so nothing reads them
+                // without writing them first:
+                if (((h64instruction_settop *)inst)->topto <= slot)
+                    overwritten = 1;
+            } else if (u.readsall) {
+                // (a call, we can't tell where its arguments start)
+                result = 1;
+            }
+            if (result)
+                break;
+            j = 0;
+            while (j < u.write_count) {
+                if (_getslot(inst, u.write_field[j]) == slot)
+                    overwritten = 1;
+                j++;
+            }
+        }
+        int r = 1;
+        if (!overwritten) {
+            int64_t instsize = (int64_t)h64program_PtrToInstructionSize(
+                (char *)inst
+            );
+            if (_hasfallthrough(inst) && k + instsize < len)
+                r = _queuepath(k + instsize, len, visited,
+                               &queue, &queue_count, &queue_alloc);
+            size_t field[2] = {0};
+            int fieldsize[2] = {0};
+            int jumpcount = _getjumpfields(inst, field, fieldsize);
+            int j = 0;
+            while (j < jumpcount && r > 0) {
+                r = _queuepath(
+                    k + _getjumpoffset(inst, field[j], fieldsize[j]),
+                    len, visited, &queue, &queue_count, &queue_alloc
+                );
+                j++;
+            }
+        }
+        // An exception may leave for any catch or finally covering
+        // this instruction, even before it wrote anything, and catch
+        // types can be read from slots:
+        int j = 0;
+        while (j < f->exceptionhandlers_count && r > 0) {
+            h64exceptionhandler *handler = &f->exceptionhandlers[j];
+            j++;
+            if (k < handler->try_start || k >= handler->try_end)
+                continue;
+            int m = 0;
+            while (m < handler->catchtypes_count) {
+                if (handler->catchtypes[m].kind ==
+                        H64CATCHTYPE_STACKSLOT &&
+                        handler->catchtypes[m].id == slot)
+                    r = 0;
+                m++;
+            }
+            if (r > 0 && handler->catch_offset >= 0)
+                r = _queuepath(handler->catch_offset, len, visited,
+                               &queue, &queue_count, &queue_alloc);
+            if (r > 0 && handler->finally_offset >= 0)
+                r = _queuepath(handler->finally_offset, len, visited,
+                               &queue, &queue_count, &queue_alloc);
+        }
+        if (r <= 0) {
+            result = (r < 0 ? -1 : 1);
+            break;
+        }
+        isstart = 0;
+        if (queue_count == 0)
+            break;
+        queue_count--;
+        k = queue[queue_count];
+    }
+    free(visited);
+    free(queue);
+    return result;
+}
@@ -0,0 +1,19 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef HORSE64_COMPILER_BYTECODEOPT_H_
+#define HORSE64_COMPILER_BYTECODEOPT_H_
+
+#include "bytecode.h"
+
+int bytecodeopt_OptimizeFunc(h64program *pr, int func_id);
+
+// Whether the slot may still be read after the instruction at the
+// given offset, before anything overwrites it. Returns 1 if it may,
+// 0 if it is dead, or -1 when out of memory:
+int bytecodeopt_IsSlotReadAfter(
+    h64func *f, int64_t offset, int16_t slot
+);
+
+#endif  // HORSE64_COMPILER_BYTECODEOPT_H_
@@ -13,6 +13,7 @@
 #include "compiler/asthelpers.h"
 #include "compiler/astparser.h"
 #include "compiler/asttransform.h"
+#include "compiler/bytecodeopt.h"
 #include "compiler/codegen.h"
 #include "compiler/compileproject.h"
 #include "compiler/main.h"
@@ -77,6 +78,13 @@ void freemultilinetemp(
     func->funcdef._storageinfo->codegen.perm_temps_used[temp] = 0;
 }
 
+static int _onelinetempsbase(h64expression *func) {
+    // One line temporaries go above the multi line ones, which may be
+    // held across statements, e.g. a for loop's iterator:
+    return (func->funcdef._storageinfo->lowest_guaranteed_free_temp +
+            func->funcdef._storageinfo->codegen.perm_temps_count);
+}
+
 int new1linetemp(h64expression *func, h64expression *expr) {
     // Use temporary 'mandated' by parent if any:
     storageref *parent_store = NULL;
@@ -95,18 +103,19 @@ int new1linetemp(h64expression *func, h64expression *expr) {
         return parent_store->id;
 
     // If a binary or unary operator, see if we can reuse child storage:
+    // (not if folded to a constant, then the children weren't evaluated)
     if (expr && (expr->type == H64EXPRTYPE_BINARYOP ||
-                 expr->type == H64EXPRTYPE_UNARYOP)) {
+                 expr->type == H64EXPRTYPE_UNARYOP) &&
+            expr->knownvalue.type == 0) {
         assert(expr->op.value1 != NULL);
         if (expr->op.value1->storage.eval_temp_id >=
-                func->funcdef._storageinfo->lowest_guaranteed_free_temp) {
+                _onelinetempsbase(func)) {
             return expr->op.value1->storage.eval_temp_id;
         }
         if (expr->type == H64EXPRTYPE_BINARYOP) {
             assert(expr->op.value2 != NULL);
             if (expr->op.value2->storage.eval_temp_id >=
-                    func->funcdef._storageinfo->
-                        lowest_guaranteed_free_temp) {
+                    _onelinetempsbase(func)) {
                 return expr->op.value2->storage.eval_temp_id;
             }
         }
@@ -122,10 +131,69 @@ int new1linetemp(h64expression *func, h64expression *expr) {
         );
     return (
         (func->funcdef._storageinfo->codegen.oneline_temps_used_now - 1) +
-        func->funcdef._storageinfo->lowest_guaranteed_free_temp
+        _onelinetempsbase(func)
     );
 }
 
+static int _codegen_IsFoldedConstant(h64expression *expr) {
+    if (expr->knownvalue.type == 0)
+        return 0;
+    if (expr->type == H64EXPRTYPE_BINARYOP ||
+            expr->type == H64EXPRTYPE_UNARYOP)
+        return 1;
+    // Identifiers of stack slots are free to use already, so only
+    // replace global const vars:
+    return (expr->type == H64EXPRTYPE_IDENTIFIERREF &&
+            expr->storage.set &&
+            expr->storage.ref.type != H64STORETYPE_STACKSLOT);
+}
+
+static int _codegen_Utf8ToConstContent(
+        const char *s, valuecontent *content, int *outofmemory
+        ) {
+    *outofmemory = 0;
+    int64_t out_len = 0;
+    int abortinvalid = 0;
+    int abortoom = 0;
+    unicodechar *result = utf8_to_utf32_ex(
+        s, strlen(s),
+        NULL, NULL, &out_len, 1,
+        &abortinvalid, &abortoom
+    );
+    if (!result) {
+        if (abortoom)
+            *outofmemory = 1;
+        return 0;
+    }
+    assert(!abortinvalid);
+    assert(!abortoom);
+    if (out_len <= VALUECONTENT_SHORTSTRLEN) {
+        memcpy(
+            content->shortstr_value,
+            result, out_len * sizeof(*result)
+        );
+        content->type = H64VALTYPE_SHORTSTR;
+        content->shortstr_len = out_len;
+    } else {
+        content->type = H64VALTYPE_CONSTPREALLOCSTR;
+        content->constpreallocstr_value = malloc(
+            out_len * sizeof(*result)
+        );
+        if (!content->constpreallocstr_value) {
+            free(result);
+            *outofmemory = 1;
+            return 0;
+        }
+        content->constpreallocstr_len = out_len;
+        memcpy(
+            content->constpreallocstr_value,
+            result, out_len * sizeof(*result)
+        );
+    }
+    free(result);
+    return 1;
+}
+
 int appendinstbyfuncid(
         h64program *p,
         int id, h64expression *correspondingexpr,
@@ -166,6 +234,28 @@ int appendinst(
     return appendinstbyfuncid(p, id, correspondingexpr, ptr, len);
 }
 
+static int appendexceptionhandler(
+        h64program *p, h64expression *func,
+        h64exceptionhandler *handler
+        ) {
+    // The offsets are still jump ids at this point, and are resolved
+    // by codegen_FinalBytecodeTransform(). On success, the handler's
+    // catch types are owned by the function:
+    int id = func->funcdef.bytecode_func_id;
+    assert(id >= 0 && id < p->func_count && !p->func[id].iscfunc);
+    h64exceptionhandler *newhandlers = realloc(
+        p->func[id].exceptionhandlers,
+        sizeof(*newhandlers) * (p->func[id].exceptionhandlers_count + 1)
+    );
+    if (!newhandlers)
+        return 0;
+    p->func[id].exceptionhandlers = newhandlers;
+    memcpy(&newhandlers[p->func[id].exceptionhandlers_count],
+           handler, sizeof(*handler));
+    p->func[id].exceptionhandlers_count++;
+    return 1;
+}
+
 void codegen_CalculateFinalFuncStack(
         h64program *program, h64expression *expr) {
     if (expr->type != H64EXPRTYPE_FUNCDEF_STMT)
@@ -259,6 +349,18 @@ struct _jumpinfo {
     int64_t offset;
 };
 
+static int64_t _resolve_jumpid_to_offset(
+        int jumpid, struct _jumpinfo *jump_info, int jump_table_fill
+        ) {
+    int z = 0;
+    while (z < jump_table_fill) {
+        if (jump_info[z].jumpid == jumpid)
+            return jump_info[z].offset;
+        z++;
+    }
+    return -1;
+}
+
 static int _resolve_jumpid_to_jumpoffset(
         h64compileproject *prj,
         int jumpid, int64_t offset,
@@ -326,6 +428,392 @@ static int _resolve_jumpid_to_jumpoffset(
     return 1;
 }
 
+static int _codegen_IsFusableCompare(int optype) {
+    return (optype == H64OP_CMP_EQUAL ||
+            optype == H64OP_CMP_NOTEQUAL ||
+            optype == H64OP_CMP_LARGEROREQUAL ||
+            optype == H64OP_CMP_SMALLEROREQUAL ||
+            optype == H64OP_CMP_LARGER ||
+            optype == H64OP_CMP_SMALLER);
+}
+
+static int _codegen_CanFuseCompareCondJump(
+        h64func *f, h64instructionany *inst,
+        int64_t nextoffset, h64instructionany *next
+        ) {
+    // If a comparison result is only used by the condjump right after,
+    // we can skip storing it entirely. It may also be a variable that
+    // is read again later, e.g. "var c = a < b", so check that nothing
+    // else reads it. Returns -1 when out of memory:
+    if (inst->type != H64INST_BINOP || next->type != H64INST_CONDJUMP)
+        return 0;
+    h64instruction_binop *binop = (h64instruction_binop *)inst;
+    h64instruction_condjump *cjump = (h64instruction_condjump *)next;
+    if (!_codegen_IsFusableCompare(binop->optype) ||
+            cjump->conditionalslot != binop->slotto)
+        return 0;
+    int result = bytecodeopt_IsSlotReadAfter(
+        f, nextoffset, binop->slotto
+    );
+    if (result < 0)
+        return -1;
+    return !result;
+}
+
+static int _codegen_IsReturnOfSlot(
+        h64instructionany *next, int16_t slot
+        ) {
+    return (next != NULL && next->type == H64INST_RETURNVALUE &&
+            ((h64instruction_returnvalue *)next)->returnslotfrom == slot);
+}
+
+static int _codegen_FuseSuperinstructionsForFunc(
+        h64program *pr, int func_id
+        ) {
+    h64func *f = &pr->func[func_id];
+    int64_t len = f->instructions_bytes;
+    if (len <= 0)
+        return 1;
+
+    // Mark all jump targets, since we must not fuse across them. The
+    // same goes for the bounds of the exception table entries. Also,
+    // a tail call would leave any catch or finally of the caller
+    // behind, so functions with those get no tail calls:
+    int cantailcall = 1;
+    char *isjumptarget = malloc(len + 1);
+    int64_t *offsetmap = malloc(sizeof(*offsetmap) * (len + 1));
+    int64_t *neworigin = malloc(sizeof(*neworigin) * (len + 1));
+    char *newinstructions = malloc(len);
+    if (!isjumptarget || !offsetmap || !neworigin || !newinstructions) {
+        free(isjumptarget);
+        free(offsetmap);
+        free(neworigin);
+        free(newinstructions);
+        return 0;
+    }
+    memset(isjumptarget, 0, len + 1);
+    int64_t k = 0;
+    while (k <= len) {
+        offsetmap[k] = -1;
+        neworigin[k] = -1;
+        k++;
+    }
+    k = 0;
+    while (k < len) {
+        h64instructionany *inst = (
+            (h64instructionany *)(f->instructions + k)
+        );
+        int64_t target1 = -1;
+        if (inst->type == H64INST_CONDJUMP) {
+            target1 = k + ((h64instruction_condjump *)inst)->
+                jumpbytesoffset;
+        } else if (inst->type == H64INST_JUMP) {
+            target1 = k + ((h64instruction_jump *)inst)->
+                jumpbytesoffset;
+        } else if (inst->type == H64INST_BINOPCONDJUMP) {
+            target1 = k + ((h64instruction_binopcondjump *)inst)->
+                jumpbytesoffset;
+        } else if (inst->type == H64INST_ITERATE) {
+            target1 = k + ((h64instruction_iterate *)inst)->jumponend;
+        }
+        if (target1 >= 0 && target1 <= len)
+            isjumptarget[target1] = 1;
+        k += (int64_t)h64program_PtrToInstructionSize((char *)inst);
+    }
+    k = 0;
+    while (k < f->exceptionhandlers_count) {
+        h64exceptionhandler *handler = &f->exceptionhandlers[k];
+        int32_t offsets[5] = {
+            handler->try_start, handler->try_end,
+            handler->catch_offset, handler->finally_offset,
+            handler->finally_end
+        };
+        int j = 0;
+        while (j < 5) {
+            if (offsets[j] >= 0 && offsets[j] <= len)
+                isjumptarget[offsets[j]] = 1;
+            j++;
+        }
+        cantailcall = 0;
+        k++;
+    }
+
+    // Copy over instructions while fusing hot pairs:
+    int64_t newlen = 0;
+    int64_t pendingcall_offset = -1;
+    int64_t pendingcall_funcid = -1;
+    k = 0;
+    while (k < len) {
+        h64instructionany *inst = (
+            (h64instructionany *)(f->instructions + k)
+        );
+        int64_t instsize = (int64_t)h64program_PtrToInstructionSize(
+            (char *)inst
+        );
+        h64instructionany *next = NULL;
+        int64_t nextsize = 0;
+        if (k + instsize < len && !isjumptarget[k + instsize]) {
+            next = (h64instructionany *)(f->instructions + k + instsize);
+            nextsize = (int64_t)h64program_PtrToInstructionSize(
+                (char *)next
+            );
+        }
+        offsetmap[k] = newlen;
+
+        // binop (comparison) + condjump on its result:
+        int canfusecompare = 0;
+        if (next != NULL) {
+            canfusecompare = _codegen_CanFuseCompareCondJump(
+                f, inst, k + instsize, next
+            );
+            if (canfusecompare < 0)
+                goto oom;
+        }
+        if (canfusecompare) {
+            h64instruction_binop *binop = (h64instruction_binop *)inst;
+            h64instruction_condjump *cjump = (
+                (h64instruction_condjump *)next
+            );
+            h64instruction_binopcondjump fused = {0};
+            fused.type = H64INST_BINOPCONDJUMP;
+            fused.optype = binop->optype;
+            fused.arg1slotfrom = binop->arg1slotfrom;
+            fused.arg2slotfrom = binop->arg2slotfrom;
+            fused.jumpbytesoffset = cjump->jumpbytesoffset;
+            memcpy(newinstructions + newlen, &fused, sizeof(fused));
+            neworigin[newlen] = k + instsize;  // jump is relative to this
+            newlen += sizeof(fused);
+            k += instsize + nextsize;
+            continue;
+        }
+
+        // setconst (number) + binop using it as second operand. We
+        // leave a following condjump to the compare fusion above:
+        if (next != NULL && inst->type == H64INST_SETCONST &&
+                next->type == H64INST_BINOP) {
+            h64instruction_setconst *sconst = (
+                (h64instruction_setconst *)inst
+            );
+            h64instruction_binop *binop = (h64instruction_binop *)next;
+            int fusesnext = 0;
+            if (k + instsize + nextsize < len &&
+                    !isjumptarget[k + instsize + nextsize]) {
+                fusesnext = _codegen_CanFuseCompareCondJump(
+                    f, next, k + instsize + nextsize,
+                    (h64instructionany *)(
+                        f->instructions + k + instsize + nextsize
+                    )
+                );
+                if (fusesnext < 0)
+                    goto oom;
+            }
+            if ((sconst->content.type == H64VALTYPE_INT64 ||
+                    sconst->content.type == H64VALTYPE_FLOAT64) &&
+                    binop->arg2slotfrom == sconst->slot &&
+                    binop->arg1slotfrom != sconst->slot &&
+                    !IS_ASSIGN_OP(binop->optype) && !fusesnext) {
+                h64instruction_binopconst fused = {0};
+                fused.type = H64INST_BINOPCONST;
+                fused.optype = binop->optype;
+                fused.slotto = binop->slotto;
+                fused.arg1slotfrom = binop->arg1slotfrom;
+                fused.arg2slotfrom = binop->arg2slotfrom;
+                memcpy(&fused.content, &sconst->content,
+                       sizeof(fused.content));
+                memcpy(newinstructions + newlen, &fused, sizeof(fused));
+                newlen += sizeof(fused);
+                k += instsize + nextsize;
+                continue;
+            }
+        }
+
+        // getfunc + call of that func. We can drop the getfunc if
+        // nothing in between touches its slot, and nothing reads it
+        // after the call either, which it may if it is a variable like
+        // in "var f = g; f(1); f(2)":
+        if (inst->type == H64INST_GETFUNC && pendingcall_offset < 0) {
+            h64instruction_getfunc *getfunc = (
+                (h64instruction_getfunc *)inst
+            );
+            int16_t slot = getfunc->slotto;
+            int64_t k2 = k + instsize;
+            while (k2 < len && !isjumptarget[k2]) {
+                h64instructionany *inst2 = (
+                    (h64instructionany *)(f->instructions + k2)
+                );
+                if (inst2->type == H64INST_CALL) {
+                    if (((h64instruction_call *)inst2)->slotcalledfrom ==
+                            slot) {
+                        int readafter = bytecodeopt_IsSlotReadAfter(
+                            f, k2, slot
+                        );
+                        if (readafter < 0)
+                            goto oom;
+                        if (!readafter) {
+                            pendingcall_offset = k2;
+                            pendingcall_funcid = getfunc->funcfrom;
+                        }
+                    }
+                    break;
+                } else if (inst2->type == H64INST_SETCONST) {
+                    if (((h64instruction_setconst *)inst2)->slot == slot)
+                        break;
+                } else if (inst2->type == H64INST_VALUECOPY) {
+                    h64instruction_valuecopy *vcopy = (
+                        (h64instruction_valuecopy *)inst2
+                    );
+                    if (vcopy->slotto == slot || vcopy->slotfrom == slot)
+                        break;
+                } else if (inst2->type == H64INST_SETTOP) {
+                    if (((h64instruction_settop *)inst2)->topto <= slot)
+                        break;
+                } else {
+                    break;
+                }
+                k2 += (int64_t)h64program_PtrToInstructionSize(
+                    (char *)inst2
+                );
+            }
+            if (pendingcall_offset >= 0) {
+                k += instsize;
+                continue;
+            }
+        }
+        if (k == pendingcall_offset && cantailcall &&
+                _codegen_IsReturnOfSlot(
+                    next, ((h64instruction_call *)inst)->returnto)) {
+            // getfunc + call + return of the result:
+            assert(inst->type == H64INST_CALL);
+            h64instruction_call *call = (h64instruction_call *)inst;
+            h64instruction_tailcallfunc fused = {0};
+            fused.type = H64INST_TAILCALLFUNC;
+            fused.funcfrom = pendingcall_funcid;
+            fused.expandlastposarg = call->expandlastposarg;
+            fused.posargs = call->posargs;
+            fused.kwargs = call->kwargs;
+            memcpy(newinstructions + newlen, &fused, sizeof(fused));
+            newlen += sizeof(fused);
+            pendingcall_offset = -1;
+            k += instsize + nextsize;
+            continue;
+        } else if (k == pendingcall_offset) {
+            assert(inst->type == H64INST_CALL);
+            h64instruction_call *call = (h64instruction_call *)inst;
+            h64instruction_callfunc fused = {0};
+            fused.type = H64INST_CALLFUNC;
+            fused.returnto = call->returnto;
+            fused.funcfrom = pendingcall_funcid;
+            fused.expandlastposarg = call->expandlastposarg;
+            fused.posargs = call->posargs;
+            fused.kwargs = call->kwargs;
+            memcpy(newinstructions + newlen, &fused, sizeof(fused));
+            newlen += sizeof(fused);
+            pendingcall_offset = -1;
+            k += instsize;
+            continue;
+        }
+
+        // call + return of the result of any other callable:
+        if (inst->type == H64INST_CALL && cantailcall &&
+                _codegen_IsReturnOfSlot(
+                    next, ((h64instruction_call *)inst)->returnto)) {
+            h64instruction_call *call = (h64instruction_call *)inst;
+            h64instruction_tailcall fused = {0};
+            fused.type = H64INST_TAILCALL;
+            fused.slotcalledfrom = call->slotcalledfrom;
+            fused.expandlastposarg = call->expandlastposarg;
+            fused.posargs = call->posargs;
+            fused.kwargs = call->kwargs;
+            memcpy(newinstructions + newlen, &fused, sizeof(fused));
+            newlen += sizeof(fused);
+            k += instsize + nextsize;
+            continue;
+        }
+
+        memcpy(newinstructions + newlen, inst, instsize);
+        neworigin[newlen] = k;
+        newlen += instsize;
+        k += instsize;
+    }
+    offsetmap[len] = newlen;
+    assert(pendingcall_offset < 0);
+
+    // Fix up the jump offsets for the new layout:
+    k = 0;
+    while (k < newlen) {
+        h64instructionany *inst = (
+            (h64instructionany *)(newinstructions + k)
+        );
+        int64_t origin = neworigin[k];
+        if (inst->type == H64INST_CONDJUMP) {
+            h64instruction_condjump *cjump = (
+                (h64instruction_condjump *)inst
+            );
+            assert(offsetmap[origin + cjump->jumpbytesoffset] >= 0);
+            cjump->jumpbytesoffset = (
+                offsetmap[origin + cjump->jumpbytesoffset] - k
+            );
+        } else if (inst->type == H64INST_JUMP) {
+            h64instruction_jump *jump = (h64instruction_jump *)inst;
+            assert(offsetmap[origin + jump->jumpbytesoffset] >= 0);
+            jump->jumpbytesoffset = (
+                offsetmap[origin + jump->jumpbytesoffset] - k
+            );
+        } else if (inst->type == H64INST_BINOPCONDJUMP) {
+            h64instruction_binopcondjump *cjump = (
+                (h64instruction_binopcondjump *)inst
+            );
+            assert(offsetmap[origin + cjump->jumpbytesoffset] >= 0);
+            cjump->jumpbytesoffset = (
+                offsetmap[origin + cjump->jumpbytesoffset] - k
+            );
+        } else if (inst->type == H64INST_ITERATE) {
+            h64instruction_iterate *iterate = (
+                (h64instruction_iterate *)inst
+            );
+            assert(offsetmap[origin + iterate->jumponend] >= 0);
+            iterate->jumponend = (
+                offsetmap[origin + iterate->jumponend] - k
+            );
+        }
+        k += (int64_t)h64program_PtrToInstructionSize((char *)inst);
+    }
+    k = 0;
+    while (k < f->exceptionhandlers_count) {
+        h64exceptionhandler *handler = &f->exceptionhandlers[k];
+        int32_t *offsets[5] = {
+            &handler->try_start, &handler->try_end,
+            &handler->catch_offset, &handler->finally_offset,
+            &handler->finally_end
+        };
+        int j = 0;
+        while (j < 5) {
+            if (*offsets[j] >= 0) {
+                assert(offsetmap[*offsets[j]] >= 0);
+                *offsets[j] = offsetmap[*offsets[j]];
+            }
+            j++;
+        }
+        k++;
+    }
+
+    free(isjumptarget);
+    free(offsetmap);
+    free(neworigin);
+    // (Instructions removed by fusion own no allocations, so this is safe:)
+    free(f->instructions);
+    f->instructions = newinstructions;
+    f->instructions_bytes = newlen;
+    return 1;
+
+    oom:
+    free(isjumptarget);
+    free(offsetmap);
+    free(neworigin);
+    free(newinstructions);
+    return 0;
+}
+
 int codegen_FinalBytecodeTransform(
         h64compileproject *prj
         ) {
@@ -386,7 +874,7 @@ int codegen_FinalBytecodeTransform(
                     sizeof(*jump_info)
                 );
                 jump_info[jump_table_fill].offset = k;
-                assert(k > 0);
+                assert(k >= 0);  // (a try block may start right away)
                 jump_info[jump_table_fill].jumpid = (
                     ((h64instruction_jumptarget *)inst)->jumpid
                 );
@@ -416,7 +904,6 @@ int codegen_FinalBytecodeTransform(
             );
 
             int32_t jumpid = -1;
-            int32_t jumpid2 = -1;
 
             switch (inst->type) {
             case H64INST_CONDJUMP: {
@@ -433,94 +920,88 @@ int codegen_FinalBytecodeTransform(
                 jumpid = jump->jumpbytesoffset;
                 break;
             }
-            case H64INST_PUSHCATCHFRAME: {
-                h64instruction_pushcatchframe *catchjump = (
-                    (h64instruction_pushcatchframe *)inst
+            case H64INST_ITERATE: {
+                h64instruction_iterate *iterate = (
+                    (h64instruction_iterate *)inst
                 );
-                if ((catchjump->mode & CATCHMODE_JUMPONCATCH) != 0) {
-                    jumpid = catchjump->jumponcatch;
-                }
-                if ((catchjump->mode & CATCHMODE_JUMPONFINALLY) != 0) {
-                    jumpid2 = catchjump->jumponfinally;
-                }
+                jumpid = iterate->jumponend;
                 break;
             }
             default:
                 k += (int64_t)h64program_PtrToInstructionSize((char*)inst);
                 continue;
             }
-            assert(jumpid >= 0 || jumpid2 >= 2);
+            assert(jumpid >= 0);
 
             // FIXME: use a faster algorithm here, maybe hash table?
-            if (jumpid >= 0) {
-                int hadoom = 0;
-                int16_t offset = 0;
-                int resolveworked = _resolve_jumpid_to_jumpoffset(
-                    prj, jumpid, k, jump_info, jump_table_fill,
-                    &hadoom, &offset
-                );
-                if (!resolveworked) {
-                    free(jump_info);
-                    return 0;
-                }
+            int hadoom = 0;
+            int16_t offset = 0;
+            int resolveworked = _resolve_jumpid_to_jumpoffset(
+                prj, jumpid, k, jump_info, jump_table_fill,
+                &hadoom, &offset
+            );
+            if (!resolveworked) {
+                free(jump_info);
+                return 0;
+            }
 
-                switch (inst->type) {
-                case H64INST_CONDJUMP: {
-                    h64instruction_condjump *cjump = (
-                        (h64instruction_condjump *)inst
-                    );
-                    cjump->jumpbytesoffset = offset;
-                    break;
-                }
-                case H64INST_JUMP: {
-                    h64instruction_jump *jump = (
-                        (h64instruction_jump *)inst
-                    );
-                    jump->jumpbytesoffset = offset;
-                    break;
-                }
-                case H64INST_PUSHCATCHFRAME: {
-                    h64instruction_pushcatchframe *catchjump = (
-                        (h64instruction_pushcatchframe *)inst
-                    );
-                    catchjump->jumponcatch = offset;
-                    break;
-                }
-                default:
-                    fprintf(stderr, "horsec: error: internal error in "
-                        "codegen jump translation: unhandled jump type\n");
-                    free(jump_info);
-                    return 0;
-                }
+            switch (inst->type) {
+            case H64INST_CONDJUMP: {
+                h64instruction_condjump *cjump = (
+                    (h64instruction_condjump *)inst
+                );
+                cjump->jumpbytesoffset = offset;
+                break;
+            }
+            case H64INST_JUMP: {
+                h64instruction_jump *jump = (
+                    (h64instruction_jump *)inst
+                );
+                jump->jumpbytesoffset = offset;
+                break;
             }
-            if (jumpid2 >= 0) {
-                int hadoom = 0;
-                int16_t offset = 0;
-                int resolveworked = _resolve_jumpid_to_jumpoffset(
-                    prj, jumpid2, k, jump_info, jump_table_fill,
-                    &hadoom, &offset
+            case H64INST_ITERATE: {
+                h64instruction_iterate *iterate = (
+                    (h64instruction_iterate *)inst
                 );
-                if (!resolveworked) {
-                    free(jump_info);
-                    return 0;
-                }
+                iterate->jumponend = offset;
+                break;
+            }
+            default:
+                fprintf(stderr, "horsec: error: internal error in "
+                    "codegen jump translation: unhandled jump type\n");
+                free(jump_info);
+                return 0;
+            }
+            k += (int64_t)h64program_PtrToInstructionSize((char*)inst);
+        }
 
-                switch (inst->type) {
-                case H64INST_PUSHCATCHFRAME: {
-                    h64instruction_pushcatchframe *catchjump = (
-                        (h64instruction_pushcatchframe *)inst
+        // Turn the exception table's jump ids into actual offsets:
+        k = 0;
+        while (k < pr->func[i].exceptionhandlers_count) {
+            h64exceptionhandler *handler = (
+                &pr->func[i].exceptionhandlers[k]
+            );
+            int32_t *offsets[5] = {
+                &handler->try_start, &handler->try_end,
+                &handler->catch_offset, &handler->finally_offset,
+                &handler->finally_end
+            };
+            int j = 0;
+            while (j < 5) {
+                if (*offsets[j] >= 0) {
+                    int64_t offset = _resolve_jumpid_to_offset(
+                        *offsets[j], jump_info, jump_table_fill
                     );
-                    catchjump->jumponfinally = offset;
-                    break;
-                }
-                default:
-                    fprintf(stderr, "horsec: error: internal error in "
-                        "codegen jump translation: unhandled jump type\n");
-                    free(jump_info);
-                    return 0;
+                    if (offset < 0) {
+                        free(jump_info);
+                        return 0;
+                    }
+                    *offsets[j] = offset;
                 }
+                j++;
             }
-            k += (int64_t)h64program_PtrToInstructionSize((char*)inst);
+            k++;
         }
         i++;
     }
@@ -573,6 +1054,70 @@ int codegen_FinalBytecodeTransform(
         i++;
     }
     free(jump_info);
+
+    // Optimize, then fuse common instruction pairs into superinstructions:
+    i = 0;
+    while (i < pr->func_count) {
+        if (!pr->func[i].iscfunc && (
+                !bytecodeopt_OptimizeFunc(pr, i) ||
+                !_codegen_FuseSuperinstructionsForFunc(pr, i)))
+            return 0;
+        i++;
+    }
+
+    // All class members are known now, so finalize their lookup:
+    if (!h64program_FinalizeAllClassMemberLookups(pr))
+        return 0;
+    return 1;
+}
+
+static int _codegen_AppendReturn(
+        asttransforminfo *rinfo, h64expression *func,
+        h64expression *expr, int returntemp
+        ) {
+    struct h64codegenfinallyroute *route = (
+        func->funcdef._storageinfo->codegen.finallyroute
+    );
+    if (!route) {
+        h64instruction_returnvalue inst_returnvalue = {0};
+        inst_returnvalue.type = H64INST_RETURNVALUE;
+        inst_returnvalue.returnslotfrom = returntemp;
+        if (!appendinst(
+                rinfo->pr->program, func, expr,
+                &inst_returnvalue, sizeof(inst_returnvalue))) {
+            rinfo->hadoutofmemory = 1;
+            return 0;
+        }
+        return 1;
+    }
+
+    // Go through the enclosing finally block first, which returns
+    // the value at its end:
+    route->used = 1;
+    h64instruction_valuecopy inst_vc = {0};
+    inst_vc.type = H64INST_VALUECOPY;
+    inst_vc.slotto = route->returnvalueslot;
+    inst_vc.slotfrom = returntemp;
+    h64instruction_setconst inst_setconst = {0};
+    inst_setconst.type = H64INST_SETCONST;
+    inst_setconst.slot = route->notreturningslot;
+    inst_setconst.content.type = H64VALTYPE_BOOL;
+    inst_setconst.content.int_value = 0;
+    h64instruction_jump inst_jump = {0};
+    inst_jump.type = H64INST_JUMP;
+    inst_jump.jumpbytesoffset = route->jumpid_finallybody;
+    if (!appendinst(
+            rinfo->pr->program, func, expr,
+            &inst_vc, sizeof(inst_vc)) ||
+            !appendinst(
+            rinfo->pr->program, func, expr,
+            &inst_setconst, sizeof(inst_setconst)) ||
+            !appendinst(
+            rinfo->pr->program, func, expr,
+            &inst_jump, sizeof(inst_jump))) {
+        rinfo->hadoutofmemory = 1;
+        return 0;
+    }
     return 1;
 }
 
@@ -595,13 +1140,50 @@ int _codegencallback_DoCodegen_visit_out(
         }
     }
 
-    if (expr->type == H64EXPRTYPE_LIST) {
+    if (_codegen_IsFoldedConstant(expr)) {
+        // Pre-evaluated by optimizer_PreevaluateConstants(), so
+        // just set the result:
+        int temp = new1linetemp(func, expr);
+        h64instruction_setconst inst = {0};
+        inst.type = H64INST_SETCONST;
+        inst.slot = temp;
+        memset(&inst.content, 0, sizeof(inst.content));
+        if (expr->knownvalue.type == KNOWNVALUETYPE_KNOWNINT) {
+            inst.content.type = H64VALTYPE_INT64;
+            inst.content.int_value = expr->knownvalue.knownint;
+        } else if (expr->knownvalue.type == KNOWNVALUETYPE_KNOWNFLOAT) {
+            inst.content.type = H64VALTYPE_FLOAT64;
+            inst.content.float_value = expr->knownvalue.knownfloat;
+        } else {
+            assert(expr->knownvalue.type == KNOWNVALUETYPE_KNOWNSTR);
+            int outofmemory = 0;
+            valuecontent content = {0};
+            if (!_codegen_Utf8ToConstContent(
+                    expr->knownvalue.knownstr, &content,
+                    &outofmemory
+                    )) {
+                // Can only be OOM, folded strings come from literals:
+                rinfo->hadoutofmemory = 1;
+                return 0;
+            }
+            memcpy(&inst.content, &content, sizeof(content));
+        }
+        if (!appendinst(rinfo->pr->program, func, expr,
+                        &inst, sizeof(inst))) {
+            if (inst.content.type == H64VALTYPE_CONSTPREALLOCSTR)
+                free(inst.content.constpreallocstr_value);
+            rinfo->hadoutofmemory = 1;
+            return 0;
+        }
+        expr->storage.eval_temp_id = temp;
+    } else if (expr->type == H64EXPRTYPE_LIST) {
         int listtmp = new1linetemp(
             func, expr
         );
         h64instruction_newlist inst = {0};
         inst.type = H64INST_NEWLIST;
         inst.slotto = listtmp;
+        inst.presize = expr->constructorlist.entry_count;
         if (!appendinst(rinfo->pr->program, func, expr,
                         &inst, sizeof(inst))) {
             rinfo->hadoutofmemory = 1;
@@ -632,6 +1214,7 @@ int _codegencallback_DoCodegen_visit_out(
         h64instruction_newset inst = {0};
         inst.type = H64INST_NEWSET;
         inst.slotto = settmp;
+        inst.presize = expr->constructorset.entry_count;
         if (!appendinst(rinfo->pr->program, func, expr,
                         &inst, sizeof(inst))) {
             rinfo->hadoutofmemory = 1;
@@ -662,6 +1245,7 @@ int _codegencallback_DoCodegen_visit_out(
         h64instruction_newvector inst = {0};
         inst.type = H64INST_NEWVECTOR;
         inst.slotto = vectortmp;
+        inst.size = expr->constructorvector.entry_count;
         if (!appendinst(rinfo->pr->program, func, expr,
                         &inst, sizeof(inst))) {
             rinfo->hadoutofmemory = 1;
@@ -693,14 +1277,17 @@ int _codegencallback_DoCodegen_visit_out(
         h64instruction_newmap inst = {0};
         inst.type = H64INST_NEWMAP;
         inst.slotto = maptmp;
+        inst.presize = expr->constructormap.entry_count;
         if (!appendinst(rinfo->pr->program, func, expr,
                         &inst, sizeof(inst))) {
             rinfo->hadoutofmemory = 1;
             return 0;
         }
         int i = 0;
-        while (i < expr->constructorvector.entry_count) {
-            assert(expr->constructorvector.entry[i]->
+        while (i < expr->constructormap.entry_count) {
+            assert(expr->constructormap.key[i]->
+                   storage.eval_temp_id >= 0 &&
+                   expr->constructormap.value[i]->
                    storage.eval_temp_id >= 0);
             h64instruction_putmap instput = {0};
             instput.type = H64INST_PUTMAP;
@@ -737,19 +1324,14 @@ int _codegencallback_DoCodegen_visit_out(
         } else if (expr->literal.type == H64TK_CONSTANT_NONE) {
             inst.content.type = H64VALTYPE_NONE;
         } else if (expr->literal.type == H64TK_CONSTANT_STRING) {
-            inst.content.type = H64VALTYPE_SHORTSTR;
             assert(expr->literal.str_value != NULL);
-            int64_t out_len = 0;
-            int abortinvalid = 0;
-            int abortoom = 0;
-            unicodechar *result = utf8_to_utf32_ex(
-                expr->literal.str_value,
-                strlen(expr->literal.str_value),
-                NULL, NULL, &out_len, 1,
-                &abortinvalid, &abortoom
-            );
-            if (!result) {
-                if (abortoom) {
+            int outofmemory = 0;
+            valuecontent content = {0};
+            if (!_codegen_Utf8ToConstContent(
+                    expr->literal.str_value, &content,
+                    &outofmemory
+                    )) {
+                if (outofmemory) {
                     rinfo->hadoutofmemory = 1;
                     return 0;
                 }
@@ -769,30 +1351,7 @@ int _codegencallback_DoCodegen_visit_out(
                 }
                 return 1;
             }
-            assert(!abortinvalid);
-            assert(!abortoom);
-            if (out_len <= VALUECONTENT_SHORTSTRLEN) {
-                memcpy(
-                    inst.content.shortstr_value,
-                    result, out_len * sizeof(*result)
-                );
-                inst.content.type = H64VALTYPE_SHORTSTR;
-            } else {
-                inst.content.type = H64VALTYPE_CONSTPREALLOCSTR;
-                inst.content.constpreallocstr_value = malloc(
-                    out_len * sizeof(*result)
-                );
-                if (!inst.content.constpreallocstr_value) {
-                    rinfo->hadoutofmemory = 1;
-                    return 0;
-                }
-                inst.content.constpreallocstr_len = out_len;
-                memcpy(
-                    inst.content.constpreallocstr_value,
-                    result, out_len * sizeof(*result)
-                );
-            }
-            free(result);
+            memcpy(&inst.content, &content, sizeof(content));
         } else {
             char buf[256];
             snprintf(buf, sizeof(buf) - 1,
@@ -841,7 +1400,9 @@ int _codegencallback_DoCodegen_visit_out(
             h64instruction_getmember inst_getmem = {0};
             inst_getmem.type = H64INST_GETMEMBER;
             inst_getmem.slotto = temp;
-            inst_getmem.objslotfrom = expr->op.value1->storage.ref.id;
+            inst_getmem.objslotfrom = (
+                expr->op.value1->storage.eval_temp_id
+            );
             inst_getmem.nameidx = idx;
             if (!appendinst(
                     rinfo->pr->program, func, expr,
@@ -874,7 +1435,7 @@ int _codegencallback_DoCodegen_visit_out(
         );
         int _argtemp = (
             func->funcdef._storageinfo->codegen.oneline_temps_used_now
-        ) + func->funcdef._storageinfo->lowest_guaranteed_free_temp;
+        ) + _onelinetempsbase(func);
         int preargs_tempceiling = _argtemp;
         int posargcount = 0;
         int expandlastposarg = 0;
@@ -970,7 +1531,8 @@ int _codegencallback_DoCodegen_visit_out(
             }
             i++;
         }
-        int maxslotsused = (_argtemp - preargs_tempceiling);
+        // (the argument window sits above all temps in use right now)
+        int maxslotsused = _argtemp - _onelinetempsbase(func);
         if (maxslotsused > func->funcdef._storageinfo->
                 codegen.max_oneline_slots)
             func->funcdef._storageinfo->codegen.max_oneline_slots = (
@@ -1095,6 +1657,7 @@ int _codegencallback_DoCodegen_visit_out(
             returntemp = new1linetemp(func, expr);
             h64instruction_setconst inst_setconst = {0};
             inst_setconst.type = H64INST_SETCONST;
+            inst_setconst.slot = returntemp;
             inst_setconst.content.type = H64VALTYPE_NONE;
             if (!appendinst(rinfo->pr->program, func, expr,
                             &inst_setconst, sizeof(inst_setconst))) {
@@ -1102,16 +1665,8 @@ int _codegencallback_DoCodegen_visit_out(
                 return 0;
             }
         }
-        h64instruction_returnvalue inst_returnvalue = {0};
-        inst_returnvalue.type = H64INST_RETURNVALUE;
-        inst_returnvalue.returnslotfrom = returntemp;
-        if (!appendinst(
-                rinfo->pr->program, func, expr,
-                &inst_returnvalue, sizeof(inst_returnvalue))
-                ) {
-            rinfo->hadoutofmemory = 1;
+        if (!_codegen_AppendReturn(rinfo, func, expr, returntemp))
             return 0;
-        }
     } else if ((expr->type == H64EXPRTYPE_VARDEF_STMT &&
                 expr->vardef.value != NULL) ||
             (expr->type == H64EXPRTYPE_ASSIGN_STMT && (
@@ -1229,6 +1784,54 @@ int _codegencallback_DoCodegen_visit_out(
     return 1;
 }
 
+int _codegencallback_DoCodegen_visit_in(
+    h64expression *expr, ATTR_UNUSED h64expression *parent, void *ud
+);
+
+static int32_t _codegen_NewJumpId(h64expression *func) {
+    int32_t jumpid = func->funcdef._storageinfo->jump_targets_used;
+    func->funcdef._storageinfo->jump_targets_used++;
+    return jumpid;
+}
+
+static int _codegen_AppendJumpTarget(
+        asttransforminfo *rinfo, h64expression *func,
+        h64expression *expr, int32_t jumpid
+        ) {
+    h64instruction_jumptarget inst_jumptarget = {0};
+    inst_jumptarget.type = H64INST_JUMPTARGET;
+    inst_jumptarget.jumpid = jumpid;
+    if (!appendinst(
+            rinfo->pr->program, func, expr,
+            &inst_jumptarget, sizeof(inst_jumptarget))) {
+        rinfo->hadoutofmemory = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int _codegen_VisitBlock(
+        asttransforminfo *rinfo, h64expression *expr,
+        h64expression **stmt, int stmt_count
+        ) {
+    int i = 0;
+    while (i < stmt_count) {
+        rinfo->dont_descend_visitation = 0;
+        int result = ast_VisitExpression(
+            stmt[i], expr,
+            &_codegencallback_DoCodegen_visit_in,
+            &_codegencallback_DoCodegen_visit_out,
+            _asttransform_cancel_visit_descend_callback,
+            rinfo
+        );
+        rinfo->dont_descend_visitation = 1;
+        if (!result)
+            return 0;
+        i++;
+    }
+    return 1;
+}
+
 int _codegencallback_DoCodegen_visit_in(
         h64expression *expr, ATTR_UNUSED h64expression *parent, void *ud
         ) {
@@ -1251,6 +1854,12 @@ int _codegencallback_DoCodegen_visit_in(
         func->funcdef._storageinfo->codegen.oneline_temps_used_now = 0;
     }
 
+    if (_codegen_IsFoldedConstant(expr)) {
+        // Operands were folded into one constant, skip them:
+        rinfo->dont_descend_visitation = 1;
+        return 1;
+    }
+
     if (expr->type == H64EXPRTYPE_WHILE_STMT) {
         rinfo->dont_descend_visitation = 1;
         int32_t jumpid_start = (
@@ -1456,246 +2065,219 @@ int _codegencallback_DoCodegen_visit_in(
     } else if (expr->type == H64EXPRTYPE_TRY_STMT) {
         rinfo->dont_descend_visitation = 1;
 
+        // No instructions are emitted for entering or leaving the try,
+        // instead the blocks go into the function's exception table,
+        // which the VM only looks at once an exception is raised:
+        int has_catch = (expr->trystmt.exceptions_count > 0);
+        int has_finally = expr->trystmt.has_finally_block;
+        int32_t jumpid_trystart = _codegen_NewJumpId(func);
+        int32_t jumpid_tryend = _codegen_NewJumpId(func);
         int32_t jumpid_catch = -1;
+        int32_t jumpid_catchend = -1;
+        if (has_catch) {
+            jumpid_catch = _codegen_NewJumpId(func);
+            jumpid_catchend = _codegen_NewJumpId(func);
+        }
         int32_t jumpid_finally = -1;
-        int32_t jumpid_end = (
-            func->funcdef._storageinfo->jump_targets_used
-        );
-        func->funcdef._storageinfo->jump_targets_used++;
+        int32_t jumpid_finallyend = -1;
+        if (has_finally) {
+            jumpid_finally = _codegen_NewJumpId(func);
+            jumpid_finallyend = _codegen_NewJumpId(func);
+        }
+        int32_t jumpid_end = _codegen_NewJumpId(func);
+
+        // Returns inside the try and catch blocks must run the finally
+        // block first, so they go through it:
+        struct h64codegenfinallyroute route = {0};
+        route.parent = func->funcdef._storageinfo->codegen.finallyroute;
+        if (has_finally) {
+            route.jumpid_finallybody = _codegen_NewJumpId(func);
+            route.returnvalueslot = newmultilinetemp(func, expr);
+            route.notreturningslot = newmultilinetemp(func, expr);
+            if (route.returnvalueslot < 0 || route.notreturningslot < 0) {
+                rinfo->hadoutofmemory = 1;
+                return 0;
+            }
+        }
 
-        h64instruction_pushcatchframe inst_pushframe = {0};
-        inst_pushframe.type = H64INST_PUSHCATCHFRAME;
-        inst_pushframe.slotexceptionto = -1;
-        inst_pushframe.jumponcatch = -1;
-        inst_pushframe.jumponfinally = -1;
-        if (expr->trystmt.exceptions_count > 0) {
+        h64exceptionhandler handler = {0};
+        handler.try_start = jumpid_trystart;
+        handler.try_end = jumpid_tryend;
+        handler.catch_offset = jumpid_catch;
+        handler.finally_offset = jumpid_finally;
+        handler.finally_end = jumpid_finallyend;
+        handler.slotexceptionto = -1;
+        if (has_catch) {
             assert(!expr->storage.set ||
                    expr->storage.ref.type ==
                    H64STORETYPE_STACKSLOT);
-            int exception_tmp = -1;
-            if (expr->storage.set) {
-                exception_tmp = expr->storage.ref.id;
-            }
-            inst_pushframe.slotexceptionto = exception_tmp;
-            inst_pushframe.mode |= CATCHMODE_JUMPONCATCH;
-            jumpid_catch = (
-                func->funcdef._storageinfo->jump_targets_used
+            if (expr->storage.set)
+                handler.slotexceptionto = expr->storage.ref.id;
+            handler.catchtypes = malloc(
+                sizeof(*handler.catchtypes) *
+                expr->trystmt.exceptions_count
             );
-            func->funcdef._storageinfo->jump_targets_used++;
-            inst_pushframe.jumponcatch = jumpid_catch;
+            if (!handler.catchtypes) {
+                rinfo->hadoutofmemory = 1;
+                return 0;
+            }
+            handler.catchtypes_count = expr->trystmt.exceptions_count;
+            int i = 0;
+            while (i < expr->trystmt.exceptions_count) {
+                h64expression *exc = expr->trystmt.exceptions[i];
+                assert(exc->storage.set);
+                h64catchtype *ctype = &handler.catchtypes[i];
+                ctype->id = exc->storage.ref.id;
+                if (exc->storage.ref.type == H64STORETYPE_GLOBALCLASSSLOT) {
+                    ctype->kind = H64CATCHTYPE_CLASS;
+                } else if (exc->storage.ref.type ==
+                        H64STORETYPE_GLOBALVARSLOT) {
+                    ctype->kind = H64CATCHTYPE_GLOBALVAR;
+                } else {
+                    assert(exc->storage.ref.type ==
+                           H64STORETYPE_STACKSLOT);
+                    ctype->kind = H64CATCHTYPE_STACKSLOT;
+                }
+                i++;
+            }
         }
-        if (expr->trystmt.has_finally_block) {
-            inst_pushframe.mode |= CATCHMODE_JUMPONFINALLY;
-            jumpid_finally = (
-                func->funcdef._storageinfo->jump_targets_used
-            );
-            func->funcdef._storageinfo->jump_targets_used++;
-            inst_pushframe.jumponfinally = jumpid_finally;
+
+        // Try block, then on to the finally block or past the catch:
+        if (has_finally)
+            func->funcdef._storageinfo->codegen.finallyroute = &route;
+        if (!_codegen_AppendJumpTarget(
+                rinfo, func, expr, jumpid_trystart) ||
+                !_codegen_VisitBlock(
+                    rinfo, expr, expr->trystmt.trystmt,
+                    expr->trystmt.trystmt_count) ||
+                !_codegen_AppendJumpTarget(
+                    rinfo, func, expr, jumpid_tryend)) {
+            func->funcdef._storageinfo->codegen.finallyroute = route.parent;
+            free(handler.catchtypes);
+            return 0;
+        }
+        // (Appended only now, such that handlers of try statements
+        // nested inside come first.)
+        if (!appendexceptionhandler(rinfo->pr->program, func, &handler)) {
+            func->funcdef._storageinfo->codegen.finallyroute = route.parent;
+            free(handler.catchtypes);
+            rinfo->hadoutofmemory = 1;
+            return 0;
         }
+        h64instruction_jump inst_jump = {0};
+        inst_jump.type = H64INST_JUMP;
+        inst_jump.jumpbytesoffset = (
+            has_finally ? jumpid_finally : jumpid_end
+        );
         if (!appendinst(
                 rinfo->pr->program, func, expr,
-                &inst_pushframe, sizeof(inst_pushframe))) {
+                &inst_jump, sizeof(inst_jump))) {
+            func->funcdef._storageinfo->codegen.finallyroute = route.parent;
             rinfo->hadoutofmemory = 1;
             return 0;
         }
 
-        int exception_reuse_tmp = -1;
-        int i = 0;
-        while (i < expr->trystmt.exceptions_count) {
-            assert(expr->trystmt.exceptions[i]->storage.set);
-            int exception_tmp = -1;
-            if (expr->trystmt.exceptions[i]->storage.ref.type ==
-                    H64STORETYPE_STACKSLOT) {
-                exception_tmp = (int)(
-                    expr->trystmt.exceptions[i]->storage.ref.id
+        // Catch block, falling through to the finally block:
+        if (has_catch) {
+            if (!_codegen_AppendJumpTarget(
+                    rinfo, func, expr, jumpid_catch) ||
+                    !_codegen_VisitBlock(
+                        rinfo, expr, expr->trystmt.catchstmt,
+                        expr->trystmt.catchstmt_count) ||
+                    !_codegen_AppendJumpTarget(
+                        rinfo, func, expr, jumpid_catchend)) {
+                func->funcdef._storageinfo->codegen.finallyroute = (
+                    route.parent
                 );
-            } else if (expr->trystmt.exceptions[i]->storage.ref.type ==
-                       H64STORETYPE_GLOBALCLASSSLOT) {
-                h64instruction_addcatchtype addctype = {0};
-                addctype.type = H64INST_ADDCATCHTYPE;
-                addctype.classid = (
-                    expr->trystmt.exceptions[i]->
-                        storage.ref.id
-                );
-                if (!appendinst(
-                        rinfo->pr->program, func, expr,
-                        &addctype, sizeof(addctype))) {
+                return 0;
+            }
+            if (has_finally) {
+                // An exception inside the catch block still needs
+                // to run the finally block:
+                h64exceptionhandler catchhandler = {0};
+                catchhandler.try_start = jumpid_catch;
+                catchhandler.try_end = jumpid_catchend;
+                catchhandler.catch_offset = -1;
+                catchhandler.finally_offset = jumpid_finally;
+                catchhandler.finally_end = jumpid_finallyend;
+                catchhandler.slotexceptionto = -1;
+                if (!appendexceptionhandler(
+                        rinfo->pr->program, func, &catchhandler)) {
                     rinfo->hadoutofmemory = 1;
                     return 0;
                 }
-                i++;
-                continue;
             } else {
-                assert(expr->trystmt.exceptions[i]->storage.ref.type ==
-                       H64STORETYPE_GLOBALVARSLOT);
-                if (exception_reuse_tmp < 0) {
-                    exception_reuse_tmp = new1linetemp(
-                        func, expr
-                    );
-                }
-                exception_tmp = exception_reuse_tmp;
-                h64instruction_getglobal inst_getglobal = {0};
-                inst_getglobal.type = H64INST_GETGLOBAL;
-                inst_getglobal.slotto = exception_tmp;
-                inst_getglobal.globalfrom = expr->trystmt.exceptions[i]->
-                    storage.ref.id;
+                h64instruction_jump inst_jumpend = {0};
+                inst_jumpend.type = H64INST_JUMP;
+                inst_jumpend.jumpbytesoffset = jumpid_end;
                 if (!appendinst(
                         rinfo->pr->program, func, expr,
-                        &inst_getglobal, sizeof(inst_getglobal))) {
+                        &inst_jumpend, sizeof(inst_jumpend))) {
                     rinfo->hadoutofmemory = 1;
                     return 0;
                 }
             }
-            assert(exception_tmp >= 0);
-            h64instruction_addcatchtypebyref addctyperef = {0};
-            addctyperef.type = H64INST_ADDCATCHTYPEBYREF;
-            addctyperef.slotfrom = exception_tmp;
-            if (!appendinst(
-                    rinfo->pr->program, func, expr,
-                    &addctyperef, sizeof(addctyperef))) {
-                rinfo->hadoutofmemory = 1;
-                return 0;
-            }
-            i++;
         }
 
-        i = 0;
-        while (i < expr->trystmt.trystmt_count) {
-            rinfo->dont_descend_visitation = 0;
-            int result = ast_VisitExpression(
-                expr->trystmt.trystmt[i], expr,
-                &_codegencallback_DoCodegen_visit_in,
-                &_codegencallback_DoCodegen_visit_out,
-                _asttransform_cancel_visit_descend_callback,
-                rinfo
-            );
-            rinfo->dont_descend_visitation = 1;
-            if (!result)
+        // Finally block, which raises the exception again at the end
+        // if it was entered due to one that wasn't caught, or returns
+        // if it was entered due to a return:
+        if (has_finally) {
+            func->funcdef._storageinfo->codegen.finallyroute = route.parent;
+            if (!_codegen_AppendJumpTarget(
+                    rinfo, func, expr, jumpid_finally))
                 return 0;
-            i++;
-        }
-        if (!(inst_pushframe.mode | CATCHMODE_JUMPONFINALLY) != 0) {
-            h64instruction_popcatchframe inst_popcatch = {0};
-            inst_popcatch.type = H64INST_POPCATCHFRAME;
-            if (!appendinst(
-                    rinfo->pr->program, func, expr,
-                    &inst_popcatch, sizeof(inst_popcatch))) {
-                rinfo->hadoutofmemory = 1;
-                return 0;
-            }
-            if ((inst_pushframe.mode | CATCHMODE_JUMPONCATCH) != 0) {
-                h64instruction_jump inst_jump = {0};
-                inst_jump.type = H64INST_JUMP;
-                inst_jump.jumpbytesoffset = jumpid_end;
+            if (route.used) {
+                h64instruction_setconst inst_setconst = {0};
+                inst_setconst.type = H64INST_SETCONST;
+                inst_setconst.slot = route.notreturningslot;
+                inst_setconst.content.type = H64VALTYPE_BOOL;
+                inst_setconst.content.int_value = 1;
                 if (!appendinst(
                         rinfo->pr->program, func, expr,
-                        &inst_jump, sizeof(inst_jump))) {
+                        &inst_setconst, sizeof(inst_setconst))) {
                     rinfo->hadoutofmemory = 1;
                     return 0;
                 }
             }
-        } else {
-            h64instruction_jumptofinally inst_jumptofinally = {0};
-            inst_jumptofinally.type = H64INST_JUMPTOFINALLY;
-            if (!appendinst(
-                    rinfo->pr->program, func, expr,
-                    &inst_jumptofinally, sizeof(inst_jumptofinally))) {
-                rinfo->hadoutofmemory = 1;
+            if (!_codegen_AppendJumpTarget(
+                    rinfo, func, expr, route.jumpid_finallybody) ||
+                    !_codegen_VisitBlock(
+                        rinfo, expr, expr->trystmt.finallystmt,
+                        expr->trystmt.finallystmt_count) ||
+                    !_codegen_AppendJumpTarget(
+                        rinfo, func, expr, jumpid_finallyend))
                 return 0;
-            }
-        }
-
-        if ((inst_pushframe.mode | CATCHMODE_JUMPONCATCH) != 0) {
-            h64instruction_jumptarget inst_jumpcatch = {0};
-            inst_jumpcatch.type = H64INST_JUMPTARGET;
-            inst_jumpcatch.jumpid = jumpid_catch;
+            h64instruction_endfinally inst_endfinally = {0};
+            inst_endfinally.type = H64INST_ENDFINALLY;
             if (!appendinst(
                     rinfo->pr->program, func, expr,
-                    &inst_jumpcatch, sizeof(inst_jumpcatch))) {
+                    &inst_endfinally, sizeof(inst_endfinally))) {
                 rinfo->hadoutofmemory = 1;
                 return 0;
             }
-
-            i = 0;
-            while (i < expr->trystmt.catchstmt_count) {
-                rinfo->dont_descend_visitation = 0;
-                int result = ast_VisitExpression(
-                    expr->trystmt.catchstmt[i], expr,
-                    &_codegencallback_DoCodegen_visit_in,
-                    &_codegencallback_DoCodegen_visit_out,
-                    _asttransform_cancel_visit_descend_callback,
-                    rinfo
-                );
-                rinfo->dont_descend_visitation = 1;
-                if (!result)
-                    return 0;
-                i++;
-            }
-            if ((inst_pushframe.mode | CATCHMODE_JUMPONFINALLY) != 0) {
-                h64instruction_jumptofinally inst_jumptofinally = {0};
-                inst_jumptofinally.type = H64INST_JUMPTOFINALLY;
+            if (route.used) {
+                h64instruction_condjump inst_condjump = {0};
+                inst_condjump.type = H64INST_CONDJUMP;
+                inst_condjump.conditionalslot = route.notreturningslot;
+                inst_condjump.jumpbytesoffset = jumpid_end;
                 if (!appendinst(
                         rinfo->pr->program, func, expr,
-                        &inst_jumptofinally, sizeof(inst_jumptofinally))) {
+                        &inst_condjump, sizeof(inst_condjump))) {
                     rinfo->hadoutofmemory = 1;
                     return 0;
                 }
-            } else {
-                h64instruction_popcatchframe inst_popcatch = {0};
-                inst_popcatch.type = H64INST_POPCATCHFRAME;
-                if (!appendinst(
-                        rinfo->pr->program, func, expr,
-                        &inst_popcatch, sizeof(inst_popcatch))) {
-                    rinfo->hadoutofmemory = 1;
+                if (!_codegen_AppendReturn(
+                        rinfo, func, expr, route.returnvalueslot))
                     return 0;
-                }
             }
         }
 
-        if ((inst_pushframe.mode | CATCHMODE_JUMPONFINALLY) != 0) {
-            h64instruction_jumptarget inst_jumpfinally = {0};
-            inst_jumpfinally.type = H64INST_JUMPTARGET;
-            inst_jumpfinally.jumpid = jumpid_finally;
-            if (!appendinst(
-                    rinfo->pr->program, func, expr,
-                    &inst_jumpfinally, sizeof(inst_jumpfinally))) {
-                rinfo->hadoutofmemory = 1;
-                return 0;
-            }
-
-            i = 0;
-            while (i < expr->trystmt.finallystmt_count) {
-                rinfo->dont_descend_visitation = 0;
-                int result = ast_VisitExpression(
-                    expr->trystmt.finallystmt[i], expr,
-                    &_codegencallback_DoCodegen_visit_in,
-                    &_codegencallback_DoCodegen_visit_out,
-                    _asttransform_cancel_visit_descend_callback,
-                    rinfo
-                );
-                rinfo->dont_descend_visitation = 1;
-                if (!result)
-                    return 0;
-                i++;
-            }
-            h64instruction_popcatchframe inst_popcatch = {0};
-            inst_popcatch.type = H64INST_POPCATCHFRAME;
-            if (!appendinst(
-                    rinfo->pr->program, func, expr,
-                    &inst_popcatch, sizeof(inst_popcatch))) {
-                rinfo->hadoutofmemory = 1;
-                return 0;
-            }
-        }
-
-        h64instruction_jumptarget inst_jumpend = {0};
-        inst_jumpend.type = H64INST_JUMPTARGET;
-        inst_jumpend.jumpid = jumpid_end;
-        if (!appendinst(
-                rinfo->pr->program, func, expr,
-                &inst_jumpend, sizeof(inst_jumpend))) {
-            rinfo->hadoutofmemory = 1;
+        if (!_codegen_AppendJumpTarget(rinfo, func, expr, jumpid_end))
             return 0;
+        if (has_finally) {
+            freemultilinetemp(func, route.returnvalueslot);
+            freemultilinetemp(func, route.notreturningslot);
         }
 
         rinfo->dont_descend_visitation = 1;
@@ -68,11 +68,19 @@ char *disassembler_DumpValueContent(valuecontent *vs) {
         return strdup("false");
     case H64VALTYPE_NONE:
         return strdup("none");
+    case H64VALTYPE_GCVAL:
+        if (!vs->ptr_value || ((h64gcvalue *)vs->ptr_value)->type !=
+                H64GCVALUETYPE_STRING)
+            return strdup("<heap value>");
+        // A string literal the VM made immortal, so:
+        // fall through
     case H64VALTYPE_CONSTPREALLOCSTR:
     case H64VALTYPE_SHORTSTR: ;
         int alloclen = -1;
         int totallen = -1;
-        if (vs->type == H64VALTYPE_CONSTPREALLOCSTR) {
+        if (vs->type == H64VALTYPE_GCVAL) {
+            totallen = (int)((h64gcvalue *)vs->ptr_value)->str_val.len;
+        } else if (vs->type == H64VALTYPE_CONSTPREALLOCSTR) {
             totallen = (int)vs->constpreallocstr_len;
         } else {
             totallen = (int)vs->shortstr_len;
@@ -82,9 +90,13 @@ char *disassembler_DumpValueContent(valuecontent *vs) {
         outbuf[0] = '\"';
         int outfill = 1;
         int k = 0;
-        while (k < vs->constpreallocstr_len) {
+        while (k < totallen) {
             uint64_t c = 0;
-            if (vs->type == H64VALTYPE_CONSTPREALLOCSTR) {
+            if (vs->type == H64VALTYPE_GCVAL) {
+                c = vmstrings_CharAt(
+                    &((h64gcvalue *)vs->ptr_value)->str_val, k
+                );
+            } else if (vs->type == H64VALTYPE_CONSTPREALLOCSTR) {
                 c = vs->constpreallocstr_value[k];
             } else {
                 c = vs->shortstr_value[k];
@@ -146,9 +158,9 @@ int disassembler_PrintInstruction(
     case H64INST_SETCONST: {
         h64instruction_setconst *inst_setconst =
             (h64instruction_setconst*)inst;
-        char *s = disassembler_DumpValueContent(
-            &inst_setconst->content
-        );
+        valuecontent content;
+        memcpy(&content, &inst_setconst->content, sizeof(content));
+        char *s = disassembler_DumpValueContent(&content);
         if (!s)
             return 0;
         if (!disassembler_Write(di,
@@ -233,7 +245,9 @@ int disassembler_PrintInstruction(
         }
         break;
     }
-    case H64INST_BINOP: {
+    case H64INST_BINOP:
+    case H64INST_BINOPINT:
+    case H64INST_BINOPFLOAT: {
         h64instruction_binop *inst_binop =
             (h64instruction_binop *)inst;
         if (!disassembler_Write(di,
@@ -297,115 +311,150 @@ int disassembler_PrintInstruction(
         }
         break;
     }
-    case H64INST_CONDJUMP: {
-        h64instruction_condjump *inst_condjump =
-            (h64instruction_condjump *)inst;
+    case H64INST_BINOPCONDJUMP: {
+        h64instruction_binopcondjump *inst_binopcondjump =
+            (h64instruction_binopcondjump *)inst;
         if (!disassembler_Write(di,
-                "    %s %s%d t%d",
+                "    %s %s%d %s t%d t%d",
                 bytecode_InstructionTypeToStr(inst->type),
-                (inst_condjump->jumpbytesoffset >= 0 ? "+" : ""),
-                (int)inst_condjump->jumpbytesoffset,
-                inst_condjump->conditionalslot)) {
+                (inst_binopcondjump->jumpbytesoffset >= 0 ? "+" : ""),
+                (int)inst_binopcondjump->jumpbytesoffset,
+                operator_OpTypeToStr(inst_binopcondjump->optype),
+                (int)inst_binopcondjump->arg1slotfrom,
+                (int)inst_binopcondjump->arg2slotfrom)) {
             return 0;
         }
         break;
     }
-    case H64INST_JUMP: {
-        h64instruction_jump *inst_jump =
-            (h64instruction_jump *)inst;
+    case H64INST_BINOPCONST: {
+        h64instruction_binopconst *inst_binopconst =
+            (h64instruction_binopconst *)inst;
+        valuecontent content;
+        memcpy(&content, &inst_binopconst->content, sizeof(content));
+        char *s = disassembler_DumpValueContent(&content);
+        if (!s)
+            return 0;
         if (!disassembler_Write(di,
-                "    %s %s%d",
+                "    %s t%d %s t%d t%d %s",
                 bytecode_InstructionTypeToStr(inst->type),
-                (inst_jump->jumpbytesoffset >= 0 ? "+" : ""),
-                (int)inst_jump->jumpbytesoffset)) {
+                (int)inst_binopconst->slotto,
+                operator_OpTypeToStr(inst_binopconst->optype),
+                (int)inst_binopconst->arg1slotfrom,
+                (int)inst_binopconst->arg2slotfrom,
+                s)) {
+            free(s);
             return 0;
         }
+        free(s);
         break;
     }
-    case H64INST_GETMEMBER: {
-        h64instruction_getmember *inst_getmember =
-            (h64instruction_getmember *)inst;
+    case H64INST_CALLFUNC: {
+        h64instruction_callfunc *inst_callfunc =
+            (h64instruction_callfunc *)inst;
         if (!disassembler_Write(di,
-                "    %s t%d t%d %" PRId64,
+                "    %s t%d f%" PRId64 " %d %d %d",
                 bytecode_InstructionTypeToStr(inst->type),
-                inst_getmember->slotto, inst_getmember->objslotfrom,
-                inst_getmember->nameidx)) {
+                (int)inst_callfunc->returnto,
+                (int64_t)inst_callfunc->funcfrom,
+                (int)inst_callfunc->posargs,
+                (int)inst_callfunc->kwargs,
+                (int)inst_callfunc->expandlastposarg)) {
             return 0;
         }
         break;
     }
-    case H64INST_PUSHCATCHFRAME: {
-        h64instruction_pushcatchframe *inst_pushcatchframe =
-            (h64instruction_pushcatchframe *)inst;
-        char slotexceptionbuf[64] = "none";
-        if (inst_pushcatchframe->slotexceptionto >= 0) {
-            snprintf(
-                slotexceptionbuf, sizeof(slotexceptionbuf) - 1,
-                "t%d", inst_pushcatchframe->slotexceptionto
-            );
+    case H64INST_TAILCALL: {
+        h64instruction_tailcall *inst_tailcall =
+            (h64instruction_tailcall *)inst;
+        if (!disassembler_Write(di,
+                "    %s t%d %d %d %d",
+                bytecode_InstructionTypeToStr(inst->type),
+                (int)inst_tailcall->slotcalledfrom,
+                (int)inst_tailcall->posargs,
+                (int)inst_tailcall->kwargs,
+                (int)inst_tailcall->expandlastposarg)) {
+            return 0;
         }
-        char catchjumpbuf[64] = "none";
-        if ((inst_pushcatchframe->mode & CATCHMODE_JUMPONCATCH) != 0) {
-            snprintf(
-                catchjumpbuf, sizeof(catchjumpbuf) - 1,
-                "%s%d",
-                (inst_pushcatchframe->jumponcatch >= 0 ? "+" : ""),
-                (int)inst_pushcatchframe->jumponcatch
-            );
+        break;
+    }
+    case H64INST_TAILCALLFUNC: {
+        h64instruction_tailcallfunc *inst_tailcallfunc =
+            (h64instruction_tailcallfunc *)inst;
+        if (!disassembler_Write(di,
+                "    %s f%" PRId64 " %d %d %d",
+                bytecode_InstructionTypeToStr(inst->type),
+                (int64_t)inst_tailcallfunc->funcfrom,
+                (int)inst_tailcallfunc->posargs,
+                (int)inst_tailcallfunc->kwargs,
+                (int)inst_tailcallfunc->expandlastposarg)) {
+            return 0;
         }
-        char finallyjumpbuf[64] = "none";
-        if ((inst_pushcatchframe->mode & CATCHMODE_JUMPONFINALLY) != 0) {
-            snprintf(
-                finallyjumpbuf, sizeof(finallyjumpbuf) - 1,
-                "%s%d",
-                (inst_pushcatchframe->jumponfinally >= 0 ? "+" : ""),
-                (int)inst_pushcatchframe->jumponfinally
-            );
+        break;
+    }
+    case H64INST_CONDJUMP: {
+        h64instruction_condjump *inst_condjump =
+            (h64instruction_condjump *)inst;
+        if (!disassembler_Write(di,
+                "    %s %s%d t%d",
+                bytecode_InstructionTypeToStr(inst->type),
+                (inst_condjump->jumpbytesoffset >= 0 ? "+" : ""),
+                (int)inst_condjump->jumpbytesoffset,
+                inst_condjump->conditionalslot)) {
+            return 0;
         }
+        break;
+    }
+    case H64INST_JUMP: {
+        h64instruction_jump *inst_jump =
+            (h64instruction_jump *)inst;
         if (!disassembler_Write(di,
-                "    %s %d %s %s %s",
+                "    %s %s%d",
                 bytecode_InstructionTypeToStr(inst->type),
-                (int)inst_pushcatchframe->mode,
-                slotexceptionbuf, catchjumpbuf, finallyjumpbuf
-                )) {
+                (inst_jump->jumpbytesoffset >= 0 ? "+" : ""),
+                (int)inst_jump->jumpbytesoffset)) {
             return 0;
         }
         break;
     }
-    case H64INST_ADDCATCHTYPEBYREF: {
-        h64instruction_addcatchtypebyref *inst_addcatchtypebyref =
-            (h64instruction_addcatchtypebyref *)inst;
+    case H64INST_NEWITERATOR: {
+        h64instruction_newiterator *inst_newiterator =
+            (h64instruction_newiterator *)inst;
         if (!disassembler_Write(di,
-                "    %s t%d",
+                "    %s t%d t%d",
                 bytecode_InstructionTypeToStr(inst->type),
-                (int)inst_addcatchtypebyref->slotfrom
-                )) {
+                inst_newiterator->slotiteratorto,
+                inst_newiterator->slotcontainerfrom)) {
             return 0;
         }
         break;
     }
-    case H64INST_ADDCATCHTYPE: {
-        h64instruction_addcatchtype *inst_addcatchtype =
-            (h64instruction_addcatchtype *)inst;
+    case H64INST_ITERATE: {
+        h64instruction_iterate *inst_iterate =
+            (h64instruction_iterate *)inst;
         if (!disassembler_Write(di,
-                "    %s c%" PRId64,
+                "    %s t%d t%d %s%d",
                 bytecode_InstructionTypeToStr(inst->type),
-                (int64_t)inst_addcatchtype->classid
-                )) {
+                inst_iterate->slotvalueto,
+                inst_iterate->slotiteratorfrom,
+                (inst_iterate->jumponend >= 0 ? "+" : ""),
+                (int)inst_iterate->jumponend)) {
             return 0;
         }
         break;
     }
-    case H64INST_POPCATCHFRAME: {
+    case H64INST_GETMEMBER: {
+        h64instruction_getmember *inst_getmember =
+            (h64instruction_getmember *)inst;
         if (!disassembler_Write(di,
-                "    %s",
-                bytecode_InstructionTypeToStr(inst->type)
-                )) {
+                "    %s t%d t%d %" PRId64,
+                bytecode_InstructionTypeToStr(inst->type),
+                inst_getmember->slotto, inst_getmember->objslotfrom,
+                inst_getmember->nameidx)) {
             return 0;
         }
         break;
     }
-    case H64INST_JUMPTOFINALLY: {
+    case H64INST_ENDFINALLY: {
         if (!disassembler_Write(di,
                 "    %s",
                 bytecode_InstructionTypeToStr(inst->type)
@@ -418,9 +467,10 @@ int disassembler_PrintInstruction(
         h64instruction_newlist *inst_newlist =
             (h64instruction_newlist *)inst;
         if (!disassembler_Write(di,
-                "    %s t%d",
+                "    %s t%d %" PRId64,
                 bytecode_InstructionTypeToStr(inst->type),
-                (int)inst_newlist->slotto
+                (int)inst_newlist->slotto,
+                (int64_t)inst_newlist->presize
                 )) {
             return 0;
         }
@@ -443,9 +493,10 @@ int disassembler_PrintInstruction(
         h64instruction_newset *inst_newset =
             (h64instruction_newset *)inst;
         if (!disassembler_Write(di,
-                "    %s t%d",
+                "    %s t%d %" PRId64,
                 bytecode_InstructionTypeToStr(inst->type),
-                (int)inst_newset->slotto
+                (int)inst_newset->slotto,
+                (int64_t)inst_newset->presize
                 )) {
             return 0;
         }
@@ -468,9 +519,10 @@ int disassembler_PrintInstruction(
         h64instruction_newvector *inst_newvector =
             (h64instruction_newvector *)inst;
         if (!disassembler_Write(di,
-                "    %s t%d",
+                "    %s t%d %" PRId64,
                 bytecode_InstructionTypeToStr(inst->type),
-                (int)inst_newvector->slotto
+                (int)inst_newvector->slotto,
+                (int64_t)inst_newvector->size
                 )) {
             return 0;
         }
@@ -483,7 +535,7 @@ int disassembler_PrintInstruction(
                 "    %s t%d %" PRId64 " t%d",
                 bytecode_InstructionTypeToStr(inst->type),
                 (int)inst_putvector->slotvectorto,
-                (int)inst_putvector->putindex,
+                (int64_t)inst_putvector->putindex,
                 (int)inst_putvector->slotputfrom
                 )) {
             return 0;
@@ -494,9 +546,10 @@ int disassembler_PrintInstruction(
         h64instruction_newmap *inst_newmap =
             (h64instruction_newmap *)inst;
         if (!disassembler_Write(di,
-                "    %s t%d",
+                "    %s t%d %" PRId64,
                 bytecode_InstructionTypeToStr(inst->type),
-                (int)inst_newmap->slotto
+                (int)inst_newmap->slotto,
+                (int64_t)inst_newmap->presize
                 )) {
             return 0;
         }
@@ -540,6 +593,34 @@ int disassembler_PrintInstruction(
     return 1;
 }
 
+static int disassembler_PrintExceptionHandler(
+        dinfo *di, h64exceptionhandler *handler
+        ) {
+    if (!disassembler_Write(di,
+            "    HANDLER %" PRId64 "-%" PRId64 " catch=%" PRId64
+            " finally=%" PRId64 "-%" PRId64,
+            (int64_t)handler->try_start, (int64_t)handler->try_end,
+            (int64_t)handler->catch_offset,
+            (int64_t)handler->finally_offset,
+            (int64_t)handler->finally_end))
+        return 0;
+    if (handler->slotexceptionto >= 0 && !disassembler_Write(di,
+            " t%d", (int)handler->slotexceptionto))
+        return 0;
+    int i = 0;
+    while (i < handler->catchtypes_count) {
+        h64catchtype *ctype = &handler->catchtypes[i];
+        if (!disassembler_Write(di,
+                " %s%" PRId64,
+                (ctype->kind == H64CATCHTYPE_CLASS ? "c" :
+                 (ctype->kind == H64CATCHTYPE_GLOBALVAR ? "g" : "t")),
+                ctype->id))
+            return 0;
+        i++;
+    }
+    return disassembler_Write(di, "\n");
+}
+
 static int disassembler_AppendToStrCallback(
         ATTR_UNUSED dinfo *di, const char *print_s,
         void *userdata
@@ -723,6 +804,13 @@ int disassembler_Dump(
             instp += (int64_t)ilen;
             lenleft -= (int64_t)ilen;
         }
+        int k = 0;
+        while (k < p->func[i].exceptionhandlers_count) {
+            if (!disassembler_PrintExceptionHandler(
+                    di, &p->func[i].exceptionhandlers[k]))
+                return 0;
+            k++;
+        }
         if (!disassembler_Write(di,
                 "ENDFUNC\n"
                 ))
@@ -214,6 +214,7 @@ int compiler_command_CompileEx(
                 project->program, &moptions
             );
             compileproject_Free(project);
+            fflush(stdout);  // _exit() won't do this for us
             _exit(resultcode);
             return 1;
         } else {
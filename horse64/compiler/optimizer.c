@@ -2,15 +2,270 @@
 // also see LICENSE.md file.
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include "compileconfig.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "compiler/ast.h"
 #include "compiler/astparser.h"
 #include "compiler/asttransform.h"
 #include "compiler/compileproject.h"
 #include "compiler/optimizer.h"
 
+// How deep const vardefs referring to other const vardefs are followed:
+#define MAX_CONST_REFERENCE_DEPTH 32
+
+
+static int _optimizer_IsAssignedTo(h64expression *expr) {
+    return (expr->parent != NULL &&
+            expr->parent->type == H64EXPRTYPE_ASSIGN_STMT &&
+            expr->parent->assignstmt.lvalue == expr);
+}
+
+static int _optimizer_KnownValueToDouble(
+        h64expression *expr, double *out
+        ) {
+    if (expr->knownvalue.type == KNOWNVALUETYPE_KNOWNINT) {
+        *out = expr->knownvalue.knownint;
+        return 1;
+    } else if (expr->knownvalue.type == KNOWNVALUETYPE_KNOWNFLOAT) {
+        *out = expr->knownvalue.knownfloat;
+        return 1;
+    }
+    return 0;
+}
+
+static int _optimizer_EvaluateBinop(
+        h64expression *expr
+        ) {
+    h64expression *v1 = expr->op.value1;
+    h64expression *v2 = expr->op.value2;
+    assert(v1 != NULL && v2 != NULL);
+    if (v1->knownvalue.type == 0 || v2->knownvalue.type == 0)
+        return 1;
+
+    // String concatenation:
+    if (v1->knownvalue.type == KNOWNVALUETYPE_KNOWNSTR ||
+            v2->knownvalue.type == KNOWNVALUETYPE_KNOWNSTR) {
+        if (expr->op.optype != H64OP_MATH_ADD ||
+                v1->knownvalue.type != KNOWNVALUETYPE_KNOWNSTR ||
+                v2->knownvalue.type != KNOWNVALUETYPE_KNOWNSTR)
+            return 1;
+        size_t len1 = strlen(v1->knownvalue.knownstr);
+        size_t len2 = strlen(v2->knownvalue.knownstr);
+        char *s = malloc(len1 + len2 + 1);
+        if (!s)
+            return 0;
+        memcpy(s, v1->knownvalue.knownstr, len1);
+        memcpy(s + len1, v2->knownvalue.knownstr, len2 + 1);
+        expr->knownvalue.type = KNOWNVALUETYPE_KNOWNSTR;
+        expr->knownvalue.knownstr = s;
+        return 1;
+    }
+
+    // Pure integer math, computed the way the VM does it:
+    if (v1->knownvalue.type == KNOWNVALUETYPE_KNOWNINT &&
+            v2->knownvalue.type == KNOWNVALUETYPE_KNOWNINT) {
+        int64_t a = v1->knownvalue.knownint;
+        int64_t b = v2->knownvalue.knownint;
+        int64_t result = 0;
+        switch (expr->op.optype) {
+        case H64OP_MATH_ADD:
+            result = (int64_t)((uint64_t)a + (uint64_t)b);
+            break;
+        case H64OP_MATH_SUBSTRACT:
+            result = (int64_t)((uint64_t)a - (uint64_t)b);
+            break;
+        case H64OP_MATH_MULTIPLY:
+            result = (int64_t)((uint64_t)a * (uint64_t)b);
+            break;
+        case H64OP_MATH_DIVIDE:
+            // Leave division by zero to raise at runtime:
+            if (b == 0 || (a == INT64_MIN && b == -1))
+                return 1;
+            result = a / b;
+            break;
+        case H64OP_MATH_MODULO:
+            if (b == 0 || (a == INT64_MIN && b == -1))
+                return 1;
+            result = a % b;
+            break;
+        case H64OP_MATH_BINAND:
+            result = a & b;
+            break;
+        case H64OP_MATH_BINOR:
+            result = a | b;
+            break;
+        case H64OP_MATH_BINXOR:
+            result = a ^ b;
+            break;
+        case H64OP_MATH_BINSHIFTLEFT:
+            if (b < 0 || b >= 64)
+                return 1;
+            result = (int64_t)((uint64_t)a << b);
+            break;
+        case H64OP_MATH_BINSHIFTRIGHT:
+            if (b < 0 || b >= 64)
+                return 1;
+            result = (int64_t)((uint64_t)a >> b);
+            break;
+        default:
+            return 1;
+        }
+        expr->knownvalue.type = KNOWNVALUETYPE_KNOWNINT;
+        expr->knownvalue.knownint = result;
+        return 1;
+    }
+
+    // Mixed or float math, promoted to float like in the VM:
+    double a = 0;
+    double b = 0;
+    if (!_optimizer_KnownValueToDouble(v1, &a) ||
+            !_optimizer_KnownValueToDouble(v2, &b))
+        return 1;
+    double result = 0;
+    switch (expr->op.optype) {
+    case H64OP_MATH_ADD:
+        result = a + b;
+        break;
+    case H64OP_MATH_SUBSTRACT:
+        result = a - b;
+        break;
+    case H64OP_MATH_MULTIPLY:
+        result = a * b;
+        break;
+    case H64OP_MATH_DIVIDE:
+        if (b == 0)
+            return 1;
+        result = a / b;
+        break;
+    case H64OP_MATH_MODULO:
+        if (b == 0)
+            return 1;
+        if (a < 0 || b < 0) {
+            if (a >= 0 && b < 0) {
+                result = -((-b) - fmod(a, -b));
+            } else if (b >= 0) {
+                result = b - fmod(-a, b);
+            } else {
+                result = -fmod(-a, -b);
+            }
+        } else {
+            result = fmod(a, b);
+        }
+        break;
+    default:
+        return 1;
+    }
+    if (isnan(result))
+        return 1;  // the VM raises an error for these
+    expr->knownvalue.type = KNOWNVALUETYPE_KNOWNFLOAT;
+    expr->knownvalue.knownfloat = result;
+    return 1;
+}
+
+static int _optimizer_EvaluateUnop(
+        h64expression *expr
+        ) {
+    h64expression *v1 = expr->op.value1;
+    assert(v1 != NULL);
+    // (the lexer leaves unary minus as H64OP_MATH_SUBSTRACT)
+    if (expr->op.optype == H64OP_MATH_SUBSTRACT ||
+            expr->op.optype == H64OP_MATH_UNARYSUBSTRACT) {
+        if (v1->knownvalue.type == KNOWNVALUETYPE_KNOWNINT) {
+            expr->knownvalue.type = KNOWNVALUETYPE_KNOWNINT;
+            expr->knownvalue.knownint = (int64_t)(
+                -(uint64_t)v1->knownvalue.knownint
+            );
+        } else if (v1->knownvalue.type == KNOWNVALUETYPE_KNOWNFLOAT) {
+            expr->knownvalue.type = KNOWNVALUETYPE_KNOWNFLOAT;
+            expr->knownvalue.knownfloat = -v1->knownvalue.knownfloat;
+        }
+    } else if (expr->op.optype == H64OP_MATH_BINNOT) {
+        if (v1->knownvalue.type == KNOWNVALUETYPE_KNOWNINT) {
+            expr->knownvalue.type = KNOWNVALUETYPE_KNOWNINT;
+            expr->knownvalue.knownint = ~v1->knownvalue.knownint;
+        }
+    }
+    return 1;
+}
+
+static int _optimizer_Evaluate(
+        h64expression *expr, int descend, int depth
+        ) {
+    if (expr->knownvalue.type != 0)
+        return 1;  // already done
+    if (depth > MAX_CONST_REFERENCE_DEPTH)
+        return 1;
+
+    if (expr->type == H64EXPRTYPE_LITERAL) {
+        if (expr->literal.type == H64TK_CONSTANT_INT) {
+            expr->knownvalue.type = KNOWNVALUETYPE_KNOWNINT;
+            expr->knownvalue.knownint = expr->literal.int_value;
+        } else if (expr->literal.type == H64TK_CONSTANT_FLOAT) {
+            expr->knownvalue.type = KNOWNVALUETYPE_KNOWNFLOAT;
+            expr->knownvalue.knownfloat = expr->literal.float_value;
+        } else if (expr->literal.type == H64TK_CONSTANT_STRING) {
+            assert(expr->literal.str_value != NULL);
+            char *s = strdup(expr->literal.str_value);
+            if (!s)
+                return 0;
+            expr->knownvalue.type = KNOWNVALUETYPE_KNOWNSTR;
+            expr->knownvalue.knownstr = s;
+        }
+        return 1;
+    } else if (expr->type == H64EXPRTYPE_IDENTIFIERREF) {
+        // Propagate the value of const variables:
+        h64expression *def = expr->identifierref.resolved_to_expr;
+        if (!def || def->type != H64EXPRTYPE_VARDEF_STMT ||
+                !def->vardef.is_const || def->vardef.value == NULL ||
+                _optimizer_IsAssignedTo(expr))
+            return 1;
+        // The definition may not have been visited yet, so evaluate
+        // its value here and descend into it if needed:
+        if (!_optimizer_Evaluate(def->vardef.value, 1, depth + 1))
+            return 0;
+        h64expression *value = def->vardef.value;
+        if (value->knownvalue.type == KNOWNVALUETYPE_KNOWNSTR) {
+            char *s = strdup(value->knownvalue.knownstr);
+            if (!s)
+                return 0;
+            expr->knownvalue.type = KNOWNVALUETYPE_KNOWNSTR;
+            expr->knownvalue.knownstr = s;
+        } else if (value->knownvalue.type != 0) {
+            memcpy(&expr->knownvalue, &value->knownvalue,
+                   sizeof(expr->knownvalue));
+        }
+        return 1;
+    } else if (expr->type == H64EXPRTYPE_BINARYOP) {
+        if (descend && (
+                !_optimizer_Evaluate(expr->op.value1, 1, depth) ||
+                !_optimizer_Evaluate(expr->op.value2, 1, depth)))
+            return 0;
+        return _optimizer_EvaluateBinop(expr);
+    } else if (expr->type == H64EXPRTYPE_UNARYOP) {
+        if (descend &&
+                !_optimizer_Evaluate(expr->op.value1, 1, depth))
+            return 0;
+        return _optimizer_EvaluateUnop(expr);
+    }
+    return 1;
+}
+
 int _resolvercallback_PreevaluateConstants_visit_out(
-        h64expression *expr, h64expression *parent, void *ud
+        h64expression *expr, ATTR_UNUSED h64expression *parent, void *ud
         ) {
+    asttransforminfo *atinfo = (asttransforminfo *)ud;
+
+    // Children were already visited, so no need to descend:
+    if (!_optimizer_Evaluate(expr, 0, 0)) {
+        atinfo->hadoutofmemory = 1;
+        return 0;
+    }
     return 1;
 }
 
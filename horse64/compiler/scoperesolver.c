@@ -659,7 +659,11 @@ int _resolvercallback_ResolveIdentifiers_visit_out(
                 }
             }
 
-            if (def->declarationexpr->storage.set) {
+            if (def->declarationexpr->storage.set &&
+                    !funcdef_has_parameter_with_name(
+                        def->declarationexpr, expr->identifierref.value
+                    )) {
+                // (parameters get their stack slot assigned later)
                 memcpy(
                     &expr->storage, &def->declarationexpr->storage,
                     sizeof(expr->storage)
@@ -1316,9 +1320,14 @@ int scoperesolver_ResolveAST(
     if (!transformresult)
         return 0;
 
-    // If so far we didn't have an error, do local storage:
+    // If so far we didn't have an error, fold constants and
+    // do local storage:
     if (pr->resultmsg->success &&
             unresolved_ast->resultmsg.success) {
+        if (!optimizer_PreevaluateConstants(
+                pr, unresolved_ast
+                ))
+            return 0;
         if (!varstorage_AssignLocalStorage(
                 pr, unresolved_ast
                 ))
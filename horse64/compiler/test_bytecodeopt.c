@@ -0,0 +1,247 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <assert.h>
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler/bytecodeopt.h"
+
+#include "testhelpers.h"
+#include "testmain.h"
+
+START_TEST (test_bytecodeopt)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int fid = h64program_RegisterHorse64Function(
+        p, "testfunc", NULL, 0, NULL, 0, NULL, NULL, -1
+    );
+    ck_assert(fid >= 0);
+    h64func *f = &p->func[fid];
+    f->inner_stack_size = 4;
+
+    // t0 = 5 (dead), t1 = 1, t2 = t1, return t2, t3 = 7 (unreachable):
+    h64instruction_setconst inst_sc = {0};
+    inst_sc.type = H64INST_SETCONST;
+    inst_sc.slot = 0;
+    inst_sc.content.type = H64VALTYPE_INT64;
+    inst_sc.content.int_value = 5;
+    _appendinst(f, &inst_sc, sizeof(inst_sc));
+    inst_sc.slot = 1;
+    inst_sc.content.int_value = 1;
+    _appendinst(f, &inst_sc, sizeof(inst_sc));
+    h64instruction_valuecopy inst_vc = {0};
+    inst_vc.type = H64INST_VALUECOPY;
+    inst_vc.slotto = 2;
+    inst_vc.slotfrom = 1;
+    _appendinst(f, &inst_vc, sizeof(inst_vc));
+    h64instruction_returnvalue inst_rv = {0};
+    inst_rv.type = H64INST_RETURNVALUE;
+    inst_rv.returnslotfrom = 2;
+    _appendinst(f, &inst_rv, sizeof(inst_rv));
+    inst_sc.slot = 3;
+    inst_sc.content.int_value = 7;
+    _appendinst(f, &inst_sc, sizeof(inst_sc));
+
+    ck_assert(bytecodeopt_OptimizeFunc(p, fid));
+    f = &p->func[fid];
+
+    // Expected result: t1 = 1, return t1
+    ck_assert(f->instructions_bytes ==
+              (int)(sizeof(inst_sc) + sizeof(inst_rv)));
+    h64instruction_setconst *sc = (
+        (h64instruction_setconst *)f->instructions
+    );
+    ck_assert(sc->type == H64INST_SETCONST && sc->slot == 1 &&
+              sc->content.int_value == 1);
+    h64instruction_returnvalue *rv = (
+        (h64instruction_returnvalue *)(f->instructions + sizeof(*sc))
+    );
+    ck_assert(rv->type == H64INST_RETURNVALUE &&
+              rv->returnslotfrom == 1);
+    ck_assert(f->inner_stack_size == 2);
+
+    h64program_Free(p);
+}
+END_TEST
+
+START_TEST (test_bytecodeopt_iterate)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int fid = h64program_RegisterHorse64Function(
+        p, "testfunc", NULL, 0, NULL, 0, NULL, NULL, -1
+    );
+    ck_assert(fid >= 0);
+    h64func *f = &p->func[fid];
+    f->inner_stack_size = 4;
+
+    // t1 = iterator of t0, loop { t2 = next of t1 or leave,
+    // t3 = 5 (dead) }, return t0:
+    h64instruction_newiterator inst_ni = {0};
+    inst_ni.type = H64INST_NEWITERATOR;
+    inst_ni.slotiteratorto = 1;
+    inst_ni.slotcontainerfrom = 0;
+    _appendinst(f, &inst_ni, sizeof(inst_ni));
+    h64instruction_iterate inst_it = {0};
+    inst_it.type = H64INST_ITERATE;
+    inst_it.slotvalueto = 2;
+    inst_it.slotiteratorfrom = 1;
+    h64instruction_setconst inst_sc = {0};
+    h64instruction_jump inst_jump = {0};
+    inst_it.jumponend = (
+        sizeof(inst_it) + sizeof(inst_sc) + sizeof(inst_jump)
+    );
+    _appendinst(f, &inst_it, sizeof(inst_it));
+    inst_sc.type = H64INST_SETCONST;
+    inst_sc.slot = 3;
+    inst_sc.content.type = H64VALTYPE_INT64;
+    inst_sc.content.int_value = 5;
+    _appendinst(f, &inst_sc, sizeof(inst_sc));
+    inst_jump.type = H64INST_JUMP;
+    inst_jump.jumpbytesoffset = -(int32_t)(
+        sizeof(inst_it) + sizeof(inst_sc)
+    );
+    _appendinst(f, &inst_jump, sizeof(inst_jump));
+    h64instruction_returnvalue inst_rv = {0};
+    inst_rv.type = H64INST_RETURNVALUE;
+    inst_rv.returnslotfrom = 0;
+    _appendinst(f, &inst_rv, sizeof(inst_rv));
+
+    ck_assert(bytecodeopt_OptimizeFunc(p, fid));
+    f = &p->func[fid];
+
+    // The dead store goes, and both jumps must account for it:
+    ck_assert(f->instructions_bytes == (int)(
+        sizeof(inst_ni) + sizeof(inst_it) + sizeof(inst_jump) +
+        sizeof(inst_rv)
+    ));
+    h64instruction_iterate *it = (
+        (h64instruction_iterate *)(f->instructions + sizeof(inst_ni))
+    );
+    ck_assert(it->type == H64INST_ITERATE);
+    ck_assert(it->jumponend ==
+              (int32_t)(sizeof(inst_it) + sizeof(inst_jump)));
+    h64instruction_jump *jump = (
+        (h64instruction_jump *)((char *)it + sizeof(*it))
+    );
+    ck_assert(jump->type == H64INST_JUMP);
+    ck_assert(jump->jumpbytesoffset == -(int32_t)sizeof(inst_it));
+
+    h64program_Free(p);
+}
+END_TEST
+
+START_TEST (test_bytecodeopt_exceptionhandlers)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int fid = h64program_RegisterHorse64Function(
+        p, "testfunc", NULL, 0, NULL, 0, NULL, NULL, -1
+    );
+    ck_assert(fid >= 0);
+    h64func *f = &p->func[fid];
+    f->inner_stack_size = 6;
+
+    // try { t0 = 1, t1 = 2 } jump to end, t3 = 9 (unreachable),
+    // catch into t2 { t2 = 3 }, end: return t0
+    h64instruction_setconst inst_sc = {0};
+    inst_sc.type = H64INST_SETCONST;
+    inst_sc.content.type = H64VALTYPE_INT64;
+    inst_sc.slot = 0;
+    inst_sc.content.int_value = 1;
+    _appendinst(f, &inst_sc, sizeof(inst_sc));
+    inst_sc.slot = 1;
+    inst_sc.content.int_value = 2;
+    _appendinst(f, &inst_sc, sizeof(inst_sc));
+    int32_t tryend = f->instructions_bytes;
+    h64instruction_jump inst_jump = {0};
+    inst_jump.type = H64INST_JUMP;
+    inst_jump.jumpbytesoffset = sizeof(inst_jump) + sizeof(inst_sc) * 2;
+    _appendinst(f, &inst_jump, sizeof(inst_jump));
+    inst_sc.slot = 3;
+    inst_sc.content.int_value = 9;
+    _appendinst(f, &inst_sc, sizeof(inst_sc));
+    int32_t catchoffset = f->instructions_bytes;
+    inst_sc.slot = 2;
+    inst_sc.content.int_value = 3;
+    _appendinst(f, &inst_sc, sizeof(inst_sc));
+    h64instruction_returnvalue inst_rv = {0};
+    inst_rv.type = H64INST_RETURNVALUE;
+    inst_rv.returnslotfrom = 0;
+    _appendinst(f, &inst_rv, sizeof(inst_rv));
+    f->exceptionhandlers = malloc(sizeof(*f->exceptionhandlers));
+    ck_assert(f->exceptionhandlers != NULL);
+    memset(f->exceptionhandlers, 0, sizeof(*f->exceptionhandlers));
+    f->exceptionhandlers_count = 1;
+    h64exceptionhandler *handler = &f->exceptionhandlers[0];
+    handler->try_start = 0;
+    handler->try_end = tryend;
+    handler->catch_offset = catchoffset;
+    handler->finally_offset = -1;
+    handler->finally_end = -1;
+    handler->slotexceptionto = 2;
+
+    ck_assert(bytecodeopt_OptimizeFunc(p, fid));
+    f = &p->func[fid];
+
+    // Only the unreachable store goes, since the catch block is entered
+    // via the table. The table must account for it, and the slot the
+    // exception goes to must be kept:
+    ck_assert(f->instructions_bytes == (int)(
+        sizeof(inst_sc) * 3 + sizeof(inst_jump) + sizeof(inst_rv)
+    ));
+    handler = &f->exceptionhandlers[0];
+    ck_assert(handler->try_start == 0);
+    ck_assert(handler->try_end == tryend);
+    ck_assert(handler->catch_offset ==
+              (int32_t)(tryend + sizeof(inst_jump)));
+    ck_assert(handler->finally_offset == -1);
+    h64instruction_setconst *sc = (
+        (h64instruction_setconst *)(f->instructions +
+                                    handler->catch_offset)
+    );
+    ck_assert(sc->type == H64INST_SETCONST && sc->slot == 2);
+    h64instruction_jump *jump = (
+        (h64instruction_jump *)(f->instructions + tryend)
+    );
+    ck_assert(jump->type == H64INST_JUMP);
+    ck_assert(jump->jumpbytesoffset ==
+              (int32_t)(sizeof(inst_jump) + sizeof(inst_sc)));
+    ck_assert(f->inner_stack_size == 3);
+
+    h64program_Free(p);
+}
+END_TEST
+
+START_TEST (test_bytecodeopt_deadstringconst)
+{
+    // A dead store of a string too long to be stored inline must be
+    // dropped along with its string buffer, which a leak checker run
+    // of this test would otherwise report:
+    h64compileproject *project = _testcompile(
+        "func main {"
+        "    var s = \"hello there, dead\""
+        "    return 0"
+        "}"
+    );
+    ck_assert(_testcountinmain(
+        project->program, H64INST_SETCONST) == 1);
+    h64program *pr = project->program;
+    h64func *f = &pr->func[pr->main_func_index];
+    h64instruction_setconst *sc = (
+        (h64instruction_setconst *)f->instructions
+    );
+    ck_assert(sc->type == H64INST_SETCONST &&
+              sc->content.type == H64VALTYPE_INT64);
+    compileproject_Free(project);
+}
+END_TEST
+
+TESTS_MAIN(test_bytecodeopt, test_bytecodeopt_iterate,
+           test_bytecodeopt_exceptionhandlers,
+           test_bytecodeopt_deadstringconst)
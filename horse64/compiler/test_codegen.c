@@ -0,0 +1,95 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <assert.h>
+#include <check.h>
+
+#include "bytecode.h"
+#include "compiler/ast.h"
+#include "compiler/compileproject.h"
+
+#include "../testhelpers.h"
+#include "../testmain.h"
+
+START_TEST (test_codegen_fusedcompare)
+{
+    // A comparison only used by the condjump gets fused:
+    h64compileproject *project = _testcompile(
+        "func main {"
+        "    var a = 3"
+        "    var i = 0"
+        "    while i < a {"
+        "        i = i + 1"
+        "    }"
+        "    return i"
+        "}"
+    );
+    ck_assert(_testcountinmain(
+        project->program, H64INST_BINOPCONDJUMP) == 1);
+    compileproject_Free(project);
+
+    // ...but not if it is stored into a variable read after the
+    // branch, which would then never be set:
+    const char *code = (
+        "func main {"
+        "    var a = 3"
+        "    var b = 5"
+        "    var r = 0"
+        "    var c = a > b"
+        "    if c {"
+        "        r = r + 1"
+        "    }"
+        "    if c {"
+        "        r = r + 10"
+        "    }"
+        "    return r"
+        "}"
+    );
+    project = _testcompile(code);
+    ck_assert(_testcountinmain(
+        project->program, H64INST_BINOPCONDJUMP) == 0);
+    compileproject_Free(project);
+    ck_assert(_testrun(code) == 11);
+}
+END_TEST
+
+START_TEST (test_codegen_fusedgetfunccall)
+{
+    // A function stored into a variable must still be there for
+    // calling it a second time:
+    const char *code = (
+        "func g(x) {"
+        "    return x + 1"
+        "}"
+        "func main {"
+        "    var f = g"
+        "    var r = f(1)"
+        "    return r + f(2)"
+        "}"
+    );
+    h64compileproject *project = _testcompile(code);
+    ck_assert(_testcountinmain(
+        project->program, H64INST_GETFUNC) == 1);
+    compileproject_Free(project);
+    ck_assert(_testrun(code) == 5);
+
+    // Calling it directly needs no getfunc at all:
+    project = _testcompile(
+        "func g(x) {"
+        "    return x + 1"
+        "}"
+        "func main {"
+        "    var r = g(1)"
+        "    return r + g(2)"
+        "}"
+    );
+    ck_assert(_testcountinmain(
+        project->program, H64INST_GETFUNC) == 0);
+    ck_assert(_testcountinmain(
+        project->program, H64INST_CALLFUNC) == 2);
+    compileproject_Free(project);
+}
+END_TEST
+
+TESTS_MAIN (test_codegen_fusedcompare, test_codegen_fusedgetfunccall)
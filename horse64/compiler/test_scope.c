@@ -301,6 +301,46 @@ START_TEST (test_scope_import_complex)
     ck_assert(ast->resultmsg.success && project->resultmsg->success);
     compileproject_Free(project);  // This indirectly frees 'ast'
 
+    {
+        FILE *f = fopen(".testdata-prj/mainfile.h64", "wb");
+        ck_assert(f != NULL);
+        char s[] = (
+            "# VALID constant expressions that should be folded:\n"
+            "const C = 2 * 3\n"
+            "func main {"
+            "    var v = -C + 10 - 0.5"
+            "}"
+        );
+        ck_assert(fwrite(s, 1, strlen(s), f));
+        fclose(f);
+    }
+    project = compileproject_New(
+        testfolder_path
+    );
+    error = NULL;
+    ast = NULL;
+    ck_assert(compileproject_GetAST(
+        project, ".testdata-prj/mainfile.h64", &ast, &error
+    ) != 0);
+    ck_assert(error == NULL);
+    ck_assert(scoperesolver_ResolveAST(
+        project, &moptions, ast, 0
+    ) != 0);
+    ck_assert(ast->resultmsg.success && project->resultmsg->success);
+    ck_assert(ast->stmt_count == 2);
+    ck_assert(ast->stmt[0]->type == H64EXPRTYPE_VARDEF_STMT);
+    ck_assert(ast->stmt[0]->vardef.value->knownvalue.type ==
+              KNOWNVALUETYPE_KNOWNINT);
+    ck_assert(ast->stmt[0]->vardef.value->knownvalue.knownint == 6);
+    ck_assert(ast->stmt[1]->type == H64EXPRTYPE_FUNCDEF_STMT);
+    ck_assert(ast->stmt[1]->funcdef.stmt_count == 1);
+    {
+        h64expression *v = ast->stmt[1]->funcdef.stmt[0]->vardef.value;
+        ck_assert(v->knownvalue.type == KNOWNVALUETYPE_KNOWNFLOAT);
+        ck_assert(fabs(v->knownvalue.knownfloat - 3.5) < 0.0001);
+    }
+    compileproject_Free(project);  // This indirectly frees 'ast'
+
     free(testfolder_path);
     testfolder_path = NULL;
 }
@@ -329,6 +329,7 @@ void varstorage_FreeExtraInfo(
         ) {
     if (!einfo)
         return;
+    free(einfo->codegen.perm_temps_used);
     free(einfo->lstoreassign);
     free(einfo->closureboundvars);
     free(einfo);
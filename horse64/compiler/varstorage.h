@@ -21,12 +21,26 @@ typedef struct h64localstorageassign {
     int ever_used_nonclosure, ever_used_closure;
 } h64localstorageassign;
 
+struct h64codegenfinallyroute {
+    // A return inside the try or catch block of a try statement with
+    // a finally block stores its value, and jumps into the finally
+    // block which then returns at its end:
+    int32_t jumpid_finallybody;
+    int returnvalueslot;
+    int notreturningslot;  // false only if entered by a return
+    int used;
+
+    struct h64codegenfinallyroute *parent;
+};
+
 struct h64codegenstorageinfo {
     int oneline_temps_used_now;
     int max_oneline_slots;
 
     int perm_temps_count;
     int *perm_temps_used;
+
+    struct h64codegenfinallyroute *finallyroute;  // innermost, if any
 };
 
 typedef struct h64funcstorageextrainfo {
@@ -7,7 +7,7 @@
 
 #include "bytecode.h"
 #include "corelib/errors.h"
-#include "poolalloc.h"
+#include "gc.h"
 #include "gcvalue.h"
 #include "stack.h"
 #include "vmexec.h"
@@ -34,15 +34,13 @@ int stderror(
             return -1;
         }
     }
-    valuecontent *v = STACK_ENTRY(vmthread->stack, -1);
-    v->type = H64GCVALUETYPE_INVALID;
-    v->ptr_value = poolalloc_malloc(vmthread->heap, 1);
+    valuecontent *v = stack_GetEntrySlow(vmthread->stack, -1);
+    v->type = H64VALTYPE_NONE;
+    v->ptr_value = gc_AllocValue(vmthread, 1);
     if (v->ptr_value) {
+        v->type = H64VALTYPE_GCVAL;
         h64gcvalue *gcval = (h64gcvalue *)v->ptr_value;
-        memset(gcval, 0, sizeof(*gcval));
         gcval->type = H64GCVALUETYPE_ERRORCLASSINSTANCE;
-        gcval->heapreferencecount = 0;
-        gcval->externalreferencecount = 1;
         gcval->classid = error_class_id;
     }
     return -1;
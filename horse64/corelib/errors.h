@@ -21,6 +21,8 @@ typedef enum stderrorclassnum {
     H64STDERROR_ARGUMENTERROR,
     H64STDERROR_TYPEERROR,
     H64STDERROR_MATHERROR,
+    H64STDERROR_ATTRIBUTEERROR,
+    H64STDERROR_INDEXERROR,
     H64STDERROR_TOTAL_COUNT
 } stderrorclassnum;
 
@@ -33,6 +35,8 @@ static const char *stderrorclassnames[] = {
     "ArgumentError",
     "TypeError",
     "MathError",
+    "AttributeError",
+    "IndexError",
     NULL
 };
 
@@ -1,9 +1,4 @@
 
-#if defined(_WIN32) || defined(_WIN64)
-#include <malloc.h>
-#else
-#include <alloca.h>
-#endif
 #include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -16,6 +11,8 @@
 #include "stack.h"
 #include "unicode.h"
 #include "vmexec.h"
+#include "vmoutput.h"
+#include "vmstrings.h"
 
 
 int corelib_print(h64vmthread *vmthread) {
@@ -25,68 +22,64 @@ int corelib_print(h64vmthread *vmthread) {
             "missing argument for print call"
         );
     }
-    char *buf = alloca(256);
-    uint64_t buflen = 256;
-    int buffree = 0;
+    h64vmoutput *out = &vmthread->output;
+    char buf[64];
     int i = 0;
     while (i < STACK_TOP(vmthread->stack)) {
+        int writeok = 1;
         if (i > 0)
-            printf(" ");
+            writeok = vmoutput_Write(out, " ", 1);
         valuecontent *c = STACK_ENTRY(vmthread->stack, i);
         switch (c->type) {
         case H64VALTYPE_GCVAL: ;
             h64gcvalue *gcval = c->ptr_value;
             switch (gcval->type) {
-            case H64GCVALUETYPE_STRING:
-                if (buflen < gcval->str_val.len * 4 + 1) {
-                    char *newbuf = malloc(
-                        gcval->str_val.len * 4 + 1
+            case H64GCVALUETYPE_STRING: ;
+                h64stringval *sv = &gcval->str_val;
+                if (!vmstrings_Flatten(vmthread, sv)) {
+                    return stderror(
+                        vmthread, H64STDERROR_OUTOFMEMORYERROR,
+                        "out of memory flattening string"
                     );
-                    buffree = 1;
-                    if (newbuf) {
-                        if (buffree)
-                            free(buf);
-                        buf = newbuf;
-                        buflen = gcval->str_val.len * 4 + 1;
-                    }
-                    int64_t outlen = 0;
-                    int result = utf32_to_utf8(
-                        gcval->str_val.s, gcval->str_val.len,
-                        buf, buflen, &outlen, 1
-                    );
-                    assert(result != 0);
-                    if (outlen >= (int64_t)buflen)
-                        outlen = buflen - 1;
-                    buf[outlen] = '\0';
-                    printf("%s", buf);
                 }
+                writeok = writeok && vmoutput_WriteString(out, sv);
                 break;
             default:
-                printf("<unhandled refvalue type=%d>\n", (int)gcval->type);
+                snprintf(buf, sizeof(buf),
+                         "<unhandled refvalue type=%d>\n",
+                         (int)gcval->type);
+                writeok = writeok && vmoutput_Write(out, buf, strlen(buf));
             }
             break;
-        case H64VALTYPE_SHORTSTR:
-            assert(buflen >= 25);
+        case H64VALTYPE_SHORTSTR: ;
             assert(c->shortstr_len >= 0 &&
                    c->shortstr_len < 5);
             unicodechar shortstr_value[
                 VALUECONTENT_SHORTSTRLEN + 1
             ];
             memcpy(&shortstr_value, c->shortstr_value,
-                   VALUECONTENT_SHORTSTRLEN + 1);
+                   sizeof(*shortstr_value) *
+                   (VALUECONTENT_SHORTSTRLEN + 1));
             int64_t outlen = 0;
             int result = utf32_to_utf8(
                 shortstr_value, c->shortstr_len,
                 buf, 25, &outlen, 1
             );
-            assert(result != 0 && outlen > 0 && outlen < 25);
-            buf[outlen - 1] = '\0';
-            printf("%s", buf);
+            assert(result != 0 && outlen >= 0 && outlen < 25);
+            writeok = writeok && vmoutput_Write(out, buf, outlen);
             break;
         default:
-            printf("<unhandled valuecontent type=%d>\n", (int)c->type);
+            snprintf(buf, sizeof(buf),
+                     "<unhandled valuecontent type=%d>\n", (int)c->type);
+            writeok = writeok && vmoutput_Write(out, buf, strlen(buf));
             break;
         }
+        if (!writeok) {
+            return stderror(
+                vmthread, H64STDERROR_IOERROR,
+                "failed to write output"
+            );
+        }
         i++;
     }
     return 0;
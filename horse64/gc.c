@@ -0,0 +1,574 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "compileconfig.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "gc.h"
+#include "gcvalue.h"
+#include "poolalloc.h"
+#include "stack.h"
+#include "vmexec.h"
+#include "vmlist.h"
+#include "vmmap.h"
+#include "vmstrings.h"
+#include "vmvector.h"
+
+// Values are reclaimed in two ways:
+//
+// Deferred reference counting frees most garbage promptly. Only
+// references from other heap values are counted, so the interpreter
+// never touches counts for stack slots. A value with a count of zero
+// sits in the zero count table (ZCT), starting with its allocation.
+// At a safe point, the ZCT is reconciled against a scan of the stack
+// and globals, and what none of them refers to gets freed.
+//
+// An incremental mark-sweep collector over vmthread->heap reclaims the
+// reference cycles the counts can never free.
+//
+// Marking flips the epoch, such that all objects turn unmarked at
+// once. The roots are then pushed in slices, and the gray objects
+// traced in slices. Objects allocated during a cycle get the current
+// epoch right away, and GC_WRITEBARRIER re-grays a marked object
+// that gets a new heap value stored into it. Since the stack has no
+// barrier, the last mark slice rescans all roots in one go before
+// sweeping. The sweep then walks the heap in slices and frees what
+// isn't marked. It does so in two walks: the first one drops the
+// counts that garbage holds on surviving values, while all of them
+// are still there to check, and only the second one frees anything.
+//
+// Immortal values (H64GCZCT_IMMORTAL) are shared by all threads, so
+// neither scheme ever writes to them.
+
+
+// How freeing a value treats the counts of the values it refers to:
+#define DROPREFS_NONE 0
+#define DROPREFS_ALL 1
+#define DROPREFS_MARKEDONLY 2
+
+
+static void _gc_RemarkCallback(void *ptr, void *userdata) {
+    ((h64gcvalue *)ptr)->gcmark = ((h64gcstate *)userdata)->epoch;
+}
+
+static void _gc_Abort(h64vmthread *vmthread) {
+    // Nothing was freed yet, but only some values got this cycle's
+    // mark. Since the next cycle flips the epoch back, the others
+    // would look marked then, so give all of them the same mark:
+    h64gcstate *gc = &vmthread->gc;
+    poolalloc_Walk(vmthread->heap, &_gc_RemarkCallback, gc);
+    gc->phase = H64GCPHASE_IDLE;
+    gc->gray_count = 0;
+    gc->next_cycle_live = gc->live_count * 2;
+    if (gc->next_cycle_live < GC_MIN_CYCLE_LIVE)
+        gc->next_cycle_live = GC_MIN_CYCLE_LIVE;
+}
+
+static int _gc_PushGray(h64gcstate *gc, h64gcvalue *gcval) {
+    if (unlikely(gc->gray_count >= gc->gray_alloc)) {
+        int64_t new_alloc = gc->gray_alloc * 2;
+        if (new_alloc < 64)
+            new_alloc = 64;
+        h64gcvalue **new_gray = realloc(
+            gc->gray, sizeof(*new_gray) * new_alloc
+        );
+        if (!new_gray)
+            return 0;
+        gc->gray = new_gray;
+        gc->gray_alloc = new_alloc;
+    }
+    gc->gray[gc->gray_count] = gcval;
+    gc->gray_count++;
+    return 1;
+}
+
+static inline int _gc_MarkGCValue(h64gcstate *gc, h64gcvalue *gcval) {
+    if (gcval->gcmark == gc->epoch ||
+            (gcval->zctflags & H64GCZCT_IMMORTAL) != 0)
+        return 1;
+    gcval->gcmark = gc->epoch;
+    return _gc_PushGray(gc, gcval);
+}
+
+static inline int _gc_MarkValue(h64gcstate *gc, valuecontent *vc) {
+    // (an iterator's container is in ptr_value, and must stay alive)
+    if ((vc->type != H64VALTYPE_GCVAL &&
+            vc->type != H64VALTYPE_ITERATOR) || vc->ptr_value == NULL)
+        return 1;
+    return _gc_MarkGCValue(gc, vc->ptr_value);
+}
+
+static int _gc_TraceValue(
+        h64vmthread *vmthread, h64gcvalue *gcval
+        ) {
+    switch (gcval->type) {
+    case H64GCVALUETYPE_CLASSINSTANCE:
+    case H64GCVALUETYPE_ERRORCLASSINSTANCE: {
+        if (!gcval->membervars)
+            return 1;
+        assert(vmthread->program != NULL &&
+               gcval->classid >= 0 &&
+               gcval->classid < vmthread->program->classes_count);
+        int count = vmthread->program->classes[gcval->classid].vars_count;
+        int i = 0;
+        while (i < count) {
+            if (!_gc_MarkValue(&vmthread->gc, &gcval->membervars[i]))
+                return 0;
+            i++;
+        }
+        return 1;
+    }
+    case H64GCVALUETYPE_STRING: {
+        if (gcval->str_val.storage != H64STRSTORAGE_ROPE)
+            return 1;
+        return (_gc_MarkGCValue(&vmthread->gc, gcval->str_val.ropeleft) &&
+                _gc_MarkGCValue(&vmthread->gc, gcval->str_val.roperight));
+    }
+    case H64GCVALUETYPE_LIST: {
+        int64_t i = 0;
+        while (i < gcval->list_val.count) {
+            if (!_gc_MarkValue(&vmthread->gc, &gcval->list_val.values[i]))
+                return 0;
+            i++;
+        }
+        return 1;
+    }
+    case H64GCVALUETYPE_MAP:
+    case H64GCVALUETYPE_SET: {
+        int32_t i = 0;
+        while (i < gcval->map_val.count) {
+            if (!_gc_MarkValue(&vmthread->gc, vmmap_KeyAt(gcval, i)) ||
+                    (!gcval->map_val.isset &&
+                     !_gc_MarkValue(&vmthread->gc, vmmap_ValueAt(gcval, i))))
+                return 0;
+            i++;
+        }
+        return 1;
+    }
+    default:
+        return 1;
+    }
+}
+
+static void _gc_DropRef(
+        h64vmthread *vmthread, h64gcvalue *gcval, int droprefs
+        ) {
+    if (droprefs == DROPREFS_ALL ||
+            (droprefs == DROPREFS_MARKEDONLY &&
+             gcval->gcmark == vmthread->gc.epoch))
+        GC_HEAPREF_DROP(vmthread, gcval);
+}
+
+static void _gc_DropChildRefs(
+        h64vmthread *vmthread, h64gcvalue *gcval, int droprefs
+        ) {
+    switch (gcval->type) {
+    case H64GCVALUETYPE_STRING:
+        if (gcval->str_val.storage == H64STRSTORAGE_ROPE) {
+            _gc_DropRef(vmthread, gcval->str_val.ropeleft, droprefs);
+            _gc_DropRef(vmthread, gcval->str_val.roperight, droprefs);
+        }
+        break;
+    case H64GCVALUETYPE_CLASSINSTANCE:
+    case H64GCVALUETYPE_ERRORCLASSINSTANCE:
+        if (gcval->membervars) {
+            int count = (
+                vmthread->program->classes[gcval->classid].vars_count
+            );
+            int i = 0;
+            while (i < count) {
+                valuecontent *vc = &gcval->membervars[i];
+                if (vc->type == H64VALTYPE_GCVAL && vc->ptr_value)
+                    _gc_DropRef(vmthread, vc->ptr_value, droprefs);
+                i++;
+            }
+        }
+        break;
+    case H64GCVALUETYPE_LIST: {
+        int64_t i = 0;
+        while (i < gcval->list_val.count) {
+            valuecontent *vc = &gcval->list_val.values[i];
+            if (vc->type == H64VALTYPE_GCVAL && vc->ptr_value)
+                _gc_DropRef(vmthread, vc->ptr_value, droprefs);
+            i++;
+        }
+        break;
+    }
+    case H64GCVALUETYPE_MAP:
+    case H64GCVALUETYPE_SET: {
+        int32_t i = 0;
+        while (i < gcval->map_val.count) {
+            int k = 0;
+            while (k < (gcval->map_val.isset ? 1 : 2)) {
+                valuecontent *vc = (
+                    k == 0 ? vmmap_KeyAt(gcval, i) :
+                    vmmap_ValueAt(gcval, i)
+                );
+                if (vc->type == H64VALTYPE_GCVAL && vc->ptr_value)
+                    _gc_DropRef(vmthread, vc->ptr_value, droprefs);
+                k++;
+            }
+            i++;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void _gc_FreeValueContents(
+        h64vmthread *vmthread, h64gcvalue *gcval, int droprefs
+        ) {
+    if (droprefs != DROPREFS_NONE)
+        _gc_DropChildRefs(vmthread, gcval, droprefs);
+    switch (gcval->type) {
+    case H64GCVALUETYPE_STRING:
+        vmstrings_Free(vmthread, &gcval->str_val);
+        break;
+    case H64GCVALUETYPE_CLASSINSTANCE:
+    case H64GCVALUETYPE_ERRORCLASSINSTANCE:
+        if (gcval->membervars) {
+            int count = (
+                vmthread->program->classes[gcval->classid].vars_count
+            );
+            int i = 0;
+            while (i < count) {
+                valuecontent_Free(&gcval->membervars[i]);
+                i++;
+            }
+            free(gcval->membervars);
+            gcval->membervars = NULL;
+        }
+        break;
+    case H64GCVALUETYPE_LIST: {
+        int64_t i = 0;
+        while (i < gcval->list_val.count) {
+            valuecontent_Free(&gcval->list_val.values[i]);
+            i++;
+        }
+        vmlist_Free(&gcval->list_val);
+        break;
+    }
+    case H64GCVALUETYPE_MAP:
+    case H64GCVALUETYPE_SET: {
+        int32_t i = 0;
+        while (i < gcval->map_val.count) {
+            valuecontent_Free(vmmap_KeyAt(gcval, i));
+            if (!gcval->map_val.isset)
+                valuecontent_Free(vmmap_ValueAt(gcval, i));
+            i++;
+        }
+        vmmap_Free(&gcval->map_val);
+        break;
+    }
+    case H64GCVALUETYPE_VECTOR:
+        vmvector_Free(&gcval->vector_val);
+        break;
+    default:
+        break;
+    }
+}
+
+static int64_t _gc_RootCount(h64vmthread *vmthread) {
+    int64_t count = STACK_TOTALSIZE(vmthread->stack);
+    if (vmthread->program)
+        count += vmthread->program->globalvar_count;
+    return count;
+}
+
+static int _gc_MarkRoot(h64vmthread *vmthread, int64_t i) {
+    if (vmthread->program) {
+        if (i < vmthread->program->globalvar_count)
+            return _gc_MarkValue(
+                &vmthread->gc, &vmthread->program->globalvar[i].content
+            );
+        i -= vmthread->program->globalvar_count;
+    }
+    return _gc_MarkValue(&vmthread->gc, &vmthread->stack->entry[i]);
+}
+
+static void _gc_SweepRefsCallback(void *ptr, void *userdata) {
+    h64vmthread *vmthread = userdata;
+    h64gcvalue *gcval = ptr;
+    if (gcval->gcmark == vmthread->gc.epoch)
+        return;
+    // Nothing was freed yet, so all referenced values are still
+    // there to check their mark. Only the surviving (marked) ones
+    // need their counts dropped, the rest is garbage too:
+    _gc_DropChildRefs(vmthread, gcval, DROPREFS_MARKEDONLY);
+}
+
+static void _gc_SweepCallback(void *ptr, void *userdata) {
+    h64vmthread *vmthread = userdata;
+    h64gcvalue *gcval = ptr;
+    if (gcval->gcmark == vmthread->gc.epoch)
+        return;
+    // (unmarked values were purged from the ZCT when marking ended)
+    assert((gcval->zctflags & H64GCZCT_INTABLE) == 0);
+    // The counts were fixed up in H64GCPHASE_SWEEPREFS already, and
+    // referenced values may be freed by now, so never look at them:
+    _gc_FreeValueContents(vmthread, gcval, DROPREFS_NONE);
+    poolalloc_free(vmthread->heap, gcval);
+    vmthread->gc.live_count--;
+}
+
+void _gc_ZCTAdd(h64vmthread *vmthread, h64gcvalue *gcval) {
+    h64gcstate *gc = &vmthread->gc;
+    if ((gcval->zctflags & H64GCZCT_INTABLE) != 0)
+        return;
+    if (unlikely(gc->zct_count >= gc->zct_alloc)) {
+        int64_t new_alloc = gc->zct_alloc * 2;
+        if (new_alloc < GC_ZCT_MIN_RECONCILE * 2)
+            new_alloc = GC_ZCT_MIN_RECONCILE * 2;
+        h64gcvalue **new_zct = realloc(
+            gc->zct, sizeof(*new_zct) * new_alloc
+        );
+        if (!new_zct)
+            return;  // the tracing collector will get it eventually
+        gc->zct = new_zct;
+        gc->zct_alloc = new_alloc;
+    }
+    gcval->zctflags |= H64GCZCT_INTABLE;
+    gc->zct[gc->zct_count] = gcval;
+    gc->zct_count++;
+}
+
+static void _gc_SetRootRefFlags(h64vmthread *vmthread, int set) {
+    int64_t count = _gc_RootCount(vmthread);
+    int64_t i = 0;
+    while (i < count) {
+        valuecontent *vc = NULL;
+        if (vmthread->program &&
+                i < vmthread->program->globalvar_count) {
+            vc = &vmthread->program->globalvar[i].content;
+        } else {
+            vc = &vmthread->stack->entry[
+                i - (vmthread->program ?
+                     vmthread->program->globalvar_count : 0)
+            ];
+        }
+        if ((vc->type == H64VALTYPE_GCVAL ||
+                vc->type == H64VALTYPE_ITERATOR) && vc->ptr_value &&
+                (((h64gcvalue *)vc->ptr_value)->zctflags &
+                 H64GCZCT_IMMORTAL) == 0) {
+            h64gcvalue *gcval = vc->ptr_value;
+            if (set)
+                gcval->zctflags |= H64GCZCT_ROOTREF;
+            else
+                gcval->zctflags &= ~H64GCZCT_ROOTREF;
+        }
+        i++;
+    }
+}
+
+static void _gc_ReconcileZCT(h64vmthread *vmthread) {
+    h64gcstate *gc = &vmthread->gc;
+    int marking = (gc->phase == H64GCPHASE_MARKROOTS ||
+                   gc->phase == H64GCPHASE_MARK);
+    _gc_SetRootRefFlags(vmthread, 1);
+    int64_t kept = 0;
+    int64_t i = 0;
+    while (i < gc->zct_count) {  // (freeing may append new entries)
+        h64gcvalue *gcval = gc->zct[i];
+        i++;
+        if (gcval->heapreferencecount > 0) {
+            gcval->zctflags &= ~H64GCZCT_INTABLE;
+            continue;
+        }
+        // Keep what the roots refer to, and while marking also what
+        // is marked already, since it may sit in the gray list:
+        if ((gcval->zctflags & H64GCZCT_ROOTREF) != 0 ||
+                (marking && gcval->gcmark == gc->epoch)) {
+            gc->zct[kept] = gcval;
+            kept++;
+            continue;
+        }
+        _gc_FreeValueContents(vmthread, gcval, DROPREFS_ALL);
+        poolalloc_free(vmthread->heap, gcval);
+        gc->live_count--;
+    }
+    gc->zct_count = kept;
+    _gc_SetRootRefFlags(vmthread, 0);
+}
+
+static void _gc_PurgeUnmarkedFromZCT(h64gcstate *gc) {
+    // Marking is complete, so unmarked values are garbage and the
+    // sweep will free them. Drop them from the ZCT beforehand, which
+    // also means no ZCT entry can ever refer to a swept value:
+    int64_t kept = 0;
+    int64_t i = 0;
+    while (i < gc->zct_count) {
+        h64gcvalue *gcval = gc->zct[i];
+        i++;
+        if (gcval->gcmark != gc->epoch) {
+            gcval->zctflags &= ~H64GCZCT_INTABLE;
+            continue;
+        }
+        gc->zct[kept] = gcval;
+        kept++;
+    }
+    gc->zct_count = kept;
+}
+
+static void _gc_StartCycle(h64gcstate *gc) {
+    gc->epoch = (gc->epoch == 1 ? 2 : 1);
+    gc->phase = H64GCPHASE_MARKROOTS;
+    gc->rootcursor = 0;
+    gc->gray_count = 0;
+}
+
+static void _gc_FinishCycle(h64gcstate *gc) {
+    gc->phase = H64GCPHASE_IDLE;
+    gc->cycles_done++;
+    gc->next_cycle_live = gc->live_count * 2;
+    if (gc->next_cycle_live < GC_MIN_CYCLE_LIVE)
+        gc->next_cycle_live = GC_MIN_CYCLE_LIVE;
+}
+
+static int _gc_DoWork(h64vmthread *vmthread, int64_t budget) {
+    // Returns 0 once the budget is used up, 1 when the cycle ended.
+    h64gcstate *gc = &vmthread->gc;
+    if (gc->phase == H64GCPHASE_MARKROOTS) {
+        int64_t count = _gc_RootCount(vmthread);
+        while (gc->rootcursor < count) {
+            if (budget <= 0)
+                return 0;
+            if (!_gc_MarkRoot(vmthread, gc->rootcursor)) {
+                _gc_Abort(vmthread);
+                return 1;
+            }
+            gc->rootcursor++;
+            budget--;
+        }
+        gc->phase = H64GCPHASE_MARK;
+    }
+    if (gc->phase == H64GCPHASE_MARK) {
+        while (1) {
+            while (gc->gray_count > 0) {
+                if (budget <= 0)
+                    return 0;
+                gc->gray_count--;
+                if (!_gc_TraceValue(
+                        vmthread, gc->gray[gc->gray_count])) {
+                    _gc_Abort(vmthread);
+                    return 1;
+                }
+                budget--;
+            }
+            // The stack changed without a barrier since the roots were
+            // pushed, so rescan all of them at once before sweeping:
+            int64_t count = _gc_RootCount(vmthread);
+            int64_t i = 0;
+            while (i < count) {
+                if (!_gc_MarkRoot(vmthread, i)) {
+                    _gc_Abort(vmthread);
+                    return 1;
+                }
+                i++;
+            }
+            if (gc->gray_count == 0)
+                break;
+            budget = INT64_MAX;  // must finish now, stack may change
+        }
+        _gc_PurgeUnmarkedFromZCT(gc);
+        gc->phase = H64GCPHASE_SWEEPREFS;
+        memset(&gc->sweepcursor, 0, sizeof(gc->sweepcursor));
+    }
+    if (gc->phase == H64GCPHASE_SWEEPREFS) {
+        int maxitems = (budget > INT32_MAX ? INT32_MAX : (int)budget);
+        if (maxitems <= 0)
+            return 0;
+        if (!poolalloc_WalkSome(
+                vmthread->heap, &gc->sweepcursor, maxitems,
+                &_gc_SweepRefsCallback, vmthread))
+            return 0;
+        gc->phase = H64GCPHASE_SWEEP;
+        memset(&gc->sweepcursor, 0, sizeof(gc->sweepcursor));
+    }
+    if (gc->phase == H64GCPHASE_SWEEP) {
+        int maxitems = (budget > INT32_MAX ? INT32_MAX : (int)budget);
+        if (maxitems <= 0)
+            return 0;
+        if (!poolalloc_WalkSome(
+                vmthread->heap, &gc->sweepcursor, maxitems,
+                &_gc_SweepCallback, vmthread))
+            return 0;
+        _gc_FinishCycle(gc);
+        return 1;
+    }
+    return 1;
+}
+
+void gc_Step(h64vmthread *vmthread) {
+    h64gcstate *gc = &vmthread->gc;
+    gc->alloc_debt = 0;
+    if (gc->zct_count >= GC_ZCT_MIN_RECONCILE &&
+            gc->zct_count >= _gc_RootCount(vmthread) / 4)
+        _gc_ReconcileZCT(vmthread);
+    if (gc->phase == H64GCPHASE_IDLE) {
+        if (gc->live_count < gc->next_cycle_live)
+            return;
+        _gc_StartCycle(gc);
+    }
+    _gc_DoWork(vmthread, GC_SLICE_WORK);
+}
+
+void gc_CollectFull(h64vmthread *vmthread) {
+    h64gcstate *gc = &vmthread->gc;
+    gc->alloc_debt = 0;
+    _gc_ReconcileZCT(vmthread);
+    if (gc->phase != H64GCPHASE_IDLE) {
+        // Finish the cycle in progress first, since it may have
+        // missed objects that became garbage while it ran:
+        _gc_DoWork(vmthread, INT64_MAX);
+    }
+    _gc_StartCycle(gc);
+    _gc_DoWork(vmthread, INT64_MAX);
+}
+
+void _gc_Regray(h64vmthread *vmthread, h64gcvalue *gcval) {
+    if (!_gc_PushGray(&vmthread->gc, gcval))
+        _gc_Abort(vmthread);
+}
+
+void gc_Init(h64vmthread *vmthread) {
+    memset(&vmthread->gc, 0, sizeof(vmthread->gc));
+    vmthread->gc.epoch = 1;
+    vmthread->gc.next_cycle_live = GC_MIN_CYCLE_LIVE;
+}
+
+h64gcvalue *gc_AllocValue(
+        h64vmthread *vmthread, int can_use_emergency_margin
+        ) {
+    h64gcvalue *gcval = poolalloc_malloc(
+        vmthread->heap, can_use_emergency_margin
+    );
+    if (!gcval)
+        return NULL;
+    h64gcstate *gc = &vmthread->gc;
+    memset(gcval, 0, sizeof(*gcval));
+    gcval->gcmark = gc->epoch;
+    gc->alloc_debt++;
+    gc->live_count++;
+    _gc_ZCTAdd(vmthread, gcval);  // nothing on the heap refers to it yet
+    return gcval;
+}
+
+static void _gc_FreeAllCallback(void *ptr, void *userdata) {
+    _gc_FreeValueContents((h64vmthread *)userdata, ptr, DROPREFS_NONE);
+}
+
+void gc_FreeAll(h64vmthread *vmthread) {
+    if (vmthread->heap)
+        poolalloc_Walk(vmthread->heap, &_gc_FreeAllCallback, vmthread);
+    free(vmthread->gc.gray);
+    free(vmthread->gc.zct);
+    memset(&vmthread->gc, 0, sizeof(vmthread->gc));
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef HORSE64_GC_H_
+#define HORSE64_GC_H_
+
+#include <stdint.h>
+
+#include "compileconfig.h"
+#include "gcvalue.h"
+#include "poolalloc.h"
+
+typedef struct h64vmthread h64vmthread;
+
+// A slice of collector work runs every this many heap allocations:
+#define GC_SLICE_ALLOCS 256
+// How many objects a slice traces or sweeps at most:
+#define GC_SLICE_WORK 2048
+// A new cycle starts once the live values doubled since the last
+// cycle, but never below this many live values:
+#define GC_MIN_CYCLE_LIVE 4096
+// The zero count table is reconciled once it has this many entries,
+// or once it has a quarter as many entries as the roots if that is
+// more, such that the root scans stay amortized:
+#define GC_ZCT_MIN_RECONCILE 1024
+
+// Bits in h64gcvalue.zctflags:
+#define H64GCZCT_INTABLE 0x1
+#define H64GCZCT_ROOTREF 0x2
+// Immortal values live outside of any thread's heap and are shared
+// by all threads, like the program's string constants. They are never
+// counted, marked, or freed by the collector:
+#define H64GCZCT_IMMORTAL 0x4
+
+typedef enum gcphase {
+    H64GCPHASE_IDLE = 0,
+    H64GCPHASE_MARKROOTS = 1,
+    H64GCPHASE_MARK = 2,
+    H64GCPHASE_SWEEPREFS = 3,
+    H64GCPHASE_SWEEP = 4
+} gcphase;
+
+typedef struct h64gcstate {
+    gcphase phase;
+    uint8_t epoch;  // objects with gcmark == epoch are marked
+    int64_t alloc_debt;
+    int64_t live_count, next_cycle_live;
+    int64_t cycles_done;
+
+    h64gcvalue **zct;
+    int64_t zct_count, zct_alloc;
+
+    int64_t rootcursor;
+    h64gcvalue **gray;
+    int64_t gray_count, gray_alloc;
+    poolallocwalkcursor sweepcursor;
+} h64gcstate;
+
+void gc_Init(h64vmthread *vmthread);
+
+h64gcvalue *gc_AllocValue(
+    h64vmthread *vmthread, int can_use_emergency_margin
+);
+
+void gc_Step(h64vmthread *vmthread);
+
+void gc_CollectFull(h64vmthread *vmthread);
+
+void gc_FreeAll(h64vmthread *vmthread);
+
+void _gc_Regray(h64vmthread *vmthread, h64gcvalue *gcval);
+
+void _gc_ZCTAdd(h64vmthread *vmthread, h64gcvalue *gcval);
+
+// Call at a point where every live value is on the stack or in a
+// global, never with values only held in C locals:
+#define GC_SAFEPOINT(vmthread) \
+    {\
+    if (unlikely((vmthread)->gc.alloc_debt >= GC_SLICE_ALLOCS))\
+        gc_Step(vmthread);\
+    }
+
+// Must be called before storing a heap value into the member vars
+// (or other contents) of another heap object:
+#define GC_WRITEBARRIER(vmthread, container) \
+    {\
+    if (unlikely(((vmthread)->gc.phase == H64GCPHASE_MARKROOTS ||\
+            (vmthread)->gc.phase == H64GCPHASE_MARK) &&\
+            (container)->gcmark == (vmthread)->gc.epoch))\
+        _gc_Regray(vmthread, container);\
+    }
+
+// Reference counting is deferred: stack slots, temporaries and globals
+// never touch the counts, only storing a value into another heap
+// value does. Use these for exactly those stores:
+#define GC_HEAPREF_ADD(gcval) \
+    {\
+    if (likely(((gcval)->zctflags & H64GCZCT_IMMORTAL) == 0))\
+        (gcval)->heapreferencecount++;\
+    }
+#define GC_HEAPREF_DROP(vmthread, gcval) \
+    {\
+    if (likely(((gcval)->zctflags & H64GCZCT_IMMORTAL) == 0)) {\
+        (gcval)->heapreferencecount--;\
+        if ((gcval)->heapreferencecount == 0)\
+            _gc_ZCTAdd(vmthread, gcval);\
+    }\
+    }
+
+#endif  // HORSE64_GC_H_
@@ -7,7 +7,10 @@
 
 #include <stdint.h>
 
+#include "vmlist.h"
+#include "vmmap.h"
 #include "vmstrings.h"
+#include "vmvector.h"
 
 typedef struct valuecontent valuecontent;
 
@@ -18,12 +21,17 @@ typedef enum gcvaluetype {
     H64GCVALUETYPE_CFUNCREF = 3,
     H64GCVALUETYPE_EMPTYARG = 4,
     H64GCVALUETYPE_ERROR = 5,
-    H64GCVALUETYPE_STRING = 6
+    H64GCVALUETYPE_STRING = 6,
+    H64GCVALUETYPE_LIST = 7,
+    H64GCVALUETYPE_MAP = 8,
+    H64GCVALUETYPE_SET = 9,
+    H64GCVALUETYPE_VECTOR = 10
 } gcvaluetype;
 
 typedef struct h64gcvalue {
     uint8_t type;
-    int heapreferencecount, externalreferencecount;
+    uint8_t gcmark, zctflags;
+    int heapreferencecount;  // only refs from other heap values count
     union {
         struct {
             int classid;
@@ -32,6 +40,15 @@ typedef struct h64gcvalue {
         struct {
             h64stringval str_val;
         };
+        struct {
+            h64listval list_val;
+        };
+        struct {
+            h64mapval map_val;  // for both maps and sets
+        };
+        struct {
+            h64vectorval vector_val;
+        };
     };
 } h64gcvalue;
 
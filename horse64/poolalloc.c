@@ -7,91 +7,97 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <malloc.h>
+#endif
 
 #include "poolalloc.h"
 
-#define FIRSTPOOLSIZE 256
+// Items live in slabs which are aligned to their own size, such that
+// the slab owning an item is found by masking the item's address.
+// Each slab hands out never used items by bumping an index, and
+// reuses freed ones via an intrusive free list. The used bitmap is
+// only needed for walking the heap, never for allocating.
+#define SLABSIZE (64 * 1024)
+#define SLABMINITEMS 16
+#define EMERGENCYMARGINITEMS 10
+#define ITEMALIGN 8
 
-typedef struct pool {
-    int item_count;
-    char *poolarea;
-    int *slotused;
-    int possiblyfreeindex;
-} pool;
+typedef struct poolslab poolslab;
+
+typedef struct poolslab {
+    poolslab *nextslab;
+    poolslab *nextnonfull;
+    void *freelist;
+    char *items;
+    int item_count, used_count, bump_index;
+    uint64_t usedmap[];
+} poolslab;
 
 typedef struct poolalloc {
     int allocsize;
-    int pools_count;
-    pool *pools;
-    int lastusedareaindex;
+    size_t slabsize;
+    int slabitems;
+    size_t itemsoffset;
+    poolslab *slabs;
+    poolslab *nonfull;
 
     int64_t totalitems;
     int64_t freeitems;
 } poolalloc;
 
 
-int poolalloc_AddArea(poolalloc *poolac) {
-    pool *new_areas = realloc(
-        poolac->pools, sizeof(*poolac->pools) * (
-        poolac->pools_count + 1));
-    if (!new_areas)
-        return 0;
-    poolac->pools = new_areas;
-    poolac->pools_count++;
-    memset(
-        &poolac->pools[poolac->pools_count - 1], 0,
-        sizeof(*poolac->pools)
-    );
-    int pool_size = FIRSTPOOLSIZE;
-    if (poolac->pools_count > 1) {
-        assert(
-            poolac->pools[poolac->pools_count - 2].
-            item_count > 0
-        );
-        pool_size = poolac->pools[poolac->pools_count - 2].
-            item_count * 2;
-    }
-    assert(pool_size > 0);
-    poolac->pools[poolac->pools_count - 1].item_count = pool_size;
-    poolac->pools[poolac->pools_count - 1].poolarea = malloc(
-        pool_size * poolac->allocsize
-    );
-    if (!poolac->pools[poolac->pools_count - 1].poolarea) {
-        poolac->pools_count--;
-        return 0;
-    }
-    poolac->pools[poolac->pools_count - 1].slotused = malloc(
-        sizeof(*poolac->pools[poolac->pools_count - 1].slotused) *
-        pool_size
+static void *_poolalloc_AlignedAlloc(size_t size) {
+    #if defined(_WIN32) || defined(_WIN64)
+    return _aligned_malloc(size, size);
+    #else
+    void *p = NULL;
+    if (posix_memalign(&p, size, size) != 0)
+        return NULL;
+    return p;
+    #endif
+}
+
+static void _poolalloc_AlignedFree(void *p) {
+    #if defined(_WIN32) || defined(_WIN64)
+    _aligned_free(p);
+    #else
+    free(p);
+    #endif
+}
+
+static inline poolslab *_poolalloc_SlabOf(
+        poolalloc *poolac, void *ptr
+        ) {
+    return (poolslab *)(
+        (uintptr_t)ptr & ~((uintptr_t)poolac->slabsize - 1)
     );
-    if (!poolac->pools[poolac->pools_count - 1].slotused) {
-        free(poolac->pools[poolac->pools_count - 1].poolarea);
-        poolac->pools_count--;
+}
+
+int poolalloc_AddArea(poolalloc *poolac) {
+    poolslab *slab = _poolalloc_AlignedAlloc(poolac->slabsize);
+    if (!slab)
         return 0;
-    }
-    memset(
-        poolac->pools[poolac->pools_count - 1].slotused, 0,
-        sizeof(*poolac->pools[poolac->pools_count - 1].slotused) *
-        pool_size
-    );
-    assert(pool_size > 0);
-    poolac->freeitems += pool_size;
-    poolac->totalitems += pool_size;
-    poolac->lastusedareaindex = poolac->pools_count - 1;
+    memset(slab, 0, poolac->itemsoffset);
+    slab->items = (char *)slab + poolac->itemsoffset;
+    slab->item_count = poolac->slabitems;
+    slab->nextslab = poolac->slabs;
+    poolac->slabs = slab;
+    slab->nextnonfull = poolac->nonfull;
+    poolac->nonfull = slab;
+    poolac->freeitems += slab->item_count;
+    poolac->totalitems += slab->item_count;
     return 1;
 }
 
 void poolalloc_Destroy(poolalloc *poolac) {
     if (!poolac)
         return;
-    if (poolac->pools) {
-        int i = 0;
-        while (i < poolac->pools_count) {
-            free(poolac->pools[i].poolarea);
-            free(poolac->pools[i].slotused);
-            i++;
-        }
-        free(poolac->pools);
+    poolslab *slab = poolac->slabs;
+    while (slab) {
+        poolslab *next = slab->nextslab;
+        _poolalloc_AlignedFree(slab);
+        slab = next;
     }
     free(poolac);
 }
@@ -103,7 +109,29 @@ poolalloc *poolalloc_New(int itemsize) {
     if (!poolac)
         return NULL;
     memset(poolac, 0, sizeof(*poolac));
+    // Items must be able to hold the free list's next pointer:
+    if ((size_t)itemsize < sizeof(void *))
+        itemsize = sizeof(void *);
+    itemsize = ((itemsize + ITEMALIGN - 1) / ITEMALIGN) * ITEMALIGN;
     poolac->allocsize = itemsize;
+
+    // Pick a slab size big enough for a sensible amount of items:
+    poolac->slabsize = SLABSIZE;
+    while (1) {
+        size_t maxitems = poolac->slabsize / itemsize;
+        size_t headersize = (
+            sizeof(poolslab) + ((maxitems + 63) / 64) * sizeof(uint64_t)
+        );
+        headersize = ((headersize + 15) / 16) * 16;
+        size_t items = (poolac->slabsize - headersize) / itemsize;
+        if (items >= SLABMINITEMS) {
+            poolac->itemsoffset = headersize;
+            poolac->slabitems = items;
+            break;
+        }
+        poolac->slabsize *= 2;
+    }
+
     if (!poolalloc_AddArea(poolac)) {
         poolalloc_Destroy(poolac);
         return NULL;
@@ -112,96 +140,125 @@ poolalloc *poolalloc_New(int itemsize) {
 }
 
 void poolalloc_free(poolalloc *poolac, void *ptr) {
-    int j = 0;
-    while (j < poolac->pools_count) {
-        const int c = poolac->pools[j].item_count;
-        int k = 0;
-        while (k < c) {
-            if ((char*)ptr >= poolac->pools[j].poolarea &&
-                    (char*)ptr < poolac->pools[j].poolarea +
-                    poolac->allocsize * c) {
-                int64_t offset = (
-                    ((char*)ptr - poolac->pools[j].poolarea)
-                );
-                offset /= poolac->allocsize;
-                assert(offset >= 0 && offset < c);
-                assert(poolac->pools[j].slotused[offset]);
-                poolac->pools[j].slotused[offset] = 0;
-                poolac->pools[j].possiblyfreeindex = offset;
-                poolac->lastusedareaindex = j;
-                poolac->freeitems++;
-                assert(poolac->freeitems <= poolac->totalitems);
-                return;
-            }
-            k++;
-        }
-        j++;
+    poolslab *slab = _poolalloc_SlabOf(poolac, ptr);
+    int64_t offset = (char *)ptr - slab->items;
+    assert(offset >= 0 && offset % poolac->allocsize == 0);
+    int index = offset / poolac->allocsize;
+    assert(index < slab->bump_index);
+    assert((slab->usedmap[index / 64] &
+            ((uint64_t)1 << (index % 64))) != 0 &&
+           "failed to process free of poolalloc ptr");
+    slab->usedmap[index / 64] &= ~((uint64_t)1 << (index % 64));
+    *(void **)ptr = slab->freelist;
+    slab->freelist = ptr;
+    if (slab->used_count == slab->item_count) {
+        // It was full, so it isn't on the non-full list yet:
+        slab->nextnonfull = poolac->nonfull;
+        poolac->nonfull = slab;
     }
-    assert(0 && "failed to process free of poolalloc ptr");
+    slab->used_count--;
+    poolac->freeitems++;
+    assert(poolac->freeitems <= poolac->totalitems);
 }
 
 void *poolalloc_malloc(poolalloc *poolac,
                        int can_use_emergency_margin) {
     // Add more free items if necessary:
-    if (!can_use_emergency_margin && poolac->freeitems < 10) {
+    if (!can_use_emergency_margin &&
+            poolac->freeitems < EMERGENCYMARGINITEMS) {
         if (!poolalloc_AddArea(poolac))
             return 0;
     }
     if (poolac->freeitems <= 0)  // Adding new free items failed
         return 0;
 
-    if (poolac->lastusedareaindex >= 0 &&
-            poolac->lastusedareaindex < poolac->pools_count) {
-        // Try to add into last used pool area:
-        const int c = poolac->pools[poolac->lastusedareaindex].item_count;
-        int k = poolac->pools[poolac->lastusedareaindex].possiblyfreeindex;
-        if (k >= 0 && k < c &&
-                !poolac->pools[poolac->lastusedareaindex].slotused[k]) {
-            poolac->freeitems--;
-            assert(poolac->freeitems >= 0);
-            poolac->pools[poolac->lastusedareaindex].slotused[k] = 1;
-            poolac->pools[poolac->lastusedareaindex].
-                possiblyfreeindex = k + 1;
-            return poolac->pools[poolac->lastusedareaindex].poolarea + (
-                poolac->allocsize * k
-            );
-        }
-        k = 0;
-        while (k < c) {
-            if (!poolac->pools[poolac->lastusedareaindex].slotused[k]) {
-                poolac->freeitems--;
-                assert(poolac->freeitems >= 0);
-                poolac->pools[poolac->lastusedareaindex].slotused[k] = 1;
-                poolac->pools[poolac->lastusedareaindex].
-                    possiblyfreeindex = k + 1;
-                return poolac->pools[poolac->lastusedareaindex].poolarea + (
-                    poolac->allocsize * k
-                );
+    poolslab *slab = poolac->nonfull;
+    assert(slab != NULL && slab->used_count < slab->item_count);
+    void *ptr = NULL;
+    int index = 0;
+    if (slab->freelist) {
+        ptr = slab->freelist;
+        slab->freelist = *(void **)ptr;
+        index = ((char *)ptr - slab->items) / poolac->allocsize;
+    } else {
+        assert(slab->bump_index < slab->item_count);
+        index = slab->bump_index;
+        ptr = slab->items + (size_t)poolac->allocsize * index;
+        slab->bump_index++;
+    }
+    slab->usedmap[index / 64] |= ((uint64_t)1 << (index % 64));
+    slab->used_count++;
+    if (slab->used_count == slab->item_count)
+        poolac->nonfull = slab->nextnonfull;
+    poolac->freeitems--;
+    assert(poolac->freeitems >= 0);
+    return ptr;
+}
+
+void poolalloc_Walk(
+        poolalloc *poolac,
+        void (*cb)(void *ptr, void *userdata),
+        void *userdata
+        ) {
+    poolslab *slab = poolac->slabs;
+    while (slab) {
+        poolslab *next = slab->nextslab;
+        int words = (slab->bump_index + 63) / 64;
+        int i = 0;
+        while (i < words) {
+            // (copied, such that the callback may free the item)
+            uint64_t word = slab->usedmap[i];
+            while (word != 0) {
+                int bit = __builtin_ctzll(word);
+                word &= word - 1;
+                cb(slab->items + (size_t)poolac->allocsize *
+                   (i * 64 + bit), userdata);
             }
-            k++;
+            i++;
         }
+        slab = next;
     }
-    // See what pool area we can add this to:
-    int j = 0;
-    while (j < poolac->pools_count) {
-        const int c = poolac->pools[j].item_count;
-        int k = 0;
-        while (k < c) {
-            if (!poolac->pools[j].slotused[k]) {
-                poolac->freeitems--;
-                assert(poolac->freeitems >= 0);
-                poolac->lastusedareaindex = j;
-                poolac->pools[j].slotused[k] = 1;
-                poolac->pools[j].possiblyfreeindex = k + 1;
-                return poolac->pools[j].poolarea + (
-                    poolac->allocsize * k
-                );
+}
+
+int poolalloc_WalkSome(
+        poolalloc *poolac, poolallocwalkcursor *cursor,
+        int maxitems,
+        void (*cb)(void *ptr, void *userdata),
+        void *userdata
+        ) {
+    // Slabs are never released and new ones are added at the front,
+    // so a cursor stays valid and only misses slabs added after the
+    // walk began:
+    if (!cursor->started) {
+        cursor->started = 1;
+        cursor->slab = poolac->slabs;
+        cursor->index = 0;
+    }
+    int visited = 0;
+    while (cursor->slab) {
+        poolslab *slab = cursor->slab;
+        while (cursor->index < slab->bump_index) {
+            if (visited >= maxitems)
+                return 0;
+            int i = cursor->index;
+            uint64_t word = slab->usedmap[i / 64] >> (i % 64);
+            if (word == 0) {
+                // Skip to the next bitmap word:
+                cursor->index = (i / 64 + 1) * 64;
+                visited++;
+                continue;
             }
-            k++;
+            i += __builtin_ctzll(word);
+            if (i >= slab->bump_index) {
+                cursor->index = slab->bump_index;
+                break;
+            }
+            cursor->index = i + 1;
+            visited++;
+            cb(slab->items + (size_t)poolac->allocsize * i, userdata);
         }
-        j++;
+        cursor->slab = slab->nextslab;
+        cursor->index = 0;
     }
-    assert(0 && "invalid pool, item used count is below"
-           " total but no slot found");
-    return NULL;
+    return 1;
 }
@@ -7,6 +7,11 @@
 
 typedef struct poolalloc poolalloc;
 
+typedef struct poolallocwalkcursor {
+    void *slab;
+    int index, started;
+} poolallocwalkcursor;
+
 poolalloc *poolalloc_New(int itemsize);
 
 void poolalloc_Destroy(poolalloc *poolac);
@@ -16,4 +21,17 @@ void *poolalloc_malloc(poolalloc *poolac,
 
 void poolalloc_free(poolalloc *poolac, void *ptr);
 
+void poolalloc_Walk(
+    poolalloc *poolac,
+    void (*cb)(void *ptr, void *userdata),
+    void *userdata
+);  // calls cb for each allocated item, cb may free the item
+
+int poolalloc_WalkSome(
+    poolalloc *poolac, poolallocwalkcursor *cursor,
+    int maxitems,
+    void (*cb)(void *ptr, void *userdata),
+    void *userdata
+);  // resumable walk from a zeroed cursor, returns 1 once done
+
 #endif  // HORSE64_POOLALLOC_H_
@@ -10,10 +10,75 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "bytecode.h"
 #include "stack.h"
 
+// The stack reserves one big range of address space and commits it
+// from the bottom as needed. One extra page past the end is never
+// committed, so that a stray write past the reserve faults right away
+// rather than corrupting other memory. Committed entries at or above
+// entry_count are always kept zeroed, such that growing the stack is
+// just a bump of entry_count.
+
+
+static size_t _stack_PageSize() {
+    static size_t pagesize = 0;
+    if (pagesize == 0) {
+        #if defined(_WIN32) || defined(_WIN64)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        pagesize = info.dwPageSize;
+        #else
+        long result = sysconf(_SC_PAGESIZE);
+        pagesize = (result > 0 ? (size_t)result : 4096);
+        #endif
+    }
+    return pagesize;
+}
+
+static void *_stack_Reserve(size_t bytes) {
+    #if defined(_WIN32) || defined(_WIN64)
+    return VirtualAlloc(NULL, bytes, MEM_RESERVE, PAGE_NOACCESS);
+    #else
+    void *p = mmap(
+        NULL, bytes, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+    );
+    if (p == MAP_FAILED)
+        return NULL;
+    return p;
+    #endif
+}
+
+static int _stack_Commit(void *p, size_t bytes) {
+    #if defined(_WIN32) || defined(_WIN64)
+    return (VirtualAlloc(p, bytes, MEM_COMMIT, PAGE_READWRITE) != NULL);
+    #else
+    return (mprotect(p, bytes, PROT_READ | PROT_WRITE) == 0);
+    #endif
+}
+
+static void _stack_Release(void *p, size_t bytes) {
+    #if defined(_WIN32) || defined(_WIN64)
+    VirtualFree(p, 0, MEM_RELEASE);
+    #else
+    munmap(p, bytes);
+    #endif
+}
+
+static size_t _stack_ReservedBytes(int64_t reserved_count) {
+    size_t pagesize = _stack_PageSize();
+    size_t bytes = sizeof(valuecontent) * (size_t)reserved_count;
+    bytes = ((bytes + pagesize - 1) / pagesize) * pagesize;
+    return bytes + pagesize;  // guard page
+}
 
 h64stack *stack_New() {
     h64stack *st = malloc(sizeof(*st));
@@ -21,6 +86,21 @@ h64stack *stack_New() {
         return NULL;
     memset(st, 0, sizeof(*st));
 
+    // Reserve the address space, and retry smaller if a limit on it
+    // (like ulimit -v) makes the full reserve fail:
+    int64_t reserve = STACK_RESERVE_ENTRIES;
+    while (1) {
+        st->entry = _stack_Reserve(_stack_ReservedBytes(reserve));
+        if (st->entry)
+            break;
+        reserve /= 2;
+        if (reserve < ALLOC_OVERSHOOT * 16) {
+            free(st);
+            return NULL;
+        }
+    }
+    st->reserved_count = reserve;
+
     return st;
 }
 
@@ -37,28 +117,20 @@ void stack_Free(h64stack *st) {
         stack_FreeEntry(st, k);
         k++;
     }
-    free(st->entry);
+    _stack_Release(st->entry, _stack_ReservedBytes(st->reserved_count));
     free(st);
 }
 
 void stack_Shrink(h64stack *st, int64_t total_entries) {
+    // Committed memory is kept around for the next growth, but the
+    // released entries must be zeroed to keep that growth cheap:
     int64_t i = st->entry_count;
     while (i > total_entries) {
         stack_FreeEntry(st, i - 1);
+        memset(&st->entry[i - 1], 0, sizeof(st->entry[i - 1]));
         i--;
     }
     st->entry_count = i;
-    if (st->alloc_count + ALLOC_MAXOVERSHOOT > st->entry_count) {
-        int64_t new_alloc = st->entry_count + ALLOC_OVERSHOOT;
-        valuecontent *new_entries = realloc(
-            st->entry, sizeof(*new_entries) * new_alloc
-        );
-        if (!new_entries) {
-            return;
-        }
-        st->entry = new_entries;
-        st->alloc_count = new_alloc;
-    }
 }
 
 void stack_PrintDebug(h64stack *st) {
@@ -81,6 +153,9 @@ void stack_PrintDebug(h64stack *st) {
             fprintf(stderr, "%s", (vc->int_value ? "true" : "false"));
         } else if (vc->type == H64VALTYPE_GCVAL) {
             fprintf(stderr, "gcval %p", vc->ptr_value);
+        } else if (vc->type == H64VALTYPE_ITERATOR) {
+            fprintf(stderr, "iterator at %d of gcval %p",
+                    (int)vc->iterator_pos, vc->ptr_value);
         } else {
             fprintf(stderr, "<value type %d>", (int)vc->type);
         }
@@ -89,44 +164,62 @@ void stack_PrintDebug(h64stack *st) {
     }
 }
 
+static int _stack_CommitUpTo(h64stack *st, int64_t min_entries) {
+    assert(min_entries <= st->reserved_count);
+    size_t pagesize = _stack_PageSize();
+    size_t chunk = STACK_COMMIT_CHUNK;
+    if (chunk < pagesize)
+        chunk = pagesize;
+    size_t old_bytes = sizeof(valuecontent) * (size_t)st->alloc_count;
+    old_bytes = (old_bytes / pagesize) * pagesize;
+    size_t new_bytes = sizeof(valuecontent) * (size_t)min_entries;
+    new_bytes = ((new_bytes + chunk - 1) / chunk) * chunk;
+    size_t max_bytes = (
+        _stack_ReservedBytes(st->reserved_count) - pagesize
+    );
+    if (new_bytes > max_bytes)
+        new_bytes = max_bytes;
+    if (new_bytes <= old_bytes)
+        return 1;
+    if (!_stack_Commit(
+            (char *)st->entry + old_bytes, new_bytes - old_bytes
+            ))
+        return 0;
+    // Fresh pages come zeroed from the OS:
+    int64_t new_alloc = (int64_t)(new_bytes / sizeof(valuecontent));
+    if (new_alloc > st->reserved_count)
+        new_alloc = st->reserved_count;
+    st->alloc_count = new_alloc;
+    return 1;
+}
+
 int stack_ToSize(
         h64stack *st,
         int64_t total_entries,
         int can_use_emergency_margin
         ) {
     assert(total_entries >= 0);
+    if (total_entries <= st->entry_count) {
+        stack_Shrink(st, total_entries);
+        return 1;
+    }
     int alloc_needed_margin = (
         can_use_emergency_margin ? 0 :
         ALLOC_EMERGENCY_MARGIN
     );
-    // Grow if needed:
-    if (unlikely(st->alloc_count < total_entries + alloc_needed_margin)) {
-        valuecontent *new_entries = realloc(
-            st->entry, sizeof(*new_entries) *
-                (total_entries + alloc_needed_margin + ALLOC_OVERSHOOT)
-        );
-        if (!new_entries) {
-            if (!can_use_emergency_margin ||
-                    total_entries > st->alloc_count)
-                return 0;
-        } else {
-            st->entry = new_entries;
-            st->alloc_count = (
-                total_entries + alloc_needed_margin + ALLOC_OVERSHOOT
-            );
-        }
-    }
-    if (total_entries < st->entry_count) {
-        // Shrink or be done:
-        stack_Shrink(st, total_entries);
-        return 1;
-    }
-    assert(st->alloc_count > total_entries);
-    int64_t k = st->entry_count;
-    while (k < total_entries) {
-        memset(&st->entry[k], 0, sizeof(st->entry[k]));
-        k++;
+    if (unlikely(total_entries + alloc_needed_margin >
+            st->reserved_count))
+        return 0;
+    if (unlikely(st->alloc_count < total_entries + ALLOC_OVERSHOOT)) {
+        int64_t want = total_entries + ALLOC_OVERSHOOT;
+        if (want > st->reserved_count)
+            want = st->reserved_count;
+        if (!_stack_CommitUpTo(st, want) &&
+                st->alloc_count < total_entries)
+            return 0;
     }
+    assert(st->alloc_count >= total_entries);
+    // Entries past the old top are already zeroed:
     st->entry_count = total_entries;
     return 1;
 }
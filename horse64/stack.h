@@ -13,12 +13,21 @@
 typedef struct valuecontent valuecontent;
 
 #define ALLOC_OVERSHOOT 32
-#define ALLOC_MAXOVERSHOOT 4096
 #define ALLOC_EMERGENCY_MARGIN 6
 
+// How many entries of address space each stack reserves up front.
+// Only the used part is ever committed, but the entry pointer never
+// moves, so valuecontent pointers stay valid across stack_ToSize():
+#ifndef STACK_RESERVE_ENTRIES
+#define STACK_RESERVE_ENTRIES (4LL * 1024LL * 1024LL)
+#endif
+// Memory is committed in chunks of this many bytes at least:
+#define STACK_COMMIT_CHUNK (64 * 1024)
+
 
 typedef struct h64stack {
     int64_t entry_count, alloc_count;
+    int64_t reserved_count;
     int64_t current_func_floor;
     valuecontent *entry;
 } h64stack;
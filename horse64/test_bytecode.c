@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <check.h>
+#include <stdio.h>
 
 #include "bytecode.h"
 #include "corelib/errors.h"
@@ -34,4 +35,59 @@ START_TEST (test_bytecode)
 }
 END_TEST
 
-TESTS_MAIN(test_bytecode)
+START_TEST (test_bytecode_classmemberlookup)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t classid = h64program_AddClass(
+        p, "TestClass", NULL, NULL, NULL
+    );
+    ck_assert(classid >= 0);
+    char name[32];
+    int i = 0;
+    while (i < 300) {
+        snprintf(name, sizeof(name), "member%d", i);
+        ck_assert(h64program_RegisterClassVariable(p, classid, name));
+        i++;
+    }
+
+    // Lookups must give the same result before and after finalizing:
+    int pass = 0;
+    while (pass < 2) {
+        if (pass == 1) {
+            ck_assert(h64program_FinalizeAllClassMemberLookups(p));
+            ck_assert(p->classes[classid].member_lookup_disp != NULL);
+        }
+        i = 0;
+        while (i < 300) {
+            snprintf(name, sizeof(name), "member%d", i);
+            int64_t nameid = h64debugsymbols_MemberNameToMemberNameId(
+                p->symbols, name, 0
+            );
+            ck_assert(nameid >= 0);
+            int varid = -1;
+            int funcid = -1;
+            h64program_LookupClassMember(
+                p, classid, nameid, &varid, &funcid
+            );
+            ck_assert(varid == i && funcid == -1);
+            i++;
+        }
+        int64_t othernameid = h64debugsymbols_MemberNameToMemberNameId(
+            p->symbols, "notamember", 1
+        );
+        ck_assert(othernameid >= 0);
+        int varid = 0;
+        int funcid = 0;
+        h64program_LookupClassMember(
+            p, classid, othernameid, &varid, &funcid
+        );
+        ck_assert(varid == -1 && funcid == -1);
+        pass++;
+    }
+
+    h64program_Free(p);
+}
+END_TEST
+
+TESTS_MAIN(test_bytecode, test_bytecode_classmemberlookup)
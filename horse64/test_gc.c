@@ -0,0 +1,254 @@
+#include <assert.h>
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "gc.h"
+#include "gcvalue.h"
+#include "poolalloc.h"
+#include "stack.h"
+#include "vmexec.h"
+#include "vmstrings.h"
+
+#include "testhelpers.h"
+#include "testmain.h"
+
+static void _storemember(
+        h64vmthread *vmthread, h64gcvalue *gcval, int i,
+        h64gcvalue *value
+        ) {
+    GC_WRITEBARRIER(vmthread, gcval);
+    GC_HEAPREF_ADD(value);
+    gcval->membervars[i].type = H64VALTYPE_GCVAL;
+    gcval->membervars[i].ptr_value = value;
+}
+
+static h64gcvalue *_newinstance(h64vmthread *vmthread, int classid) {
+    h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+    ck_assert(gcval != NULL);
+    gcval->type = H64GCVALUETYPE_CLASSINSTANCE;
+    gcval->classid = classid;
+    gcval->membervars = calloc(2, sizeof(valuecontent));
+    ck_assert(gcval->membervars != NULL);
+    return gcval;
+}
+
+START_TEST (test_gc_cycles)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t classid = h64program_AddClass(p, "Node", NULL, NULL, NULL);
+    ck_assert(classid >= 0);
+    ck_assert(h64program_RegisterClassVariable(p, classid, "a"));
+    ck_assert(h64program_RegisterClassVariable(p, classid, "b"));
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    vmthread->program = p;
+    ck_assert(stack_ToSize(vmthread->stack, 1, 0));
+
+    // Two instances referring to each other, and nothing else:
+    h64gcvalue *a = _newinstance(vmthread, classid);
+    h64gcvalue *b = _newinstance(vmthread, classid);
+    _storemember(vmthread, a, 0, b);
+    _storemember(vmthread, b, 1, a);
+    ck_assert(_heapcount(vmthread) == 2);
+
+    // While on the stack, both must survive:
+    STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_GCVAL;
+    STACK_ENTRY(vmthread->stack, 0)->ptr_value = a;
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 2);
+    ck_assert(a->membervars[0].ptr_value == b);
+
+    // Once unreachable, the cycle must be freed:
+    STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_NONE;
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 0);
+
+    vmthread_Free(vmthread);
+    h64program_Free(p);
+}
+END_TEST
+
+START_TEST (test_gc_incremental)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t classid = h64program_AddClass(p, "Node", NULL, NULL, NULL);
+    ck_assert(classid >= 0);
+    ck_assert(h64program_RegisterClassVariable(p, classid, "a"));
+    ck_assert(h64program_RegisterClassVariable(p, classid, "b"));
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    vmthread->program = p;
+    ck_assert(stack_ToSize(vmthread->stack, 1, 0));
+
+    // Build a long linked chain from the stack, and drop garbage
+    // cycles in between, collecting only via the slices:
+    h64gcvalue *head = NULL;
+    int i = 0;
+    while (i < 100000) {
+        GC_SAFEPOINT(vmthread);
+        h64gcvalue *node = _newinstance(vmthread, classid);
+        if (head)
+            _storemember(vmthread, node, 0, head);
+        if (i % 10 == 0) {
+            head = node;
+            STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_GCVAL;
+            STACK_ENTRY(vmthread->stack, 0)->ptr_value = head;
+        } else {
+            _storemember(vmthread, node, 1, node);
+        }
+        i++;
+    }
+    ck_assert(vmthread->gc.cycles_done > 0);
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 10000);
+
+    // The whole chain must still be intact:
+    int length = 0;
+    h64gcvalue *node = head;
+    while (node) {
+        ck_assert(node->type == H64GCVALUETYPE_CLASSINSTANCE);
+        length++;
+        node = (node->membervars[0].type == H64VALTYPE_GCVAL ?
+                node->membervars[0].ptr_value : NULL);
+    }
+    ck_assert(length == 10000);
+
+    vmthread_Free(vmthread);
+    h64program_Free(p);
+}
+END_TEST
+
+START_TEST (test_gc_zct)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t classid = h64program_AddClass(p, "Node", NULL, NULL, NULL);
+    ck_assert(classid >= 0);
+    ck_assert(h64program_RegisterClassVariable(p, classid, "a"));
+    ck_assert(h64program_RegisterClassVariable(p, classid, "b"));
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    vmthread->program = p;
+    ck_assert(stack_ToSize(vmthread->stack, 1, 0));
+
+    // Acyclic garbage must be freed via the ZCT alone, with the value
+    // held in the stack slot and its child surviving:
+    int i = 0;
+    while (i < 100000) {
+        GC_SAFEPOINT(vmthread);
+        h64gcvalue *node = _newinstance(vmthread, classid);
+        h64gcvalue *child = _newinstance(vmthread, classid);
+        _storemember(vmthread, node, 0, child);
+        STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_GCVAL;
+        STACK_ENTRY(vmthread->stack, 0)->ptr_value = node;
+        i++;
+    }
+    ck_assert(vmthread->gc.cycles_done == 0);
+    ck_assert(_heapcount(vmthread) < GC_SLICE_ALLOCS * 2 +
+              GC_ZCT_MIN_RECONCILE * 2);
+    h64gcvalue *node = STACK_ENTRY(vmthread->stack, 0)->ptr_value;
+    h64gcvalue *child = node->membervars[0].ptr_value;
+    ck_assert(child->type == H64GCVALUETYPE_CLASSINSTANCE &&
+              child->heapreferencecount == 1);
+
+    vmthread_Free(vmthread);
+    h64program_Free(p);
+}
+END_TEST
+
+START_TEST (test_gc_immortal)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t classid = h64program_AddClass(p, "Node", NULL, NULL, NULL);
+    ck_assert(classid >= 0);
+    ck_assert(h64program_RegisterClassVariable(p, classid, "a"));
+    ck_assert(h64program_RegisterClassVariable(p, classid, "b"));
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    vmthread->program = p;
+    ck_assert(stack_ToSize(vmthread->stack, 1, 0));
+
+    // An immortal string like the ones string literals turn into:
+    h64gcvalue *conststr = calloc(1, sizeof(*conststr));
+    ck_assert(conststr != NULL);
+    conststr->type = H64GCVALUETYPE_STRING;
+    conststr->zctflags = H64GCZCT_IMMORTAL;
+    unicodechar chars[] = {'a', 'b', 'c'};
+    ck_assert(vmstrings_SetFromUTF32(NULL, &conststr->str_val, chars, 3));
+
+    // Storing it into heap values and collecting them must leave it
+    // alone entirely:
+    STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_GCVAL;
+    STACK_ENTRY(vmthread->stack, 0)->ptr_value = conststr;
+    h64gcvalue *node = _newinstance(vmthread, classid);
+    _storemember(vmthread, node, 0, conststr);
+    _storemember(vmthread, node, 1, node);
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 0);
+    ck_assert(conststr->heapreferencecount == 0);
+    ck_assert(conststr->gcmark == 0 && conststr->zctflags ==
+              H64GCZCT_IMMORTAL);
+    ck_assert(conststr->str_val.len == 3 &&
+              vmstrings_CharAt(&conststr->str_val, 2) == 'c');
+
+    vmthread_Free(vmthread);
+    vmstrings_Free(NULL, &conststr->str_val);
+    free(conststr);
+    h64program_Free(p);
+}
+END_TEST
+
+START_TEST (test_gc_nestedcycles)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t classid = h64program_AddClass(p, "Node", NULL, NULL, NULL);
+    ck_assert(classid >= 0);
+    ck_assert(h64program_RegisterClassVariable(p, classid, "a"));
+    ck_assert(h64program_RegisterClassVariable(p, classid, "b"));
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    vmthread->program = p;
+    ck_assert(stack_ToSize(vmthread->stack, 1, 0));
+
+    h64gcvalue *survivor = _newinstance(vmthread, classid);
+    STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_GCVAL;
+    STACK_ENTRY(vmthread->stack, 0)->ptr_value = survivor;
+
+    // Chains of garbage cycles holding other garbage cycles, and all
+    // of them the survivor, such that a sweep frees values that other
+    // values it frees later still refer to:
+    h64gcvalue *prev = NULL;
+    int i = 0;
+    while (i < 100000) {
+        GC_SAFEPOINT(vmthread);
+        h64gcvalue *outer = _newinstance(vmthread, classid);
+        h64gcvalue *inner = _newinstance(vmthread, classid);
+        _storemember(vmthread, outer, 0, inner);
+        _storemember(vmthread, inner, 0, outer);
+        _storemember(vmthread, inner, 1, survivor);
+        if (prev)
+            _storemember(vmthread, outer, 1, prev);
+        prev = (i % 100 == 99 ? NULL : outer);
+        i++;
+    }
+    ck_assert(vmthread->gc.cycles_done > 0);
+
+    // Only the survivor is left, with no heap references to it:
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 1);
+    ck_assert(survivor->type == H64GCVALUETYPE_CLASSINSTANCE &&
+              survivor->heapreferencecount == 0);
+
+    vmthread_Free(vmthread);
+    h64program_Free(p);
+}
+END_TEST
+
+TESTS_MAIN(test_gc_cycles, test_gc_incremental, test_gc_zct,
+           test_gc_immortal, test_gc_nestedcycles)
@@ -0,0 +1,58 @@
+#include <assert.h>
+#include <check.h>
+#include <string.h>
+
+#include "poolalloc.h"
+
+#include "testhelpers.h"
+#include "testmain.h"
+
+START_TEST (test_poolalloc)
+{
+    poolalloc *poolac = poolalloc_New(24);
+    ck_assert(poolac != NULL);
+
+    // Allocate enough items to need multiple slabs:
+    static void *items[50000];
+    int i = 0;
+    while (i < 50000) {
+        items[i] = poolalloc_malloc(poolac, 0);
+        ck_assert(items[i] != NULL);
+        memset(items[i], 0xAB, 24);
+        i++;
+    }
+    ck_assert(_poolcount(poolac) == 50000);
+
+    // Free every other item, and check they get reused:
+    i = 0;
+    while (i < 50000) {
+        poolalloc_free(poolac, items[i]);
+        i += 2;
+    }
+    ck_assert(_poolcount(poolac) == 25000);
+    i = 0;
+    while (i < 50000) {
+        void *p = poolalloc_malloc(poolac, 0);
+        ck_assert(p != NULL);
+        items[i] = p;
+        i += 2;
+    }
+    ck_assert(_poolcount(poolac) == 50000);
+
+    // No item may have been handed out twice:
+    i = 0;
+    while (i < 50000) {
+        memset(items[i], (i % 250), 24);
+        i++;
+    }
+    i = 0;
+    while (i < 50000) {
+        ck_assert(((unsigned char *)items[i])[23] == (i % 250));
+        i++;
+    }
+
+    poolalloc_Destroy(poolac);
+}
+END_TEST
+
+TESTS_MAIN(test_poolalloc)
@@ -18,6 +18,21 @@ START_TEST (test_stack)
     ck_assert(STACK_ENTRY(stack, 0) == &stack->entry[0]);
     stack->current_func_floor = 1;
     ck_assert(STACK_ENTRY(stack, 0) == &stack->entry[1]);
+    stack->current_func_floor = 0;
+
+    // Growing must not move entries, and slots beyond the old top
+    // must come back zeroed after a shrink:
+    valuecontent *first = &stack->entry[0];
+    STACK_ENTRY(stack, 9)->type = H64VALTYPE_INT64;
+    STACK_ENTRY(stack, 9)->int_value = 5;
+    ck_assert(stack_ToSize(stack, 100000, 0));
+    ck_assert(&stack->entry[0] == first);
+    ck_assert(STACK_ENTRY(stack, 9)->int_value == 5);
+    STACK_ENTRY(stack, 50000)->type = H64VALTYPE_INT64;
+    ck_assert(stack_ToSize(stack, 10, 0));
+    ck_assert(stack_ToSize(stack, 100000, 0));
+    ck_assert(STACK_ENTRY(stack, 50000)->type == H64VALTYPE_INVALID);
+    ck_assert(!stack_ToSize(stack, stack->reserved_count, 0));
 
     stack_Free(stack);
 }
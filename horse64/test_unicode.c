@@ -2,6 +2,8 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "unicode.h"
 
@@ -66,4 +68,84 @@ START_TEST (test_unicode)
 }
 END_TEST
 
-TESTS_MAIN (test_unicode)
+static void _check_roundtrip_all_levels(const char *input) {
+    int64_t input_len = strlen(input);
+    unicodechar *expected = NULL;
+    int64_t expected_len = 0;
+    unicode_LimitSIMDLevel(UNICODE_SIMD_NONE);
+    expected = utf8_to_utf32(input, input_len, NULL, NULL, &expected_len);
+    ck_assert(expected != NULL);
+
+    int level = UNICODE_SIMD_NONE;
+    while (level <= UNICODE_SIMD_AVX2) {
+        unicode_LimitSIMDLevel(level);
+        int64_t out_len = 0;
+        unicodechar *s = utf8_to_utf32(
+            input, input_len, NULL, NULL, &out_len
+        );
+        ck_assert(s != NULL);
+        ck_assert(out_len == expected_len);
+        ck_assert(memcmp(s, expected,
+                         (out_len + 1) * sizeof(*s)) == 0);
+
+        char *back = malloc(input_len + 1);
+        ck_assert(back != NULL);
+        int64_t back_len = 0;
+        ck_assert(utf32_to_utf8(
+            s, out_len, back, input_len + 1, &back_len, 1
+        ));
+        ck_assert(back_len == input_len);
+        ck_assert(memcmp(back, input, input_len) == 0);
+
+        // Too small output buffers must fail the same way on every level:
+        if (input_len > 0)
+            ck_assert(!utf32_to_utf8(
+                s, out_len, back, input_len - 1, &back_len, 1
+            ));
+        free(back);
+        free(s);
+        level++;
+    }
+    free(expected);
+    unicode_LimitSIMDLevel(UNICODE_SIMD_AVX2);
+}
+
+START_TEST (test_unicode_simd)
+{
+    char buf[512];
+    int i = 0;
+    while (i < (int)sizeof(buf) - 1) {
+        buf[i] = 'a' + (i % 26);
+        i++;
+    }
+    buf[sizeof(buf) - 1] = '\0';
+    _check_roundtrip_all_levels(buf);
+    _check_roundtrip_all_levels("");
+    _check_roundtrip_all_levels("short");
+
+    // Non-ASCII at various offsets across the vector block boundaries:
+    i = 0;
+    while (i < 70) {
+        char mixed[256];
+        memset(mixed, 'x', sizeof(mixed));
+        memcpy(mixed + i, "\xc3\xb6", 2);
+        memcpy(mixed + i + 40, "\xe4\xb8\xad", 3);
+        memcpy(mixed + i + 100, "\xf0\x9f\x90\xb4", 4);
+        mixed[sizeof(mixed) - 1] = '\0';
+        _check_roundtrip_all_levels(mixed);
+        i++;
+    }
+    _check_roundtrip_all_levels(
+        "\xe4\xb8\xad\xe6\x96\x87\xe4\xb8\xad\xe6\x96\x87"
+        "\xe4\xb8\xad\xe6\x96\x87\xe4\xb8\xad\xe6\x96\x87"
+        "\xe4\xb8\xad\xe6\x96\x87\xe4\xb8\xad\xe6\x96\x87"
+    );
+    // Invalid bytes get surrogate escaped and restored again:
+    _check_roundtrip_all_levels(
+        "abcdefghijklmnopqrstuvwxyz0123456789\xff"
+        "abcdefghijklmnopqrstuvwxyz0123456789\xc3"
+    );
+}
+END_TEST
+
+TESTS_MAIN (test_unicode, test_unicode_simd)
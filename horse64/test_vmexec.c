@@ -0,0 +1,728 @@
+#include <assert.h>
+#include <check.h>
+
+#include "bytecode.h"
+#include "corelib/errors.h"
+#include "debugsymbols.h"
+#include "gc.h"
+#include "gcvalue.h"
+#include "stack.h"
+#include "testhelpers.h"
+#include "testmain.h"
+
+START_TEST (test_vmexec_quickbinopdivzero)
+{
+    // Division and modulo by zero must raise from the quickened int
+    // instructions, and leave them working for the next run:
+    ck_assert(_testrun(
+        "func div(a, b) {"
+        "    return a / b"
+        "}"
+        "func mod(a, b) {"
+        "    return a % b"
+        "}"
+        "func main {"
+        "    var r = div(6, 2)"
+        "    try {"
+        "        div(1, 0)"
+        "    } catch MathError {"
+        "        r = r + 10"
+        "    }"
+        "    r = r + mod(7, 4)"
+        "    try {"
+        "        mod(7, 0)"
+        "    } catch MathError {"
+        "        r = r + 100"
+        "    }"
+        "    return r + div(8, 2) + mod(9, 5)"
+        "}"
+    ) == 124);
+}
+END_TEST
+
+START_TEST (test_vmexec_returnthroughfinally)
+{
+    // A return inside try or catch runs the finally block first,
+    // which may return something else instead:
+    ck_assert(_testrun(
+        "func f {"
+        "    try {"
+        "        return 10"
+        "    } finally {"
+        "        return 109"
+        "    }"
+        "    return 0"
+        "}"
+        "func main {"
+        "    return f()"
+        "}"
+    ) == 109);
+    ck_assert(_testrun(
+        "func f {"
+        "    var x = 1"
+        "    try {"
+        "        try {"
+        "            return x"
+        "        } finally {"
+        "            x = x + 10"
+        "        }"
+        "    } finally {"
+        "        return x + 100"
+        "    }"
+        "    return 0"
+        "}"
+        "func g {"
+        "    var x = 0"
+        "    try {"
+        "        var y = 1 + none"
+        "    } catch TypeError {"
+        "        x = 20"
+        "        return x"
+        "    } finally {"
+        "        return x + 3"
+        "    }"
+        "    return 0"
+        "}"
+        "func main {"
+        "    return f() + g()"
+        "}"
+    ) == 134);
+
+    // ...or raise an exception instead:
+    ck_assert(_testrun(
+        "func f {"
+        "    try {"
+        "        return 10"
+        "    } finally {"
+        "        var x = 1 + none"
+        "    }"
+        "    return 0"
+        "}"
+        "func main {"
+        "    var r = 0"
+        "    try {"
+        "        r = f()"
+        "    } catch TypeError {"
+        "        r = 77"
+        "    }"
+        "    return r"
+        "}"
+    ) == 77);
+
+    // Returning from a finally block entered due to an exception
+    // drops that exception, also when going through another finally
+    // block which the loop then enters again normally:
+    ck_assert(_testrun(
+        "func f {"
+        "    try {"
+        "        try {"
+        "            var x = 1 + none"
+        "        } finally {"
+        "            return 5"
+        "        }"
+        "    } finally {"
+        "        var y = 2"
+        "    }"
+        "    return 0"
+        "}"
+        "func g {"
+        "    var r = 0"
+        "    var v = none"
+        "    var i = 0"
+        "    while i < -2 {"
+        "        try {"
+        "            try {"
+        "                try {"
+        "                    var x = 1 + v"
+        "                } finally {"
+        "                    if i < 0 {"
+        "                        return 1"
+        "                    }"
+        "                }"
+        "            } finally {"
+        "                var y = v + 1"
+        "            }"
+        "        } catch TypeError {"
+        "            r = r + 10"
+        "        }"
+        "        v = 0"
+        "        i = i - 1"
+        "    }"
+        "    return r"
+        "}"
+        "func main {"
+        "    return f() + g()"
+        "}"
+    ) == 15);
+}
+END_TEST
+
+START_TEST (test_vmexec_stringlength)
+{
+    // Short strings are stored inline rather than on the heap, and
+    // must know their length all the same:
+    ck_assert(_testrun(
+        "func main {"
+        "    var e = \"\""
+        "    var a = \"a\""
+        "    var s = \"ab\""
+        "    var h = \"abc\""
+        "    var l = \"a much longer string constant\""
+        "    return e.length + a.length * 2 + s.length * 4 +"
+        "        h.length * 8 + l.length"
+        "}"
+    ) == 63);
+}
+END_TEST
+
+START_TEST (test_vmexec_callargwindow)
+{
+    // The arguments of a call are placed above the caller's live
+    // temporaries, and its result may land in a slot below them.
+    // Nested calls as arguments open their window above the one
+    // of the outer call which is partially filled at that point:
+    ck_assert(_testrun(
+        "func add(a, b) {"
+        "    return a + b"
+        "}"
+        "func id(x) {"
+        "    return x"
+        "}"
+        "func pick(n, v) {"
+        "    return v"
+        "}"
+        "func three(a, b, c) {"
+        "    return a * 100 + b * 10 + c"
+        "}"
+        "func main {"
+        "    var a = 1"
+        "    var r = a * 1000 + add(id(20), add(300, id(4))) * 2 +"
+        "        (a + add(a, a))"
+        "    r = r + three(id(a), add(a, 1), three(0, 0, 3)) - 123"
+        "    r = r + add(a, 2) + pick(print(\"\"), add(3, 4)) + a"
+        "    return r"
+        "}"
+    ) == 1662);
+
+    // Wrong positional argument counts raise, also for C functions,
+    // and leave the caller's temporaries intact:
+    ck_assert(_testrun(
+        "func add(a, b) {"
+        "    return a + b"
+        "}"
+        "func main {"
+        "    var a = 1"
+        "    var r = 0"
+        "    try {"
+        "        r = a + add(a)"
+        "    } catch ArgumentError {"
+        "        r = 10"
+        "    }"
+        "    try {"
+        "        r = r + add(a, 2, 3) * 1000"
+        "    } catch ArgumentError {"
+        "        r = r + 20"
+        "    }"
+        "    try {"
+        "        print()"
+        "    } catch ArgumentError {"
+        "        r = r + 300"
+        "    }"
+        "    return r + add(a, a) * 1000 + a"
+        "}"
+    ) == 2331);
+}
+END_TEST
+
+START_TEST (test_vmexec_tailcallhandlers)
+{
+    // A tail call out of a func with a try block would leave its
+    // handlers behind, so those must stay regular calls:
+    h64compileproject *project = _testcompile(
+        "func f(x) {"
+        "    return x + 1"
+        "}"
+        "func main {"
+        "    try {"
+        "        return f(1)"
+        "    } catch TypeError {"
+        "        return f(2)"
+        "    } finally {"
+        "        var y = 0"
+        "    }"
+        "    return f(3)"
+        "}"
+    );
+    ck_assert(_testcountinmain(
+        project->program, H64INST_TAILCALLFUNC
+    ) == 0);
+    ck_assert(_testcountinmain(project->program, H64INST_TAILCALL) == 0);
+    compileproject_Free(project);
+
+    // Errors from within tail called funcs still reach the handlers
+    // of the caller further up:
+    ck_assert(_testrun(
+        "func boom(x) {"
+        "    return x + 1"
+        "}"
+        "func tail(x) {"
+        "    return boom(x)"
+        "}"
+        "func fin {"
+        "    try {"
+        "        return tail(none)"
+        "    } finally {"
+        "        return 40"
+        "    }"
+        "    return 0"
+        "}"
+        "func cat {"
+        "    try {"
+        "        return tail(none)"
+        "    } catch TypeError {"
+        "        return 100"
+        "    }"
+        "    return 0"
+        "}"
+        "func main {"
+        "    var r = tail(1)"
+        "    try {"
+        "        r = r + tail(none)"
+        "    } catch TypeError {"
+        "        r = r + 10"
+        "    }"
+        "    return r + fin() + cat()"
+        "}"
+    ) == 152);
+}
+END_TEST
+
+static h64gcvalue *_newinstance(
+        h64vmthread *vmthread, int classid, int64_t x
+        ) {
+    // Makes an instance with all members set to x:
+    h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+    ck_assert(gcval != NULL);
+    gcval->type = H64GCVALUETYPE_CLASSINSTANCE;
+    gcval->classid = classid;
+    int count = vmthread->program->classes[classid].vars_count;
+    gcval->membervars = calloc(count + 1, sizeof(valuecontent));
+    ck_assert(gcval->membervars != NULL);
+    int i = 0;
+    while (i < count) {
+        gcval->membervars[i].type = H64VALTYPE_INT64;
+        gcval->membervars[i].int_value = x;
+        i++;
+    }
+    return gcval;
+}
+
+static int _rungetmember(
+        h64vmthread *vmthread, int64_t func_id, h64gcvalue *obj
+        ) {
+    // Runs the func with obj as argument on top of the stack, and
+    // returns the int result or -1 for an AttributeError:
+    int64_t top = vmthread->stack->entry_count;
+    ck_assert(stack_ToSize(vmthread->stack, top + 1, 0));
+    STACK_ENTRY(vmthread->stack, top)->type = H64VALTYPE_GCVAL;
+    STACK_ENTRY(vmthread->stack, top)->ptr_value = obj;
+    int uncaught = 0;
+    h64exceptioninfo einfo = {0};
+    ck_assert(vmthread_RunFunction(vmthread, func_id, &uncaught, &einfo));
+    if (uncaught) {
+        ck_assert(einfo.exception_class_id ==
+                  H64STDERROR_ATTRIBUTEERROR);
+        free(einfo.msg);
+        ck_assert(vmthread->stack->entry_count == top);
+        return -1;
+    }
+    ck_assert(vmthread->stack->entry_count == top + 1);
+    valuecontent *vc = STACK_ENTRY(vmthread->stack, top);
+    ck_assert(vc->type == H64VALTYPE_INT64);
+    int result = vc->int_value;
+    ck_assert(stack_ToSize(vmthread->stack, top, 0));
+    return result;
+}
+
+START_TEST (test_vmexec_getmembercache)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t classa = h64program_AddClass(p, "A", NULL, NULL, NULL);
+    ck_assert(classa >= 0);
+    ck_assert(h64program_RegisterClassVariable(p, classa, "x"));
+    int64_t classb = h64program_AddClass(p, "B", NULL, NULL, NULL);
+    ck_assert(classb >= 0);
+    ck_assert(h64program_RegisterClassVariable(p, classb, "y"));
+    ck_assert(h64program_RegisterClassVariable(p, classb, "x"));
+    int64_t classc = h64program_AddClass(p, "C", NULL, NULL, NULL);
+    ck_assert(classc >= 0);
+    int methodid = h64program_RegisterHorse64Function(
+        p, "x", NULL, 0, NULL, 0, NULL, NULL, classc
+    );
+    ck_assert(methodid >= 0);
+    h64instruction_returnvalue inst_rv = {0};
+    inst_rv.type = H64INST_RETURNVALUE;
+    inst_rv.returnslotfrom = 0;
+    p->func[methodid].instructions = malloc(sizeof(inst_rv));
+    ck_assert(p->func[methodid].instructions != NULL);
+    memcpy(p->func[methodid].instructions, &inst_rv, sizeof(inst_rv));
+    p->func[methodid].instructions_bytes = sizeof(inst_rv);
+    ck_assert(h64program_FinalizeAllClassMemberLookups(p));
+
+    // func getx(obj) { return obj.x }
+    int fid = h64program_RegisterHorse64Function(
+        p, "getx", NULL, 1, NULL, 0, NULL, NULL, -1
+    );
+    ck_assert(fid >= 0);
+    h64func *f = &p->func[fid];
+    f->inner_stack_size = 1;
+    h64instruction_getmember inst_gm = {0};
+    inst_gm.type = H64INST_GETMEMBER;
+    inst_gm.slotto = 1;
+    inst_gm.objslotfrom = 0;
+    inst_gm.nameidx = h64debugsymbols_MemberNameToMemberNameId(
+        p->symbols, "x", 0
+    );
+    ck_assert(inst_gm.nameidx >= 0);
+    inst_rv.returnslotfrom = 1;
+    f->instructions = malloc(sizeof(inst_gm) + sizeof(inst_rv));
+    ck_assert(f->instructions != NULL);
+    memcpy(f->instructions, &inst_gm, sizeof(inst_gm));
+    memcpy(f->instructions + sizeof(inst_gm), &inst_rv, sizeof(inst_rv));
+    f->instructions_bytes = sizeof(inst_gm) + sizeof(inst_rv);
+    ck_assert(vmexec_PrepareThreadedCode(p));
+
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    vmthread->program = p;
+    ck_assert(stack_ToSize(vmthread->stack, 3, 0));
+    h64gcvalue *a = _newinstance(vmthread, classa, 1);
+    h64gcvalue *b = _newinstance(vmthread, classb, 20);
+    h64gcvalue *c = _newinstance(vmthread, classc, 0);
+    h64gcvalue *objs[] = {a, b, c};
+    int i = 0;
+    while (i < 3) {
+        STACK_ENTRY(vmthread->stack, i)->type = H64VALTYPE_GCVAL;
+        STACK_ENTRY(vmthread->stack, i)->ptr_value = objs[i];
+        i++;
+    }
+
+    // A miss filling the cache, then a hit:
+    ck_assert(_rungetmember(vmthread, fid, a) == 1);
+    ck_assert(_rungetmember(vmthread, fid, a) == 1);
+
+    // Another class with the member elsewhere must miss, and not
+    // break the entry of the first one:
+    ck_assert(_rungetmember(vmthread, fid, b) == 20);
+    ck_assert(_rungetmember(vmthread, fid, a) == 1);
+    ck_assert(_rungetmember(vmthread, fid, b) == 20);
+
+    // A method isn't supported as a value, which must raise an error
+    // rather than stop the VM:
+    ck_assert(_rungetmember(vmthread, fid, c) == -1);
+    ck_assert(_rungetmember(vmthread, fid, a) == 1);
+
+    ck_assert(stack_ToSize(vmthread->stack, 0, 0));
+    vmthread_Free(vmthread);
+    h64program_Free(p);
+}
+END_TEST
+
+static int _cfunc_seenargs = -1;
+
+static int _cfunc_sum(h64vmthread *vmthread) {
+    // Sums up the int arguments, and notes how many it saw:
+    _cfunc_seenargs = STACK_TOP(vmthread->stack);
+    int64_t sum = 0;
+    int i = 0;
+    while (i < _cfunc_seenargs) {
+        ck_assert(STACK_ENTRY(vmthread->stack, i)->type ==
+                  H64VALTYPE_INT64);
+        sum += STACK_ENTRY(vmthread->stack, i)->int_value;
+        i++;
+    }
+    if (!stack_ToSize(vmthread->stack,
+                      vmthread->stack->entry_count + 1, 0))
+        return -1;
+    valuecontent *vc = STACK_ENTRY(vmthread->stack, _cfunc_seenargs);
+    vc->type = H64VALTYPE_INT64;
+    vc->int_value = sum;
+    return 1;
+}
+
+static void _appendsetint(h64func *f, int slot, int64_t value) {
+    h64instruction_setconst inst = {0};
+    inst.type = H64INST_SETCONST;
+    inst.slot = slot;
+    inst.content.type = H64VALTYPE_INT64;
+    inst.content.int_value = value;
+    _appendinst(f, &inst, sizeof(inst));
+}
+
+static void _appendbinop(
+        h64func *f, int optype, int slotto, int arg1, int arg2
+        ) {
+    h64instruction_binop inst = {0};
+    inst.type = H64INST_BINOP;
+    inst.optype = optype;
+    inst.slotto = slotto;
+    inst.arg1slotfrom = arg1;
+    inst.arg2slotfrom = arg2;
+    _appendinst(f, &inst, sizeof(inst));
+}
+
+static int64_t _newcaller(
+        h64program *p, int64_t calledfunc, int posargs,
+        int kwargs, const int64_t *argvalues
+        ) {
+    // Makes a func which does: t0 = 7, then t1 = calledfunc(...)
+    // with the arguments starting at t1, and returns t0 + t1.
+    // Keyword arguments are given as name id and value pairs:
+    int64_t fid = h64program_RegisterHorse64Function(
+        p, NULL, NULL, 0, NULL, 0, NULL, NULL, -1
+    );
+    ck_assert(fid >= 0);
+    h64func *f = &p->func[fid];
+    f->inner_stack_size = 1 + posargs + kwargs * 2;
+    if (f->inner_stack_size < 2)
+        f->inner_stack_size = 2;
+    _appendsetint(f, 0, 7);
+    h64instruction_settop inst_st = {0};
+    inst_st.type = H64INST_SETTOP;
+    inst_st.topto = 1;
+    _appendinst(f, &inst_st, sizeof(inst_st));
+    int i = 0;
+    while (i < posargs + kwargs * 2) {
+        _appendsetint(f, 1 + i, argvalues[i]);
+        i++;
+    }
+    h64instruction_callfunc inst_cf = {0};
+    inst_cf.type = H64INST_CALLFUNC;
+    inst_cf.returnto = 1;
+    inst_cf.funcfrom = calledfunc;
+    inst_cf.posargs = posargs;
+    inst_cf.kwargs = kwargs;
+    _appendinst(f, &inst_cf, sizeof(inst_cf));
+    _appendbinop(f, H64OP_MATH_ADD, 0, 0, 1);
+    h64instruction_returnvalue inst_rv = {0};
+    inst_rv.type = H64INST_RETURNVALUE;
+    inst_rv.returnslotfrom = 0;
+    _appendinst(f, &inst_rv, sizeof(inst_rv));
+    return fid;
+}
+
+static int _runcaller(h64vmthread *vmthread, int64_t func_id) {
+    // Runs the func, and returns the int result or -1 for an
+    // ArgumentError:
+    int64_t top = vmthread->stack->entry_count;
+    int uncaught = 0;
+    h64exceptioninfo einfo = {0};
+    ck_assert(vmthread_RunFunction(vmthread, func_id, &uncaught, &einfo));
+    ck_assert(vmthread->funcframe_count == 0);
+    if (uncaught) {
+        ck_assert(einfo.exception_class_id ==
+                  H64STDERROR_ARGUMENTERROR);
+        free(einfo.msg);
+        ck_assert(vmthread->stack->entry_count == top);
+        return -1;
+    }
+    ck_assert(vmthread->stack->entry_count == top + 1);
+    valuecontent *vc = STACK_ENTRY(vmthread->stack, top);
+    ck_assert(vc->type == H64VALTYPE_INT64);
+    int result = vc->int_value;
+    ck_assert(stack_ToSize(vmthread->stack, top, 0));
+    return result;
+}
+
+START_TEST (test_vmexec_callkwargs)
+{
+    // Keyword arguments can't be written in h64 code yet, so this
+    // uses hand-made callers.
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t nameb = h64debugsymbols_MemberNameToMemberNameId(
+        p->symbols, "b", 1
+    );
+    int64_t namec = h64debugsymbols_MemberNameToMemberNameId(
+        p->symbols, "c", 1
+    );
+    int64_t named = h64debugsymbols_MemberNameToMemberNameId(
+        p->symbols, "d", 1
+    );
+    ck_assert(nameb >= 0 && namec >= 0 && named >= 0);
+
+    // func f(a, b=..., c=...) { return a * 100 + b * 10 + c }
+    char *argnames[] = {NULL, "b", "c"};
+    int64_t fid = h64program_RegisterHorse64Function(
+        p, "f", NULL, 3, argnames, 0, NULL, NULL, -1
+    );
+    ck_assert(fid >= 0);
+    h64func *f = &p->func[fid];
+    f->inner_stack_size = 2;
+    _appendsetint(f, 3, 100);
+    _appendbinop(f, H64OP_MATH_MULTIPLY, 3, 0, 3);
+    _appendsetint(f, 4, 10);
+    _appendbinop(f, H64OP_MATH_MULTIPLY, 4, 1, 4);
+    _appendbinop(f, H64OP_MATH_ADD, 3, 3, 4);
+    _appendbinop(f, H64OP_MATH_ADD, 3, 3, 2);
+    h64instruction_returnvalue inst_rv = {0};
+    inst_rv.type = H64INST_RETURNVALUE;
+    inst_rv.returnslotfrom = 3;
+    _appendinst(f, &inst_rv, sizeof(inst_rv));
+    int64_t cfid = h64program_RegisterCFunction(
+        p, "csum", &_cfunc_sum, NULL, 2, NULL, 0, NULL, NULL, 1, -1
+    );
+    ck_assert(cfid >= 0);
+
+    int64_t args_pos[] = {1, 2, 3};
+    int64_t pos = _newcaller(p, fid, 3, 0, args_pos);
+    int64_t args_inorder[] = {1, nameb, 8, namec, 5};
+    int64_t inorder = _newcaller(p, fid, 1, 2, args_inorder);
+    int64_t args_reordered[] = {1, namec, 5, nameb, 8};
+    int64_t reordered = _newcaller(p, fid, 1, 2, args_reordered);
+    int64_t args_mixed[] = {1, 2, namec, 6};
+    int64_t mixed = _newcaller(p, fid, 2, 1, args_mixed);
+    int64_t args_dup[] = {1, nameb, 8, nameb, 5};
+    int64_t dup = _newcaller(p, fid, 1, 2, args_dup);
+    int64_t args_unknown[] = {1, nameb, 8, named, 5};
+    int64_t unknown = _newcaller(p, fid, 1, 2, args_unknown);
+    int64_t args_posaskw[] = {1, 2, nameb, 5};
+    int64_t posaskw = _newcaller(p, fid, 2, 1, args_posaskw);
+    int64_t args_nopos[] = {nameb, 8, namec, 5};
+    int64_t nopos = _newcaller(p, fid, 0, 2, args_nopos);
+    int64_t args_c[] = {20, 3};
+    int64_t callc = _newcaller(p, cfid, 2, 0, args_c);
+    ck_assert(vmexec_PrepareThreadedCode(p));
+
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    vmthread->program = p;
+
+    // Keyword arguments end up in the callee's parameter order:
+    ck_assert(_runcaller(vmthread, pos) == 7 + 123);
+    ck_assert(_runcaller(vmthread, inorder) == 7 + 185);
+    ck_assert(_runcaller(vmthread, reordered) == 7 + 185);
+    ck_assert(_runcaller(vmthread, mixed) == 7 + 126);
+
+    // Duplicate or unknown keyword arguments raise, as does naming a
+    // parameter which was already passed positionally, or leaving
+    // out a positional one:
+    ck_assert(_runcaller(vmthread, dup) == -1);
+    ck_assert(_runcaller(vmthread, unknown) == -1);
+    ck_assert(_runcaller(vmthread, posaskw) == -1);
+    ck_assert(_runcaller(vmthread, nopos) == -1);
+
+    // A C function sees exactly its arguments, and the caller's
+    // frame is restored afterwards:
+    ck_assert(_runcaller(vmthread, callc) == 7 + 23);
+    ck_assert(_cfunc_seenargs == 2);
+    ck_assert(_runcaller(vmthread, reordered) == 7 + 185);
+
+    vmthread_Free(vmthread);
+    h64program_Free(p);
+}
+END_TEST
+
+static int _cfunc_maxframes = 0;
+static int64_t _cfunc_maxstack = 0;
+
+static int _cfunc_iszero(h64vmthread *vmthread) {
+    // Returns whether the argument is zero, and notes how deep the
+    // call stack currently is:
+    if (vmthread->funcframe_count > _cfunc_maxframes)
+        _cfunc_maxframes = vmthread->funcframe_count;
+    if (vmthread->stack->entry_count > _cfunc_maxstack)
+        _cfunc_maxstack = vmthread->stack->entry_count;
+    ck_assert(STACK_TOP(vmthread->stack) == 1);
+    int iszero = (STACK_ENTRY(vmthread->stack, 0)->int_value == 0);
+    if (!stack_ToSize(vmthread->stack,
+                      vmthread->stack->entry_count + 1, 0))
+        return -1;
+    valuecontent *vc = STACK_ENTRY(vmthread->stack, 1);
+    vc->type = H64VALTYPE_BOOL;
+    vc->int_value = iszero;
+    return 1;
+}
+
+START_TEST (test_vmexec_tailcalldepth)
+{
+    h64program *p = h64program_New();
+    ck_assert(p != NULL);
+    int64_t cfid = h64program_RegisterCFunction(
+        p, "iszero", &_cfunc_iszero, NULL, 1, NULL, 0, NULL, NULL, 1, -1
+    );
+    ck_assert(cfid >= 0);
+
+    // func down(n) { if iszero(n) { return n } return down(n - 1) }
+    int64_t fid = h64program_RegisterHorse64Function(
+        p, "down", NULL, 1, NULL, 0, NULL, NULL, -1
+    );
+    ck_assert(fid >= 0);
+    h64func *f = &p->func[fid];
+    f->inner_stack_size = 2;
+    h64instruction_settop inst_st = {0};
+    inst_st.type = H64INST_SETTOP;
+    inst_st.topto = 1;
+    _appendinst(f, &inst_st, sizeof(inst_st));
+    h64instruction_valuecopy inst_vc = {0};
+    inst_vc.type = H64INST_VALUECOPY;
+    inst_vc.slotto = 1;
+    inst_vc.slotfrom = 0;
+    _appendinst(f, &inst_vc, sizeof(inst_vc));
+    h64instruction_callfunc inst_cf = {0};
+    inst_cf.type = H64INST_CALLFUNC;
+    inst_cf.returnto = 1;
+    inst_cf.funcfrom = cfid;
+    inst_cf.posargs = 1;
+    _appendinst(f, &inst_cf, sizeof(inst_cf));
+    h64instruction_condjump inst_cj = {0};
+    inst_cj.type = H64INST_CONDJUMP;
+    inst_cj.conditionalslot = 1;
+    inst_cj.jumpbytesoffset = (
+        sizeof(inst_cj) + sizeof(inst_st) + sizeof(h64instruction_setconst) +
+        sizeof(h64instruction_binop) + sizeof(h64instruction_tailcallfunc)
+    );
+    _appendinst(f, &inst_cj, sizeof(inst_cj));
+    _appendinst(f, &inst_st, sizeof(inst_st));
+    _appendsetint(f, 2, 1);
+    _appendbinop(f, H64OP_MATH_SUBSTRACT, 1, 0, 2);
+    h64instruction_tailcallfunc inst_tcf = {0};
+    inst_tcf.type = H64INST_TAILCALLFUNC;
+    inst_tcf.funcfrom = fid;
+    inst_tcf.posargs = 1;
+    _appendinst(f, &inst_tcf, sizeof(inst_tcf));
+    h64instruction_returnvalue inst_rv = {0};
+    inst_rv.type = H64INST_RETURNVALUE;
+    inst_rv.returnslotfrom = 0;
+    _appendinst(f, &inst_rv, sizeof(inst_rv));
+
+    int64_t args_shallow[] = {3};
+    int64_t shallow = _newcaller(p, fid, 1, 0, args_shallow);
+    int64_t args_deep[] = {200000};
+    int64_t deep = _newcaller(p, fid, 1, 0, args_deep);
+    ck_assert(vmexec_PrepareThreadedCode(p));
+
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    vmthread->program = p;
+
+    // Each tail call reuses the frame of down, so the depth seen from
+    // inside the recursion doesn't grow with the count:
+    ck_assert(_runcaller(vmthread, shallow) == 7);
+    int shallowframes = _cfunc_maxframes;
+    int64_t shallowstack = _cfunc_maxstack;
+    ck_assert(shallowframes > 0 && shallowstack > 0);
+    ck_assert(_runcaller(vmthread, deep) == 7);
+    ck_assert(_cfunc_maxframes == shallowframes);
+    ck_assert(_cfunc_maxstack == shallowstack);
+
+    vmthread_Free(vmthread);
+    h64program_Free(p);
+}
+END_TEST
+
+TESTS_MAIN (test_vmexec_quickbinopdivzero, test_vmexec_returnthroughfinally,
+            test_vmexec_getmembercache, test_vmexec_stringlength,
+            test_vmexec_callargwindow, test_vmexec_callkwargs,
+            test_vmexec_tailcallhandlers, test_vmexec_tailcalldepth)
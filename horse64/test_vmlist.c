@@ -0,0 +1,118 @@
+#include <assert.h>
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "gc.h"
+#include "gcvalue.h"
+#include "poolalloc.h"
+#include "stack.h"
+#include "vmexec.h"
+#include "vmlist.h"
+
+#include "testhelpers.h"
+#include "testmain.h"
+
+static h64gcvalue *_newlist(h64vmthread *vmthread, int64_t capacity) {
+    h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+    ck_assert(gcval != NULL);
+    gcval->type = H64GCVALUETYPE_LIST;
+    ck_assert(vmlist_Init(&gcval->list_val, capacity));
+    return gcval;
+}
+
+START_TEST (test_vmlist_growth)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+
+    // A presized list must not grow while filling it:
+    h64gcvalue *list = _newlist(vmthread, 5);
+    valuecontent *values = list->list_val.values;
+    valuecontent vc = {0};
+    vc.type = H64VALTYPE_INT64;
+    int i = 0;
+    while (i < 5) {
+        vc.int_value = i;
+        ck_assert(vmlist_Add(vmthread, list, &vc));
+        i++;
+    }
+    ck_assert(list->list_val.count == 5);
+    ck_assert(list->list_val.alloc == 5);
+    ck_assert(list->list_val.values == values);
+
+    // Growing is geometric, so only few reallocations happen:
+    h64gcvalue *list2 = _newlist(vmthread, 0);
+    int grows = 0;
+    int64_t lastalloc = 0;
+    i = 0;
+    while (i < 100000) {
+        vc.int_value = i;
+        ck_assert(vmlist_Add(vmthread, list2, &vc));
+        if (list2->list_val.alloc != lastalloc) {
+            lastalloc = list2->list_val.alloc;
+            grows++;
+        }
+        i++;
+    }
+    ck_assert(grows <= 20);
+    ck_assert(list2->list_val.count == 100000);
+    i = 0;
+    while (i < 100000) {
+        ck_assert(list2->list_val.values[i].type == H64VALTYPE_INT64);
+        ck_assert(list2->list_val.values[i].int_value == i);
+        i++;
+    }
+
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+START_TEST (test_vmlist_gc)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    ck_assert(stack_ToSize(vmthread->stack, 1, 0));
+
+    h64gcvalue *list = _newlist(vmthread, 0);
+    STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_GCVAL;
+    STACK_ENTRY(vmthread->stack, 0)->ptr_value = list;
+    unicodechar chars[] = {'e', 'n', 't', 'r', 'y'};
+    int i = 0;
+    while (i < 100) {
+        h64gcvalue *s = gc_AllocValue(vmthread, 0);
+        ck_assert(s != NULL);
+        s->type = H64GCVALUETYPE_STRING;
+        ck_assert(vmstrings_SetFromUTF32(vmthread, &s->str_val, chars, 5));
+        valuecontent vc = {0};
+        vc.type = H64VALTYPE_GCVAL;
+        vc.ptr_value = s;
+        ck_assert(vmlist_Add(vmthread, list, &vc));
+        ck_assert(s->heapreferencecount == 1);
+        i++;
+    }
+
+    // The entries are only referenced by the list, but must survive:
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 101);
+    ck_assert(list->list_val.count == 100);
+
+    // A list in a list, then all of it unreachable:
+    h64gcvalue *outer = _newlist(vmthread, 1);
+    valuecontent vc = {0};
+    vc.type = H64VALTYPE_GCVAL;
+    vc.ptr_value = list;
+    ck_assert(vmlist_Add(vmthread, outer, &vc));
+    STACK_ENTRY(vmthread->stack, 0)->ptr_value = outer;
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 102);
+    STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_NONE;
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 0);
+
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+TESTS_MAIN (test_vmlist_growth, test_vmlist_gc)
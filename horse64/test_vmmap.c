@@ -0,0 +1,202 @@
+#include <assert.h>
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "gc.h"
+#include "gcvalue.h"
+#include "poolalloc.h"
+#include "stack.h"
+#include "vmexec.h"
+#include "vmlist.h"
+#include "vmmap.h"
+
+#include "testhelpers.h"
+#include "testmain.h"
+
+static h64gcvalue *_newmap(
+        h64vmthread *vmthread, int isset, int64_t capacity
+        ) {
+    h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+    ck_assert(gcval != NULL);
+    gcval->type = (isset ? H64GCVALUETYPE_SET : H64GCVALUETYPE_MAP);
+    ck_assert(vmmap_Init(&gcval->map_val, isset, capacity));
+    return gcval;
+}
+
+static h64gcvalue *_newstr(
+        h64vmthread *vmthread, const unicodechar *chars, uint64_t len
+        ) {
+    h64gcvalue *s = gc_AllocValue(vmthread, 0);
+    ck_assert(s != NULL);
+    s->type = H64GCVALUETYPE_STRING;
+    ck_assert(vmstrings_SetFromUTF32(vmthread, &s->str_val, chars, len));
+    return s;
+}
+
+START_TEST (test_vmmap_intkeys)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+
+    h64gcvalue *map = _newmap(vmthread, 0, 0);
+    valuecontent key = {0};
+    valuecontent value = {0};
+    key.type = H64VALTYPE_INT64;
+    value.type = H64VALTYPE_INT64;
+    int64_t i = 0;
+    while (i < 50000) {
+        key.int_value = i * 7;
+        value.int_value = i;
+        ck_assert(vmmap_Put(vmthread, map, &key, &value) == VMMAP_OK);
+        i++;
+    }
+    ck_assert(map->map_val.count == 50000);
+
+    // Overwriting keeps the entry and its place:
+    key.int_value = 7;
+    value.int_value = -1;
+    ck_assert(vmmap_Put(vmthread, map, &key, &value) == VMMAP_OK);
+    ck_assert(map->map_val.count == 50000);
+
+    // Lookups, including floats of the same value, and misses:
+    i = 0;
+    while (i < 50000) {
+        valuecontent *found = NULL;
+        key.type = H64VALTYPE_INT64;
+        key.int_value = i * 7;
+        ck_assert(vmmap_Get(vmthread, map, &key, &found) == VMMAP_OK);
+        ck_assert(found != NULL && found->type == H64VALTYPE_INT64);
+        ck_assert(found->int_value == (i == 1 ? -1 : i));
+        key.type = H64VALTYPE_FLOAT64;
+        key.float_value = (double)(i * 7);
+        ck_assert(vmmap_Get(vmthread, map, &key, &found) == VMMAP_OK);
+        ck_assert(found != NULL);
+        key.float_value = (double)(i * 7) + 0.5;
+        ck_assert(vmmap_Get(vmthread, map, &key, &found) == VMMAP_OK);
+        ck_assert(found == NULL);
+        key.type = H64VALTYPE_INT64;
+        key.int_value = i * 7 + 1;
+        ck_assert(vmmap_Get(vmthread, map, &key, &found) == VMMAP_OK);
+        ck_assert(found == NULL);
+        i++;
+    }
+
+    // Entries stay in insertion order:
+    i = 0;
+    while (i < 50000) {
+        ck_assert(vmmap_KeyAt(map, i)->int_value == i * 7);
+        i++;
+    }
+
+    // A presized set doesn't grow while filling it, and ignores
+    // duplicates:
+    h64gcvalue *set = _newmap(vmthread, 1, 3);
+    char *entries = set->map_val.entries;
+    int32_t *index = set->map_val.index;
+    key.type = H64VALTYPE_INT64;
+    i = 0;
+    while (i < 6) {
+        key.int_value = i % 3;
+        ck_assert(vmmap_Put(vmthread, set, &key, NULL) == VMMAP_OK);
+        i++;
+    }
+    ck_assert(set->map_val.count == 3);
+    ck_assert(set->map_val.entries == entries);
+    ck_assert(set->map_val.index == index);
+
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+START_TEST (test_vmmap_stringkeys)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+    ck_assert(stack_ToSize(vmthread->stack, 1, 0));
+
+    h64gcvalue *map = _newmap(vmthread, 0, 0);
+    STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_GCVAL;
+    STACK_ENTRY(vmthread->stack, 0)->ptr_value = map;
+
+    // A short string key must find the same heap string and back:
+    unicodechar ab[] = {'a', 'b'};
+    h64gcvalue *heapab = _newstr(vmthread, ab, 2);
+    valuecontent key = {0};
+    key.type = H64VALTYPE_GCVAL;
+    key.ptr_value = heapab;
+    valuecontent value = {0};
+    value.type = H64VALTYPE_INT64;
+    value.int_value = 1;
+    ck_assert(vmmap_Put(vmthread, map, &key, &value) == VMMAP_OK);
+    ck_assert(heapab->str_val.hash != 0);  // cached now
+    valuecontent shortkey = {0};
+    shortkey.type = H64VALTYPE_SHORTSTR;
+    shortkey.shortstr_len = 2;
+    shortkey.shortstr_value[0] = 'a';
+    shortkey.shortstr_value[1] = 'b';
+    valuecontent *found = NULL;
+    ck_assert(vmmap_Get(vmthread, map, &shortkey, &found) == VMMAP_OK);
+    ck_assert(found != NULL && found->int_value == 1);
+    shortkey.shortstr_value[1] = 'c';
+    ck_assert(vmmap_Get(vmthread, map, &shortkey, &found) == VMMAP_OK);
+    ck_assert(found == NULL);
+
+    // Equal bytes with another width are another string:
+    unicodechar wide[] = {0x6261};
+    h64gcvalue *heapwide = _newstr(vmthread, wide, 1);
+    key.ptr_value = heapwide;
+    ck_assert(vmmap_Get(vmthread, map, &key, &found) == VMMAP_OK);
+    ck_assert(found == NULL);
+
+    // A long key, and a rope with the same chars:
+    unicodechar longchars[VMSTRINGS_ROPEMINLEN];
+    int i = 0;
+    while (i < VMSTRINGS_ROPEMINLEN) {
+        longchars[i] = 'a' + (i % 26);
+        i++;
+    }
+    h64gcvalue *heaplong = _newstr(
+        vmthread, longchars, VMSTRINGS_ROPEMINLEN
+    );
+    key.ptr_value = heaplong;
+    value.int_value = 2;
+    ck_assert(vmmap_Put(vmthread, map, &key, &value) == VMMAP_OK);
+    h64gcvalue *part1 = _newstr(
+        vmthread, longchars, VMSTRINGS_ROPEMINLEN / 2
+    );
+    h64gcvalue *part2 = _newstr(
+        vmthread, longchars + VMSTRINGS_ROPEMINLEN / 2,
+        VMSTRINGS_ROPEMINLEN / 2
+    );
+    h64gcvalue *rope = gc_AllocValue(vmthread, 0);
+    ck_assert(rope != NULL);
+    rope->type = H64GCVALUETYPE_STRING;
+    ck_assert(vmstrings_Concat(vmthread, rope, part1, part2));
+    ck_assert(rope->str_val.storage == H64STRSTORAGE_ROPE);
+    key.ptr_value = rope;
+    ck_assert(vmmap_Get(vmthread, map, &key, &found) == VMMAP_OK);
+    ck_assert(found != NULL && found->int_value == 2);
+
+    // Mutable values can't be keys:
+    h64gcvalue *list = gc_AllocValue(vmthread, 0);
+    ck_assert(list != NULL);
+    list->type = H64GCVALUETYPE_LIST;
+    ck_assert(vmlist_Init(&list->list_val, 0));
+    key.ptr_value = list;
+    ck_assert(vmmap_Put(vmthread, map, &key, &value) == VMMAP_UNHASHABLE);
+    ck_assert(map->map_val.count == 2);
+
+    // Only the keys held by the map survive:
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 3);
+    STACK_ENTRY(vmthread->stack, 0)->type = H64VALTYPE_NONE;
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 0);
+
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+TESTS_MAIN (test_vmmap_intkeys, test_vmmap_stringkeys)
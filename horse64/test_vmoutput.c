@@ -0,0 +1,119 @@
+
+#include <assert.h>
+#include <check.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unicode.h"
+#include "vmoutput.h"
+#include "vmstrings.h"
+
+#include "testmain.h"
+
+static int _readavailable(int fd, char *buf, int buflen) {
+    int total = 0;
+    while (total < buflen) {
+        ssize_t r = read(fd, buf + total, buflen - total);
+        if (r <= 0)
+            break;
+        total += r;
+    }
+    return total;
+}
+
+START_TEST (test_vmoutput_buffering)
+{
+    int fds[2];
+    ck_assert(pipe(fds) == 0);
+    ck_assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    static char readbuf[VMOUTPUT_BUFSIZE * 4];
+
+    h64vmoutput *out = malloc(sizeof(*out));
+    ck_assert(out != NULL);
+    vmoutput_Init(out, fds[1]);
+    ck_assert(!out->flushonnewline);  // a pipe is no terminal
+
+    // Small writes stay in the buffer, even with a line break:
+    ck_assert(vmoutput_Write(out, "hello\n", 6));
+    ck_assert(_readavailable(fds[0], readbuf, sizeof(readbuf)) == 0);
+    ck_assert(vmoutput_Flush(out));
+    ck_assert(_readavailable(fds[0], readbuf, sizeof(readbuf)) == 6);
+    ck_assert(memcmp(readbuf, "hello\n", 6) == 0);
+
+    // Big writes go out directly, after what is pending:
+    static char big[VMOUTPUT_BUFSIZE * 2];
+    memset(big, 'x', sizeof(big));
+    ck_assert(vmoutput_Write(out, "ab", 2));
+    ck_assert(vmoutput_Write(out, big, sizeof(big)));
+    ck_assert(out->fill == 0);
+    ck_assert(_readavailable(fds[0], readbuf, sizeof(readbuf)) ==
+              (int)sizeof(big) + 2);
+    ck_assert(memcmp(readbuf, "ab", 2) == 0);
+    ck_assert(memcmp(readbuf + 2, big, sizeof(big)) == 0);
+
+    // With line buffering, a line break writes everything out:
+    out->flushonnewline = 1;
+    ck_assert(vmoutput_Write(out, "abc", 3));
+    ck_assert(_readavailable(fds[0], readbuf, sizeof(readbuf)) == 0);
+    ck_assert(vmoutput_Write(out, "d\ne", 3));
+    ck_assert(_readavailable(fds[0], readbuf, sizeof(readbuf)) == 6);
+    ck_assert(memcmp(readbuf, "abcd\ne", 6) == 0);
+
+    free(out);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+START_TEST (test_vmoutput_strings)
+{
+    int fds[2];
+    ck_assert(pipe(fds) == 0);
+    ck_assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    static char readbuf[VMOUTPUT_BUFSIZE * 8];
+
+    h64vmoutput *out = malloc(sizeof(*out));
+    ck_assert(out != NULL);
+    vmoutput_Init(out, fds[1]);
+
+    // Strings longer than the buffer, in every char width:
+    uint64_t len = VMOUTPUT_BUFSIZE + 100;
+    unicodechar *chars = malloc(sizeof(*chars) * len);
+    ck_assert(chars != NULL);
+    unicodechar widechar[] = {0xE9, 0x4E2D, 0x1F434};
+    int w = 0;
+    while (w < 3) {
+        uint64_t i = 0;
+        while (i < len) {
+            chars[i] = ((i % 7) == 3 ? widechar[w] : 'a' + (i % 26));
+            i++;
+        }
+        h64stringval sv = {0};
+        ck_assert(vmstrings_SetFromUTF32(NULL, &sv, chars, len));
+        ck_assert(sv.width == (w == 0 ? 1 : (w == 1 ? 2 : 4)));
+        ck_assert(vmoutput_WriteString(out, &sv));
+        ck_assert(vmoutput_Flush(out));
+
+        int64_t expectedlen = 0;
+        char *expected = malloc(len * 4 + 1);
+        ck_assert(expected != NULL);
+        ck_assert(utf32_to_utf8(
+            chars, len, expected, len * 4 + 1, &expectedlen, 1
+        ));
+        ck_assert(_readavailable(fds[0], readbuf, sizeof(readbuf)) ==
+                  expectedlen);
+        ck_assert(memcmp(readbuf, expected, expectedlen) == 0);
+        free(expected);
+        vmstrings_Free(NULL, &sv);
+        w++;
+    }
+    free(chars);
+    free(out);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+TESTS_MAIN (test_vmoutput_buffering, test_vmoutput_strings)
@@ -0,0 +1,201 @@
+#include <assert.h>
+#include <check.h>
+#include <string.h>
+
+#include "gc.h"
+#include "gcvalue.h"
+#include "vmexec.h"
+#include "vmstrings.h"
+
+#include "testmain.h"
+
+static h64gcvalue *_newstring(
+        h64vmthread *vmthread, unicodechar *chars, uint64_t len
+        ) {
+    h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+    ck_assert(gcval != NULL);
+    gcval->type = H64GCVALUETYPE_STRING;
+    ck_assert(vmstrings_SetFromUTF32(
+        vmthread, &gcval->str_val, chars, len
+    ));
+    return gcval;
+}
+
+static h64gcvalue *_concat(
+        h64vmthread *vmthread, h64gcvalue *v1, h64gcvalue *v2
+        ) {
+    h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+    ck_assert(gcval != NULL);
+    gcval->type = H64GCVALUETYPE_STRING;
+    ck_assert(vmstrings_Concat(vmthread, gcval, v1, v2));
+    return gcval;
+}
+
+START_TEST (test_vmstrings_widths)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+
+    unicodechar ascii[] = {'k', 'e', 'y'};
+    unicodechar latin1[] = {'k', 0xE9, 'y'};
+    unicodechar ucs2[] = {'k', 0x20AC, 'y'};
+    unicodechar utf32[] = {'k', 0x1F600, 'y'};
+    h64stringval s1, s2, s3, s4;
+    ck_assert(vmstrings_SetFromUTF32(vmthread, &s1, ascii, 3));
+    ck_assert(vmstrings_SetFromUTF32(vmthread, &s2, latin1, 3));
+    ck_assert(vmstrings_SetFromUTF32(vmthread, &s3, ucs2, 3));
+    ck_assert(vmstrings_SetFromUTF32(vmthread, &s4, utf32, 3));
+    ck_assert(s1.width == 1 && s1.isascii);
+    ck_assert(s2.width == 1 && !s2.isascii);
+    ck_assert(s3.width == 2);
+    ck_assert(s4.width == 4);
+    ck_assert(vmstrings_CharAt(&s2, 1) == 0xE9);
+    ck_assert(vmstrings_CharAt(&s3, 1) == 0x20AC);
+    ck_assert(vmstrings_CharAt(&s4, 1) == 0x1F600);
+    ck_assert(vmstrings_CharAt(&s4, 2) == 'y');
+
+    // Equality:
+    h64stringval s5;
+    ck_assert(vmstrings_SetFromUTF32(vmthread, &s5, ascii, 3));
+    ck_assert(vmstrings_Equal(&s1, &s5));
+    ck_assert(!vmstrings_Equal(&s1, &s2));
+    ck_assert(!vmstrings_Equal(&s3, &s4));
+
+    // Concatenation widens to the wider side:
+    h64gcvalue *g1 = _newstring(vmthread, ascii, 3);
+    h64gcvalue *g2 = _newstring(vmthread, latin1, 3);
+    h64gcvalue *g4 = _newstring(vmthread, utf32, 3);
+    h64gcvalue *c1 = _concat(vmthread, g1, g1);
+    ck_assert(c1->str_val.width == 1 && c1->str_val.isascii &&
+              c1->str_val.len == 6);
+    ck_assert(memcmp(c1->str_val.s, "keykey", 6) == 0);
+    h64gcvalue *c2 = _concat(vmthread, g2, g4);
+    ck_assert(c2->str_val.width == 4 && !c2->str_val.isascii &&
+              c2->str_val.len == 6);
+    ck_assert(vmstrings_CharAt(&c2->str_val, 1) == 0xE9);
+    ck_assert(vmstrings_CharAt(&c2->str_val, 4) == 0x1F600);
+
+    vmstrings_Free(vmthread, &s1);
+    vmstrings_Free(vmthread, &s2);
+    vmstrings_Free(vmthread, &s3);
+    vmstrings_Free(vmthread, &s4);
+    vmstrings_Free(vmthread, &s5);
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+START_TEST (test_vmstrings_append)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+
+    // Appending repeatedly reuses the same buffer most of the time,
+    // while every earlier string keeps its own contents:
+    unicodechar a[] = {'a'};
+    unicodechar b[] = {'b'};
+    h64gcvalue *ga = _newstring(vmthread, a, 1);
+    h64gcvalue *gb = _newstring(vmthread, b, 1);
+    h64gcvalue *s = _concat(vmthread, ga, ga);
+    h64gcvalue *first = s;
+    int buffers = 1;
+    int i = 0;
+    while (i < 10000) {
+        h64gcvalue *next = _concat(vmthread, s, ga);
+        if (next->str_val.buf != s->str_val.buf)
+            buffers++;
+        s = next;
+        i++;
+    }
+    ck_assert(s->str_val.len == 10002);
+    ck_assert(buffers < 20);
+    ck_assert(first->str_val.len == 2);
+
+    // Appending to a string that isn't the newest in its buffer must
+    // not change the newer one:
+    h64gcvalue *s2 = _concat(vmthread, first, gb);
+    ck_assert(s2->str_val.len == 3 &&
+              vmstrings_CharAt(&s2->str_val, 2) == 'b');
+    ck_assert(vmstrings_CharAt(&s->str_val, 2) == 'a');
+
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+START_TEST (test_vmstrings_rope)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+
+    // Prepending repeatedly makes a deep rope, which must flatten
+    // without recursing:
+    unicodechar a[] = {'a'};
+    unicodechar b[] = {0x20AC};
+    unicodechar big[VMSTRINGS_ROPEMINLEN];
+    int i = 0;
+    while (i < VMSTRINGS_ROPEMINLEN) {
+        big[i] = 'x';
+        i++;
+    }
+    h64gcvalue *ga = _newstring(vmthread, a, 1);
+    h64gcvalue *gb = _newstring(vmthread, b, 1);
+    h64gcvalue *s = _newstring(vmthread, big, VMSTRINGS_ROPEMINLEN);
+    h64gcvalue *prev = NULL;
+    i = 0;
+    while (i < 100000) {
+        prev = s;
+        s = _concat(vmthread, (i % 2 == 0 ? ga : gb), s);
+        ck_assert(s->str_val.storage == H64STRSTORAGE_ROPE);
+        i++;
+    }
+    ck_assert(s->str_val.width == 2 && !s->str_val.isascii);
+    ck_assert(vmstrings_Flatten(vmthread, &s->str_val));
+    ck_assert(s->str_val.storage == H64STRSTORAGE_SHAREDBUF);
+    ck_assert(s->str_val.len == 100000 + VMSTRINGS_ROPEMINLEN);
+    ck_assert(vmstrings_CharAt(&s->str_val, 0) == 0x20AC);
+    ck_assert(vmstrings_CharAt(&s->str_val, 1) == 'a');
+    ck_assert(vmstrings_CharAt(&s->str_val, 100000) == 'x');
+
+    // The parts are no longer referenced by the flattened string:
+    ck_assert(prev->heapreferencecount == 0);
+
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+START_TEST (test_vmstrings_sizeclasses)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+
+    // Each length must land in the smallest class that fits it, and
+    // freeing must return it to that same class:
+    uint64_t lens[] = {0, 1, 16, 17, 40, 200, 512, 513, 5000};
+    int widths[] = {1, 2, 4};
+    int i = 0;
+    while (i < (int)(sizeof(lens) / sizeof(lens[0]))) {
+        int k = 0;
+        while (k < 3) {
+            h64stringval v = {0};
+            ck_assert(vmstrings_Set(vmthread, &v, lens[i], widths[k]));
+            uint64_t bytes = lens[i] * widths[k];
+            if (bytes > VMSTRINGS_MAXPOOLED) {
+                ck_assert(v.sizeclass == VMSTRINGS_LARGECLASS);
+            } else {
+                ck_assert(v.sizeclass < VMSTRINGS_SIZECLASSES);
+                ck_assert((uint64_t)(16 << v.sizeclass) >= bytes);
+                ck_assert(v.sizeclass == 0 ||
+                          (uint64_t)(8 << v.sizeclass) < bytes);
+            }
+            memset(v.s, 'a', bytes);
+            vmstrings_Free(vmthread, &v);
+            k++;
+        }
+        i++;
+    }
+
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+TESTS_MAIN(test_vmstrings_widths, test_vmstrings_append,
+           test_vmstrings_rope, test_vmstrings_sizeclasses)
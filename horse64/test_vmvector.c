@@ -0,0 +1,145 @@
+#include <assert.h>
+#include <check.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler/operator.h"
+#include "gc.h"
+#include "gcvalue.h"
+#include "poolalloc.h"
+#include "vmexec.h"
+#include "vmvector.h"
+
+#include "testhelpers.h"
+#include "testmain.h"
+
+#define TESTLEN 37
+
+static int _approx(double a, double b) {
+    return fabs(a - b) <= 1e-9 * (fabs(a) + fabs(b) + 1);
+}
+
+START_TEST (test_vmvector_simd)
+{
+    double a[TESTLEN], b[TESTLEN];
+    double expected[TESTLEN], out[TESTLEN];
+    int i = 0;
+    while (i < TESTLEN) {
+        a[i] = (i * 37 % 11) - 4.5;
+        b[i] = (i * 13 % 7) + 0.25;  // (never zero)
+        i++;
+    }
+    int ops[] = {H64OP_MATH_ADD, H64OP_MATH_SUBSTRACT,
+                 H64OP_MATH_MULTIPLY, H64OP_MATH_DIVIDE};
+    int maxlevel = vmvector_GetSIMDLevel();
+
+    // Every level must compute the same as the plain scalar code,
+    // for every length, with either side being a scalar:
+    int len = 0;
+    while (len <= TESTLEN) {
+        int k = 0;
+        while (k < 4) {
+            int shape = 0;
+            while (shape < 3) {
+                int ainc = (shape != 1);
+                int binc = (shape != 2);
+                vmvector_LimitSIMDLevel(VMVECTOR_SIMD_NONE);
+                vmvector_Arith(ops[k], a, ainc, b, binc, expected, len);
+                i = 0;
+                while (i < len) {
+                    double x = a[ainc ? i : 0];
+                    double y = b[binc ? i : 0];
+                    double r = (k == 0 ? x + y : (k == 1 ? x - y :
+                                (k == 2 ? x * y : x / y)));
+                    ck_assert(expected[i] == r);
+                    i++;
+                }
+                int level = VMVECTOR_SIMD_SSE2;
+                while (level <= maxlevel) {
+                    vmvector_LimitSIMDLevel(level);
+                    memset(out, 0, sizeof(out));
+                    vmvector_Arith(ops[k], a, ainc, b, binc, out, len);
+                    ck_assert(memcmp(out, expected,
+                                     sizeof(*out) * len) == 0);
+                    level++;
+                }
+                shape++;
+            }
+            k++;
+        }
+
+        vmvector_LimitSIMDLevel(VMVECTOR_SIMD_NONE);
+        double sum = vmvector_Sum(a, len);
+        double dot = vmvector_Dot(a, b, len);
+        double length = vmvector_Length(b, len);
+        double sumexpected = 0;
+        double dotexpected = 0;
+        i = 0;
+        while (i < len) {
+            sumexpected += a[i];
+            dotexpected += a[i] * b[i];
+            i++;
+        }
+        ck_assert(_approx(sum, sumexpected));
+        ck_assert(_approx(dot, dotexpected));
+        ck_assert(_approx(length * length, vmvector_Dot(b, b, len)));
+        int level = VMVECTOR_SIMD_SSE2;
+        while (level <= maxlevel) {
+            vmvector_LimitSIMDLevel(level);
+            ck_assert(_approx(vmvector_Sum(a, len), sum));
+            ck_assert(_approx(vmvector_Dot(a, b, len), dot));
+            ck_assert(_approx(vmvector_Length(b, len), length));
+            level++;
+        }
+        len++;
+    }
+
+    // The result may be written over an operand:
+    vmvector_LimitSIMDLevel(VMVECTOR_SIMD_AVX2);
+    memcpy(out, a, sizeof(out));
+    vmvector_Arith(H64OP_MATH_MULTIPLY, out, 1, out, 1, out, TESTLEN);
+    i = 0;
+    while (i < TESTLEN) {
+        ck_assert(out[i] == a[i] * a[i]);
+        i++;
+    }
+}
+END_TEST
+
+START_TEST (test_vmvector_storage)
+{
+    h64vmthread *vmthread = vmthread_New();
+    ck_assert(vmthread != NULL);
+
+    // Small vectors are inline, bigger ones allocated, all zeroed:
+    int64_t sizes[] = {0, 2, VMVECTOR_MAXINLINE, 100};
+    int k = 0;
+    while (k < 4) {
+        h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+        ck_assert(gcval != NULL);
+        gcval->type = H64GCVALUETYPE_VECTOR;
+        ck_assert(vmvector_Init(&gcval->vector_val, sizes[k]));
+        h64vectorval *v = &gcval->vector_val;
+        ck_assert(v->count == sizes[k]);
+        ck_assert((vmvector_Values(v) == v->inlinevalues) ==
+                  (sizes[k] <= VMVECTOR_MAXINLINE));
+        int64_t i = 0;
+        while (i < sizes[k]) {
+            ck_assert(vmvector_Values(v)[i] == 0);
+            vmvector_Values(v)[i] = i;
+            i++;
+        }
+        k++;
+    }
+    ck_assert(!vmvector_Init(&(h64vectorval){0}, -1));
+
+    // Unreferenced vectors are freed along with their numbers:
+    gc_CollectFull(vmthread);
+    ck_assert(_heapcount(vmthread) == 0);
+
+    vmthread_Free(vmthread);
+}
+END_TEST
+
+TESTS_MAIN (test_vmvector_simd, test_vmvector_storage)
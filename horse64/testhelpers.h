@@ -0,0 +1,112 @@
+#ifndef HORSE64_TESTHELPERS_H_
+#define HORSE64_TESTHELPERS_H_
+
+#include <assert.h>
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "compileconfig.h"
+#include "compiler/ast.h"
+#include "compiler/astparser.h"
+#include "compiler/compileproject.h"
+#include "compiler/main.h"
+#include "compiler/result.h"
+#include "filesys.h"
+#include "poolalloc.h"
+#include "vfs.h"
+#include "vmexec.h"
+
+// Compiles the given code as the main file of a project in a fresh
+// folder, and returns the project for the caller to free:
+static h64compileproject *_testcompile(const char *code) {
+    vfs_Init(NULL);
+    char folder[64];
+    snprintf(folder, sizeof(folder) - 1, ".testdata-compile-%d",
+             (int)getpid());
+    if (filesys_FileExists(folder)) {
+        ck_assert(filesys_IsDirectory(folder));
+        ck_assert(filesys_RemoveFolder(folder, 1));
+    }
+    ck_assert(filesys_CreateDirectory(folder));
+    char *mainfile = filesys_Join(folder, "mainfile.h64");
+    ck_assert(mainfile != NULL);
+    FILE *f = fopen(mainfile, "wb");
+    ck_assert(f != NULL);
+    ck_assert(fwrite(code, 1, strlen(code), f) == strlen(code));
+    fclose(f);
+
+    h64compileproject *project = compileproject_New(folder);
+    ck_assert(project != NULL);
+    h64misccompileroptions moptions = {0};
+    h64ast *ast = NULL;
+    char *error = NULL;
+    ck_assert(compileproject_GetAST(project, mainfile, &ast, &error));
+    ck_assert(compileproject_CompileAllToBytecode(
+        project, &moptions, mainfile, &error
+    ));
+    ck_assert(error == NULL);
+    ck_assert(ast->resultmsg.success && project->resultmsg->success);
+    free(mainfile);
+    ck_assert(filesys_RemoveFolder(folder, 1));
+    return project;
+}
+
+// Compiles and runs the given code, returning what main returned,
+// or -1 for an uncaught exception:
+static int _testrun(const char *code) {
+    h64compileproject *project = _testcompile(code);
+    h64misccompileroptions moptions = {0};
+    int result = vmexec_ExecuteProgram(project->program, &moptions);
+    compileproject_Free(project);
+    return result;
+}
+
+// Counts the instructions of the given type in the main func:
+static int _testcountinmain(h64program *pr, int type) {
+    assert(pr->main_func_index >= 0);
+    h64func *f = &pr->func[pr->main_func_index];
+    int count = 0;
+    int64_t k = 0;
+    while (k < f->instructions_bytes) {
+        h64instructionany *inst = (
+            (h64instructionany *)(f->instructions + k)
+        );
+        if (inst->type == type)
+            count++;
+        k += (int64_t)h64program_PtrToInstructionSize((char *)inst);
+    }
+    return count;
+}
+
+// Appends the given instruction to the func's code:
+static void _appendinst(h64func *f, void *inst, size_t len) {
+    char *newinstructions = realloc(
+        f->instructions, f->instructions_bytes + len
+    );
+    ck_assert(newinstructions != NULL);
+    f->instructions = newinstructions;
+    memcpy(f->instructions + f->instructions_bytes, inst, len);
+    f->instructions_bytes += len;
+}
+
+static void _countitem(ATTR_UNUSED void *ptr, void *userdata) {
+    (*(int *)userdata)++;
+}
+
+// Counts the items currently allocated from the given pool:
+static int _poolcount(poolalloc *pool) {
+    int count = 0;
+    poolalloc_Walk(pool, &_countitem, &count);
+    return count;
+}
+
+// Counts the values currently on the thread's heap:
+static int _heapcount(h64vmthread *vmthread) {
+    return _poolcount(vmthread->heap);
+}
+
+#endif  // HORSE64_TESTHELPERS_H_
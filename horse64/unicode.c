@@ -14,6 +14,268 @@
 
 #include "unicode.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define UNICODE_X86SIMD 1
+#include <immintrin.h>
+#else
+#define UNICODE_X86SIMD 0
+#endif
+
+// The vectorized paths only handle runs of ASCII, which make up most
+// text. Everything else goes through the scalar code one code point at
+// a time, so both give exactly the same results. Which instruction set
+// is used gets detected at runtime, such that the binary doesn't need
+// to be built for a specific CPU.
+static int unicode_simdlevel = -1;
+static int unicode_simdlimit = UNICODE_SIMD_AVX2;
+
+int unicode_GetSIMDLevel() {
+    if (unicode_simdlevel < 0) {
+        int level = UNICODE_SIMD_NONE;
+        #if UNICODE_X86SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            level = UNICODE_SIMD_AVX2;
+        else if (__builtin_cpu_supports("sse2"))
+            level = UNICODE_SIMD_SSE2;
+        #endif
+        unicode_simdlevel = level;
+    }
+    if (unicode_simdlevel > unicode_simdlimit)
+        return unicode_simdlimit;
+    return unicode_simdlevel;
+}
+
+void unicode_LimitSIMDLevel(int level) {
+    unicode_simdlimit = level;
+}
+
+static int64_t _widenascii_scalar(
+        const uint8_t *in, int64_t len, unicodechar *out
+        ) {
+    int64_t i = 0;
+    while (i + 8 <= len) {
+        uint64_t word;
+        memcpy(&word, in + i, sizeof(word));
+        if ((word & 0x8080808080808080ULL) != 0)
+            break;
+        int k = 0;
+        while (k < 8) {
+            out[i + k] = in[i + k];
+            k++;
+        }
+        i += 8;
+    }
+    return i;
+}
+
+static int64_t _asciiprefix_scalar(const uint8_t *in, int64_t len) {
+    int64_t i = 0;
+    while (i + 8 <= len) {
+        uint64_t word;
+        memcpy(&word, in + i, sizeof(word));
+        if ((word & 0x8080808080808080ULL) != 0)
+            break;
+        i += 8;
+    }
+    while (i < len && in[i] < 0x80)
+        i++;
+    return i;
+}
+
+static int64_t _narrowascii_scalar(
+        const unicodechar *in, int64_t len, uint8_t *out
+        ) {
+    int64_t i = 0;
+    while (i + 4 <= len) {
+        if (((in[i] | in[i + 1] | in[i + 2] | in[i + 3]) &
+                ~(unicodechar)0x7F) != 0)
+            break;
+        out[i] = in[i];
+        out[i + 1] = in[i + 1];
+        out[i + 2] = in[i + 2];
+        out[i + 3] = in[i + 3];
+        i += 4;
+    }
+    return i;
+}
+
+#if UNICODE_X86SIMD
+__attribute__((target("sse2")))
+static int64_t _asciiprefix_sse2(const uint8_t *in, int64_t len) {
+    int64_t i = 0;
+    while (i + 16 <= len) {
+        int mask = _mm_movemask_epi8(
+            _mm_loadu_si128((const __m128i *)(in + i))
+        );
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static int64_t _widenascii_sse2(
+        const uint8_t *in, int64_t len, unicodechar *out
+        ) {
+    const __m128i zero = _mm_setzero_si128();
+    int64_t i = 0;
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        if (_mm_movemask_epi8(v) != 0)
+            break;
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *)(out + i),
+                         _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 4),
+                         _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 8),
+                         _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 12),
+                         _mm_unpackhi_epi16(hi, zero));
+        i += 16;
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static int64_t _narrowascii_sse2(
+        const unicodechar *in, int64_t len, uint8_t *out
+        ) {
+    const __m128i nonascii = _mm_set1_epi32(~0x7F);
+    const __m128i zero = _mm_setzero_si128();
+    int64_t i = 0;
+    while (i + 16 <= len) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + i + 4));
+        __m128i c = _mm_loadu_si128((const __m128i *)(in + i + 8));
+        __m128i d = _mm_loadu_si128((const __m128i *)(in + i + 12));
+        __m128i all = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+                _mm_and_si128(all, nonascii), zero)) != 0xFFFF)
+            break;
+        // (all values are below 128, so saturation never kicks in)
+        __m128i ab = _mm_packs_epi32(a, b);
+        __m128i cd = _mm_packs_epi32(c, d);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(ab, cd));
+        i += 16;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int64_t _asciiprefix_avx2(const uint8_t *in, int64_t len) {
+    int64_t i = 0;
+    while (i + 32 <= len) {
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_loadu_si256((const __m256i *)(in + i))
+        );
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int64_t _widenascii_avx2(
+        const uint8_t *in, int64_t len, unicodechar *out
+        ) {
+    int64_t i = 0;
+    while (i + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        if (_mm256_movemask_epi8(v) != 0)
+            break;
+        int k = 0;
+        while (k < 32) {
+            __m128i b = _mm_loadl_epi64((const __m128i *)(in + i + k));
+            _mm256_storeu_si256((__m256i *)(out + i + k),
+                                _mm256_cvtepu8_epi32(b));
+            k += 8;
+        }
+        i += 32;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int64_t _narrowascii_avx2(
+        const unicodechar *in, int64_t len, uint8_t *out
+        ) {
+    const __m256i nonascii = _mm256_set1_epi32(~0x7F);
+    // The packs work per 128-bit lane, this puts the 4-byte groups
+    // back into order afterwards:
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int64_t i = 0;
+    while (i + 32 <= len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(in + i + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(in + i + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(in + i + 24));
+        __m256i all = _mm256_or_si256(
+            _mm256_or_si256(a, b), _mm256_or_si256(c, d)
+        );
+        if (!_mm256_testz_si256(all, nonascii))
+            break;
+        __m256i ab = _mm256_packs_epi32(a, b);
+        __m256i cd = _mm256_packs_epi32(c, d);
+        __m256i bytes = _mm256_permutevar8x32_epi32(
+            _mm256_packus_epi16(ab, cd), order
+        );
+        _mm256_storeu_si256((__m256i *)(out + i), bytes);
+        i += 32;
+    }
+    return i;
+}
+#endif
+
+static int64_t _asciiprefix(const uint8_t *in, int64_t len) {
+    // Returns the length of the leading run of ASCII:
+    int64_t done = 0;
+    #if UNICODE_X86SIMD
+    int level = unicode_GetSIMDLevel();
+    if (level >= UNICODE_SIMD_AVX2)
+        done = _asciiprefix_avx2(in, len);
+    else if (level >= UNICODE_SIMD_SSE2)
+        done = _asciiprefix_sse2(in, len);
+    if (done < len && in[done] >= 0x80)
+        return done;
+    #endif
+    return done + _asciiprefix_scalar(in + done, len - done);
+}
+
+static int64_t _widenascii(
+        const uint8_t *in, int64_t len, unicodechar *out
+        ) {
+    // Converts a leading run of ASCII, returns how many were done:
+    int64_t done = 0;
+    #if UNICODE_X86SIMD
+    int level = unicode_GetSIMDLevel();
+    if (level >= UNICODE_SIMD_AVX2)
+        done = _widenascii_avx2(in, len, out);
+    else if (level >= UNICODE_SIMD_SSE2)
+        done = _widenascii_sse2(in, len, out);
+    #endif
+    return done + _widenascii_scalar(in + done, len - done, out + done);
+}
+
+static int64_t _narrowascii(
+        const unicodechar *in, int64_t len, uint8_t *out
+        ) {
+    int64_t done = 0;
+    #if UNICODE_X86SIMD
+    int level = unicode_GetSIMDLevel();
+    if (level >= UNICODE_SIMD_AVX2)
+        done = _narrowascii_avx2(in, len, out);
+    else if (level >= UNICODE_SIMD_SSE2)
+        done = _narrowascii_sse2(in, len, out);
+    #endif
+    return done + _narrowascii_scalar(in + done, len - done, out + done);
+}
+
 static int is_utf8_start(uint8_t c) {
     if ((int)(c & 0xE0) == (int)0xC0) {  // 110xxxxx
         return 1;
@@ -39,6 +301,17 @@ int write_codepoint_as_utf8(
         uint64_t codepoint, int surrogateunescape,
         char *out, int outbuflen, int *outlen
         ) {
+    if (surrogateunescape &&
+            codepoint >= 0xDC80ULL + 0x80ULL &&
+            codepoint <= 0xDC80ULL + 0xFFULL) {
+        // An invalid byte that utf8_to_utf32 stored as a surrogate:
+        if (outbuflen < 1) return 0;
+        out[0] = (int)(codepoint - 0xDC80ULL);
+        if (outbuflen >= 2)
+            out[1] = '\0';
+        if (outlen) *outlen = 1;
+        return 1;
+    }
     if (codepoint < 0x80ULL) {
         if (outbuflen < 1) return 0;
         out[0] = (int)codepoint;
@@ -61,7 +334,7 @@ int write_codepoint_as_utf8(
         uint64_t byte2val = (codepoint & 0xFC0ULL) >> 6;
         uint64_t byte1val = (codepoint & 0xF000ULL) >> 12;
         if (outbuflen < 3) return 0;
-        out[0] = (int)(byte1val | 0xC0);
+        out[0] = (int)(byte1val | 0xE0);
         out[1] = (int)(byte2val | 0x80);
         out[2] = (int)(byte3val | 0x80);
         if (outbuflen >= 4)
@@ -74,7 +347,7 @@ int write_codepoint_as_utf8(
         uint64_t byte2val = (codepoint & 0x3F000ULL) >> 12;
         uint64_t byte1val = (codepoint & 0x1C0000ULL) >> 18;
         if (outbuflen < 4) return 0;
-        out[0] = (int)(byte1val | 0xC0);
+        out[0] = (int)(byte1val | 0xF0);
         out[1] = (int)(byte2val | 0x80);
         out[2] = (int)(byte3val | 0x80);
         out[3] = (int)(byte4val | 0x80);
@@ -93,6 +366,11 @@ int get_utf8_codepoint(
         ) {
     if (size < 1)
         return 0;
+    if (*p < 0x80) {  // ASCII, the most common case
+        if (out) *out = (unicodechar)(*p);
+        if (outlen) *outlen = 1;
+        return 1;
+    }
     if (!is_utf8_start(*p)) {
         if (*p > 127)
             return 0;
@@ -166,8 +444,8 @@ int get_utf8_codepoint(
                 (int)(*(p + 4) & 0xC0) == (int)0x80) { // p[4] == 10xxxxxx
             return 0;
         }
-        unicodechar c = (   // 00011111 of first byte
-            (unicodechar)(*p) & (unicodechar)0x1FULL
+        unicodechar c = (   // 00000111 of first byte
+            (unicodechar)(*p) & (unicodechar)0x07ULL
         ) << (unicodechar)18ULL;
         c += (  // 00111111 of second byte
             (unicodechar)(*(p + 1)) & (unicodechar)0x3FULL
@@ -218,9 +496,33 @@ unicodechar *utf8_to_utf32_ex(
         int *was_aborted_invalid,
         int *was_aborted_outofmemory
         ) {
+    if (_asciiprefix((const uint8_t *)input, input_len) == input_len) {
+        // Pure ASCII maps 1:1, so skip the temporary buffer:
+        unicodechar *result = (out_alloc ?
+            out_alloc((input_len + 1) * sizeof(unicodechar), out_alloc_ud) :
+            malloc((input_len + 1) * sizeof(unicodechar)));
+        if (!result) {
+            if (was_aborted_invalid) *was_aborted_invalid = 0;
+            if (was_aborted_outofmemory) *was_aborted_outofmemory = 1;
+            return NULL;
+        }
+        int64_t done = _widenascii(
+            (const uint8_t *)input, input_len, result
+        );
+        while (done < input_len) {
+            result[done] = ((const uint8_t *)input)[done];
+            done++;
+        }
+        result[input_len] = 0;
+        if (was_aborted_invalid) *was_aborted_invalid = 0;
+        if (was_aborted_outofmemory) *was_aborted_outofmemory = 0;
+        if (out_len) *out_len = input_len;
+        return result;
+    }
     int free_temp_buf = 0;
     char *temp_buf = NULL;
-    int64_t temp_buf_len = input_len * sizeof(unicodechar);
+    // (with room for the terminating zero)
+    int64_t temp_buf_len = (input_len + 1) * sizeof(unicodechar);
     if (temp_buf_len < 1024 * 2) {
         temp_buf = alloca(temp_buf_len);
     } else {
@@ -237,6 +539,16 @@ unicodechar *utf8_to_utf32_ex(
     int k = 0;
     int i = 0;
     while (i < input_len) {
+        if (((const uint8_t *)input)[i] < 0x80) {
+            int64_t done = _widenascii(
+                (const uint8_t *)input + i, input_len - i,
+                (unicodechar *)(temp_buf + k * sizeof(unicodechar))
+            );
+            i += done;
+            k += done;
+            if (i >= input_len)
+                break;
+        }
         unicodechar c;
         int cbytes = 0;
         if (!get_utf8_codepoint(
@@ -264,7 +576,7 @@ unicodechar *utf8_to_utf32_ex(
         memcpy((char*)temp_buf + k * sizeof(c), &c, sizeof(c));
         k++;
     }
-    temp_buf[k * sizeof(unicodechar)] = '\0';
+    memset(temp_buf + k * sizeof(unicodechar), 0, sizeof(unicodechar));
     char *result = NULL;
     if (out_alloc) {
         result = out_alloc(
@@ -300,6 +612,22 @@ int utf32_to_utf8(
     uint64_t totallen = 0;
     int64_t i = 0;
     while (i < input_len) {
+        if (*p < 0x80) {
+            int64_t maxdone = input_len - i;
+            if (maxdone > outbuflen)
+                maxdone = outbuflen;
+            int64_t done = _narrowascii(p, maxdone, (uint8_t *)outbuf);
+            p += done;
+            outbuflen -= done;
+            outbuf += done;
+            totallen += done;
+            i += done;
+            if (i >= input_len) {
+                if (outbuflen >= 1)
+                    outbuf[0] = '\0';
+                break;
+            }
+        }
         int inneroutlen = 0;
         if (!write_codepoint_as_utf8(
                 (uint64_t)*p, surrogateunescape,
@@ -9,6 +9,16 @@
 
 typedef uint32_t unicodechar;
 
+// Vectorized code paths for ASCII runs, picked at runtime:
+#define UNICODE_SIMD_NONE 0
+#define UNICODE_SIMD_SSE2 1
+#define UNICODE_SIMD_AVX2 2
+
+int unicode_GetSIMDLevel();
+
+// Use at most the given level, e.g. to compare the code paths:
+void unicode_LimitSIMDLevel(int level);
+
 int is_valid_utf8_char(
     const unsigned char *p, int size
 );
@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <math.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -22,21 +23,72 @@
 #include "poolalloc.h"
 #include "stack.h"
 #include "vmexec.h"
+#include "vmlist.h"
+#include "vmmap.h"
+#include "vmstrings.h"
+#include "vmvector.h"
 
 #define DEBUGVMEXEC
 
+#if H64VM_DIRECTTHREADED
+// Direct-threaded code as prepared by vmexec_PrepareThreadedCode():
+// every instruction is preceded by its handler address, padded such
+// that this address is aligned. 'p' always points at the instruction
+// itself, so the handlers can read it the same way as plain bytecode.
+#define THREADEDINST_HEADERSIZE ((ptrdiff_t)sizeof(void *))
+#define THREADEDINST_SIZE(instsize) ((ptrdiff_t)(\
+    ((THREADEDINST_HEADERSIZE + (ptrdiff_t)(instsize) +\
+      THREADEDINST_HEADERSIZE - 1) / THREADEDINST_HEADERSIZE) *\
+    THREADEDINST_HEADERSIZE))
+#define FUNCCODE(pr, func_id) (\
+    (pr)->func[func_id].threaded_instructions + THREADEDINST_HEADERSIZE)
+#define FUNCCODEEND(pr, func_id) (\
+    (pr)->func[func_id].threaded_instructions +\
+    (pr)->func[func_id].threaded_bytes)
+#define FUNCHANDLERS(pr, func_id) (\
+    (pr)->func[func_id].threaded_exceptionhandlers)
+#define INSTSIZE(insttype) THREADEDINST_SIZE(sizeof(insttype))
+#define DISPATCH() goto **(void **)(p - THREADEDINST_HEADERSIZE)
+#else
+#define FUNCCODE(pr, func_id) ((pr)->func[func_id].instructions)
+#define FUNCCODEEND(pr, func_id) (\
+    (pr)->func[func_id].instructions +\
+    (pr)->func[func_id].instructions_bytes)
+#define FUNCHANDLERS(pr, func_id) ((pr)->func[func_id].exceptionhandlers)
+#define INSTSIZE(insttype) ((ptrdiff_t)sizeof(insttype))
+#define DISPATCH() goto *jumptable[((h64instructionany *)p)->type]
+#endif
+
+static void **vmexec_handlers = NULL;
+
+// Change the instruction at 'p' in place, e.g. when quickening:
+#if H64VM_DIRECTTHREADED
+#define REWRITEINST(newtype, newhandler) \
+    {\
+    ((h64instructionany *)p)->type = newtype;\
+    *(void **)(p - THREADEDINST_HEADERSIZE) = (newhandler);\
+    }
+#else
+#define REWRITEINST(newtype, newhandler) \
+    {\
+    ((h64instructionany *)p)->type = newtype;\
+    }
+#endif
+
 
 h64vmthread *vmthread_New() {
     h64vmthread *vmthread = malloc(sizeof(*vmthread));
     if (!vmthread)
         return NULL;
     memset(vmthread, 0, sizeof(*vmthread));
+    vmoutput_Init(&vmthread->output, 1);
 
     vmthread->heap = poolalloc_New(sizeof(h64gcvalue));
     if (!vmthread->heap) {
         vmthread_Free(vmthread);
         return NULL;
     }
+    gc_Init(vmthread);
 
     vmthread->stack = stack_New();
     if (!vmthread->stack) {
@@ -44,6 +96,15 @@ h64vmthread *vmthread_New() {
         return NULL;
     }
 
+    vmthread->funcframe = malloc(
+        sizeof(*vmthread->funcframe) * FUNCFRAME_ARENA_INITIAL
+    );
+    if (!vmthread->funcframe) {
+        vmthread_Free(vmthread);
+        return NULL;
+    }
+    vmthread->funcframe_alloc = FUNCFRAME_ARENA_INITIAL;
+
     return vmthread;
 }
 
@@ -51,8 +112,12 @@ void vmthread_Free(h64vmthread *vmthread) {
     if (!vmthread)
         return;
 
+    // Don't lose anything printed that wasn't written out yet:
+    vmoutput_Flush(&vmthread->output);
+
     if (vmthread->heap) {
-        // Free items on heap, FIXME
+        // Free items on heap:
+        gc_FreeAll(vmthread);
 
         // Free heap:
         poolalloc_Destroy(vmthread->heap);
@@ -61,9 +126,17 @@ void vmthread_Free(h64vmthread *vmthread) {
         stack_Free(vmthread->stack);
     }
     free(vmthread->funcframe);
-    free(vmthread->exceptionframe);
-    if (vmthread->str_pile) {
-        poolalloc_Destroy(vmthread->str_pile);
+    int k = 0;
+    while (k < vmthread->pendingexception_count) {
+        free(vmthread->pendingexception[k].e.msg);
+        k++;
+    }
+    free(vmthread->pendingexception);
+    int i = 0;
+    while (i < VMSTRINGS_SIZECLASSES) {
+        if (vmthread->str_pile[i])
+            poolalloc_Destroy(vmthread->str_pile[i]);
+        i++;
     }
     free(vmthread);
 }
@@ -108,26 +181,46 @@ static int vmthread_PrintExec(
 }
 #endif
 
+static void vmthread_exceptions_DropPendingOfPoppedFrames(
+        h64vmthread *vt
+        ) {
+    // A function returning or being unrolled from inside a finally block
+    // discards the exception it was going to raise again at the end:
+    while (vt->pendingexception_count > 0 &&
+            vt->pendingexception[vt->pendingexception_count - 1].
+                func_frame_no >= vt->funcframe_count) {
+        free(vt->pendingexception[vt->pendingexception_count - 1].e.msg);
+        vt->pendingexception_count--;
+    }
+}
+
+static void vmthread_exceptions_DropPendingLeftByReturn(
+        h64vmthread *vt, ptrdiff_t offset
+        ) {
+    // A return inside a finally block entered due to an exception may
+    // leave it by jumping into an outer finally block, which discards
+    // the exception just like returning directly would:
+    while (vt->pendingexception_count > 0) {
+        h64vmpendingexception *pending = &vt->pendingexception[
+            vt->pendingexception_count - 1
+        ];
+        if (pending->func_frame_no != vt->funcframe_count - 1 ||
+                (offset >= pending->finally_offset &&
+                 offset <= pending->finally_end))
+            break;
+        free(pending->e.msg);
+        vt->pendingexception_count--;
+    }
+}
+
 static inline void popfuncframe(
         h64vmthread *vt, int dontclearstack
         ) {
     assert(vt->funcframe_count > 0);
-    int64_t new_floor = (
-        vt->funcframe[vt->funcframe_count - 1].stack_bottom
-    );
     int64_t prev_floor = vt->stack->current_func_floor;
-    #ifndef NDEBUG
-    if (!dontclearstack)
-        assert(new_floor <= prev_floor);
-    #endif
-    vt->stack->current_func_floor = new_floor;
-    if (prev_floor < vt->stack->entry_count && !dontclearstack) {
-        int result = stack_ToSize(
-            vt->stack, prev_floor, 0
-        );
-        assert(result != 0);
-    }
     vt->funcframe_count -= 1;
+    if (unlikely(vt->pendingexception_count > 0))
+        vmthread_exceptions_DropPendingOfPoppedFrames(vt);
     #ifndef NDEBUG
     if (vt->moptions.vmexec_debug) {
         fprintf(
@@ -136,14 +229,43 @@ static inline void popfuncframe(
         );
     }
     #endif
-    if (vt->funcframe_count <= 1) {
+    if (vt->funcframe_count <= 0) {
         vt->stack->current_func_floor = 0;
+        return;
+    }
+    h64vmfunctionframe *caller = &vt->funcframe[vt->funcframe_count - 1];
+    vt->stack->current_func_floor = caller->stack_bottom;
+    if (dontclearstack)
+        return;
+
+    // The popped frame may overlap the caller's frame, since the
+    // arguments are passed in place. Clear its part of the caller's
+    // frame, and cut off the part beyond it:
+    int64_t caller_top = (
+        caller->stack_bottom +
+        vt->program->func[caller->func_id].input_stack_size +
+        vt->program->func[caller->func_id].inner_stack_size
+    );
+    assert(prev_floor >= caller->stack_bottom);
+    int64_t prev_top = vt->stack->entry_count;
+    if (prev_top != caller_top) {
+        // (growing back can't fail, the caller's frame fit before)
+        int result = stack_ToSize(
+            vt->stack, caller_top, 1
+        );
+        assert(result != 0);
+    }
+    int64_t i = prev_floor;
+    while (i < caller_top && i < prev_top) {
+        memset(&vt->stack->entry[i], 0, sizeof(vt->stack->entry[i]));
+        i++;
     }
 }
 
 static inline int pushfuncframe(
         h64vmthread *vt, int func_id, int return_slot,
-        int return_to_func_id, ptrdiff_t return_to_execution_offset
+        int return_to_func_id, ptrdiff_t return_to_execution_offset,
+        int64_t new_floor
         ) {
     #ifndef NDEBUG
     if (vt->moptions.vmexec_debug) {
@@ -153,215 +275,460 @@ static inline int pushfuncframe(
         );
     }
     #endif
-    if (vt->funcframe_count + 1 > vt->funcframe_alloc) {
+    if (unlikely(vt->funcframe_count + 1 > vt->funcframe_alloc)) {
+        int new_alloc = vt->funcframe_alloc * 2;
+        if (new_alloc < FUNCFRAME_ARENA_INITIAL)
+            new_alloc = FUNCFRAME_ARENA_INITIAL;
         h64vmfunctionframe *new_funcframe = realloc(
-            vt->funcframe, sizeof(*new_funcframe) *
-            (vt->funcframe_count + 32)
+            vt->funcframe, sizeof(*new_funcframe) * new_alloc
         );
         if (!new_funcframe)
             return 0;
         vt->funcframe = new_funcframe;
-        vt->funcframe_alloc = vt->funcframe_count + 32;
-    }
-    memset(
-        &vt->funcframe[vt->funcframe_count], 0,
-        sizeof(vt->funcframe[vt->funcframe_count])
-    );
-    #ifndef NDEBUG
-    if (vt->funcframe_count > 0) {
-        assert(
-            vt->stack->entry_count -
-            vt->stack->current_func_floor >=
-            vt->program->func[func_id].input_stack_size
-        );
+        vt->funcframe_alloc = new_alloc;
     }
-    #endif
     assert(vt->program != NULL &&
            func_id >= 0 && func_id < vt->program->func_count);
-    int prevtop = vt->stack->entry_count;
-    if (!stack_ToSize(
-            vt->stack,
-            (vt->funcframe_count == 0 ?
-             vt->program->func[func_id].input_stack_size : 0) +
-            vt->program->func[func_id].inner_stack_size, 0
-            )) {
-        return 0;
-    }
-    vt->funcframe[vt->funcframe_count].stack_bottom = (
-        vt->stack->entry_count - (
+    assert(new_floor >= vt->stack->current_func_floor);
+
+    // The arguments are already in place at the new floor, so only grow
+    // the stack if the new frame reaches past the current top:
+    int64_t new_top = (
+        new_floor +
         vt->program->func[func_id].input_stack_size +
-        vt->program->func[func_id].inner_stack_size)
+        vt->program->func[func_id].inner_stack_size
     );
-    vt->funcframe[vt->funcframe_count].func_id = func_id;
-    vt->funcframe[vt->funcframe_count].return_slot = return_slot;
-    vt->funcframe[vt->funcframe_count].
-            return_to_func_id = return_to_func_id;
-    vt->funcframe[vt->funcframe_count].
-            return_to_execution_offset = return_to_execution_offset;
+    if (new_top > vt->stack->entry_count) {
+        if (!stack_ToSize(
+                vt->stack, new_top, 0
+                )) {
+            return 0;
+        }
+    }
+    h64vmfunctionframe *frame = &vt->funcframe[vt->funcframe_count];
+    frame->stack_bottom = new_floor;
+    frame->func_id = func_id;
+    frame->return_slot = return_slot;
+    frame->return_to_func_id = return_to_func_id;
+    frame->return_to_execution_offset = return_to_execution_offset;
     vt->funcframe_count++;
-    vt->stack->current_func_floor = (
-        vt->funcframe[vt->funcframe_count - 1].stack_bottom
-    );
+    vt->stack->current_func_floor = new_floor;
+    return 1;
+}
+
+static inline int vmexec_IsStringValue(valuecontent *vc) {
+    return (vc->type == H64VALTYPE_SHORTSTR ||
+            (vc->type == H64VALTYPE_GCVAL &&
+             ((h64gcvalue *)vc->ptr_value)->type ==
+             H64GCVALUETYPE_STRING));
+}
+
+static inline int vmexec_IsVectorValue(valuecontent *vc) {
+    return (vc->type == H64VALTYPE_GCVAL &&
+            ((h64gcvalue *)vc->ptr_value)->type ==
+            H64GCVALUETYPE_VECTOR);
+}
+
+static void vmexec_ShortStrToStringVal(
+        valuecontent *vc, h64stringval *out,
+        unicodechar *buf
+        ) {
+    // Make a temporary string of a short string's chars, stored in buf
+    // with the canonical width:
+    assert(vc->type == H64VALTYPE_SHORTSTR);
+    unicodechar chars[VALUECONTENT_SHORTSTRLEN + 1];
+    memcpy(chars, vc->shortstr_value, sizeof(chars));
+    int len = vc->shortstr_len;
+    unicodechar maxc = 0;
+    int i = 0;
+    while (i < len) {
+        if (chars[i] > maxc)
+            maxc = chars[i];
+        i++;
+    }
+    memset(out, 0, sizeof(*out));
+    out->storage = H64STRSTORAGE_OWNED;
+    out->s = (char *)buf;
+    out->len = len;
+    out->width = (maxc <= 0xFF ? 1 : (maxc <= 0xFFFF ? 2 : 4));
+    out->isascii = (maxc < 0x80);
+    i = 0;
+    while (i < len) {
+        if (out->width == 1)
+            ((uint8_t *)buf)[i] = chars[i];
+        else if (out->width == 2)
+            ((uint16_t *)buf)[i] = chars[i];
+        else
+            buf[i] = chars[i];
+        i++;
+    }
+}
+
+static int vmexec_StringValuesEqual(
+        h64vmthread *vmthread, valuecontent *v1, valuecontent *v2,
+        int *result
+        ) {
+    // Returns 0 when out of memory, otherwise sets result:
+    unicodechar buf1[VALUECONTENT_SHORTSTRLEN + 1];
+    unicodechar buf2[VALUECONTENT_SHORTSTRLEN + 1];
+    h64stringval short1, short2;
+    h64stringval *str1 = &short1;
+    h64stringval *str2 = &short2;
+    if (v1->type == H64VALTYPE_SHORTSTR)
+        vmexec_ShortStrToStringVal(v1, &short1, buf1);
+    else
+        str1 = &((h64gcvalue *)v1->ptr_value)->str_val;
+    if (v2->type == H64VALTYPE_SHORTSTR)
+        vmexec_ShortStrToStringVal(v2, &short2, buf2);
+    else
+        str2 = &((h64gcvalue *)v2->ptr_value)->str_val;
+    if (str1->len != str2->len) {
+        *result = 0;
+        return 1;
+    }
+    if (!vmstrings_Flatten(vmthread, str1) ||
+            !vmstrings_Flatten(vmthread, str2))
+        return 0;
+    *result = vmstrings_Equal(str1, str2);
     return 1;
 }
 
-static int pushexceptionframe(
-        h64vmthread* vmthread,
-        int64_t catch_instruction_offset,
-        int64_t finally_instruction_offset,
-        int exception_obj_temporary_slot
+static h64gcvalue *vmexec_StringOperand(
+        h64vmthread *vmthread, valuecontent *vc,
+        h64gcvalue *tmp, unicodechar *tmpbuf, int needheapvalue
         ) {
-    int new_alloc = vmthread->exceptionframe_count + 10;
-    if (new_alloc > vmthread->exceptionframe_alloc ||
-            new_alloc < vmthread->exceptionframe_alloc - 20) {
-        h64vmexceptioncatchframe *newframes = realloc(
-            vmthread->exceptionframe,
-            sizeof(*newframes) * new_alloc
-        );
-        if (!newframes && vmthread->exceptionframe_count >
-                vmthread->exceptionframe_alloc) {
-            return 0;
-        }
-        if (newframes) {
-            vmthread->exceptionframe = newframes;
-            vmthread->exceptionframe_alloc = new_alloc;
+    // Get a string value for a concatenation operand. A short string
+    // becomes a temporary string in tmp, or a new heap value if the
+    // result may need to refer to it:
+    if (vc->type == H64VALTYPE_GCVAL)
+        return vc->ptr_value;
+    memset(tmp, 0, sizeof(*tmp));
+    tmp->type = H64GCVALUETYPE_STRING;
+    vmexec_ShortStrToStringVal(vc, &tmp->str_val, tmpbuf);
+    if (!needheapvalue)
+        return tmp;
+    h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+    if (!gcval)
+        return NULL;
+    gcval->type = H64GCVALUETYPE_STRING;
+    if (!vmstrings_Set(
+            vmthread, &gcval->str_val,
+            tmp->str_val.len, tmp->str_val.width)) {
+        gcval->type = H64GCVALUETYPE_INVALID;  // (collector frees it)
+        return NULL;
+    }
+    memcpy(gcval->str_val.s, tmpbuf,
+           tmp->str_val.len * tmp->str_val.width);
+    gcval->str_val.isascii = tmp->str_val.isascii;
+    return gcval;
+}
+
+static int vmexec_ConcatStringValues(
+        h64vmthread *vmthread, valuecontent *result,
+        valuecontent *v1, valuecontent *v2
+        ) {
+    // Returns 0 when out of memory. Allocates, so this must only run
+    // at a point where a GC_SAFEPOINT would be fine:
+    uint64_t len1 = (v1->type == H64VALTYPE_SHORTSTR ?
+        (uint64_t)v1->shortstr_len :
+        ((h64gcvalue *)v1->ptr_value)->str_val.len);
+    uint64_t len2 = (v2->type == H64VALTYPE_SHORTSTR ?
+        (uint64_t)v2->shortstr_len :
+        ((h64gcvalue *)v2->ptr_value)->str_val.len);
+    if (len1 + len2 <= VALUECONTENT_SHORTSTRLEN) {
+        // Fits into a short string, so no allocation needed:
+        unicodechar chars[VALUECONTENT_SHORTSTRLEN + 1] = {0};
+        uint64_t i = 0;
+        while (i < len1 + len2) {
+            valuecontent *from = (i < len1 ? v1 : v2);
+            uint64_t k = (i < len1 ? i : i - len1);
+            if (from->type == H64VALTYPE_SHORTSTR) {
+                unicodechar shortchars[VALUECONTENT_SHORTSTRLEN + 1];
+                memcpy(shortchars, from->shortstr_value,
+                       sizeof(shortchars));
+                chars[i] = shortchars[k];
+            } else {
+                // (too short to be a rope)
+                chars[i] = vmstrings_CharAt(
+                    &((h64gcvalue *)from->ptr_value)->str_val, k
+                );
+            }
+            i++;
         }
+        result->type = H64VALTYPE_SHORTSTR;
+        result->shortstr_len = len1 + len2;
+        memcpy(result->shortstr_value, chars, sizeof(chars));
+        return 1;
     }
-    h64vmexceptioncatchframe *newframe = (
-        &vmthread->exceptionframe[vmthread->exceptionframe_count]
+    int needheapvalues = (len1 + len2 >= VMSTRINGS_ROPEMINLEN);
+    h64gcvalue tmp1, tmp2;
+    unicodechar tmpbuf1[VALUECONTENT_SHORTSTRLEN + 1];
+    unicodechar tmpbuf2[VALUECONTENT_SHORTSTRLEN + 1];
+    h64gcvalue *str1 = vmexec_StringOperand(
+        vmthread, v1, &tmp1, tmpbuf1, needheapvalues
+    );
+    h64gcvalue *str2 = vmexec_StringOperand(
+        vmthread, v2, &tmp2, tmpbuf2, needheapvalues
     );
-    memset(newframe, 0, sizeof(*newframe));
-    newframe->storeddelayedexception.exception_class_id = -1;
-    newframe->catch_instruction_offset = catch_instruction_offset;
-    newframe->finally_instruction_offset = finally_instruction_offset;
-    newframe->exception_obj_temporary_id = exception_obj_temporary_slot;
-    newframe->func_frame_no = vmthread->funcframe_count - 1;
-    vmthread->exceptionframe_count++;
+    if (!str1 || !str2)
+        return 0;
+    h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+    if (!gcval)
+        return 0;
+    gcval->type = H64GCVALUETYPE_STRING;
+    if (!vmstrings_Concat(vmthread, gcval, str1, str2)) {
+        gcval->type = H64GCVALUETYPE_INVALID;  // (collector frees it)
+        return 0;
+    }
+    result->type = H64VALTYPE_GCVAL;
+    result->ptr_value = gcval;
     return 1;
 }
 
-static void popexceptionframe(h64vmthread *vmthread) {
-    assert(vmthread->exceptionframe_count >= 0);
-    if (vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-            ].storeddelayedexception.exception_class_id >= 0) {
-        free(vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-        ].storeddelayedexception.msg);
-    }
-    if (vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-            ].caught_types_more) {
-        assert(vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-            ].caught_types_count > 5);
-        free(vmthread->exceptionframe[
-             vmthread->exceptionframe_count - 1
-             ].caught_types_more);
-    }
-    vmthread->exceptionframe_count--;
+// Slow path of GETMEMBER when the first inline cache entry missed:
+// check the other entries, then do the full class member lookup and
+// remember the result if there is room. Returns the cache entry to use,
+// or NULL if the class has no such member.
+static h64getmembercacheentry *vmexec_GetMemberCacheMiss(
+        h64program *pr, h64instruction_getmember *inst,
+        int32_t classid
+        ) {
+    int i = 1;
+    while (i < inst->cache_fill) {
+        if (inst->cache[i].classid == classid)
+            return &inst->cache[i];
+        i++;
+    }
+    int membervarid = -1;
+    int membermethodidx = -1;
+    h64program_LookupClassMember(
+        pr, classid, inst->nameidx, &membervarid, &membermethodidx
+    );
+    if (membervarid < 0 && membermethodidx < 0)
+        return NULL;
+    h64getmembercacheentry *entry = NULL;
+    if (inst->cache_fill < H64GETMEMBER_CACHE_SIZE) {
+        entry = &inst->cache[inst->cache_fill];
+        inst->cache_fill++;
+    } else {
+        // Megamorphic site, keep the first entries but recycle the last:
+        entry = &inst->cache[H64GETMEMBER_CACHE_SIZE - 1];
+    }
+    entry->classid = classid;
+    entry->membervarid = membervarid;
+    entry->memberfuncid = (
+        membermethodidx >= 0 ?
+        pr->classes[classid].method_func_idx[membermethodidx] : -1
+    );
+    return entry;
+}
+
+static int vmthread_exceptions_ReservePending(h64vmthread *vmthread) {
+    if (vmthread->pendingexception_count + 1 <=
+            vmthread->pendingexception_alloc)
+        return 1;
+    int new_alloc = vmthread->pendingexception_count + 8;
+    h64vmpendingexception *newpending = realloc(
+        vmthread->pendingexception,
+        sizeof(*newpending) * new_alloc
+    );
+    if (!newpending)
+        return 0;
+    vmthread->pendingexception = newpending;
+    vmthread->pendingexception_alloc = new_alloc;
+    return 1;
 }
 
-static void vmthread_exceptions_ProceedToFinally(
-        h64vmthread *vmthread,
-        ATTR_UNUSED int64_t *current_func_id,  // unused in release builds
-        ptrdiff_t *current_exec_offset
+static int vmthread_exceptions_Catches(
+        h64vmthread *vmthread, int frame,
+        h64exceptionhandler *handler, int64_t class_id
         ) {
-    assert(vmthread->exceptionframe_count > 0);
-    assert(vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].triggered_catch);
-    assert(!vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].triggered_finally);
-    assert(vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].finally_instruction_offset >= 0);
-    vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].triggered_finally = 1;
-    assert(vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].func_frame_no == vmthread->funcframe_count - 1);
-    assert(vmthread->funcframe[
-           vmthread->funcframe_count - 1
-           ].func_id ==
-           *current_func_id);
-    *current_exec_offset = vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].finally_instruction_offset;
+    if (handler->catchtypes_count == 0)
+        return 1;
+    h64program *pr = vmthread->program;
+    int i = 0;
+    while (i < handler->catchtypes_count) {
+        h64catchtype *ctype = &handler->catchtypes[i];
+        i++;
+        int64_t catchclass = -1;
+        if (ctype->kind == H64CATCHTYPE_CLASS) {
+            catchclass = ctype->id;
+        } else {
+            // A class stored somewhere, so look at what it is now:
+            valuecontent *vc = NULL;
+            if (ctype->kind == H64CATCHTYPE_GLOBALVAR) {
+                assert(ctype->id >= 0 && ctype->id < pr->globalvar_count);
+                vc = &pr->globalvar[ctype->id].content;
+            } else {
+                assert(ctype->kind == H64CATCHTYPE_STACKSLOT);
+                vc = &vmthread->stack->entry[
+                    vmthread->funcframe[frame].stack_bottom + ctype->id
+                ];
+            }
+            if (vc->type == H64VALTYPE_CLASSREF)
+                catchclass = vc->int_value;
+        }
+        if (catchclass < 0 || catchclass >= pr->classes_count)
+            continue;
+        int64_t c = class_id;
+        int64_t depth = 0;
+        while (c >= 0 && c < pr->classes_count &&
+                depth <= pr->classes_count) {
+            if (c == catchclass)
+                return 1;
+            c = pr->classes[c].base_class_global_id;
+            depth++;
+        }
+    }
+    return 0;
 }
 
-static int vmthread_exceptions_Raise(
-        h64vmthread *vmthread, int64_t class_id,
+static int vmthread_exceptions_Dispatch(
+        h64vmthread *vmthread, h64exceptioninfo *e,
         int64_t *current_func_id, ptrdiff_t *current_exec_offset,
-        int canfailonoom,
+        int funcframesbefore, int canfailonoom,
         int *returneduncaughtexception,
-        h64exceptioninfo *out_uncaughtexception,
-        const char *msg, ...
+        h64exceptioninfo *out_uncaughtexception
         ) {
-    int bubble_up_exception_later = 0;
-    int unroll_to_frame = -1;
-    int exception_to_slot = -1;
-    int jump_to_finally = 0;
+    // Returns 0 only if out of memory, in which case nothing changed
+    // and e still owns its message.
+    h64program *pr = vmthread->program;
     if (returneduncaughtexception) *returneduncaughtexception = 0;
-
-    // Figure out from top-most catch frame what to do:
-    while (1) {
-        if (vmthread->exceptionframe_count > 0) {
-            // Get to which function frame we should unroll:
-            unroll_to_frame = vmthread->exceptionframe[
-                vmthread->exceptionframe_count - 1
-            ].func_frame_no;
-            exception_to_slot = vmthread->exceptionframe[
-                vmthread->exceptionframe_count - 1
-            ].exception_obj_temporary_id;
-            if (vmthread->exceptionframe[
-                    vmthread->exceptionframe_count - 1
-                    ].triggered_catch ||
-                    vmthread->exceptionframe[
-                        vmthread->exceptionframe_count - 1
-                    ].catch_instruction_offset < 0) {
-                // Wait, we ran into 'catch' already.
-                // But what about finally?
-                if (!vmthread->exceptionframe[
-                        vmthread->exceptionframe_count - 1
-                        ].triggered_finally) {
-                    // No finally yet. -> enter, but
-                    // bubble up exception later.
-                    bubble_up_exception_later = 1;
-                    exception_to_slot = -1;
-                    jump_to_finally = 1;
-                    break;  // done setting up, resume past loop
-                } else {
-                    // Finally was also entered, so we
-                    // failed while running it.
-                    //  -> this catch frame must be ignored
-                    bubble_up_exception_later = 0;
-                    unroll_to_frame = -1;
-                    exception_to_slot = -1;
-                    popexceptionframe(vmthread);
-                    continue;  // try next catch frame instead
-                }
+    assert(e->exception_class_id >= 0);
+
+    // Find the innermost handler in the functions' exception tables,
+    // going from the raising function out through its callers. The
+    // return offset of a caller is right past its call, so we look
+    // one byte before that:
+    h64exceptionhandler *handler = NULL;
+    int docatch = 0;
+    int frame = vmthread->funcframe_count - 1;
+    ptrdiff_t offset = *current_exec_offset;
+    while (frame >= funcframesbefore && frame >= 0) {
+        int64_t func_id = vmthread->funcframe[frame].func_id;
+        h64exceptionhandler *handlers = FUNCHANDLERS(pr, func_id);
+        int i = 0;
+        while (i < pr->func[func_id].exceptionhandlers_count) {
+            h64exceptionhandler *h = &handlers[i];
+            i++;
+            if (offset < h->try_start || offset >= h->try_end)
+                continue;
+            if (h->catch_offset >= 0 && vmthread_exceptions_Catches(
+                    vmthread, frame, h, e->exception_class_id)) {
+                handler = h;
+                docatch = 1;
+                break;
+            }
+            if (h->finally_offset >= 0) {
+                handler = h;
+                break;
             }
         }
-        break;
+        if (handler)
+            break;
+        offset = vmthread->funcframe[frame].return_to_execution_offset - 1;
+        frame--;
+    }
+
+    // If this is a final, uncaught exception, bail out here:
+    if (!handler) {
+        assert(out_uncaughtexception != NULL);
+        if (returneduncaughtexception) *returneduncaughtexception = 1;
+        memcpy(out_uncaughtexception, e, sizeof(*e));
+        return 1;
+    }
+
+    // Get what we need before changing anything:
+    h64exceptioninfo *einfo = NULL;
+    if (docatch && handler->slotexceptionto >= 0) {
+        einfo = malloc(sizeof(*einfo));
+        if (!einfo && canfailonoom)
+            return 0;
+    } else if (!docatch) {
+        if (!vmthread_exceptions_ReservePending(vmthread) &&
+                canfailonoom)
+            return 0;
     }
-    if (unroll_to_frame < 0) {
-        unroll_to_frame = vmthread->funcframe_count - 1;
+    ptrdiff_t target = (
+        docatch ? handler->catch_offset : handler->finally_offset
+    );
+
+    // Unroll to the handler's function:
+    while (vmthread->funcframe_count - 1 > frame)
+        popfuncframe(vmthread, 0);
+
+    // If we were running a finally block that was entered due to an
+    // exception, and we're now leaving it, that exception is replaced.
+    // (Same if we already left it earlier by a return going through
+    // an outer finally block.)
+    while (vmthread->pendingexception_count > 0) {
+        h64vmpendingexception *pending = &vmthread->pendingexception[
+            vmthread->pendingexception_count - 1
+        ];
+        if (pending->func_frame_no != frame ||
+                (offset >= pending->finally_offset &&
+                 offset <= pending->finally_end &&
+                 target >= pending->finally_offset &&
+                 target <= pending->finally_end))
+            break;
+        free(pending->e.msg);
+        vmthread->pendingexception_count--;
+    }
+
+    *current_func_id = vmthread->funcframe[frame].func_id;
+    *current_exec_offset = target;
+    if (docatch) {
+        // Write out exception to stack slot if needed:
+        if (handler->slotexceptionto >= 0) {
+            valuecontent *vc = STACK_ENTRY(
+                vmthread->stack, handler->slotexceptionto
+            );
+            memset(vc, 0, sizeof(*vc));
+            vc->type = H64VALTYPE_NONE;
+            if (einfo) {
+                vc->type = H64VALTYPE_EXCEPTION;
+                vc->exception_class_id = e->exception_class_id;
+                vc->einfo = einfo;
+                memcpy(vc->einfo, e, sizeof(*e));
+            }
+        }
+        if (!einfo)
+            free(e->msg);
+    } else if (vmthread->pendingexception_count + 1 <=
+               vmthread->pendingexception_alloc) {
+        // Keep the exception around until the finally block ends:
+        h64vmpendingexception *pending = &vmthread->pendingexception[
+            vmthread->pendingexception_count
+        ];
+        pending->func_frame_no = frame;
+        pending->finally_offset = handler->finally_offset;
+        pending->finally_end = handler->finally_end;
+        memcpy(&pending->e, e, sizeof(*e));
+        vmthread->pendingexception_count++;
+    } else {
+        free(e->msg);  // out of memory, so it is lost
     }
+    return 1;
+}
+
+static int vmthread_exceptions_Raise(
+        h64vmthread *vmthread, int64_t class_id,
+        int64_t *current_func_id, ptrdiff_t *current_exec_offset,
+        int funcframesbefore, int canfailonoom,
+        int *returneduncaughtexception,
+        h64exceptioninfo *out_uncaughtexception,
+        const char *msg, ...
+        ) {
+    if (returneduncaughtexception) *returneduncaughtexception = 0;
 
     // Combine error info:
-    int buflen = strlen(msg) * 4;
-    if (buflen < 2048) buflen = 2048;
     char *buf = NULL;
-    if ((exception_to_slot >= 0 || unroll_to_frame < 0) &&
-            !bubble_up_exception_later && msg) {
+    if (msg) {
+        int buflen = strlen(msg) * 4;
+        if (buflen < 2048) buflen = 2048;
         buf = malloc(buflen);
-        if (!buf && canfailonoom) {
-            *returneduncaughtexception = 0;
+        if (!buf && canfailonoom)
             return 0;
-        }
         if (buf) {
             va_list args;
             va_start(args, msg);
@@ -375,193 +742,72 @@ static int vmthread_exceptions_Raise(
     e.msg = buf;
 
     // Extract backtrace:
-    int k = 1;
     if (MAX_EXCEPTION_STACK_FRAMES >= 1) {
         e.stack_frame_funcid[0] = *current_func_id;
         e.stack_frame_byteoffset[0] = *current_exec_offset;
     }
-    assert(unroll_to_frame < vmthread->funcframe_count);
+    int k = 1;
     int i = vmthread->funcframe_count - 1;
-    while (i > unroll_to_frame && i >= 0) {
-        if (k < MAX_EXCEPTION_STACK_FRAMES) {
-            e.stack_frame_funcid[k] = (
-                vmthread->funcframe[i].return_to_func_id
-            );
-            e.stack_frame_byteoffset[k] = (
-                vmthread->funcframe[i].return_to_execution_offset
-            );
-        }
-        popfuncframe(vmthread, 0);
+    while (i > funcframesbefore && k < MAX_EXCEPTION_STACK_FRAMES) {
+        e.stack_frame_funcid[k] = (
+            vmthread->funcframe[i].return_to_func_id
+        );
+        e.stack_frame_byteoffset[k] = (
+            vmthread->funcframe[i].return_to_execution_offset
+        );
         k++;
         i--;
     }
 
-    // If this is a final, uncaught exception, bail out here:
-    if (vmthread->exceptionframe_count <= 0 &&
-            !bubble_up_exception_later) {
-        assert(e.exception_class_id >= 0);
-        if (returneduncaughtexception) *returneduncaughtexception = 1;
-        if (out_uncaughtexception) {
-            memcpy(out_uncaughtexception, &e, sizeof(e));
-            assert(out_uncaughtexception->exception_class_id >= 0);
-        } else {
-            if (returneduncaughtexception) *returneduncaughtexception = 0;
-            free(buf);
-            return 0;
-        }
-        return 1;
-    }
-    // Write out exception to stack slot if needed:
-    if (exception_to_slot >= 0 && !bubble_up_exception_later) {
-        valuecontent *vc = STACK_ENTRY(
-            vmthread->stack, exception_to_slot
-        );
-        valuecontent_Free(vc);
-        memset(vc, 0, sizeof(*vc));
-        vc->type = H64VALTYPE_EXCEPTION;
-        vc->exception_class_id = class_id;
-        vc->einfo = malloc(sizeof(e));
-        if (!vc->einfo && canfailonoom) {
-            free(buf);
-            return 0;
-        }
-        memcpy(vc->einfo, &e, sizeof(e));
-    } else {
-        assert(buf == NULL || bubble_up_exception_later);
-    }
-
-    // Set proper execution position:
-    int frameid = vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].func_frame_no;
-    assert(frameid >= 0 && frameid < vmthread->funcframe_count);
-    *current_func_id = vmthread->funcframe[frameid].func_id;
-    int dontpop = 0;  // whether we need to keep the catch frame we used
-    if (vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-            ].catch_instruction_offset >= 0 &&
-            !vmthread->exceptionframe[
-                vmthread->exceptionframe_count - 1
-            ].triggered_catch) {
-        // Go into catch clause.
-        assert(
-            !vmthread->exceptionframe[
-                vmthread->exceptionframe_count - 1
-            ].triggered_catch
-        );
-        *current_exec_offset = vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-        ].catch_instruction_offset;
-        vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-        ].triggered_catch = 1;
-        if (vmthread->exceptionframe[
-                vmthread->exceptionframe_count - 1
-                ].finally_instruction_offset >= 0) {
-            dontpop = 1;  // keep catch frame to run finally later
-        }
-    } else {
-        assert(
-            !vmthread->exceptionframe[
-                vmthread->exceptionframe_count - 1
-            ].triggered_finally
-        );
-        vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-        ].triggered_finally = 1;
-        *current_exec_offset = vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-        ].finally_instruction_offset;
-        if (bubble_up_exception_later) {
-            assert(
-                vmthread->exceptionframe[
-                    vmthread->exceptionframe_count - 1
-                ].storeddelayedexception.exception_class_id < 0
-            );
-            memcpy(
-                &vmthread->exceptionframe[
-                    vmthread->exceptionframe_count - 1
-                ].storeddelayedexception, &e, sizeof(e)
-            );
-            assert(
-                vmthread->exceptionframe[
-                    vmthread->exceptionframe_count - 1
-                ].storeddelayedexception.exception_class_id >= 0
-            );
-        }
+    if (!vmthread_exceptions_Dispatch(
+            vmthread, &e, current_func_id, current_exec_offset,
+            funcframesbefore, canfailonoom,
+            returneduncaughtexception, out_uncaughtexception)) {
+        free(buf);
+        return 0;
     }
-    assert(*current_exec_offset > 0);
-
-    if (!dontpop)
-        popexceptionframe(vmthread);
     return 1;
 }
 
-static void vmthread_exceptions_EndFinally(
+static int vmthread_exceptions_EndFinally(
         h64vmthread *vmthread,
         int64_t *current_func_id, ptrdiff_t *current_exec_offset,
+        int funcframesbefore,
         int *returneduncaughtexception,
         h64exceptioninfo *out_uncaughtexception
         ) {
-    assert(vmthread->exceptionframe_count > 0);
-    assert(vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].triggered_catch);
-    assert(vmthread->exceptionframe[
-        vmthread->exceptionframe_count - 1
-    ].triggered_finally);
-    if (vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-            ].storeddelayedexception.exception_class_id >= 0) {
-        h64exceptioninfo e;
-        memcpy(
-            &e, &vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-            ].storeddelayedexception, sizeof(e)
-        );
-        memset(
-            &vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-            ].storeddelayedexception, 0, sizeof(e)
+    // Returns 1 if an exception was raised again, 0 if the finally
+    // block was entered normally and execution just continues.
+    if (returneduncaughtexception) *returneduncaughtexception = 0;
+    vmthread_exceptions_DropPendingLeftByReturn(
+        vmthread, *current_exec_offset
+    );
+    if (vmthread->pendingexception_count <= 0)
+        return 0;
+    h64vmpendingexception *pending = &vmthread->pendingexception[
+        vmthread->pendingexception_count - 1
+    ];
+    if (pending->func_frame_no != vmthread->funcframe_count - 1 ||
+            pending->finally_end != *current_exec_offset)
+        return 0;
+    h64exceptioninfo e;
+    memcpy(&e, &pending->e, sizeof(e));
+    vmthread->pendingexception_count--;
+    int wasoom = (e.exception_class_id == H64STDERROR_OUTOFMEMORYERROR);
+    if (!vmthread_exceptions_Dispatch(
+            vmthread, &e, current_func_id, current_exec_offset,
+            funcframesbefore, !wasoom,
+            returneduncaughtexception, out_uncaughtexception)) {
+        free(e.msg);
+        int result = vmthread_exceptions_Raise(
+            vmthread, H64STDERROR_OUTOFMEMORYERROR,
+            current_func_id, current_exec_offset,
+            funcframesbefore, 0, returneduncaughtexception,
+            out_uncaughtexception, NULL
         );
-        vmthread->exceptionframe[
-            vmthread->exceptionframe_count - 1
-        ].storeddelayedexception.exception_class_id = -1;
-        popexceptionframe(vmthread);
-        assert(e.exception_class_id >= 0);
-        int wasoom = (e.exception_class_id == H64STDERROR_OUTOFMEMORYERROR);
-        int result = 0;
-        if (e.msg != NULL) {
-            result = vmthread_exceptions_Raise(
-                vmthread, e.exception_class_id,
-                current_func_id, current_exec_offset,
-                !wasoom, returneduncaughtexception,
-                out_uncaughtexception,
-                (e.msg ? "%s" : NULL), e.msg
-            );
-        } else {
-            result = vmthread_exceptions_Raise(
-                vmthread, e.exception_class_id,
-                current_func_id, current_exec_offset,
-                !wasoom, returneduncaughtexception,
-                out_uncaughtexception,
-                NULL
-            );
-        }
-        if (!result) {
-            assert(!wasoom);
-            result = vmthread_exceptions_Raise(
-                vmthread, H64STDERROR_OUTOFMEMORYERROR,
-                current_func_id, current_exec_offset,
-                0, returneduncaughtexception,
-                out_uncaughtexception,
-                NULL
-            );
-            assert(result != 0);
-        }
-    } else {
-        popexceptionframe(vmthread);
+        assert(result != 0);
     }
+    return 1;
 }
 
 #ifdef NDEBUG
@@ -616,7 +862,7 @@ static void vmexec_PrintPostExceptionInfo(
 // (int64_t class_id, const char *msg, ...args for msg's formatters...)
 #define RAISE_EXCEPTION(class_id, ...) \
     {\
-    ptrdiff_t offset = (p - pr->func[func_id].instructions);\
+    ptrdiff_t offset = (p - FUNCCODE(pr, func_id));\
     int returneduncaught = 0; \
     h64exceptioninfo uncaughtexception = {0}; \
     uncaughtexception.exception_class_id = -1; \
@@ -624,12 +870,12 @@ static void vmexec_PrintPostExceptionInfo(
             vmthread->moptions.vmexec_debug) {\
         vmexec_PrintPreExceptionInfo(\
             vmthread, class_id, func_id,\
-            (p - pr->func[func_id].instructions)\
+            (p - FUNCCODE(pr, func_id))\
         );\
     }\
     int raiseresult = vmthread_exceptions_Raise( \
         vmthread, class_id, \
-        &func_id, &offset, \
+        &func_id, &offset, funcframesbefore, \
         (class_id != H64STDERROR_OUTOFMEMORYERROR), \
         &returneduncaught, \
         &uncaughtexception, __VA_ARGS__ \
@@ -639,7 +885,7 @@ static void vmexec_PrintPostExceptionInfo(
         uncaughtexception.exception_class_id = -1; \
         raiseresult = vmthread_exceptions_Raise( \
             vmthread, H64STDERROR_OUTOFMEMORYERROR, \
-            &func_id, &offset, 0, \
+            &func_id, &offset, funcframesbefore, 0, \
             &returneduncaught, \
             &uncaughtexception, "Allocation failure" \
         );\
@@ -662,8 +908,72 @@ static void vmexec_PrintPostExceptionInfo(
             vmthread, class_id, func_id, offset\
         );\
     }\
-    assert(pr->func[func_id].instructions != NULL);\
-    p = (pr->func[func_id].instructions + offset);\
+    assert(FUNCCODE(pr, func_id) != NULL);\
+    p = (FUNCCODE(pr, func_id) + offset);\
+    pend = FUNCCODEEND(pr, func_id);\
+    funcnestdepth = vmthread->funcframe_count - funcframesbefore;\
+    }
+
+#ifndef NDEBUG
+#define QUICKBINOP_PRINTEXEC() \
+    if (vmthread->moptions.vmexec_debug &&\
+            !vmthread_PrintExec((void*)inst)) goto triggeroom;
+#else
+#define QUICKBINOP_PRINTEXEC()
+#endif
+
+// Handler body for a quickened BINOP, specialized for both operands
+// being of type 'valtype'. If the operands don't match, the instruction
+// is turned back into a generic BINOP. If 'slowcase' holds, e.g. for
+// a division by zero, just this run takes the generic path, which must
+// not quicken it again right away:
+#define QUICKBINOP(valtype, valfield, resulttype, resultctype,\
+                   resultfield, slowcase, op) \
+    {\
+    h64instruction_binop *inst = (h64instruction_binop *)p;\
+    valuecontent *v1 = STACK_ENTRY(stack, inst->arg1slotfrom);\
+    valuecontent *v2 = STACK_ENTRY(stack, inst->arg2slotfrom);\
+    if (unlikely(v1->type != valtype || v2->type != valtype)) {\
+        REWRITEINST(H64INST_BINOP, &&inst_binop);\
+        goto inst_binop;\
+    }\
+    if (unlikely(slowcase))\
+        goto binop_unquickened;\
+    QUICKBINOP_PRINTEXEC();\
+    resultctype result = (v1->valfield op v2->valfield);\
+    valuecontent *vresult = STACK_ENTRY(stack, inst->slotto);\
+    vresult->type = resulttype;\
+    vresult->resultfield = result;\
+    p += INSTSIZE(h64instruction_binop);\
+    DISPATCH();\
+    }
+
+// Comparison of two numbers of the same type, for the superinstructions:
+#define NUMCOMPARE(optype, a, b, result) \
+    switch (optype) {\
+    case H64OP_CMP_EQUAL: result = ((a) == (b)); break;\
+    case H64OP_CMP_NOTEQUAL: result = ((a) != (b)); break;\
+    case H64OP_CMP_LARGEROREQUAL: result = ((a) >= (b)); break;\
+    case H64OP_CMP_SMALLEROREQUAL: result = ((a) <= (b)); break;\
+    case H64OP_CMP_LARGER: result = ((a) > (b)); break;\
+    case H64OP_CMP_SMALLER: result = ((a) < (b)); break;\
+    default: result = -1;\
+    }
+
+// Arithmetic on two numbers of the same type, for the superinstructions.
+// Sets 'handled' to 0 for anything not covered, like division:
+#define NUMARITH(optype, a, b, valtype, valfield, vresult, handled) \
+    switch (optype) {\
+    case H64OP_MATH_ADD:\
+        vresult->type = valtype;\
+        vresult->valfield = ((a) + (b)); break;\
+    case H64OP_MATH_SUBSTRACT:\
+        vresult->type = valtype;\
+        vresult->valfield = ((a) - (b)); break;\
+    case H64OP_MATH_MULTIPLY:\
+        vresult->type = valtype;\
+        vresult->valfield = ((a) * (b)); break;\
+    default: handled = 0;\
     }
 
 int _vmthread_RunFunction_NoPopFuncFrames(
@@ -671,6 +981,87 @@ int _vmthread_RunFunction_NoPopFuncFrames(
         int *returneduncaughtexception,
         h64exceptioninfo *einfo
         ) {
+    static void *jumptable[H64INST_TOTAL_COUNT] = {
+        [H64INST_INVALID] = &&inst_invalid,
+        [H64INST_SETCONST] = &&inst_setconst,
+        [H64INST_SETGLOBAL] = &&inst_setglobal,
+        [H64INST_GETGLOBAL] = &&inst_getglobal,
+        [H64INST_GETFUNC] = &&inst_getfunc,
+        [H64INST_GETCLASS] = &&inst_getclass,
+        [H64INST_VALUECOPY] = &&inst_valuecopy,
+        [H64INST_BINOP] = &&inst_binop,
+        [H64INST_UNOP] = &&inst_unop,
+        [H64INST_CALL] = &&inst_call,
+        [H64INST_SETTOP] = &&inst_settop,
+        [H64INST_RETURNVALUE] = &&inst_returnvalue,
+        [H64INST_JUMPTARGET] = &&inst_jumptarget,
+        [H64INST_CONDJUMP] = &&inst_condjump,
+        [H64INST_JUMP] = &&inst_jump,
+        [H64INST_NEWITERATOR] = &&inst_newiterator,
+        [H64INST_ITERATE] = &&inst_iterate,
+        [H64INST_ENDFINALLY] = &&inst_endfinally,
+        [H64INST_GETMEMBER] = &&inst_getmember,
+        [H64INST_NEWLIST] = &&inst_newlist,
+        [H64INST_ADDTOLIST] = &&inst_addtolist,
+        [H64INST_NEWSET] = &&inst_newset,
+        [H64INST_ADDTOSET] = &&inst_addtoset,
+        [H64INST_NEWMAP] = &&inst_newmap,
+        [H64INST_PUTMAP] = &&inst_putmap,
+        [H64INST_NEWVECTOR] = &&inst_newvector,
+        [H64INST_PUTVECTOR] = &&inst_putvector,
+        [H64INST_BINOPCONDJUMP] = &&inst_binopcondjump,
+        [H64INST_BINOPCONST] = &&inst_binopconst,
+        [H64INST_CALLFUNC] = &&inst_callfunc,
+        [H64INST_TAILCALL] = &&inst_tailcall,
+        [H64INST_TAILCALLFUNC] = &&inst_tailcallfunc,
+        [H64INST_BINOPINT] = &&inst_binopint,
+        [H64INST_BINOPFLOAT] = &&inst_binopfloat,
+    };
+    static void *op_jumptable[TOTAL_OP_COUNT] = {
+        [H64OP_MATH_DIVIDE] = &&binop_divide,
+        [H64OP_MATH_ADD] = &&binop_add,
+        [H64OP_MATH_SUBSTRACT] = &&binop_substract,
+        [H64OP_MATH_MULTIPLY] = &&binop_multiply,
+        [H64OP_MATH_MODULO] = &&binop_modulo,
+        [H64OP_CMP_EQUAL] = &&binop_cmp_equal,
+        [H64OP_CMP_NOTEQUAL] = &&binop_cmp_notequal,
+        [H64OP_CMP_LARGEROREQUAL] = &&binop_cmp_largerorequal,
+        [H64OP_CMP_SMALLEROREQUAL] = &&binop_cmp_smallerorequal,
+        [H64OP_CMP_LARGER] = &&binop_cmp_larger,
+        [H64OP_CMP_SMALLER] = &&binop_cmp_smaller,
+        [H64OP_INDEXBYEXPR] = &&binop_indexbyexpr,
+        [H64OP_BOOLCOND_IN] = &&binop_boolcond_in,
+    };
+    static void *binopint_jumptable[TOTAL_OP_COUNT] = {
+        [H64OP_MATH_DIVIDE] = &&binopint_divide,
+        [H64OP_MATH_ADD] = &&binopint_add,
+        [H64OP_MATH_SUBSTRACT] = &&binopint_substract,
+        [H64OP_MATH_MULTIPLY] = &&binopint_multiply,
+        [H64OP_MATH_MODULO] = &&binopint_modulo,
+        [H64OP_CMP_EQUAL] = &&binopint_cmp_equal,
+        [H64OP_CMP_NOTEQUAL] = &&binopint_cmp_notequal,
+        [H64OP_CMP_LARGEROREQUAL] = &&binopint_cmp_largerorequal,
+        [H64OP_CMP_SMALLEROREQUAL] = &&binopint_cmp_smallerorequal,
+        [H64OP_CMP_LARGER] = &&binopint_cmp_larger,
+        [H64OP_CMP_SMALLER] = &&binopint_cmp_smaller,
+    };
+    static void *binopfloat_jumptable[TOTAL_OP_COUNT] = {
+        [H64OP_MATH_ADD] = &&binopfloat_add,
+        [H64OP_MATH_SUBSTRACT] = &&binopfloat_substract,
+        [H64OP_MATH_MULTIPLY] = &&binopfloat_multiply,
+        [H64OP_CMP_EQUAL] = &&binopfloat_cmp_equal,
+        [H64OP_CMP_NOTEQUAL] = &&binopfloat_cmp_notequal,
+        [H64OP_CMP_LARGEROREQUAL] = &&binopfloat_cmp_largerorequal,
+        [H64OP_CMP_SMALLEROREQUAL] = &&binopfloat_cmp_smallerorequal,
+        [H64OP_CMP_LARGER] = &&binopfloat_cmp_larger,
+        [H64OP_CMP_SMALLER] = &&binopfloat_cmp_smaller,
+    };
+    if (!vmthread && !einfo) {
+        // Special call by vmexec_PrepareThreadedCode() which just
+        // wants to know our instruction handler addresses:
+        vmexec_handlers = jumptable;
+        return 1;
+    }
     if (!vmthread || !einfo)
         return 0;
     h64program *pr = vmthread->program;
@@ -685,18 +1076,19 @@ int _vmthread_RunFunction_NoPopFuncFrames(
     #endif
     assert(func_id >= 0 && func_id < pr->func_count);
     assert(!pr->func[func_id].iscfunc);
-    char *p = pr->func[func_id].instructions;
-    char *pend = p + (intptr_t)pr->func[func_id].instructions_bytes;
-    void *jumptable[H64INST_TOTAL_COUNT];
-    void *op_jumptable[TOTAL_OP_COUNT];
-    memset(op_jumptable, 0, sizeof(*op_jumptable) * TOTAL_OP_COUNT);
+    #if H64VM_DIRECTTHREADED
+    assert(pr->func[func_id].threaded_instructions != NULL &&
+           "must run vmexec_PrepareThreadedCode() first");
+    #endif
+    char *p = FUNCCODE(pr, func_id);
+    char *pend = FUNCCODEEND(pr, func_id);
     h64stack *stack = vmthread->stack;
-    poolalloc *heap = vmthread->heap;
     int64_t original_stack_size = (
         stack->entry_count - pr->func[func_id].input_stack_size
     );
     stack->current_func_floor = original_stack_size;
     int funcnestdepth = 0;
+    int funcframesbefore = vmthread->funcframe_count;
     #ifndef NDEBUG
     if (vmthread->moptions.vmexec_debug)
         fprintf(
@@ -706,6 +1098,39 @@ int _vmthread_RunFunction_NoPopFuncFrames(
         );
     #endif
 
+    // Operands for binop_generic, set up by BINOP and the superinstructions
+    // that fall back to it:
+    int binop_optype = H64OP_INVALID;
+    valuecontent *binop_v1 = NULL;
+    valuecontent *binop_v2 = NULL;
+    valuecontent *binop_target = NULL;
+    valuecontent binop_condresult = {0};
+    ptrdiff_t binop_instsize = 0;
+    ptrdiff_t binop_condjumpoffset = 0;  // only for BINOPCONDJUMP
+    // Error flags checked at binop_done, reset by binop_generic. (Kept
+    // out here such that they're initialized on all paths, since the
+    // compiler can't tell which labels the computed gotos may reach.)
+    int invalidtypes = 1;
+    int divisionbyzero = 0;
+    int indexoutofrange = 0;
+    int keynotfound = 0;
+    int unhashable = 0;
+    int sizemismatch = 0;
+
+    // Start of the outgoing argument window as set by SETTOP, and the
+    // operands for call_generic as set up by CALL and CALLFUNC:
+    int call_argslot = 0;
+    int64_t call_funcid = -1;
+    int call_returnto = -1;
+    int call_posargs = 0;
+    int call_kwargs = 0;
+    int call_expandlastposarg = 0;
+    int call_tail = 0;  // set by TAILCALL and TAILCALLFUNC
+    ptrdiff_t call_instsize = 0;
+
+    // Operand for return_generic, already referenced if a GC value:
+    valuecontent return_value = {0};
+
     goto setupinterpreter;
 
     inst_invalid: {
@@ -718,7 +1143,7 @@ int _vmthread_RunFunction_NoPopFuncFrames(
         #endif
         RAISE_EXCEPTION(H64STDERROR_OUTOFMEMORYERROR,
                         "Allocation failure");
-        goto *jumptable[((h64instructionany *)p)->type];
+        DISPATCH();
     }
     inst_setconst: {
         h64instruction_setconst *inst = (h64instruction_setconst *)p;
@@ -732,40 +1157,12 @@ int _vmthread_RunFunction_NoPopFuncFrames(
             stack->current_func_floor &&
             stack->alloc_count >= stack->entry_count
         );
+        // (string literals were made immortal values beforehand)
+        assert(inst->content.type != H64VALTYPE_CONSTPREALLOCSTR);
         valuecontent *vc = STACK_ENTRY(stack, inst->slot);
-        valuecontent_Free(vc);
-        if (inst->content.type == H64VALTYPE_CONSTPREALLOCSTR) {
-            vc->type = H64VALTYPE_GCVAL;
-            vc->ptr_value = poolalloc_malloc(
-                heap, 0
-            );
-            if (!vc->ptr_value)
-                goto triggeroom;
-            h64gcvalue *gcval = (h64gcvalue *)vc->ptr_value;
-            gcval->type = H64GCVALUETYPE_STRING;
-            gcval->heapreferencecount = 0;
-            gcval->externalreferencecount = 1;
-            memset(&gcval->str_val, 0, sizeof(gcval->str_val));
-            if (!vmstrings_Set(
-                    vmthread, &gcval->str_val,
-                    inst->content.constpreallocstr_len)) {
-                poolalloc_free(heap, gcval);
-                vc->ptr_value = NULL;
-                goto triggeroom;
-            }
-            memcpy(
-                gcval->str_val.s, inst->content.constpreallocstr_value,
-                inst->content.constpreallocstr_len * sizeof(unicodechar)
-            );
-        } else {
-            memcpy(vc, &inst->content, sizeof(*vc));
-            if (vc->type == H64VALTYPE_GCVAL)
-                ((h64gcvalue *)vc->ptr_value)->
-                    externalreferencecount = 1;
-        }
-        assert(vc->type != H64VALTYPE_CONSTPREALLOCSTR);
-        p += sizeof(h64instruction_setconst);
-        goto *jumptable[((h64instructionany *)p)->type];
+        memcpy(vc, &inst->content, sizeof(*vc));
+        p += INSTSIZE(h64instruction_setconst);
+        DISPATCH();
     }
     inst_setglobal: {
         fprintf(stderr, "setglobal not implemented\n");
@@ -783,12 +1180,11 @@ int _vmthread_RunFunction_NoPopFuncFrames(
         #endif
 
         valuecontent *vc = STACK_ENTRY(stack, inst->slotto);
-        valuecontent_Free(vc);
         vc->type = H64VALTYPE_CFUNCREF;
         vc->int_value = (int64_t)inst->funcfrom;
 
-        p += sizeof(h64instruction_getfunc);
-        goto *jumptable[((h64instructionany *)p)->type];
+        p += INSTSIZE(h64instruction_getfunc);
+        DISPATCH();
     }
     inst_getclass: {
         h64instruction_getclass *inst = (h64instruction_getclass *)p;
@@ -798,54 +1194,103 @@ int _vmthread_RunFunction_NoPopFuncFrames(
         #endif
 
         valuecontent *vc = STACK_ENTRY(stack, inst->slotto);
-        valuecontent_Free(vc);
         vc->type = H64VALTYPE_CLASSREF;
         vc->int_value = (int64_t)inst->classfrom;
 
-        p += sizeof(h64instruction_getclass);
-        goto *jumptable[((h64instructionany *)p)->type];
+        p += INSTSIZE(h64instruction_getclass);
+        DISPATCH();
     }
     inst_valuecopy: {
-        fprintf(stderr, "valuecopy not implemented\n");
-        return 0;
+        h64instruction_valuecopy *inst = (h64instruction_valuecopy *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        if (likely(inst->slotto != inst->slotfrom)) {
+            valuecontent *vcfrom = STACK_ENTRY(stack, inst->slotfrom);
+            valuecontent *vcto = STACK_ENTRY(stack, inst->slotto);
+            memcpy(vcto, vcfrom, sizeof(*vcto));
+        }
+
+        p += INSTSIZE(h64instruction_valuecopy);
+        DISPATCH();
     }
     inst_binop: {
         h64instruction_binop *inst = (h64instruction_binop *)p;
+
+        // Quickening: if both operands are int or both are float, turn
+        // this into a specialized instruction that skips all the type
+        // checks below. It reverts itself once the operands change.
+        {
+            uint8_t v1type = STACK_ENTRY(stack, inst->arg1slotfrom)->type;
+            uint8_t v2type = STACK_ENTRY(stack, inst->arg2slotfrom)->type;
+            void *quickhandler = NULL;
+            int quickinsttype = H64INST_BINOP;
+            if (v1type == H64VALTYPE_INT64 && v2type == H64VALTYPE_INT64) {
+                quickhandler = binopint_jumptable[inst->optype];
+                quickinsttype = H64INST_BINOPINT;
+            } else if (v1type == H64VALTYPE_FLOAT64 &&
+                    v2type == H64VALTYPE_FLOAT64) {
+                quickhandler = binopfloat_jumptable[inst->optype];
+                quickinsttype = H64INST_BINOPFLOAT;
+            }
+            if (quickhandler) {
+                REWRITEINST(quickinsttype, quickhandler);
+                goto *quickhandler;
+            }
+        }
+        goto binop_unquickened;
+    }
+    binop_unquickened: {
+        h64instruction_binop *inst = (h64instruction_binop *)p;
         #ifndef NDEBUG
         if (vmthread->moptions.vmexec_debug &&
                 !vmthread_PrintExec((void*)inst)) goto triggeroom;
         #endif
 
+        binop_optype = inst->optype;
+        binop_v1 = STACK_ENTRY(stack, inst->arg1slotfrom);
+        binop_v2 = STACK_ENTRY(stack, inst->arg2slotfrom);
+        binop_target = STACK_ENTRY(stack, inst->slotto);
+        binop_instsize = INSTSIZE(h64instruction_binop);
+        binop_condjumpoffset = 0;
+        goto binop_generic;
+    }
+    binop_generic: {
+        invalidtypes = 1;
+        divisionbyzero = 0;
+        indexoutofrange = 0;
+        keynotfound = 0;
+        unhashable = 0;
+        sizemismatch = 0;
         int copyatend = 0;
         valuecontent _tmpresultbuf = {0};
-        valuecontent *tmpresult = STACK_ENTRY(stack, inst->slotto);
-        if (likely(inst->slotto == inst->arg1slotfrom ||
-                inst->slotto == inst->arg2slotfrom)) {
+        valuecontent *tmpresult = binop_target;
+        valuecontent *v1 = binop_v1;
+        valuecontent *v2 = binop_v2;
+        if (likely(tmpresult == v1 || tmpresult == v2)) {
             copyatend = 1;
             tmpresult = &_tmpresultbuf;
         } else {
-            valuecontent_Free(tmpresult);
             memset(tmpresult, 0, sizeof(*tmpresult));
         }
 
-        valuecontent *v1 = STACK_ENTRY(stack, inst->arg1slotfrom);
-        valuecontent *v2 = STACK_ENTRY(stack, inst->arg2slotfrom);
         #ifndef NDEBUG
-        if (!op_jumptable[inst->optype]) {
+        if (!op_jumptable[binop_optype]) {
             fprintf(stderr, "binop %d missing in jump table\n",
-                    inst->optype);
+                    binop_optype);
             return 0;
         }
         #endif
-        int invalidtypes = 1;
-        int divisionbyzero = 0;
-        goto *op_jumptable[inst->optype];
+        goto *op_jumptable[binop_optype];
         binop_divide: {
             if (unlikely((v1->type != H64VALTYPE_INT64 &&
                     v1->type != H64VALTYPE_FLOAT64) ||
                     (v2->type != H64VALTYPE_INT64 &&
                     v2->type != H64VALTYPE_FLOAT64))) {
-                // invalid
+                if (vmexec_IsVectorValue(v1) || vmexec_IsVectorValue(v2))
+                    goto binop_vectorarith;
             } else {
                 invalidtypes = 0;
                 if (v1->type == H64VALTYPE_FLOAT64 ||
@@ -885,18 +1330,16 @@ int _vmthread_RunFunction_NoPopFuncFrames(
                     v1->type != H64VALTYPE_FLOAT64) ||
                     (v2->type != H64VALTYPE_INT64 &&
                     v2->type != H64VALTYPE_FLOAT64))) {
-                // invalid
-            } else if (unlikely((
-                    ((v1->type == H64VALTYPE_GCVAL &&
-                     ((h64gcvalue *)v1->ptr_value)->type ==
-                        H64GCVALUETYPE_STRING) ||
-                     v1->type == H64VALTYPE_SHORTSTR)) &&
-                    ((v2->type == H64VALTYPE_GCVAL &&
-                     ((h64gcvalue *)v2->ptr_value)->type ==
-                        H64GCVALUETYPE_STRING) ||
-                     v2->type == H64VALTYPE_SHORTSTR))) {
-                fprintf(stderr, "string concatenation not implemented\n");
-                return 0;
+                if (vmexec_IsVectorValue(v1) || vmexec_IsVectorValue(v2))
+                    goto binop_vectorarith;
+                if (vmexec_IsStringValue(v1) &&
+                        vmexec_IsStringValue(v2)) {
+                    invalidtypes = 0;
+                    GC_SAFEPOINT(vmthread);
+                    if (!vmexec_ConcatStringValues(
+                            vmthread, tmpresult, v1, v2))
+                        goto triggeroom;
+                }
             } else {
                 invalidtypes = 0;
                 if (v1->type == H64VALTYPE_FLOAT64 ||
@@ -929,7 +1372,8 @@ int _vmthread_RunFunction_NoPopFuncFrames(
                     v1->type != H64VALTYPE_FLOAT64) ||
                     (v2->type != H64VALTYPE_INT64 &&
                     v2->type != H64VALTYPE_FLOAT64))) {
-                // invalid
+                if (vmexec_IsVectorValue(v1) || vmexec_IsVectorValue(v2))
+                    goto binop_vectorarith;
             } else {
                 invalidtypes = 0;
                 if (v1->type == H64VALTYPE_FLOAT64 ||
@@ -962,7 +1406,8 @@ int _vmthread_RunFunction_NoPopFuncFrames(
                     v1->type != H64VALTYPE_FLOAT64) ||
                     (v2->type != H64VALTYPE_INT64 &&
                     v2->type != H64VALTYPE_FLOAT64))) {
-                // invalid
+                if (vmexec_IsVectorValue(v1) || vmexec_IsVectorValue(v2))
+                    goto binop_vectorarith;
             } else {
                 invalidtypes = 0;
                 if (v1->type == H64VALTYPE_FLOAT64 ||
@@ -1052,6 +1497,17 @@ int _vmthread_RunFunction_NoPopFuncFrames(
                     (v2->type != H64VALTYPE_INT64 &&
                     v2->type != H64VALTYPE_FLOAT64))) {
                 // generic case:
+                if (vmexec_IsStringValue(v1) &&
+                        vmexec_IsStringValue(v2)) {
+                    invalidtypes = 0;
+                    int equal = 0;
+                    if (!vmexec_StringValuesEqual(
+                            vmthread, v1, v2, &equal))
+                        goto triggeroom;
+                    tmpresult->type = H64VALTYPE_BOOL;
+                    tmpresult->int_value = equal;
+                    goto binop_done;
+                }
                 fprintf(stderr, "equality case not implemented\n");
                 return 0;
             } else {
@@ -1217,45 +1673,706 @@ int _vmthread_RunFunction_NoPopFuncFrames(
             }
             goto binop_done;
         }
-        binop_done:
-        if (invalidtypes) {
+        binop_indexbyexpr: {
+            if (likely(v1->type == H64VALTYPE_GCVAL &&
+                    ((h64gcvalue *)v1->ptr_value)->type ==
+                        H64GCVALUETYPE_LIST &&
+                    v2->type == H64VALTYPE_INT64)) {
+                invalidtypes = 0;
+                h64listval *l = &((h64gcvalue *)v1->ptr_value)->list_val;
+                // (indexes start at 1)
+                if (unlikely(v2->int_value < 1 ||
+                        v2->int_value > l->count)) {
+                    indexoutofrange = 1;
+                } else {
+                    memcpy(tmpresult, &l->values[v2->int_value - 1],
+                           sizeof(*tmpresult));
+                }
+            } else if (vmexec_IsVectorValue(v1) &&
+                    v2->type == H64VALTYPE_INT64) {
+                invalidtypes = 0;
+                h64vectorval *vec = &((h64gcvalue *)v1->ptr_value)->vector_val;
+                if (unlikely(v2->int_value < 1 ||
+                        v2->int_value > vec->count)) {
+                    indexoutofrange = 1;
+                } else {
+                    tmpresult->type = H64VALTYPE_FLOAT64;
+                    tmpresult->float_value = (
+                        vmvector_Values(vec)[v2->int_value - 1]
+                    );
+                }
+            } else if (v1->type == H64VALTYPE_GCVAL &&
+                    ((h64gcvalue *)v1->ptr_value)->type ==
+                        H64GCVALUETYPE_MAP) {
+                invalidtypes = 0;
+                valuecontent *value = NULL;
+                int result = vmmap_Get(
+                    vmthread, v1->ptr_value, v2, &value
+                );
+                if (unlikely(result == VMMAP_OUTOFMEMORY))
+                    goto triggeroom;
+                if (unlikely(result == VMMAP_UNHASHABLE))
+                    unhashable = 1;
+                else if (unlikely(!value))
+                    keynotfound = 1;
+                else
+                    memcpy(tmpresult, value, sizeof(*tmpresult));
+            }
+            goto binop_done;
+        }
+        binop_vectorarith: {
+            // Elementwise on vectors of the same size, or with a number
+            // applied to every element:
+            const double *a = NULL;
+            const double *b = NULL;
+            int ainc = 1;
+            int binc = 1;
+            int64_t count = -1;
+            double v1no = 0;
+            double v2no = 0;
+            if (vmexec_IsVectorValue(v1)) {
+                h64vectorval *vec = &((h64gcvalue *)v1->ptr_value)->vector_val;
+                a = vmvector_Values(vec);
+                count = vec->count;
+            } else if (v1->type == H64VALTYPE_INT64 ||
+                    v1->type == H64VALTYPE_FLOAT64) {
+                v1no = (v1->type == H64VALTYPE_INT64 ?
+                        (double)v1->int_value : v1->float_value);
+                a = &v1no;
+                ainc = 0;
+            } else {
+                goto binop_done;
+            }
+            if (vmexec_IsVectorValue(v2)) {
+                h64vectorval *vec = &((h64gcvalue *)v2->ptr_value)->vector_val;
+                b = vmvector_Values(vec);
+                if (count >= 0 && count != vec->count) {
+                    invalidtypes = 0;
+                    sizemismatch = 1;
+                    goto binop_done;
+                }
+                count = vec->count;
+            } else if (v2->type == H64VALTYPE_INT64 ||
+                    v2->type == H64VALTYPE_FLOAT64) {
+                v2no = (v2->type == H64VALTYPE_INT64 ?
+                        (double)v2->int_value : v2->float_value);
+                b = &v2no;
+                binc = 0;
+            } else {
+                goto binop_done;
+            }
+            invalidtypes = 0;
+            if (binop_optype == H64OP_MATH_DIVIDE) {
+                int64_t i = 0;
+                while (i < (binc ? count : 1)) {
+                    if (unlikely(b[i] == 0)) {
+                        divisionbyzero = 1;
+                        goto binop_done;
+                    }
+                    i++;
+                }
+            }
+            GC_SAFEPOINT(vmthread);
+            h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+            if (!gcval)
+                goto triggeroom;
+            gcval->type = H64GCVALUETYPE_VECTOR;
+            if (!vmvector_Init(&gcval->vector_val, count)) {
+                gcval->type = H64GCVALUETYPE_INVALID;  // (collector frees it)
+                goto triggeroom;
+            }
+            vmvector_Arith(
+                binop_optype, a, ainc, b, binc,
+                vmvector_Values(&gcval->vector_val), count
+            );
+            tmpresult->type = H64VALTYPE_GCVAL;
+            tmpresult->ptr_value = gcval;
+            goto binop_done;
+        }
+        binop_boolcond_in: {
+            if (v2->type == H64VALTYPE_GCVAL &&
+                    (((h64gcvalue *)v2->ptr_value)->type ==
+                        H64GCVALUETYPE_MAP ||
+                     ((h64gcvalue *)v2->ptr_value)->type ==
+                        H64GCVALUETYPE_SET)) {
+                // For maps, this tests the keys:
+                invalidtypes = 0;
+                valuecontent *value = NULL;
+                int result = vmmap_Get(
+                    vmthread, v2->ptr_value, v1, &value
+                );
+                if (unlikely(result == VMMAP_OUTOFMEMORY))
+                    goto triggeroom;
+                tmpresult->type = H64VALTYPE_BOOL;
+                tmpresult->int_value = (value != NULL);
+                // (unhashable values are never contained)
+            } else if (v2->type == H64VALTYPE_GCVAL &&
+                    ((h64gcvalue *)v2->ptr_value)->type ==
+                        H64GCVALUETYPE_LIST) {
+                invalidtypes = 0;
+                h64listval *l = &((h64gcvalue *)v2->ptr_value)->list_val;
+                int found = 0;
+                int64_t i = 0;
+                while (i < l->count && !found) {
+                    if (!vmmap_KeysEqual(vmthread, &l->values[i], v1,
+                                         &found))
+                        goto triggeroom;
+                    i++;
+                }
+                tmpresult->type = H64VALTYPE_BOOL;
+                tmpresult->int_value = found;
+            }
+            goto binop_done;
+        }
+        binop_done:
+        if (invalidtypes) {
             RAISE_EXCEPTION(
                 H64STDERROR_TYPEERROR,
                 "cannot apply %s operator to given types",
-                operator_OpPrintedAsStr(inst->optype)
+                operator_OpPrintedAsStr(binop_optype)
             );
-            goto *jumptable[((h64instructionany *)p)->type];
+            DISPATCH();
         } else if (divisionbyzero) {
             RAISE_EXCEPTION(
                 H64STDERROR_MATHERROR,
                 "division by zero"
             );
-            goto *jumptable[((h64instructionany *)p)->type];
+            DISPATCH();
+        } else if (indexoutofrange) {
+            RAISE_EXCEPTION(
+                H64STDERROR_INDEXERROR,
+                "index out of range"
+            );
+            DISPATCH();
+        } else if (keynotfound) {
+            RAISE_EXCEPTION(
+                H64STDERROR_INDEXERROR,
+                "key not in map"
+            );
+            DISPATCH();
+        } else if (unhashable) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "value can't be used as key"
+            );
+            DISPATCH();
+        } else if (sizemismatch) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "cannot apply %s operator to vectors of different size",
+                operator_OpPrintedAsStr(binop_optype)
+            );
+            DISPATCH();
         }
         if (copyatend) {
-            valuecontent *target = STACK_ENTRY(stack, inst->slotto);
-            if (target->type == H64VALTYPE_GCVAL) {
-                // prevent actual value from being free'd
-                ((h64gcvalue *)target->ptr_value)->
-                    externalreferencecount++;
-            }
-            valuecontent_Free(target);
+            valuecontent *target = binop_target;
             memcpy(target, tmpresult, sizeof(*tmpresult));
         }
-        p += sizeof(h64instruction_binop);
-        goto *jumptable[((h64instructionany *)p)->type];
+        if (unlikely(binop_condjumpoffset != 0)) {
+            // BINOPCONDJUMP, so jump if the comparison was true:
+            if (binop_target->int_value != 0) {
+                p += binop_condjumpoffset;
+                assert(p >= FUNCCODE(pr, func_id) &&
+                       p < pend);
+                DISPATCH();
+            }
+        }
+        p += binop_instsize;
+        DISPATCH();
+    }
+    inst_binopcondjump: {
+        h64instruction_binopcondjump *inst = (
+            (h64instruction_binopcondjump *)p
+        );
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        valuecontent *v1 = STACK_ENTRY(stack, inst->arg1slotfrom);
+        valuecontent *v2 = STACK_ENTRY(stack, inst->arg2slotfrom);
+        int result = -1;
+        if (likely(v1->type == H64VALTYPE_INT64 &&
+                v2->type == H64VALTYPE_INT64)) {
+            NUMCOMPARE(inst->optype, v1->int_value, v2->int_value, result);
+        } else if (v1->type == H64VALTYPE_FLOAT64 &&
+                v2->type == H64VALTYPE_FLOAT64) {
+            NUMCOMPARE(inst->optype, v1->float_value, v2->float_value,
+                       result);
+        }
+        if (unlikely(result < 0)) {
+            binop_optype = inst->optype;
+            binop_v1 = v1;
+            binop_v2 = v2;
+            binop_target = &binop_condresult;
+            binop_instsize = INSTSIZE(h64instruction_binopcondjump);
+            binop_condjumpoffset = inst->jumpbytesoffset;
+            goto binop_generic;
+        }
+        if (result) {
+            p += (ptrdiff_t)inst->jumpbytesoffset;
+            assert(p >= FUNCCODE(pr, func_id) &&
+                   p < pend);
+            DISPATCH();
+        }
+        p += INSTSIZE(h64instruction_binopcondjump);
+        DISPATCH();
     }
+    inst_binopconst: {
+        h64instruction_binopconst *inst = (
+            (h64instruction_binopconst *)p
+        );
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        // The setconst part, which is never a heap value:
+        valuecontent *v2 = STACK_ENTRY(stack, inst->arg2slotfrom);
+        memcpy(v2, &inst->content, sizeof(*v2));
+
+        valuecontent *v1 = STACK_ENTRY(stack, inst->arg1slotfrom);
+        valuecontent *vresult = STACK_ENTRY(stack, inst->slotto);
+        int handled = 0;
+        if (likely(v1->type == v2->type)) {
+            handled = 1;
+            int result = -1;
+            if (v1->type == H64VALTYPE_INT64) {
+                int64_t a = v1->int_value;
+                int64_t b = v2->int_value;
+                NUMCOMPARE(inst->optype, a, b, result);
+                if (result < 0) {
+                    NUMARITH(inst->optype, a, b, H64VALTYPE_INT64,
+                             int_value, vresult, handled);
+                }
+            } else {
+                double a = v1->float_value;
+                double b = v2->float_value;
+                NUMCOMPARE(inst->optype, a, b, result);
+                if (result < 0) {
+                    NUMARITH(inst->optype, a, b, H64VALTYPE_FLOAT64,
+                             float_value, vresult, handled);
+                }
+            }
+            if (result >= 0) {
+                vresult->type = H64VALTYPE_BOOL;
+                vresult->int_value = result;
+            }
+        }
+        if (unlikely(!handled)) {
+            binop_optype = inst->optype;
+            binop_v1 = v1;
+            binop_v2 = v2;
+            binop_target = vresult;
+            binop_instsize = INSTSIZE(h64instruction_binopconst);
+            binop_condjumpoffset = 0;
+            goto binop_generic;
+        }
+        p += INSTSIZE(h64instruction_binopconst);
+        DISPATCH();
+    }
+    inst_binopint: {
+        // (With threaded code, we directly jump to the right binopint_*
+        // handler instead and never get here.)
+        goto *binopint_jumptable[((h64instruction_binop *)p)->optype];
+    }
+    binopint_divide:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_INT64,
+                   int64_t, int_value, v2->int_value == 0, /)
+    binopint_add:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_INT64,
+                   int64_t, int_value, 0, +)
+    binopint_substract:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_INT64,
+                   int64_t, int_value, 0, -)
+    binopint_multiply:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_INT64,
+                   int64_t, int_value, 0, *)
+    binopint_modulo:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_INT64,
+                   int64_t, int_value, v2->int_value == 0, %)
+    binopint_cmp_equal:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, ==)
+    binopint_cmp_notequal:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, !=)
+    binopint_cmp_largerorequal:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, >=)
+    binopint_cmp_smallerorequal:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, <=)
+    binopint_cmp_larger:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, >)
+    binopint_cmp_smaller:
+        QUICKBINOP(H64VALTYPE_INT64, int_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, <)
+    inst_binopfloat: {
+        goto *binopfloat_jumptable[((h64instruction_binop *)p)->optype];
+    }
+    binopfloat_add:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_FLOAT64,
+                   double, float_value, 0, +)
+    binopfloat_substract:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_FLOAT64,
+                   double, float_value, 0, -)
+    binopfloat_multiply:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_FLOAT64,
+                   double, float_value, 0, *)
+    binopfloat_cmp_equal:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, ==)
+    binopfloat_cmp_notequal:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, !=)
+    binopfloat_cmp_largerorequal:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, >=)
+    binopfloat_cmp_smallerorequal:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, <=)
+    binopfloat_cmp_larger:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, >)
+    binopfloat_cmp_smaller:
+        QUICKBINOP(H64VALTYPE_FLOAT64, float_value, H64VALTYPE_BOOL,
+                   int64_t, int_value, 0, <)
     inst_unop: {
         fprintf(stderr, "unop not implemented\n");
         return 0;
     }
     inst_call: {
-        fprintf(stderr, "call not implemented\n");
-        return 0;
+        h64instruction_call *inst = (h64instruction_call *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        valuecontent *vc = STACK_ENTRY(stack, inst->slotcalledfrom);
+        if (unlikely(vc->type != H64VALTYPE_CFUNCREF &&
+                vc->type != H64VALTYPE_SIMPLEFUNCREF)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "cannot call a value that is not a function"
+            );
+            DISPATCH();
+        }
+        call_funcid = vc->int_value;
+        call_returnto = inst->returnto;
+        call_posargs = inst->posargs;
+        call_kwargs = inst->kwargs;
+        call_expandlastposarg = inst->expandlastposarg;
+        call_tail = 0;
+        call_instsize = INSTSIZE(h64instruction_call);
+        goto call_generic;
+    }
+    inst_callfunc: {
+        h64instruction_callfunc *inst = (h64instruction_callfunc *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        call_funcid = inst->funcfrom;
+        call_returnto = inst->returnto;
+        call_posargs = inst->posargs;
+        call_kwargs = inst->kwargs;
+        call_expandlastposarg = inst->expandlastposarg;
+        call_tail = 0;
+        call_instsize = INSTSIZE(h64instruction_callfunc);
+        goto call_generic;
+    }
+    inst_tailcall: {
+        h64instruction_tailcall *inst = (h64instruction_tailcall *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        valuecontent *vc = STACK_ENTRY(stack, inst->slotcalledfrom);
+        if (unlikely(vc->type != H64VALTYPE_CFUNCREF &&
+                vc->type != H64VALTYPE_SIMPLEFUNCREF)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "cannot call a value that is not a function"
+            );
+            DISPATCH();
+        }
+        call_funcid = vc->int_value;
+        call_returnto = -1;
+        call_posargs = inst->posargs;
+        call_kwargs = inst->kwargs;
+        call_expandlastposarg = inst->expandlastposarg;
+        call_tail = 1;
+        call_instsize = INSTSIZE(h64instruction_tailcall);
+        goto call_generic;
+    }
+    inst_tailcallfunc: {
+        h64instruction_tailcallfunc *inst = (
+            (h64instruction_tailcallfunc *)p
+        );
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        call_funcid = inst->funcfrom;
+        call_returnto = -1;
+        call_posargs = inst->posargs;
+        call_kwargs = inst->kwargs;
+        call_expandlastposarg = inst->expandlastposarg;
+        call_tail = 1;
+        call_instsize = INSTSIZE(h64instruction_tailcallfunc);
+        goto call_generic;
+    }
+    call_generic: {
+        // Calling convention: the arguments were placed by the caller
+        // starting at the slot given by the last SETTOP, and the callee's
+        // frame starts right there. This way, the caller's outgoing
+        // arguments already are the callee's parameters, and nothing
+        // needs to be copied.
+        assert(call_funcid >= 0 && call_funcid < pr->func_count);
+        h64func *f = &pr->func[call_funcid];
+        int64_t argfloor = stack->current_func_floor + call_argslot;
+        int64_t returnslot = (
+            call_returnto >= 0 ?
+            stack->current_func_floor + call_returnto : -1
+        );
+        ptrdiff_t returnoffset = (
+            (p - FUNCCODE(pr, func_id)) + call_instsize
+        );
+        int argcount = call_posargs;
+
+        if (unlikely(call_kwargs > 0 || call_expandlastposarg ||
+                (!f->iscfunc && argcount != f->input_stack_size))) {
+            // Slow path: keyword arguments need to be put into the
+            // callee's parameter order.
+            h64funcsymbol *fsymbol = h64debugsymbols_GetFuncSymbolById(
+                pr->symbols, call_funcid
+            );
+            assert(fsymbol != NULL);
+            if (call_expandlastposarg ||
+                    (!f->iscfunc && (fsymbol->last_arg_is_multiarg ||
+                     fsymbol->has_self_arg ||
+                     fsymbol->closure_bound_count > 0))) {
+                fprintf(stderr, "call with multiarg, self or "
+                        "closure not implemented\n");
+                return 0;
+            }
+            int required_posargs = 0;
+            while (required_posargs < fsymbol->arg_count &&
+                    (fsymbol->arg_kwarg_name == NULL ||
+                     fsymbol->arg_kwarg_name[required_posargs] == NULL))
+                required_posargs++;
+            if (unlikely(call_posargs < required_posargs ||
+                    (call_posargs > fsymbol->arg_count &&
+                     !fsymbol->last_arg_is_multiarg))) {
+                RAISE_EXCEPTION(
+                    H64STDERROR_ARGUMENTERROR,
+                    "called function with %d positional arguments, "
+                    "expected %d", call_posargs, required_posargs
+                );
+                DISPATCH();
+            }
+            argcount = call_posargs;
+            if (argcount < fsymbol->arg_count)
+                argcount = fsymbol->arg_count;
+            int64_t newtop = argfloor + argcount;
+            if (newtop < argfloor + call_posargs + call_kwargs * 2)
+                newtop = argfloor + call_posargs + call_kwargs * 2;
+            if (newtop > stack->entry_count &&
+                    !stack_ToSize(stack, newtop, 0))
+                goto triggeroom;
+
+            // Take the keyword arguments out, and mark all keyword
+            // parameters as unspecified:
+            valuecontent _kwvaluesbuf[16];
+            int64_t _kwnamesbuf[16];
+            valuecontent *kwvalues = _kwvaluesbuf;
+            int64_t *kwnames = _kwnamesbuf;
+            if (call_kwargs > 16) {
+                kwvalues = malloc(sizeof(*kwvalues) * call_kwargs);
+                kwnames = malloc(sizeof(*kwnames) * call_kwargs);
+                if (!kwvalues || !kwnames) {
+                    free(kwvalues); free(kwnames);
+                    goto triggeroom;
+                }
+            }
+            int i = 0;
+            while (i < call_kwargs) {
+                valuecontent *namevc = &stack->entry[
+                    argfloor + call_posargs + i * 2
+                ];
+                assert(namevc->type == H64VALTYPE_INT64);
+                kwnames[i] = namevc->int_value;
+                memcpy(&kwvalues[i], &stack->entry[
+                    argfloor + call_posargs + i * 2 + 1
+                ], sizeof(*kwvalues));
+                memset(namevc, 0, sizeof(*namevc));
+                memset(&stack->entry[
+                    argfloor + call_posargs + i * 2 + 1
+                ], 0, sizeof(*kwvalues));
+                i++;
+            }
+            i = call_posargs;
+            while (i < argcount) {
+                valuecontent *vc = &stack->entry[argfloor + i];
+                memset(vc, 0, sizeof(*vc));
+                vc->type = H64VALTYPE_UNSPECIFIED_KWARG;
+                i++;
+            }
+
+            // Put them into the slots of the parameters they name:
+            int unknownkwarg = 0;
+            i = 0;
+            while (i < call_kwargs) {
+                int target = -1;
+                int k = call_posargs;
+                while (k < fsymbol->arg_count) {
+                    if (fsymbol->arg_kwarg_name &&
+                            fsymbol->arg_kwarg_name[k] &&
+                            h64debugsymbols_MemberNameToMemberNameId(
+                                pr->symbols,
+                                fsymbol->arg_kwarg_name[k], 0
+                            ) == kwnames[i]) {
+                        target = k;
+                        break;
+                    }
+                    k++;
+                }
+                if (target < 0 || stack->entry[argfloor + target].type !=
+                        H64VALTYPE_UNSPECIFIED_KWARG) {
+                    unknownkwarg = 1;
+                } else {
+                    memcpy(&stack->entry[argfloor + target],
+                           &kwvalues[i], sizeof(kwvalues[i]));
+                }
+                i++;
+            }
+            if (kwvalues != _kwvaluesbuf) {
+                free(kwvalues);
+                free(kwnames);
+            }
+            if (unlikely(unknownkwarg)) {
+                RAISE_EXCEPTION(
+                    H64STDERROR_ARGUMENTERROR,
+                    "unexpected or duplicate keyword argument"
+                );
+                DISPATCH();
+            }
+        }
+
+        if (f->iscfunc) {
+            // C functions see exactly their arguments on the stack:
+            if (!pushfuncframe(vmthread, call_funcid, returnslot,
+                               func_id, returnoffset, argfloor))
+                goto triggeroom;
+            if (!stack_ToSize(stack, argfloor + argcount, 0)) {
+                popfuncframe(vmthread, 0);
+                goto triggeroom;
+            }
+            int (*cfunc)(h64vmthread *vmthread) = f->cfunc_ptr;
+            assert(cfunc != NULL);
+            int result = cfunc(vmthread);
+
+            // A negative result means an error object was pushed, a
+            // positive one that the return value was pushed:
+            valuecontent vresult = {0};
+            vresult.type = H64VALTYPE_NONE;
+            int64_t errorclassid = -1;
+            if (result != 0 && STACK_TOP(stack) > 0) {
+                valuecontent *top = stack_GetEntrySlow(stack, -1);
+                if (result < 0) {
+                    errorclassid = H64STDERROR_OUTOFMEMORYERROR;
+                    if (top->type == H64VALTYPE_GCVAL &&
+                            top->ptr_value != NULL)
+                        errorclassid = (
+                            ((h64gcvalue *)top->ptr_value)->classid
+                        );
+                } else {
+                    memcpy(&vresult, top, sizeof(vresult));
+                }
+            } else if (result < 0) {
+                errorclassid = H64STDERROR_OUTOFMEMORYERROR;
+            }
+            popfuncframe(vmthread, 0);
+            if (errorclassid >= 0) {
+                RAISE_EXCEPTION(
+                    errorclassid, "error in native function"
+                );
+                DISPATCH();
+            }
+            if (call_tail) {
+                // Nothing to reuse, just return the result right away:
+                memcpy(&return_value, &vresult, sizeof(vresult));
+                goto return_generic;
+            }
+            valuecontent *vreturn = &stack->entry[returnslot];
+            memcpy(vreturn, &vresult, sizeof(vresult));
+            p += call_instsize;
+            DISPATCH();
+        }
+
+        if (call_tail) {
+            // Reuse our own frame and its return info for the callee,
+            // by moving the arguments down to our stack floor:
+            int64_t floor = stack->current_func_floor;
+            if (argfloor > floor)
+                memmove(
+                    &stack->entry[floor], &stack->entry[argfloor],
+                    sizeof(*stack->entry) * argcount
+                );
+            int64_t i = floor + argcount;
+            while (i < stack->entry_count) {
+                memset(&stack->entry[i], 0, sizeof(*stack->entry));
+                i++;
+            }
+            int64_t new_top = (
+                floor + f->input_stack_size + f->inner_stack_size
+            );
+            if (new_top != stack->entry_count &&
+                    !stack_ToSize(stack, new_top, 0))
+                goto triggeroom;
+            #ifndef NDEBUG
+            if (vmthread->moptions.vmexec_debug)
+                fprintf(
+                    stderr, "horsevm: debug: vmexec tail call "
+                    "reuses funcframe %d\n",
+                    (int)vmthread->funcframe_count
+                );
+            #endif
+            vmthread->funcframe[vmthread->funcframe_count - 1].
+                func_id = call_funcid;
+            func_id = call_funcid;
+            p = FUNCCODE(pr, func_id);
+            pend = FUNCCODEEND(pr, func_id);
+            DISPATCH();
+        }
+
+        if (!pushfuncframe(vmthread, call_funcid, returnslot,
+                           func_id, returnoffset, argfloor))
+            goto triggeroom;
+        funcnestdepth++;
+        func_id = call_funcid;
+        p = FUNCCODE(pr, func_id);
+        pend = FUNCCODEEND(pr, func_id);
+        DISPATCH();
     }
     inst_settop: {
-        fprintf(stderr, "settop not implemented\n");
-        return 0;
+        h64instruction_settop *inst = (h64instruction_settop *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        // The frame already has room for all temporaries, so this only
+        // marks where the arguments for the upcoming call start:
+        call_argslot = inst->topto;
+
+        p += INSTSIZE(h64instruction_settop);
+        DISPATCH();
     }
     inst_returnvalue: {
         h64instruction_returnvalue *inst = (h64instruction_returnvalue *)p;
@@ -1266,42 +2383,40 @@ int _vmthread_RunFunction_NoPopFuncFrames(
 
         // Get return value:
         valuecontent *vc = STACK_ENTRY(stack, inst->returnslotfrom);
+        memcpy(&return_value, vc, sizeof(return_value));
+        goto return_generic;
+    }
+    return_generic: {
         valuecontent vccopy;
-        memcpy(&vccopy, vc, sizeof(vccopy));
-        if (vccopy.type == H64VALTYPE_GCVAL) {
-            // Make sure it won't be GC'ed when stack is reduced
-            ((h64gcvalue *)vccopy.ptr_value)->externalreferencecount++;
-        }
+        memcpy(&vccopy, &return_value, sizeof(vccopy));
 
-        // Remove function stack:
-        int current_stack_size = (
-            pr->func[func_id].input_stack_size +
-            pr->func[func_id].inner_stack_size
-        );
-        #ifndef NDEBUG
-        if (funcnestdepth <= 1 &&
-                stack->entry_count - current_stack_size != 0) {
-            fprintf(
-                stderr, "horsevm: error: "
-                "stack total count %d, current func stack %d, "
-                "unwound last function should return this to 0 "
-                "and doesn't\n",
-                (int)stack->entry_count, (int)current_stack_size
-            );
-        }
-        #endif
-        assert(stack->entry_count >= current_stack_size);
         funcnestdepth--;
         if (funcnestdepth <= 0) {
+            // Returning to the C caller:
+            int current_stack_size = (
+                pr->func[func_id].input_stack_size +
+                pr->func[func_id].inner_stack_size
+            );
+            #ifndef NDEBUG
+            if (stack->entry_count - current_stack_size !=
+                    original_stack_size) {
+                fprintf(
+                    stderr, "horsevm: error: "
+                    "stack total count %d, current func stack %d, "
+                    "unwound last function should return this to %d "
+                    "and doesn't\n",
+                    (int)stack->entry_count, (int)current_stack_size,
+                    (int)original_stack_size
+                );
+            }
+            #endif
             popfuncframe(vmthread, 1);  // pop frame but leave stack!
             func_id = -1;
-            assert(stack->entry_count - current_stack_size == 0);
+            assert(stack->entry_count - current_stack_size ==
+                   original_stack_size);
             if (!stack_ToSize(
                     stack, original_stack_size + 1, 0
                     )) {
-                if (vccopy.type == H64VALTYPE_GCVAL)
-                    ((h64gcvalue *)vccopy.ptr_value)->externalreferencecount--;
-
                 // Need to "manually" raise error since we're outside of any
                 // function at this point:
                 if (returneduncaughtexception)
@@ -1316,43 +2431,29 @@ int _vmthread_RunFunction_NoPopFuncFrames(
             valuecontent *newvc = stack_GetEntrySlow(
                 stack, original_stack_size
             );
-            valuecontent_Free(newvc);
             memcpy(newvc, &vccopy, sizeof(vccopy));
             return 1;
         }
         assert(vmthread->funcframe_count > 1);
-        int returnslot = (
-            vmthread->funcframe[vmthread->funcframe_count].
-            return_slot
-        );
-        int returnfuncid = (
-            vmthread->funcframe[vmthread->funcframe_count].
-            return_to_func_id
-        );
-        ptrdiff_t returnoffset = (
-            vmthread->funcframe[vmthread->funcframe_count].
-            return_to_execution_offset
-        );
+        h64vmfunctionframe *frame = &vmthread->funcframe[
+            vmthread->funcframe_count - 1
+        ];
+        int returnslot = frame->return_slot;
+        int returnfuncid = frame->return_to_func_id;
+        ptrdiff_t returnoffset = frame->return_to_execution_offset;
         popfuncframe(vmthread, 0);
 
-        // Place return value:
+        // Place return value directly in the caller's target slot:
         if (returnslot >= 0) {
-            valuecontent *newvc = stack_GetEntrySlow(
-                stack, returnslot
-            );
-            valuecontent_Free(newvc);
+            valuecontent *newvc = &stack->entry[returnslot];
             memcpy(newvc, &vccopy, sizeof(vccopy));
-        } else {
-            valuecontent_Free(&vccopy);
         }
 
         // Return to old execution:
         func_id = returnfuncid;
-        p = pr->func[func_id].instructions + returnoffset;
-        pend = pr->func[func_id].instructions + (
-            (ptrdiff_t)pr->func[func_id].instructions_bytes
-        );
-        goto *jumptable[((h64instructionany *)p)->type];
+        p = FUNCCODE(pr, func_id) + returnoffset;
+        pend = FUNCCODEEND(pr, func_id);
+        DISPATCH();
     }
     inst_jumptarget: {
         fprintf(stderr, "jumptarget not implemented\n");
@@ -1378,16 +2479,16 @@ int _vmthread_RunFunction_NoPopFuncFrames(
         }
 
         if (!jumpevalvalue) {
-            p += sizeof(h64instruction_condjump);
-            goto *jumptable[((h64instructionany *)p)->type];
+            p += INSTSIZE(h64instruction_condjump);
+            DISPATCH();
         }
 
         p += (
             (ptrdiff_t)inst->jumpbytesoffset
         );
-        assert(p >= pr->func[func_id].instructions &&
+        assert(p >= FUNCCODE(pr, func_id) &&
                p < pend);
-        goto *jumptable[((h64instructionany *)p)->type];
+        DISPATCH();
     }
     inst_jump: {
         h64instruction_jump *inst = (h64instruction_jump *)p;
@@ -1399,225 +2500,478 @@ int _vmthread_RunFunction_NoPopFuncFrames(
         p += (
             (ptrdiff_t)inst->jumpbytesoffset
         );
-        assert(p >= pr->func[func_id].instructions &&
+        assert(p >= FUNCCODE(pr, func_id) &&
                p < pend);
-        goto *jumptable[((h64instructionany *)p)->type];
+        DISPATCH();
     }
     inst_newiterator: {
-        fprintf(stderr, "newiterator not implemented\n");
-        return 0;
-    }
-    inst_iterate: {
-        fprintf(stderr, "iterate not implemented\n");
-        return 0;
-    }
-    inst_pushcatchframe: {
-        h64instruction_pushcatchframe *inst = (
-            (h64instruction_pushcatchframe *)p
+        h64instruction_newiterator *inst = (
+            (h64instruction_newiterator *)p
         );
         #ifndef NDEBUG
         if (vmthread->moptions.vmexec_debug &&
                 !vmthread_PrintExec((void*)inst)) goto triggeroom;
         #endif
 
+        // The iterator is just the container and a position, kept in
+        // the iterator's stack slot such that nothing is allocated:
+        valuecontent *vc = STACK_ENTRY(stack, inst->slotcontainerfrom);
+        valuecontent *it = STACK_ENTRY(stack, inst->slotiteratorto);
+        if (vc->type == H64VALTYPE_SHORTSTR) {
+            // A short string is its own iterator, ITERATE takes the
+            // chars off the front:
+            if (it != vc)
+                memcpy(it, vc, sizeof(*it));
+            p += INSTSIZE(h64instruction_newiterator);
+            DISPATCH();
+        }
+        if (unlikely(vc->type != H64VALTYPE_GCVAL)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "cannot iterate over this value"
+            );
+            DISPATCH();
+        }
+        h64gcvalue *gcval = vc->ptr_value;
+        int64_t length = 0;
+        if (gcval->type == H64GCVALUETYPE_LIST) {
+            length = gcval->list_val.count;
+        } else if (gcval->type == H64GCVALUETYPE_STRING) {
+            if (gcval->str_val.storage == H64STRSTORAGE_ROPE &&
+                    !vmstrings_Flatten(vmthread, &gcval->str_val))
+                goto triggeroom;
+            length = gcval->str_val.len;
+        } else if (unlikely(gcval->type != H64GCVALUETYPE_VECTOR &&
+                gcval->type != H64GCVALUETYPE_MAP &&
+                gcval->type != H64GCVALUETYPE_SET)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                (gcval->type == H64GCVALUETYPE_CLASSINSTANCE ?
+                 "cannot iterate over class instances" :
+                 "cannot iterate over this value")
+            );
+            DISPATCH();
+        }
+        if (unlikely(length > INT32_MAX)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_INDEXERROR,
+                "too many entries to iterate over"
+            );
+            DISPATCH();
+        }
+        it->type = H64VALTYPE_ITERATOR;
+        it->iterator_pos = 0;
+        it->iterator_container = gcval;
+        p += INSTSIZE(h64instruction_newiterator);
+        DISPATCH();
+    }
+    inst_iterate: {
+        h64instruction_iterate *inst = (h64instruction_iterate *)p;
         #ifndef NDEBUG
-        int previous_count = vmthread->exceptionframe_count;
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
         #endif
-        if (!pushexceptionframe(
-                vmthread,
-                ((inst->mode & CATCHMODE_JUMPONCATCH) != 0 ?
-                 (p - pr->func[func_id].instructions) +
-                 (int64_t)inst->jumponcatch : -1),
-                ((inst->mode & CATCHMODE_JUMPONFINALLY) != 0 ?
-                 (p - pr->func[func_id].instructions) +
-                 (int64_t)inst->jumponfinally : -1),
-                inst->slotexceptionto)) {
-            goto triggeroom;
+
+        // Read the next entry right from the container's storage. The
+        // current count is checked every time, since the loop may
+        // have added entries:
+        valuecontent *it = STACK_ENTRY(stack, inst->slotiteratorfrom);
+        valuecontent *target = STACK_ENTRY(stack, inst->slotvalueto);
+        if (unlikely(it->type == H64VALTYPE_SHORTSTR)) {
+            if (it->shortstr_len == 0)
+                goto iterate_end;
+            valuecontent c = {0};
+            c.type = H64VALTYPE_SHORTSTR;
+            c.shortstr_len = 1;
+            c.shortstr_value[0] = it->shortstr_value[0];
+            memmove(&it->shortstr_value[0], &it->shortstr_value[1],
+                    sizeof(*it->shortstr_value) * (it->shortstr_len - 1));
+            it->shortstr_len--;
+            memcpy(target, &c, sizeof(c));
+            p += INSTSIZE(h64instruction_iterate);
+            DISPATCH();
+        }
+        assert(it->type == H64VALTYPE_ITERATOR);
+        h64gcvalue *gcval = it->iterator_container;
+        int32_t pos = it->iterator_pos;
+        switch (gcval->type) {
+        case H64GCVALUETYPE_LIST:
+            if (pos >= gcval->list_val.count)
+                goto iterate_end;
+            memcpy(target, &gcval->list_val.values[pos],
+                   sizeof(*target));
+            break;
+        case H64GCVALUETYPE_VECTOR:
+            if (pos >= gcval->vector_val.count)
+                goto iterate_end;
+            target->type = H64VALTYPE_FLOAT64;
+            target->float_value = vmvector_Values(&gcval->vector_val)[pos];
+            break;
+        case H64GCVALUETYPE_MAP:
+        case H64GCVALUETYPE_SET:
+            // (maps are iterated over by their keys)
+            if (pos >= gcval->map_val.count)
+                goto iterate_end;
+            memcpy(target, vmmap_KeyAt(gcval, pos), sizeof(*target));
+            break;
+        case H64GCVALUETYPE_STRING: {
+            if (pos >= (int64_t)gcval->str_val.len)
+                goto iterate_end;
+            valuecontent c = {0};
+            c.type = H64VALTYPE_SHORTSTR;
+            c.shortstr_len = 1;
+            c.shortstr_value[0] = vmstrings_CharAt(&gcval->str_val, pos);
+            memcpy(target, &c, sizeof(c));
+            break;
         }
+        default:
+            assert(0 && "unexpected iterator container");
+            goto iterate_end;
+        }
+        it->iterator_pos = pos + 1;
+        p += INSTSIZE(h64instruction_iterate);
+        DISPATCH();
+
+        iterate_end:
+        p += (ptrdiff_t)inst->jumponend;
+        assert(p >= FUNCCODE(pr, func_id) &&
+               p < pend);
+        DISPATCH();
+    }
+    inst_endfinally: {
+        h64instruction_endfinally *inst = (
+            (h64instruction_endfinally *)p
+        );
         #ifndef NDEBUG
-        assert(vmthread->exceptionframe_count > 0 &&
-               vmthread->exceptionframe_count > previous_count);
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
         #endif
 
-        p += sizeof(h64instruction_pushcatchframe);
-        while (((h64instructionany *)p)->type == H64INST_ADDCATCHTYPE ||
-                ((h64instructionany *)p)->type == H64INST_ADDCATCHTYPEBYREF
-                ) {
-            #ifndef NDEBUG
-            if (vmthread->moptions.vmexec_debug &&
-                    !vmthread_PrintExec((void*)p)) goto triggeroom;
-            #endif
-            int64_t class_id = -1;
-            if (((h64instructionany *)p)->type == H64INST_ADDCATCHTYPE) {
-                class_id = ((h64instruction_addcatchtype *)p)->classid;
-            } else {
-                int16_t slotfrom = (
-                    ((h64instruction_addcatchtypebyref *)p)->slotfrom
-                );
-                valuecontent *vc = STACK_ENTRY(stack, slotfrom);
-                if (vc->type == H64VALTYPE_CLASSREF) {
-                    int64_t _class_id = vc->int_value;
-                    assert(_class_id >= 0 &&
-                           _class_id < pr->classes_count);
-                    int64_t base_class = pr->classes[_class_id].\
-                        base_class_global_id;
-                    while (base_class > 0)
-                        base_class = pr->classes[base_class].\
-                            base_class_global_id;
-                    if (base_class == 0)  // is Exception-derived!
-                        class_id = _class_id;
+        // Raise again what led into this finally block, if anything:
+        if (unlikely(vmthread->pendingexception_count > 0)) {
+            ptrdiff_t offset = (p - FUNCCODE(pr, func_id));
+            int returneduncaught = 0;
+            h64exceptioninfo uncaughtexception = {0};
+            uncaughtexception.exception_class_id = -1;
+            if (vmthread_exceptions_EndFinally(
+                    vmthread, &func_id, &offset, funcframesbefore,
+                    &returneduncaught, &uncaughtexception)) {
+                if (returneduncaught) {
+                    *returneduncaughtexception = 1;
+                    memcpy(einfo, &uncaughtexception,
+                           sizeof(uncaughtexception));
+                    return 1;
                 }
-            }
-            if (class_id < 0) {
-                RAISE_EXCEPTION(H64STDERROR_TYPEERROR,
-                                "catch on non-Exception type");
-                goto *jumptable[((h64instructionany *)p)->type];
-            }
-            assert(vmthread->exceptionframe_count > 0);
-            h64vmexceptioncatchframe *topframe = &(vmthread->
-                exceptionframe[vmthread->exceptionframe_count - 1]);
-            if (topframe->caught_types_count + 1 > 5) {
-                int64_t *caught_types_more_new = malloc(
-                    sizeof(*caught_types_more_new) *
-                    ((topframe->caught_types_count + 1) - 5)
+                p = (FUNCCODE(pr, func_id) + offset);
+                pend = FUNCCODEEND(pr, func_id);
+                funcnestdepth = (
+                    vmthread->funcframe_count - funcframesbefore
                 );
-                if (!caught_types_more_new)
-                    goto triggeroom;
-                topframe->caught_types_more = caught_types_more_new;
+                DISPATCH();
             }
-            int index = topframe->caught_types_count;
-            if (index >= 5) {
-                topframe->caught_types_more[index - 5] = class_id;
-            } else {
-                topframe->caught_types_firstfive[index] = class_id;
+        }
+        p += INSTSIZE(h64instruction_endfinally);
+        DISPATCH();
+    }
+    inst_getmember: {
+        h64instruction_getmember *inst = (h64instruction_getmember *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        valuecontent *vc = STACK_ENTRY(stack, inst->objslotfrom);
+        if (inst->nameidx == pr->length_name_index &&
+                (vc->type == H64VALTYPE_SHORTSTR ||
+                 (vc->type == H64VALTYPE_GCVAL &&
+                  ((h64gcvalue *)vc->ptr_value)->type !=
+                  H64GCVALUETYPE_CLASSINSTANCE))) {
+            // Built-in values that know their length:
+            h64gcvalue *gcval = (
+                vc->type == H64VALTYPE_GCVAL ?
+                (h64gcvalue *)vc->ptr_value : NULL
+            );
+            int64_t length = -1;
+            if (!gcval)
+                length = vc->shortstr_len;
+            else if (gcval->type == H64GCVALUETYPE_VECTOR)
+                length = gcval->vector_val.count;
+            else if (gcval->type == H64GCVALUETYPE_LIST)
+                length = gcval->list_val.count;
+            else if (gcval->type == H64GCVALUETYPE_MAP ||
+                    gcval->type == H64GCVALUETYPE_SET)
+                length = gcval->map_val.count;
+            else if (gcval->type == H64GCVALUETYPE_STRING)
+                length = gcval->str_val.len;
+            if (length >= 0) {
+                valuecontent *target = STACK_ENTRY(stack, inst->slotto);
+                target->type = H64VALTYPE_INT64;
+                target->int_value = length;
+                p += INSTSIZE(h64instruction_getmember);
+                DISPATCH();
             }
-            topframe->caught_types_count++;
-            if (((h64instructionany *)p)->type == H64INST_ADDCATCHTYPE) {
-                p += sizeof(h64instruction_addcatchtype);
-            } else {
-                p += sizeof(h64instruction_addcatchtypebyref);
+        }
+        if (unlikely(vc->type != H64VALTYPE_GCVAL ||
+                ((h64gcvalue *)vc->ptr_value)->type !=
+                H64GCVALUETYPE_CLASSINSTANCE)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_ATTRIBUTEERROR,
+                "value has no attributes"
+            );
+            DISPATCH();
+        }
+        h64gcvalue *gcval = (h64gcvalue *)vc->ptr_value;
+
+        // Inline cache, where monomorphic sites hit the first entry:
+        h64getmembercacheentry *entry = &inst->cache[0];
+        if (unlikely(inst->cache_fill == 0 ||
+                entry->classid != gcval->classid)) {
+            entry = vmexec_GetMemberCacheMiss(
+                pr, inst, gcval->classid
+            );
+            if (!entry) {
+                RAISE_EXCEPTION(
+                    H64STDERROR_ATTRIBUTEERROR,
+                    "object has no such attribute"
+                );
+                DISPATCH();
             }
         }
-        goto *jumptable[((h64instructionany *)p)->type];
+        if (unlikely(entry->membervarid < 0)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_ATTRIBUTEERROR,
+                "getting a method as a value is not supported"
+            );
+            DISPATCH();
+        }
+        valuecontent copy;
+        memcpy(&copy, &gcval->membervars[entry->membervarid],
+               sizeof(copy));
+        valuecontent *target = STACK_ENTRY(stack, inst->slotto);
+        memcpy(target, &copy, sizeof(copy));
+        p += INSTSIZE(h64instruction_getmember);
+        DISPATCH();
     }
-    inst_addcatchtypebyref: {
-        fprintf(stderr, "INVALID isolated addcatchtypebyref!!\n");
-        return 0;
+    inst_newlist: {
+        h64instruction_newlist *inst = (h64instruction_newlist *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        GC_SAFEPOINT(vmthread);
+        h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+        if (!gcval)
+            goto triggeroom;
+        gcval->type = H64GCVALUETYPE_LIST;
+        if (!vmlist_Init(&gcval->list_val, inst->presize)) {
+            gcval->type = H64GCVALUETYPE_INVALID;  // (collector frees it)
+            goto triggeroom;
+        }
+        valuecontent *target = STACK_ENTRY(stack, inst->slotto);
+        target->type = H64VALTYPE_GCVAL;
+        target->ptr_value = gcval;
+        p += INSTSIZE(h64instruction_newlist);
+        DISPATCH();
     }
-    inst_addcatchtype: {
-        fprintf(stderr, "INVALID isolated addcatchtype!!\n");
-        return 0;
+    inst_addtolist: {
+        h64instruction_addtolist *inst = (h64instruction_addtolist *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        valuecontent *vc = STACK_ENTRY(stack, inst->slotlistto);
+        if (unlikely(vc->type != H64VALTYPE_GCVAL ||
+                ((h64gcvalue *)vc->ptr_value)->type !=
+                H64GCVALUETYPE_LIST)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "can only add list entries to a list"
+            );
+            DISPATCH();
+        }
+        if (!vmlist_Add(vmthread, vc->ptr_value,
+                        STACK_ENTRY(stack, inst->slotaddfrom)))
+            goto triggeroom;
+        p += INSTSIZE(h64instruction_addtolist);
+        DISPATCH();
     }
-    inst_popcatchframe: {
-        h64instruction_popcatchframe *inst = (
-            (h64instruction_popcatchframe *)p
-        );
+    inst_newset: {
+        h64instruction_newset *inst = (h64instruction_newset *)p;
         #ifndef NDEBUG
         if (vmthread->moptions.vmexec_debug &&
                 !vmthread_PrintExec((void*)inst)) goto triggeroom;
         #endif
 
-        // See if we got a finally block to terminate:
-        assert(vmthread->exceptionframe_count > 0);
-        if (vmthread->exceptionframe[
-                vmthread->exceptionframe_count - 1
-                ].triggered_catch &&
-                vmthread->exceptionframe[
-                vmthread->exceptionframe_count - 1
-                ].triggered_finally) {
-            int64_t offset = (p - pr->func[func_id].instructions);
-            int64_t oldoffset = offset;
-            int exitwithexception = 0;
-            h64exceptioninfo e = {0};
-            vmthread_exceptions_EndFinally(
-                vmthread, &func_id, &offset,
-                &exitwithexception, &e
-            );  // calls popexceptionframe
-            if (exitwithexception) {
-                int result = stack_ToSize(stack, 0, 0);
-                stack->current_func_floor = 0;
-                assert(result != 0);
-                *returneduncaughtexception = 1;
-                memcpy(einfo, &e, sizeof(e));
-                return 1;
-            }
-            if (offset == oldoffset) {
-                offset += sizeof(h64instruction_popcatchframe);
-            }
-            p = (pr->func[func_id].instructions + offset);
-        } else {
-            popexceptionframe(vmthread);
-            p += sizeof(h64instruction_popcatchframe);
+        GC_SAFEPOINT(vmthread);
+        h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+        if (!gcval)
+            goto triggeroom;
+        gcval->type = H64GCVALUETYPE_SET;
+        if (!vmmap_Init(&gcval->map_val, 1, inst->presize)) {
+            gcval->type = H64GCVALUETYPE_INVALID;  // (collector frees it)
+            goto triggeroom;
         }
+        valuecontent *target = STACK_ENTRY(stack, inst->slotto);
+        target->type = H64VALTYPE_GCVAL;
+        target->ptr_value = gcval;
+        p += INSTSIZE(h64instruction_newset);
+        DISPATCH();
+    }
+    inst_addtoset: {
+        h64instruction_addtoset *inst = (h64instruction_addtoset *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
 
-        goto *jumptable[((h64instructionany *)p)->type];
+        valuecontent *vc = STACK_ENTRY(stack, inst->slotsetto);
+        if (unlikely(vc->type != H64VALTYPE_GCVAL ||
+                ((h64gcvalue *)vc->ptr_value)->type !=
+                H64GCVALUETYPE_SET)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "can only add set entries to a set"
+            );
+            DISPATCH();
+        }
+        int result = vmmap_Put(
+            vmthread, vc->ptr_value,
+            STACK_ENTRY(stack, inst->slotaddfrom), NULL
+        );
+        if (unlikely(result != VMMAP_OK)) {
+            if (result == VMMAP_OUTOFMEMORY)
+                goto triggeroom;
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "value can't be used as key"
+            );
+            DISPATCH();
+        }
+        p += INSTSIZE(h64instruction_addtoset);
+        DISPATCH();
     }
-    inst_getmember: {
-        fprintf(stderr, "getmember not implemented\n");
-        return 0;
+    inst_newmap: {
+        h64instruction_newmap *inst = (h64instruction_newmap *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        GC_SAFEPOINT(vmthread);
+        h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+        if (!gcval)
+            goto triggeroom;
+        gcval->type = H64GCVALUETYPE_MAP;
+        if (!vmmap_Init(&gcval->map_val, 0, inst->presize)) {
+            gcval->type = H64GCVALUETYPE_INVALID;  // (collector frees it)
+            goto triggeroom;
+        }
+        valuecontent *target = STACK_ENTRY(stack, inst->slotto);
+        target->type = H64VALTYPE_GCVAL;
+        target->ptr_value = gcval;
+        p += INSTSIZE(h64instruction_newmap);
+        DISPATCH();
     }
-    inst_jumptofinally: {
-        h64instruction_jumptofinally *inst = (
-            (h64instruction_jumptofinally *)p
-        );
+    inst_putmap: {
+        h64instruction_putmap *inst = (h64instruction_putmap *)p;
         #ifndef NDEBUG
         if (vmthread->moptions.vmexec_debug &&
                 !vmthread_PrintExec((void*)inst)) goto triggeroom;
         #endif
 
-        int64_t offset = (p - pr->func[func_id].instructions);
-        vmthread_exceptions_ProceedToFinally(
-            vmthread, &func_id, &offset
+        valuecontent *vc = STACK_ENTRY(stack, inst->slotmapto);
+        if (unlikely(vc->type != H64VALTYPE_GCVAL ||
+                ((h64gcvalue *)vc->ptr_value)->type !=
+                H64GCVALUETYPE_MAP)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "can only put map entries into a map"
+            );
+            DISPATCH();
+        }
+        int result = vmmap_Put(
+            vmthread, vc->ptr_value,
+            STACK_ENTRY(stack, inst->slotputkeyfrom),
+            STACK_ENTRY(stack, inst->slotputvaluefrom)
         );
-        p = (pr->func[func_id].instructions + offset);
-        goto *jumptable[((h64instructionany *)p)->type];
+        if (unlikely(result != VMMAP_OK)) {
+            if (result == VMMAP_OUTOFMEMORY)
+                goto triggeroom;
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "value can't be used as key"
+            );
+            DISPATCH();
+        }
+        p += INSTSIZE(h64instruction_putmap);
+        DISPATCH();
+    }
+    inst_newvector: {
+        h64instruction_newvector *inst = (h64instruction_newvector *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
+
+        GC_SAFEPOINT(vmthread);
+        h64gcvalue *gcval = gc_AllocValue(vmthread, 0);
+        if (!gcval)
+            goto triggeroom;
+        gcval->type = H64GCVALUETYPE_VECTOR;
+        if (!vmvector_Init(&gcval->vector_val, inst->size)) {
+            gcval->type = H64GCVALUETYPE_INVALID;  // (collector frees it)
+            goto triggeroom;
+        }
+        valuecontent *target = STACK_ENTRY(stack, inst->slotto);
+        target->type = H64VALTYPE_GCVAL;
+        target->ptr_value = gcval;
+        p += INSTSIZE(h64instruction_newvector);
+        DISPATCH();
     }
+    inst_putvector: {
+        h64instruction_putvector *inst = (h64instruction_putvector *)p;
+        #ifndef NDEBUG
+        if (vmthread->moptions.vmexec_debug &&
+                !vmthread_PrintExec((void*)inst)) goto triggeroom;
+        #endif
 
+        valuecontent *vc = STACK_ENTRY(stack, inst->slotvectorto);
+        valuecontent *from = STACK_ENTRY(stack, inst->slotputfrom);
+        if (unlikely(!vmexec_IsVectorValue(vc) ||
+                (from->type != H64VALTYPE_INT64 &&
+                 from->type != H64VALTYPE_FLOAT64))) {
+            RAISE_EXCEPTION(
+                H64STDERROR_TYPEERROR,
+                "vector entries must be numbers"
+            );
+            DISPATCH();
+        }
+        h64vectorval *vec = &((h64gcvalue *)vc->ptr_value)->vector_val;
+        if (unlikely(inst->putindex < 0 || inst->putindex >= vec->count)) {
+            RAISE_EXCEPTION(
+                H64STDERROR_INDEXERROR,
+                "index out of range"
+            );
+            DISPATCH();
+        }
+        vmvector_Values(vec)[inst->putindex] = (
+            from->type == H64VALTYPE_INT64 ?
+            (double)from->int_value : from->float_value
+        );
+        p += INSTSIZE(h64instruction_putvector);
+        DISPATCH();
+    }
     setupinterpreter:
-    jumptable[H64INST_INVALID] = &&inst_invalid;
-    jumptable[H64INST_SETCONST] = &&inst_setconst;
-    jumptable[H64INST_SETGLOBAL] = &&inst_setglobal;
-    jumptable[H64INST_GETGLOBAL] = &&inst_getglobal;
-    jumptable[H64INST_GETFUNC] = &&inst_getfunc;
-    jumptable[H64INST_GETCLASS] = &&inst_getclass;
-    jumptable[H64INST_VALUECOPY] = &&inst_valuecopy;
-    jumptable[H64INST_BINOP] = &&inst_binop;
-    jumptable[H64INST_UNOP] = &&inst_unop;
-    jumptable[H64INST_CALL] = &&inst_call;
-    jumptable[H64INST_SETTOP] = &&inst_settop;
-    jumptable[H64INST_RETURNVALUE] = &&inst_returnvalue;
-    jumptable[H64INST_JUMPTARGET] = &&inst_jumptarget;
-    jumptable[H64INST_CONDJUMP] = &&inst_condjump;
-    jumptable[H64INST_JUMP] = &&inst_jump;
-    jumptable[H64INST_NEWITERATOR] = &&inst_newiterator;
-    jumptable[H64INST_ITERATE] = &&inst_iterate;
-    jumptable[H64INST_PUSHCATCHFRAME] = &&inst_pushcatchframe;
-    jumptable[H64INST_ADDCATCHTYPEBYREF] = &&inst_addcatchtypebyref;
-    jumptable[H64INST_ADDCATCHTYPE] = &&inst_addcatchtype;
-    jumptable[H64INST_POPCATCHFRAME] = &&inst_popcatchframe;
-    jumptable[H64INST_GETMEMBER] = &&inst_getmember;
-    jumptable[H64INST_JUMPTOFINALLY] = &&inst_jumptofinally;
-    op_jumptable[H64OP_MATH_DIVIDE] = &&binop_divide;
-    op_jumptable[H64OP_MATH_ADD] = &&binop_add;
-    op_jumptable[H64OP_MATH_SUBSTRACT] = &&binop_substract;
-    op_jumptable[H64OP_MATH_MULTIPLY] = &&binop_multiply;
-    op_jumptable[H64OP_MATH_MODULO] = &&binop_modulo;
-    op_jumptable[H64OP_CMP_EQUAL] = &&binop_cmp_equal;
-    op_jumptable[H64OP_CMP_NOTEQUAL] = &&binop_cmp_notequal;
-    op_jumptable[H64OP_CMP_LARGEROREQUAL] = &&binop_cmp_largerorequal;
-    op_jumptable[H64OP_CMP_SMALLEROREQUAL] = &&binop_cmp_smallerorequal;
-    op_jumptable[H64OP_CMP_LARGER] = &&binop_cmp_larger;
-    op_jumptable[H64OP_CMP_SMALLER] = &&binop_cmp_smaller;
     assert(stack != NULL);
-    if (!pushfuncframe(vmthread, func_id, -1, -1, 0)) {
+    if (!pushfuncframe(vmthread, func_id, -1, -1, 0,
+                       original_stack_size)) {
         goto triggeroom;
     }
-    vmthread->funcframe[vmthread->funcframe_count - 1].stack_bottom = (
-        original_stack_size
-    );
 
     funcnestdepth++;
-    goto *jumptable[((h64instructionany *)p)->type];
+    DISPATCH();
 }
 
 int vmthread_RunFunction(
@@ -1631,7 +2985,9 @@ int vmthread_RunFunction(
     );
     int64_t old_floor = vmthread->stack->current_func_floor;
     int funcframesbefore = vmthread->funcframe_count;
-    int exceptionframesbefore = vmthread->exceptionframe_count;
+    #ifndef NDEBUG
+    int pendingexceptionsbefore = vmthread->pendingexception_count;
+    #endif
     int inneruncaughtexception = 0;
     int result = _vmthread_RunFunction_NoPopFuncFrames(
         vmthread, func_id, &inneruncaughtexception, einfo
@@ -1639,7 +2995,6 @@ int vmthread_RunFunction(
 
     // Make sure we don't leave excess func frames behind:
     assert(vmthread->funcframe_count >= funcframesbefore);
-    assert(vmthread->exceptionframe_count >= exceptionframesbefore);
     int i = vmthread->funcframe_count;
     while (i > funcframesbefore) {
         assert(inneruncaughtexception);  // only allow unclean frames if error
@@ -1648,12 +3003,8 @@ int vmthread_RunFunction(
             // assert otherwise. We'll just wipe it manually later.
         i--;
     }
-    i = vmthread->exceptionframe_count;
-    while (i > exceptionframesbefore) {
-        assert(inneruncaughtexception);  // only allow unclean frames if error
-        popexceptionframe(vmthread);
-        i--;
-    }
+    // (Popping the frames also dropped their pending exceptions.)
+    assert(vmthread->pendingexception_count == pendingexceptionsbefore);
     // Stack clean-up:
     assert(vmthread->stack->entry_count >= old_stack);
     if (inneruncaughtexception) {
@@ -1725,9 +3076,270 @@ int vmthread_RunFunctionWithReturnInt(
     return result;
 }
 
+#if H64VM_DIRECTTHREADED
+static int _threadedjumpoffset(
+        int64_t *offsetmap, int64_t instructions_bytes,
+        int64_t instoffset, int64_t jumpoffset,
+        int64_t *out_threadedjumpoffset
+        ) {
+    int64_t target = instoffset + jumpoffset;
+    if (target < 0 || target >= instructions_bytes ||
+            offsetmap[target] < 0)
+        return 0;
+    *out_threadedjumpoffset = (
+        offsetmap[target] - offsetmap[instoffset]
+    );
+    return 1;
+}
+
+static int vmexec_PrepareThreadedFunc(
+        h64program *pr, int64_t func_id
+        ) {
+    h64func *f = &pr->func[func_id];
+    assert(!f->iscfunc && f->threaded_instructions == NULL);
+    assert(vmexec_handlers != NULL);
+
+    // Figure out where each instruction ends up in the threaded code:
+    int64_t *offsetmap = malloc(
+        sizeof(*offsetmap) * (f->instructions_bytes + 1)
+    );
+    if (!offsetmap)
+        return 0;
+    int64_t k = 0;
+    while (k <= f->instructions_bytes) {
+        offsetmap[k] = -1;
+        k++;
+    }
+    int64_t threaded_bytes = 0;
+    k = 0;
+    while (k < f->instructions_bytes) {
+        size_t instsize = h64program_PtrToInstructionSize(
+            f->instructions + k
+        );
+        offsetmap[k] = threaded_bytes;
+        threaded_bytes += THREADEDINST_SIZE(instsize);
+        k += (int64_t)instsize;
+    }
+    if (threaded_bytes > INT_MAX) {
+        free(offsetmap);
+        return 0;
+    }
+    char *code = malloc(threaded_bytes);
+    if (!code) {
+        free(offsetmap);
+        return 0;
+    }
+    memset(code, 0, threaded_bytes);
+
+    // Copy over instructions with handlers, and fix up jump offsets:
+    k = 0;
+    while (k < f->instructions_bytes) {
+        h64instructionany *inst = (
+            (h64instructionany *)(f->instructions + k)
+        );
+        size_t instsize = h64program_PtrToInstructionSize((char *)inst);
+        char *target = code + offsetmap[k];
+        void *handler = vmexec_handlers[inst->type];
+        if (!handler)
+            handler = vmexec_handlers[H64INST_INVALID];
+        memcpy(target, &handler, sizeof(handler));
+        memcpy(target + THREADEDINST_HEADERSIZE, inst, instsize);
+        h64instructionany *newinst = (
+            (h64instructionany *)(target + THREADEDINST_HEADERSIZE)
+        );
+        int64_t newoffset = 0;
+        switch (newinst->type) {
+        case H64INST_CONDJUMP: {
+            h64instruction_condjump *cjump = (
+                (h64instruction_condjump *)newinst
+            );
+            if (!_threadedjumpoffset(
+                    offsetmap, f->instructions_bytes, k,
+                    cjump->jumpbytesoffset, &newoffset) ||
+                    newoffset > INT32_MAX || newoffset < INT32_MIN)
+                goto fail;
+            cjump->jumpbytesoffset = newoffset;
+            break;
+        }
+        case H64INST_JUMP: {
+            h64instruction_jump *jump = (
+                (h64instruction_jump *)newinst
+            );
+            if (!_threadedjumpoffset(
+                    offsetmap, f->instructions_bytes, k,
+                    jump->jumpbytesoffset, &newoffset) ||
+                    newoffset > INT32_MAX || newoffset < INT32_MIN)
+                goto fail;
+            jump->jumpbytesoffset = newoffset;
+            break;
+        }
+        case H64INST_BINOPCONDJUMP: {
+            h64instruction_binopcondjump *cjump = (
+                (h64instruction_binopcondjump *)newinst
+            );
+            if (!_threadedjumpoffset(
+                    offsetmap, f->instructions_bytes, k,
+                    cjump->jumpbytesoffset, &newoffset) ||
+                    newoffset > INT32_MAX || newoffset < INT32_MIN)
+                goto fail;
+            cjump->jumpbytesoffset = newoffset;
+            break;
+        }
+        case H64INST_ITERATE: {
+            h64instruction_iterate *iterate = (
+                (h64instruction_iterate *)newinst
+            );
+            if (!_threadedjumpoffset(
+                    offsetmap, f->instructions_bytes, k,
+                    iterate->jumponend, &newoffset) ||
+                    newoffset > INT32_MAX || newoffset < INT32_MIN)
+                goto fail;
+            iterate->jumponend = newoffset;
+            break;
+        }
+        default:
+            break;
+        }
+        k += (int64_t)instsize;
+    }
+
+    // Translate the exception table to the threaded offsets:
+    h64exceptionhandler *handlers = NULL;
+    if (f->exceptionhandlers_count > 0) {
+        handlers = malloc(sizeof(*handlers) * f->exceptionhandlers_count);
+        if (!handlers)
+            goto fail;
+        memcpy(handlers, f->exceptionhandlers,
+               sizeof(*handlers) * f->exceptionhandlers_count);
+    }
+    offsetmap[f->instructions_bytes] = threaded_bytes;
+    k = 0;
+    while (k < f->exceptionhandlers_count) {
+        int32_t *offsets[5] = {
+            &handlers[k].try_start, &handlers[k].try_end,
+            &handlers[k].catch_offset, &handlers[k].finally_offset,
+            &handlers[k].finally_end
+        };
+        int j = 0;
+        while (j < 5) {
+            if (*offsets[j] >= 0) {
+                if (*offsets[j] > f->instructions_bytes ||
+                        offsetmap[*offsets[j]] < 0) {
+                    free(handlers);
+                    goto fail;
+                }
+                *offsets[j] = offsetmap[*offsets[j]];
+            }
+            j++;
+        }
+        k++;
+    }
+    free(offsetmap);
+    f->threaded_instructions = code;
+    f->threaded_bytes = threaded_bytes;
+    f->threaded_exceptionhandlers = handlers;
+    return 1;
+
+    fail:
+    free(offsetmap);
+    free(code);
+    return 0;
+}
+#endif
+
+static int _vmexec_PrepareConstStrings(h64program *pr) {
+    // Turn each string literal into an immortal string value once, so
+    // SETCONST only copies a reference instead of allocating a new
+    // string every time it runs:
+    int64_t i = 0;
+    while (i < pr->func_count) {
+        if (pr->func[i].iscfunc) {
+            i++;
+            continue;
+        }
+        char *p = pr->func[i].instructions;
+        char *pend = p + pr->func[i].instructions_bytes;
+        while (p < pend) {
+            size_t instsize = h64program_PtrToInstructionSize(p);
+            if (((h64instructionany *)p)->type != H64INST_SETCONST) {
+                p += instsize;
+                continue;
+            }
+            h64instruction_setconst *inst = (
+                (h64instruction_setconst *)p
+            );
+            valuecontent content;
+            memcpy(&content, &inst->content, sizeof(content));
+            p += instsize;
+            if (content.type != H64VALTYPE_CONSTPREALLOCSTR)
+                continue;
+
+            h64gcvalue **new_conststr = realloc(
+                pr->conststr,
+                sizeof(*new_conststr) * (pr->conststr_count + 1)
+            );
+            if (!new_conststr)
+                return 0;
+            pr->conststr = new_conststr;
+            h64gcvalue *gcval = malloc(sizeof(*gcval));
+            if (!gcval)
+                return 0;
+            memset(gcval, 0, sizeof(*gcval));
+            gcval->type = H64GCVALUETYPE_STRING;
+            gcval->zctflags = H64GCZCT_IMMORTAL;
+            if (!vmstrings_SetFromUTF32(
+                    NULL, &gcval->str_val,
+                    content.constpreallocstr_value,
+                    content.constpreallocstr_len)) {
+                free(gcval);
+                return 0;
+            }
+            // (hashed now, since threads must not write to these later)
+            vmmap_StringHash(&gcval->str_val);
+            pr->conststr[pr->conststr_count] = gcval;
+            pr->conststr_count++;
+
+            valuecontent_Free(&content);
+            memset(&content, 0, sizeof(content));
+            content.type = H64VALTYPE_GCVAL;
+            content.ptr_value = gcval;
+            memcpy(&inst->content, &content, sizeof(content));
+        }
+        i++;
+    }
+    return 1;
+}
+
+int vmexec_PrepareThreadedCode(h64program *pr) {
+    if (!_vmexec_PrepareConstStrings(pr))
+        return 0;
+    #if H64VM_DIRECTTHREADED
+    if (!vmexec_handlers) {
+        _vmthread_RunFunction_NoPopFuncFrames(NULL, -1, NULL, NULL);
+        assert(vmexec_handlers != NULL);
+    }
+    int64_t i = 0;
+    while (i < pr->func_count) {
+        if (!pr->func[i].iscfunc &&
+                pr->func[i].threaded_instructions == NULL &&
+                pr->func[i].instructions_bytes > 0) {
+            if (!vmexec_PrepareThreadedFunc(pr, i))
+                return 0;
+        }
+        i++;
+    }
+    #endif
+    return 1;
+}
+
 int vmexec_ExecuteProgram(
         h64program *pr, h64misccompileroptions *moptions
         ) {
+    if (!vmexec_PrepareThreadedCode(pr)) {
+        fprintf(stderr, "vmexec.c: failed to prepare threaded code, "
+            "out of memory or jump out of range?\n");
+        return -1;
+    }
     h64vmthread *mainthread = vmthread_New();
     if (!mainthread) {
         fprintf(stderr, "vmexec.c: out of memory during setup\n");
@@ -1744,6 +3356,7 @@ int vmexec_ExecuteProgram(
                 mainthread, pr->globalinit_func_index,
                 &haduncaughtexception, &einfo, &rval
                 )) {
+            vmoutput_Flush(&mainthread->output);
             fprintf(stderr, "vmexec.c: fatal error in $$globalinit, "
                 "out of memory?\n");
             vmthread_Free(mainthread);
@@ -1751,6 +3364,7 @@ int vmexec_ExecuteProgram(
         }
         if (haduncaughtexception) {
             assert(einfo.exception_class_id >= 0);
+            vmoutput_Flush(&mainthread->output);
             fprintf(stderr, "Uncaught %s\n",
                 (pr->symbols ?
                  _classnamelookup(pr, einfo.exception_class_id) :
@@ -1767,6 +3381,7 @@ int vmexec_ExecuteProgram(
             mainthread, pr->main_func_index,
             &haduncaughtexception, &einfo, &rval
             )) {
+        vmoutput_Flush(&mainthread->output);
         fprintf(stderr, "vmexec.c: fatal error in main, "
             "out of memory?\n");
         vmthread_Free(mainthread);
@@ -1774,6 +3389,7 @@ int vmexec_ExecuteProgram(
     }
     if (haduncaughtexception) {
         assert(einfo.exception_class_id >= 0);
+        vmoutput_Flush(&mainthread->output);
         fprintf(stderr, "Uncaught %s\n",
             (pr->symbols ?
              _classnamelookup(pr, einfo.exception_class_id) :
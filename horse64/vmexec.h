@@ -10,8 +10,14 @@
 
 #define MAX_STACK_FRAMES 10
 
+// Function frames preallocated per thread, so calls usually don't
+// need to allocate (the arena only grows for very deep recursion):
+#define FUNCFRAME_ARENA_INITIAL 1024
+
 #include "bytecode.h"
 #include "compiler/main.h"
+#include "gc.h"
+#include "vmoutput.h"
 
 typedef struct h64program h64program;
 typedef struct h64instruction h64instruction;
@@ -23,23 +29,19 @@ typedef struct h64refvalue h64refvalue;
 typedef struct h64vmfunctionframe {
     int stack_bottom;
     int func_id;
-    int return_slot;
+    int return_slot;  // absolute stack index in the caller, or -1
     int return_to_func_id;
     ptrdiff_t return_to_execution_offset;
 } h64vmfunctionframe;
 
-typedef struct h64vmexceptioncatchframe {
+// An exception that led into a finally block, raised again once the
+// block ends at its ENDFINALLY. Nothing else about try statements is
+// tracked at runtime, see the functions' exception tables instead:
+typedef struct h64vmpendingexception {
     int func_frame_no;
-    int64_t catch_instruction_offset;
-    int64_t finally_instruction_offset;
-    int exception_obj_temporary_id;
-    int triggered_catch, triggered_finally;
-    h64exceptioninfo storeddelayedexception;
-
-    int caught_types_count;
-    int64_t caught_types_firstfive[5];
-    int64_t *caught_types_more;
-} h64vmexceptioncatchframe;
+    int64_t finally_offset, finally_end;
+    h64exceptioninfo e;
+} h64vmpendingexception;
 
 
 typedef struct h64vmthread {
@@ -49,12 +51,15 @@ typedef struct h64vmthread {
     int can_call_unthreadable;
 
     h64stack *stack;
-    poolalloc *heap, *str_pile;
+    poolalloc *heap;
+    poolalloc *str_pile[VMSTRINGS_SIZECLASSES];
+    h64gcstate gc;
+    h64vmoutput output;  // print goes here, for stdout
 
     int funcframe_count, funcframe_alloc;
     h64vmfunctionframe *funcframe;
-    int exceptionframe_count, exceptionframe_alloc;
-    h64vmexceptioncatchframe *exceptionframe;
+    int pendingexception_count, pendingexception_alloc;
+    h64vmpendingexception *pendingexception;
 
     int execution_func_id;
     int execution_instruction_id;
@@ -72,6 +77,12 @@ void vmthread_WipeFuncStack(h64vmthread *vmthread);
 
 h64vmthread *vmthread_New();
 
+int vmthread_RunFunction(
+    h64vmthread *vmthread, int64_t func_id,
+    int *returneduncaughtexception,
+    h64exceptioninfo *einfo
+);
+
 int vmthread_RunFunctionWithReturnInt(
     h64vmthread *vmthread, int64_t func_id,
     int *returneduncaughtexception,
@@ -81,6 +92,8 @@ int vmthread_RunFunctionWithReturnInt(
 
 void vmthread_Free(h64vmthread *vmthread);
 
+int vmexec_PrepareThreadedCode(h64program *pr);
+
 int vmexec_ExecuteProgram(
     h64program *pr, h64misccompileroptions *moptions
 );
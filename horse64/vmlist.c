@@ -0,0 +1,61 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "compileconfig.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "gc.h"
+#include "gcvalue.h"
+#include "vmexec.h"
+#include "vmlist.h"
+
+#define VMLIST_MINALLOC 4
+
+int vmlist_Init(h64listval *l, int64_t capacity) {
+    l->values = NULL;
+    l->count = 0;
+    l->alloc = 0;
+    if (capacity <= 0)
+        return 1;
+    l->values = malloc(sizeof(*l->values) * capacity);
+    if (!l->values)
+        return 0;
+    l->alloc = capacity;
+    return 1;
+}
+
+int vmlist_Add(h64vmthread *vthread, h64gcvalue *list, valuecontent *v) {
+    assert(list->type == H64GCVALUETYPE_LIST);
+    h64listval *l = &list->list_val;
+    if (unlikely(l->count >= l->alloc)) {
+        int64_t new_alloc = l->alloc * 2;
+        if (new_alloc < VMLIST_MINALLOC)
+            new_alloc = VMLIST_MINALLOC;
+        valuecontent *new_values = realloc(
+            l->values, sizeof(*new_values) * new_alloc
+        );
+        if (!new_values)
+            return 0;
+        l->values = new_values;
+        l->alloc = new_alloc;
+    }
+    if (v->type == H64VALTYPE_GCVAL) {
+        GC_WRITEBARRIER(vthread, list);
+        GC_HEAPREF_ADD((h64gcvalue *)v->ptr_value);
+    }
+    memcpy(&l->values[l->count], v, sizeof(*v));
+    l->count++;
+    return 1;
+}
+
+void vmlist_Free(h64listval *l) {
+    free(l->values);
+    l->values = NULL;
+    l->count = 0;
+    l->alloc = 0;
+}
@@ -0,0 +1,33 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef HORSE64_VMLIST_H_
+#define HORSE64_VMLIST_H_
+
+#include <stdint.h>
+
+typedef struct h64vmthread h64vmthread;
+typedef struct h64gcvalue h64gcvalue;
+typedef struct valuecontent valuecontent;
+
+// Lists keep their entries in one contiguous array that grows
+// geometrically, so appending is amortized O(1) and indexing is a
+// plain array access into values[0 .. count - 1].
+typedef struct h64listval {
+    valuecontent *values;
+    int64_t count, alloc;
+} h64listval;
+
+// The capacity is a hint how many entries will be added, such that a
+// list of known size is allocated just once:
+int vmlist_Init(h64listval *l, int64_t capacity);
+
+// Appends a copy of v. The list holds a heap reference to v if it is
+// a heap value, so this must only be used on lists on the heap:
+int vmlist_Add(h64vmthread *vthread, h64gcvalue *list, valuecontent *v);
+
+// (the collector drops the references to the entries)
+void vmlist_Free(h64listval *l);
+
+#endif  // HORSE64_VMLIST_H_
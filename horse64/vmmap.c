@@ -0,0 +1,500 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "compileconfig.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "gc.h"
+#include "gcvalue.h"
+#include "hash.h"
+#include "vmexec.h"
+#include "vmmap.h"
+#include "vmstrings.h"
+
+#define VMMAP_MINALLOC 4
+#define VMMAP_MININDEX 8
+
+typedef struct h64mapentry {
+    uint32_t hash;
+    valuecontent key;
+    valuecontent value;  // left out for sets
+} h64mapentry;
+
+static inline size_t _vmmap_EntrySize(const h64mapval *m) {
+    if (!m->isset)
+        return sizeof(h64mapentry);
+    size_t align = _Alignof(h64mapentry);
+    return ((offsetof(h64mapentry, value) + align - 1) / align) * align;
+}
+
+static inline h64mapentry *_vmmap_Entry(const h64mapval *m, int32_t i) {
+    return (h64mapentry *)(m->entries + (size_t)i * _vmmap_EntrySize(m));
+}
+
+static inline uint64_t _vmmap_Mix(uint64_t x) {
+    // The splitmix64 finalizer, so that keys differing in any bit
+    // spread over the whole index:
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint32_t _vmmap_Fold(uint64_t x) {
+    uint32_t h = (uint32_t)(x ^ (x >> 32));
+    return (h != 0 ? h : 1);  // (0 means not computed for strings)
+}
+
+static uint32_t _vmmap_HashStringBytes(
+        const char *bytes, uint64_t len, int width
+        ) {
+    uint64_t byteslen = len * width;
+    if (byteslen <= sizeof(uint64_t)) {
+        // Short strings are packed into one number instead:
+        uint64_t packed = 0;
+        memcpy(&packed, bytes, byteslen);
+        return _vmmap_Fold(_vmmap_Mix(
+            packed ^ _vmmap_Mix((len << 3) | (uint64_t)width)
+        ));
+    }
+    // (the width is mixed in, since equal bytes with a different
+    // width are a different string)
+    return _vmmap_Fold(_vmmap_Mix(
+        hash_ByteHash(bytes, byteslen, NULL) ^ (uint64_t)width
+    ));
+}
+
+uint32_t vmmap_StringHash(h64stringval *s) {
+    assert(s->storage != H64STRSTORAGE_ROPE);
+    if (s->hash == 0)
+        s->hash = _vmmap_HashStringBytes(s->s, s->len, s->width);
+    return s->hash;
+}
+
+static int _vmmap_ShortStrBytes(
+        const valuecontent *vc, char *out, int *outwidth
+        ) {
+    // Writes a short string's chars with their canonical width, the
+    // same way a string value with these chars would store them:
+    assert(vc->type == H64VALTYPE_SHORTSTR);
+    unicodechar chars[VALUECONTENT_SHORTSTRLEN + 1];
+    memcpy(chars, vc->shortstr_value, sizeof(chars));
+    int len = vc->shortstr_len;
+    unicodechar maxc = 0;
+    int i = 0;
+    while (i < len) {
+        if (chars[i] > maxc)
+            maxc = chars[i];
+        i++;
+    }
+    int width = (maxc <= 0xFF ? 1 : (maxc <= 0xFFFF ? 2 : 4));
+    i = 0;
+    while (i < len) {
+        if (width == 1) {
+            uint8_t c = chars[i];
+            memcpy(out + i, &c, 1);
+        } else if (width == 2) {
+            uint16_t c = chars[i];
+            memcpy(out + i * 2, &c, 2);
+        } else {
+            memcpy(out + i * 4, &chars[i], 4);
+        }
+        i++;
+    }
+    *outwidth = width;
+    return len;
+}
+
+static int _vmmap_Hash(
+        h64vmthread *vthread, valuecontent *key, uint32_t *hash
+        ) {
+    switch (key->type) {
+    case H64VALTYPE_INT64:
+        *hash = _vmmap_Fold(_vmmap_Mix((uint64_t)key->int_value));
+        return VMMAP_OK;
+    case H64VALTYPE_FLOAT64: {
+        double f = key->float_value;
+        if (f >= -9223372036854775808.0 && f < 9223372036854775808.0 &&
+                (double)(int64_t)f == f) {
+            // Must match the int of the same value, since they are equal:
+            *hash = _vmmap_Fold(_vmmap_Mix((uint64_t)(int64_t)f));
+            return VMMAP_OK;
+        }
+        uint64_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        *hash = _vmmap_Fold(_vmmap_Mix(bits ^ 0x2545f4914f6cdd1dULL));
+        return VMMAP_OK;
+    }
+    case H64VALTYPE_BOOL:
+    case H64VALTYPE_NONE:
+    case H64VALTYPE_CFUNCREF:
+    case H64VALTYPE_CLASSREF:
+    case H64VALTYPE_SIMPLEFUNCREF:
+        *hash = _vmmap_Fold(_vmmap_Mix(
+            (uint64_t)key->int_value ^ ((uint64_t)key->type << 56)
+        ));
+        return VMMAP_OK;
+    case H64VALTYPE_SHORTSTR: {
+        char bytes[(VALUECONTENT_SHORTSTRLEN + 1) * sizeof(unicodechar)];
+        int width = 1;
+        int len = _vmmap_ShortStrBytes(key, bytes, &width);
+        *hash = _vmmap_HashStringBytes(bytes, len, width);
+        return VMMAP_OK;
+    }
+    case H64VALTYPE_GCVAL:
+        break;
+    default:
+        return VMMAP_UNHASHABLE;
+    }
+
+    h64gcvalue *gcval = key->ptr_value;
+    switch (gcval->type) {
+    case H64GCVALUETYPE_STRING:
+        if (!vmstrings_Flatten(vthread, &gcval->str_val))
+            return VMMAP_OUTOFMEMORY;
+        *hash = vmmap_StringHash(&gcval->str_val);
+        return VMMAP_OK;
+    case H64GCVALUETYPE_LIST:
+    case H64GCVALUETYPE_MAP:
+    case H64GCVALUETYPE_SET:
+        // These can change after being added, so they can't be keys.
+        return VMMAP_UNHASHABLE;
+    case H64GCVALUETYPE_CLASSINSTANCE:
+    case H64GCVALUETYPE_ERRORCLASSINSTANCE: {
+        // Instances are compared by identity. Classes with their own
+        // equals/hash can't be keys yet, since the VM can't call into
+        // methods from here:
+        h64program *pr = vthread->program;
+        int i = 0;
+        while (i < 2) {
+            int64_t nameidx = (
+                i == 0 ? pr->equals_name_index : pr->hash_name_index
+            );
+            if (nameidx >= 0) {
+                int membervarid = -1;
+                int memberfuncid = -1;
+                h64program_LookupClassMember(
+                    pr, gcval->classid, nameidx,
+                    &membervarid, &memberfuncid
+                );
+                if (memberfuncid >= 0)
+                    return VMMAP_UNHASHABLE;
+            }
+            i++;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    *hash = _vmmap_Fold(_vmmap_Mix((uint64_t)(uintptr_t)gcval));
+    return VMMAP_OK;
+}
+
+static int _vmmap_StringsEqual(
+        h64vmthread *vthread, valuecontent *a, valuecontent *b,
+        int *result
+        ) {
+    char bytesa[(VALUECONTENT_SHORTSTRLEN + 1) * sizeof(unicodechar)];
+    char bytesb[(VALUECONTENT_SHORTSTRLEN + 1) * sizeof(unicodechar)];
+    const char *sa, *sb;
+    uint64_t lena, lenb;
+    int widtha, widthb;
+    if (a->type == H64VALTYPE_SHORTSTR) {
+        lena = _vmmap_ShortStrBytes(a, bytesa, &widtha);
+        sa = bytesa;
+    } else {
+        h64stringval *s = &((h64gcvalue *)a->ptr_value)->str_val;
+        if (!vmstrings_Flatten(vthread, s))
+            return VMMAP_OUTOFMEMORY;
+        lena = s->len;
+        widtha = s->width;
+        sa = s->s;
+    }
+    if (b->type == H64VALTYPE_SHORTSTR) {
+        lenb = _vmmap_ShortStrBytes(b, bytesb, &widthb);
+        sb = bytesb;
+    } else {
+        h64stringval *s = &((h64gcvalue *)b->ptr_value)->str_val;
+        if (!vmstrings_Flatten(vthread, s))
+            return VMMAP_OUTOFMEMORY;
+        lenb = s->len;
+        widthb = s->width;
+        sb = s->s;
+    }
+    *result = (lena == lenb && widtha == widthb &&
+               memcmp(sa, sb, lena * widtha) == 0);
+    return VMMAP_OK;
+}
+
+static inline int _vmmap_IsString(valuecontent *vc) {
+    return (vc->type == H64VALTYPE_SHORTSTR ||
+            (vc->type == H64VALTYPE_GCVAL &&
+             ((h64gcvalue *)vc->ptr_value)->type ==
+             H64GCVALUETYPE_STRING));
+}
+
+int vmmap_KeysEqual(
+        h64vmthread *vthread, valuecontent *a, valuecontent *b,
+        int *result
+        ) {
+    if (a->type == H64VALTYPE_INT64 && b->type == H64VALTYPE_INT64) {
+        *result = (a->int_value == b->int_value);
+        return VMMAP_OK;
+    }
+    if ((a->type == H64VALTYPE_INT64 || a->type == H64VALTYPE_FLOAT64) &&
+            (b->type == H64VALTYPE_INT64 ||
+             b->type == H64VALTYPE_FLOAT64)) {
+        if (a->type == H64VALTYPE_FLOAT64 &&
+                b->type == H64VALTYPE_FLOAT64) {
+            *result = (a->float_value == b->float_value);
+            return VMMAP_OK;
+        }
+        // Compare an int and a float exactly, without rounding the int:
+        int64_t i = (a->type == H64VALTYPE_INT64 ?
+                     a->int_value : b->int_value);
+        double f = (a->type == H64VALTYPE_FLOAT64 ?
+                    a->float_value : b->float_value);
+        *result = (f >= -9223372036854775808.0 &&
+                   f < 9223372036854775808.0 &&
+                   (double)(int64_t)f == f && (int64_t)f == i);
+        return VMMAP_OK;
+    }
+    if (_vmmap_IsString(a) || _vmmap_IsString(b)) {
+        if (!_vmmap_IsString(a) || !_vmmap_IsString(b)) {
+            *result = 0;
+            return VMMAP_OK;
+        }
+        return _vmmap_StringsEqual(vthread, a, b, result);
+    }
+    if (a->type != b->type) {
+        *result = 0;
+        return VMMAP_OK;
+    }
+    switch (a->type) {
+    case H64VALTYPE_NONE:
+        *result = 1;
+        return VMMAP_OK;
+    case H64VALTYPE_BOOL:
+    case H64VALTYPE_CFUNCREF:
+    case H64VALTYPE_CLASSREF:
+    case H64VALTYPE_SIMPLEFUNCREF:
+    case H64VALTYPE_GCVAL:
+        // (heap values other than strings are compared by identity)
+        *result = (a->int_value == b->int_value);
+        return VMMAP_OK;
+    default:
+        *result = 0;
+        return VMMAP_OK;
+    }
+}
+
+static int64_t _vmmap_IndexSizeFor(int64_t count) {
+    // The index is kept at most 2/3 full, so probe runs stay short:
+    int64_t size = VMMAP_MININDEX;
+    while (size * 2 < count * 3)
+        size *= 2;
+    return size;
+}
+
+static int _vmmap_RebuildIndex(h64mapval *m, int64_t size) {
+    int32_t *new_index = malloc(sizeof(*new_index) * size);
+    if (!new_index)
+        return 0;
+    memset(new_index, 0xFF, sizeof(*new_index) * size);  // all -1
+    uint32_t mask = size - 1;
+    int32_t i = 0;
+    while (i < m->count) {
+        uint32_t slot = _vmmap_Entry(m, i)->hash & mask;
+        while (new_index[slot] >= 0)
+            slot = (slot + 1) & mask;
+        new_index[slot] = i;
+        i++;
+    }
+    free(m->index);
+    m->index = new_index;
+    m->indexmask = mask;
+    return 1;
+}
+
+int vmmap_Init(h64mapval *m, int isset, int64_t capacity) {
+    memset(m, 0, sizeof(*m));
+    m->isset = (isset != 0);
+    if (capacity <= 0)
+        return 1;
+    if (capacity > INT32_MAX / 2)
+        return 0;
+    m->entries = malloc(_vmmap_EntrySize(m) * capacity);
+    if (!m->entries)
+        return 0;
+    m->alloc = capacity;
+    if (!_vmmap_RebuildIndex(m, _vmmap_IndexSizeFor(capacity))) {
+        free(m->entries);
+        m->entries = NULL;
+        m->alloc = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static int _vmmap_Find(
+        h64vmthread *vthread, h64mapval *m,
+        valuecontent *key, uint32_t hash,
+        int32_t *out_entry, uint32_t *out_slot
+        ) {
+    // Sets the entry of the key, or -1 and the free slot to use:
+    *out_entry = -1;
+    if (!m->index)
+        return VMMAP_OK;
+    uint32_t slot = hash & m->indexmask;
+    while (1) {
+        int32_t i = m->index[slot];
+        if (i < 0)
+            break;
+        h64mapentry *e = _vmmap_Entry(m, i);
+        if (e->hash == hash) {
+            if (key->type == H64VALTYPE_INT64 &&
+                    e->key.type == H64VALTYPE_INT64) {
+                // Fast path for int keys:
+                if (e->key.int_value == key->int_value) {
+                    *out_entry = i;
+                    return VMMAP_OK;
+                }
+            } else {
+                int equal = 0;
+                if (!vmmap_KeysEqual(vthread, &e->key, key, &equal))
+                    return VMMAP_OUTOFMEMORY;
+                if (equal) {
+                    *out_entry = i;
+                    return VMMAP_OK;
+                }
+            }
+        }
+        slot = (slot + 1) & m->indexmask;
+    }
+    *out_slot = slot;
+    return VMMAP_OK;
+}
+
+int vmmap_Put(
+        h64vmthread *vthread, h64gcvalue *map,
+        valuecontent *key, valuecontent *value
+        ) {
+    assert(map->type == H64GCVALUETYPE_MAP ||
+           map->type == H64GCVALUETYPE_SET);
+    h64mapval *m = &map->map_val;
+    assert((value == NULL) == (m->isset != 0));
+    uint32_t hash = 0;
+    int result = _vmmap_Hash(vthread, key, &hash);
+    if (result != VMMAP_OK)
+        return result;
+
+    // Make room first, such that the free slot found stays valid:
+    if (unlikely(!m->index ||
+            ((int64_t)m->count + 1) * 3 >
+            ((int64_t)m->indexmask + 1) * 2)) {
+        if (!_vmmap_RebuildIndex(m, _vmmap_IndexSizeFor(m->count + 1)))
+            return VMMAP_OUTOFMEMORY;
+    }
+    int32_t i = -1;
+    uint32_t slot = 0;
+    if (!_vmmap_Find(vthread, m, key, hash, &i, &slot))
+        return VMMAP_OUTOFMEMORY;
+    if (i >= 0) {
+        // Already present, so only the value changes:
+        if (m->isset)
+            return VMMAP_OK;
+        h64mapentry *e = _vmmap_Entry(m, i);
+        if (value->type == H64VALTYPE_GCVAL) {
+            GC_WRITEBARRIER(vthread, map);
+            GC_HEAPREF_ADD((h64gcvalue *)value->ptr_value);
+        }
+        if (e->value.type == H64VALTYPE_GCVAL)
+            GC_HEAPREF_DROP(vthread, (h64gcvalue *)e->value.ptr_value);
+        memcpy(&e->value, value, sizeof(*value));
+        return VMMAP_OK;
+    }
+
+    if (unlikely(m->count >= m->alloc)) {
+        int64_t new_alloc = (int64_t)m->alloc * 2;
+        if (new_alloc < VMMAP_MINALLOC)
+            new_alloc = VMMAP_MINALLOC;
+        if (new_alloc > INT32_MAX / 2)
+            return VMMAP_OUTOFMEMORY;
+        char *new_entries = realloc(
+            m->entries, _vmmap_EntrySize(m) * new_alloc
+        );
+        if (!new_entries)
+            return VMMAP_OUTOFMEMORY;
+        m->entries = new_entries;
+        m->alloc = new_alloc;
+    }
+    h64mapentry *e = _vmmap_Entry(m, m->count);
+    if (key->type == H64VALTYPE_GCVAL ||
+            (value && value->type == H64VALTYPE_GCVAL))
+        GC_WRITEBARRIER(vthread, map);
+    if (key->type == H64VALTYPE_GCVAL)
+        GC_HEAPREF_ADD((h64gcvalue *)key->ptr_value);
+    e->hash = hash;
+    memcpy(&e->key, key, sizeof(*key));
+    if (value) {
+        if (value->type == H64VALTYPE_GCVAL)
+            GC_HEAPREF_ADD((h64gcvalue *)value->ptr_value);
+        memcpy(&e->value, value, sizeof(*value));
+    }
+    m->index[slot] = m->count;
+    m->count++;
+    return VMMAP_OK;
+}
+
+int vmmap_Get(
+        h64vmthread *vthread, h64gcvalue *map,
+        valuecontent *key, valuecontent **value
+        ) {
+    assert(map->type == H64GCVALUETYPE_MAP ||
+           map->type == H64GCVALUETYPE_SET);
+    h64mapval *m = &map->map_val;
+    *value = NULL;
+    uint32_t hash = 0;
+    int result = _vmmap_Hash(vthread, key, &hash);
+    if (result != VMMAP_OK)
+        return result;
+    int32_t i = -1;
+    uint32_t slot = 0;
+    if (!_vmmap_Find(vthread, m, key, hash, &i, &slot))
+        return VMMAP_OUTOFMEMORY;
+    if (i >= 0) {
+        h64mapentry *e = _vmmap_Entry(m, i);
+        *value = (m->isset ? &e->key : &e->value);
+    }
+    return VMMAP_OK;
+}
+
+valuecontent *vmmap_KeyAt(h64gcvalue *map, int32_t i) {
+    assert(i >= 0 && i < map->map_val.count);
+    return &_vmmap_Entry(&map->map_val, i)->key;
+}
+
+valuecontent *vmmap_ValueAt(h64gcvalue *map, int32_t i) {
+    assert(!map->map_val.isset);
+    assert(i >= 0 && i < map->map_val.count);
+    return &_vmmap_Entry(&map->map_val, i)->value;
+}
+
+void vmmap_Free(h64mapval *m) {
+    free(m->entries);
+    free(m->index);
+    m->entries = NULL;
+    m->index = NULL;
+    m->count = 0;
+    m->alloc = 0;
+    m->indexmask = 0;
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef HORSE64_VMMAP_H_
+#define HORSE64_VMMAP_H_
+
+#include <stdint.h>
+
+typedef struct h64vmthread h64vmthread;
+typedef struct h64gcvalue h64gcvalue;
+typedef struct valuecontent valuecontent;
+typedef struct h64stringval h64stringval;
+
+// Maps and sets keep their entries densely in one array in insertion
+// order, each with its key's hash, the key and (for maps) the value.
+// Lookups go through a separate open addressed index of entry numbers,
+// which is small enough to stay in cache and is probed linearly,
+// comparing the stored hash before comparing any key.
+typedef struct h64mapval {
+    char *entries;
+    int32_t *index;  // entry numbers, or -1 for a free slot
+    int32_t count, alloc;
+    uint32_t indexmask;  // index has indexmask + 1 slots
+    uint8_t isset;  // entries have no value
+} h64mapval;
+
+#define VMMAP_OUTOFMEMORY 0
+#define VMMAP_OK 1
+#define VMMAP_UNHASHABLE -1  // the key can't be used in a map or set
+
+// The capacity is a hint how many entries will be added. It works
+// for sets too, which simply have no values:
+int vmmap_Init(h64mapval *m, int isset, int64_t capacity);
+
+// Adds the key, or replaces the value if the key is already present.
+// For sets, value must be NULL. Heap values hold a heap reference from
+// the map, so this must only be used on maps and sets on the heap:
+int vmmap_Put(
+    h64vmthread *vthread, h64gcvalue *map,
+    valuecontent *key, valuecontent *value
+);
+
+// Sets *value to the value for the key, or NULL if it isn't present.
+// For sets, *value is the stored key instead:
+int vmmap_Get(
+    h64vmthread *vthread, h64gcvalue *map,
+    valuecontent *key, valuecontent **value
+);
+
+// Whether a and b are the same key: numbers compare by value, ints
+// and floats included, strings by their chars, everything else by
+// identity. Sets result, and only fails when out of memory:
+int vmmap_KeysEqual(
+    h64vmthread *vthread, valuecontent *a, valuecontent *b,
+    int *result
+);
+
+// A string's hash as maps use it, which the string caches. It must not
+// be a rope:
+uint32_t vmmap_StringHash(h64stringval *s);
+
+valuecontent *vmmap_KeyAt(h64gcvalue *map, int32_t i);
+
+valuecontent *vmmap_ValueAt(h64gcvalue *map, int32_t i);  // maps only
+
+// (the collector drops the references to the keys and values)
+void vmmap_Free(h64mapval *m);
+
+#endif  // HORSE64_VMMAP_H_
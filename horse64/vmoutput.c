@@ -0,0 +1,171 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "unicode.h"
+#include "vmoutput.h"
+#include "vmstrings.h"
+
+
+void vmoutput_Init(h64vmoutput *out, int fd) {
+    out->fd = fd;
+    out->fill = 0;
+    #if defined(_WIN32) || defined(_WIN64)
+    out->flushonnewline = (_isatty(fd) != 0);
+    #else
+    out->flushonnewline = (isatty(fd) != 0);
+    #endif
+}
+
+static int _vmoutput_WriteFd(
+        int fd, const char *a, uint64_t alen,
+        const char *b, uint64_t blen
+        ) {
+    // Writes a and then b, without copying them together first.
+    // Anything written with stdio before must go out before this:
+    if (fd == 1)
+        fflush(stdout);
+    else if (fd == 2)
+        fflush(stderr);
+    #if defined(_WIN32) || defined(_WIN64)
+    while (alen > 0 || blen > 0) {
+        if (alen == 0) {
+            a = b; alen = blen;
+            b = NULL; blen = 0;
+        }
+        unsigned int chunk = (alen > 0x40000000 ? 0x40000000 :
+                              (unsigned int)alen);
+        int written = _write(fd, a, chunk);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        a += written;
+        alen -= written;
+    }
+    return 1;
+    #else
+    struct iovec iov[2];
+    iov[0].iov_base = (char *)a;
+    iov[0].iov_len = alen;
+    iov[1].iov_base = (char *)b;
+    iov[1].iov_len = blen;
+    int first = 0;
+    while (1) {
+        while (first < 2 && iov[first].iov_len == 0)
+            first++;
+        if (first >= 2)
+            break;
+        ssize_t written = writev(fd, iov + first, 2 - first);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        // Skip what was written, it may have been partial:
+        while (first < 2 && (size_t)written >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            iov[first].iov_len = 0;
+            first++;
+        }
+        if (first < 2) {
+            iov[first].iov_base = (char *)iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+    return 1;
+    #endif
+}
+
+int vmoutput_Flush(h64vmoutput *out) {
+    if (out->fill == 0)
+        return 1;
+    int result = _vmoutput_WriteFd(out->fd, out->data, out->fill, NULL, 0);
+    out->fill = 0;
+    return result;
+}
+
+int vmoutput_Write(h64vmoutput *out, const char *data, uint64_t len) {
+    if (out->fill + len > VMOUTPUT_BUFSIZE) {
+        if (len >= VMOUTPUT_BUFSIZE / 2) {
+            // Big enough to go out directly, along with what is pending:
+            int result = _vmoutput_WriteFd(
+                out->fd, out->data, out->fill, data, len
+            );
+            out->fill = 0;
+            return result;
+        }
+        if (!vmoutput_Flush(out))
+            return 0;
+    }
+    memcpy(out->data + out->fill, data, len);
+    out->fill += len;
+    if (out->flushonnewline && memchr(data, '\n', len) != NULL)
+        return vmoutput_Flush(out);
+    return 1;
+}
+
+int vmoutput_WriteString(h64vmoutput *out, const h64stringval *sv) {
+    assert(sv->storage != H64STRSTORAGE_ROPE);
+    if (sv->width == 1 && sv->isascii) {
+        // ASCII is valid UTF-8 as it is:
+        return vmoutput_Write(out, sv->s, sv->len);
+    }
+
+    // Otherwise, transcode straight into the buffer in chunks:
+    int sawnewline = 0;
+    uint64_t k = 0;
+    while (k < sv->len) {
+        if (out->fill + 4 > VMOUTPUT_BUFSIZE) {
+            if (!vmoutput_Flush(out))
+                return 0;
+        }
+        char *chunkstart = out->data + out->fill;
+        if (sv->width == 4) {
+            // (this takes the vectorized path for runs of ASCII)
+            uint64_t chunklen = (VMOUTPUT_BUFSIZE - out->fill) / 4;
+            if (chunklen > sv->len - k)
+                chunklen = sv->len - k;
+            int64_t written = 0;
+            int result = utf32_to_utf8(
+                (const unicodechar *)sv->s + k, chunklen,
+                chunkstart, VMOUTPUT_BUFSIZE - out->fill,
+                &written, 1
+            );
+            assert(result != 0);
+            out->fill += written;
+            k += chunklen;
+        } else {
+            while (k < sv->len && out->fill + 4 <= VMOUTPUT_BUFSIZE) {
+                int charlen = 0;
+                int result = write_codepoint_as_utf8(
+                    vmstrings_CharAt(sv, k), 1,
+                    out->data + out->fill,
+                    VMOUTPUT_BUFSIZE - out->fill, &charlen
+                );
+                assert(result != 0);
+                out->fill += charlen;
+                k++;
+            }
+        }
+        if (out->flushonnewline && !sawnewline &&
+                memchr(chunkstart, '\n',
+                       (out->data + out->fill) - chunkstart) != NULL)
+            sawnewline = 1;
+    }
+    if (sawnewline)
+        return vmoutput_Flush(out);
+    return 1;
+}
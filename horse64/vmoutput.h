@@ -0,0 +1,36 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef HORSE64_VMOUTPUT_H_
+#define HORSE64_VMOUTPUT_H_
+
+#include <stdint.h>
+
+typedef struct h64stringval h64stringval;
+
+#define VMOUTPUT_BUFSIZE 8192
+
+// Output a VM thread writes to a file descriptor. It is collected
+// and handed to the OS in one go, either when the buffer is full, or
+// when a line is complete if the descriptor is a terminal. Anything
+// not written yet goes out with vmoutput_Flush, which must be called
+// before the thread ends or writes to another stream like stderr.
+typedef struct h64vmoutput {
+    int fd;
+    int flushonnewline;
+    uint64_t fill;
+    char data[VMOUTPUT_BUFSIZE];
+} h64vmoutput;
+
+void vmoutput_Init(h64vmoutput *out, int fd);
+
+// These return 0 if writing failed. The output is then dropped:
+int vmoutput_Write(h64vmoutput *out, const char *data, uint64_t len);
+
+// Writes the string as UTF-8, it must not be a rope:
+int vmoutput_WriteString(h64vmoutput *out, const h64stringval *sv);
+
+int vmoutput_Flush(h64vmoutput *out);
+
+#endif  // HORSE64_VMOUTPUT_H_
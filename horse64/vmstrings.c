@@ -2,43 +2,316 @@
 // also see LICENSE.md file.
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "gc.h"
+#include "gcvalue.h"
 #include "poolalloc.h"
 #include "threading.h"
 #include "vmexec.h"
 #include "vmstrings.h"
 
-#define POOLEDSTRSIZE 64
+// Concatenation results live in a buffer with spare room at the end.
+// Every string using the buffer sees its own prefix of it, and only the
+// string ending exactly at 'fill' may append more, by creating a new
+// longer string using the same buffer. This gives amortized in-place
+// appends without ever changing an existing string, which matters
+// since the deferred reference counts can't tell whether a string is
+// referenced from more than one stack slot.
+typedef struct h64strbuf {
+    int refcount;  // strings using this buffer
+    uint8_t sizeclass;
+    uint64_t fill, alloc;  // in chars
+    char data[];
+} h64strbuf;
+
+static int _vmstrings_SizeClass(uint64_t bytes) {
+    if (bytes > VMSTRINGS_MAXPOOLED)
+        return VMSTRINGS_LARGECLASS;
+    int sizeclass = 0;
+    while ((uint64_t)(16 << sizeclass) < bytes)
+        sizeclass++;
+    return sizeclass;
+}
+
+static void *_vmstrings_AllocBytes(
+        h64vmthread *vthread, uint64_t *bytes, uint8_t *sizeclass
+        ) {
+    // Rounds *bytes up to what was actually allocated:
+    int c = (vthread ? _vmstrings_SizeClass(*bytes) :
+             VMSTRINGS_LARGECLASS);
+    *sizeclass = c;
+    if (c == VMSTRINGS_LARGECLASS)
+        return malloc(*bytes > 0 ? *bytes : 1);
+    if (!vthread->str_pile[c]) {
+        vthread->str_pile[c] = poolalloc_New(16 << c);
+        if (!vthread->str_pile[c])
+            return NULL;
+    }
+    *bytes = (16 << c);
+    return poolalloc_malloc(vthread->str_pile[c], 0);
+}
+
+static void _vmstrings_FreeBytes(
+        h64vmthread *vthread, void *ptr, uint8_t sizeclass
+        ) {
+    if (sizeclass == VMSTRINGS_LARGECLASS) {
+        free(ptr);
+        return;
+    }
+    assert(vthread != NULL && vthread->str_pile[sizeclass] != NULL);
+    poolalloc_free(vthread->str_pile[sizeclass], ptr);
+}
 
 int vmstrings_Set(
         h64vmthread *vthread,
-        h64stringval *v, uint64_t len) {
-    if (!vthread || !v)
+        h64stringval *v, uint64_t len, int width) {
+    if (!v)
         return 0;
-    if (!vthread->str_pile) {
-        vthread->str_pile = poolalloc_New(POOLEDSTRSIZE);
-        if (!vthread->str_pile)
-            return 0;
+    assert(width == 1 || width == 2 || width == 4);
+    v->storage = H64STRSTORAGE_OWNED;
+    v->buf = NULL;
+    uint64_t bytes = len * width;
+    v->s = _vmstrings_AllocBytes(vthread, &bytes, &v->sizeclass);
+    if (!v->s)
+        return 0;
+    v->len = len;
+    v->width = width;
+    v->isascii = 0;
+    v->hash = 0;
+    return 1;
+}
+
+static void _vmstrings_CopyChars(
+        char *out, int outwidth,
+        const h64stringval *v
+        ) {
+    // Copies all chars of v into out, widening them if needed:
+    assert(v->storage != H64STRSTORAGE_ROPE);
+    if (outwidth == v->width) {
+        memcpy(out, v->s, v->len * v->width);
+        return;
     }
-    if (len * sizeof(unicodechar) <= POOLEDSTRSIZE) {
-        v->s = poolalloc_malloc(
-            vthread->str_pile, 0
-        );
+    assert(outwidth > v->width);
+    uint64_t i = 0;
+    if (outwidth == 2) {
+        uint16_t *out16 = (uint16_t *)out;
+        while (i < v->len) {
+            out16[i] = ((const uint8_t *)v->s)[i];
+            i++;
+        }
     } else {
-        v->s = malloc(sizeof(unicodechar) * len);
+        unicodechar *out32 = (unicodechar *)out;
+        while (i < v->len) {
+            out32[i] = vmstrings_CharAt(v, i);
+            i++;
+        }
+    }
+}
+
+int vmstrings_SetFromUTF32(
+        h64vmthread *vthread, h64stringval *v,
+        const unicodechar *chars, uint64_t len
+        ) {
+    unicodechar maxc = 0;
+    uint64_t i = 0;
+    while (i < len) {
+        if (chars[i] > maxc)
+            maxc = chars[i];
+        i++;
     }
-    return (v->s != NULL);
+    int width = (maxc <= 0xFF ? 1 : (maxc <= 0xFFFF ? 2 : 4));
+    if (!vmstrings_Set(vthread, v, len, width))
+        return 0;
+    v->isascii = (maxc < 0x80);
+    i = 0;
+    if (width == 1) {
+        uint8_t *out = (uint8_t *)v->s;
+        while (i < len) {
+            out[i] = chars[i];
+            i++;
+        }
+    } else if (width == 2) {
+        uint16_t *out = (uint16_t *)v->s;
+        while (i < len) {
+            out[i] = chars[i];
+            i++;
+        }
+    } else {
+        memcpy(v->s, chars, len * sizeof(*chars));
+    }
+    return 1;
+}
+
+static h64strbuf *_vmstrings_NewBuf(
+        h64vmthread *vthread, uint64_t alloc, int width
+        ) {
+    uint64_t bytes = sizeof(h64strbuf) + alloc * width;
+    uint8_t sizeclass = 0;
+    h64strbuf *buf = _vmstrings_AllocBytes(vthread, &bytes, &sizeclass);
+    if (!buf)
+        return NULL;
+    buf->refcount = 0;
+    buf->sizeclass = sizeclass;
+    buf->fill = 0;
+    // Use all of the size class as room to grow:
+    buf->alloc = (bytes - sizeof(h64strbuf)) / width;
+    assert(buf->alloc >= alloc);
+    return buf;
+}
+
+static void _vmstrings_UseBuf(
+        h64stringval *v, h64strbuf *buf, uint64_t len, int width
+        ) {
+    v->storage = H64STRSTORAGE_SHAREDBUF;
+    v->s = buf->data;
+    v->buf = buf;
+    v->len = len;
+    v->width = width;
+    buf->refcount++;
+}
+
+int vmstrings_Flatten(h64vmthread *vthread, h64stringval *v) {
+    if (v->storage != H64STRSTORAGE_ROPE)
+        return 1;
+    h64strbuf *buf = _vmstrings_NewBuf(vthread, v->len, v->width);
+    if (!buf)
+        return 0;
+
+    // Ropes may be nested very deeply, so walk the parts with our own
+    // stack instead of recursing:
+    int64_t todo_alloc = 16;
+    int64_t todo_count = 0;
+    h64stringval **todo = malloc(sizeof(*todo) * todo_alloc);
+    if (!todo) {
+        _vmstrings_FreeBytes(vthread, buf, buf->sizeclass);
+        return 0;
+    }
+    todo[todo_count] = v;
+    todo_count++;
+    while (todo_count > 0) {
+        todo_count--;
+        h64stringval *part = todo[todo_count];
+        if (part->storage != H64STRSTORAGE_ROPE) {
+            _vmstrings_CopyChars(
+                buf->data + buf->fill * v->width, v->width, part
+            );
+            buf->fill += part->len;
+            continue;
+        }
+        if (todo_count + 2 > todo_alloc) {
+            h64stringval **newtodo = realloc(
+                todo, sizeof(*newtodo) * todo_alloc * 2
+            );
+            if (!newtodo) {
+                free(todo);
+                _vmstrings_FreeBytes(vthread, buf, buf->sizeclass);
+                return 0;
+            }
+            todo = newtodo;
+            todo_alloc *= 2;
+        }
+        // (pushed right first, such that left is copied first)
+        todo[todo_count] = &part->roperight->str_val;
+        todo[todo_count + 1] = &part->ropeleft->str_val;
+        todo_count += 2;
+    }
+    free(todo);
+    assert(buf->fill == v->len);
+
+    h64gcvalue *left = v->ropeleft;
+    h64gcvalue *right = v->roperight;
+    _vmstrings_UseBuf(v, buf, v->len, v->width);
+    GC_HEAPREF_DROP(vthread, left);
+    GC_HEAPREF_DROP(vthread, right);
+    return 1;
+}
+
+int vmstrings_Concat(
+        h64vmthread *vthread, h64gcvalue *result,
+        h64gcvalue *v1, h64gcvalue *v2
+        ) {
+    h64stringval *s1 = &v1->str_val;
+    h64stringval *s2 = &v2->str_val;
+    h64stringval *out = &result->str_val;
+    out->hash = 0;
+    uint64_t len = s1->len + s2->len;
+    // Both are canonical, so the wider one is the result's width:
+    int width = (s1->width > s2->width ? s1->width : s2->width);
+    int isascii = (s1->isascii && s2->isascii);
+    int s1istip = (
+        s1->storage == H64STRSTORAGE_SHAREDBUF &&
+        s1->width == width &&
+        s1->s + s1->len * width == s1->buf->data + s1->buf->fill * width
+    );
+
+    if (!s1istip && len >= VMSTRINGS_ROPEMINLEN) {
+        // Nothing to append to, so just refer to both parts:
+        GC_WRITEBARRIER(vthread, result);
+        GC_HEAPREF_ADD(v1);
+        GC_HEAPREF_ADD(v2);
+        out->storage = H64STRSTORAGE_ROPE;
+        out->ropeleft = v1;
+        out->roperight = v2;
+        out->len = len;
+        out->width = width;
+        out->isascii = isascii;
+        return 1;
+    }
+    if (!vmstrings_Flatten(vthread, s2))
+        return 0;
+    if (s1istip && s1->buf->fill + s2->len <= s1->buf->alloc) {
+        // Append in place:
+        h64strbuf *buf = s1->buf;
+        _vmstrings_CopyChars(
+            buf->data + buf->fill * width, width, s2
+        );
+        buf->fill += s2->len;
+        _vmstrings_UseBuf(out, buf, len, width);
+        out->isascii = isascii;
+        return 1;
+    }
+
+    // Copy both into a new buffer with room to grow, such that
+    // repeatedly appending to the result takes amortized linear time:
+    if (!vmstrings_Flatten(vthread, s1))
+        return 0;
+    h64strbuf *buf = _vmstrings_NewBuf(vthread, len * 2, width);
+    if (!buf)
+        return 0;
+    _vmstrings_CopyChars(buf->data, width, s1);
+    _vmstrings_CopyChars(buf->data + s1->len * width, width, s2);
+    buf->fill = len;
+    _vmstrings_UseBuf(out, buf, len, width);
+    out->isascii = isascii;
+    return 1;
+}
+
+int vmstrings_Equal(const h64stringval *v1, const h64stringval *v2) {
+    assert(v1->storage != H64STRSTORAGE_ROPE &&
+           v2->storage != H64STRSTORAGE_ROPE);
+    if (v1->len != v2->len || v1->width != v2->width)
+        return 0;
+    return (memcmp(v1->s, v2->s, v1->len * v1->width) == 0);
 }
 
 void vmstrings_Free(h64vmthread *vthread, h64stringval *v) {
-    if (!vthread || !v)
+    if (!v)
         return;
-    if (v->len <= POOLEDSTRSIZE) {
-        poolalloc_free(vthread->str_pile, v->s);
+    if (v->storage == H64STRSTORAGE_ROPE) {
+        // Nothing owned, the parts are heap values of their own.
+    } else if (v->storage == H64STRSTORAGE_SHAREDBUF) {
+        v->buf->refcount--;
+        if (v->buf->refcount <= 0)
+            _vmstrings_FreeBytes(vthread, v->buf, v->buf->sizeclass);
     } else {
-        free(v->s);
+        _vmstrings_FreeBytes(vthread, v->s, v->sizeclass);
     }
+    v->storage = H64STRSTORAGE_OWNED;
+    v->s = NULL;
+    v->buf = NULL;
     v->len = 0;
+    v->hash = 0;
 }
@@ -9,17 +9,80 @@
 
 typedef uint32_t unicodechar;
 typedef struct h64vmthread h64vmthread;
+typedef struct h64gcvalue h64gcvalue;
+typedef struct h64strbuf h64strbuf;
 
+// Small strings are pooled in size classes of 16, 32, ... bytes up to
+// VMSTRINGS_MAXPOOLED, bigger ones use malloc:
+#define VMSTRINGS_SIZECLASSES 6
+#define VMSTRINGS_MAXPOOLED (16 << (VMSTRINGS_SIZECLASSES - 1))
+#define VMSTRINGS_LARGECLASS 0xFF
+
+// Concatenations at least this long may become a rope instead of
+// being copied, if the left side can't be appended to in place:
+#define VMSTRINGS_ROPEMINLEN 1024
+
+// How a string's chars are stored:
+#define H64STRSTORAGE_OWNED 0  // s is owned by this string alone
+#define H64STRSTORAGE_SHAREDBUF 1  // s points into a shared buf
+#define H64STRSTORAGE_ROPE 2  // ropeleft + roperight, not flattened yet
+
+// Strings store each char with 1, 2 or 4 bytes, always the smallest
+// width that fits the largest code point in the string. Since the
+// width is canonical, strings of different widths are never equal.
 typedef struct h64stringval {
-    unicodechar *s;
+    union {
+        char *s;  // len chars of width bytes each
+        h64gcvalue *ropeleft;
+    };
     uint64_t len;
-    int refcount;
+    uint8_t width;
+    uint8_t isascii;  // all code points are below 128
+    uint8_t storage;
+    uint8_t sizeclass;  // of s if storage is H64STRSTORAGE_OWNED
+    uint32_t hash;  // cached by vmmap_StringHash, 0 if not known yet
+    union {
+        h64strbuf *buf;
+        h64gcvalue *roperight;
+    };
 } h64stringval;
 
+// With vthread set to NULL, the string isn't allocated from any thread's
+// pool. It must then also be freed with vthread set to NULL:
 int vmstrings_Set(
-    h64vmthread *vthread, h64stringval *v, uint64_t len
+    h64vmthread *vthread, h64stringval *v, uint64_t len, int width
+);
+
+int vmstrings_SetFromUTF32(
+    h64vmthread *vthread, h64stringval *v,
+    const unicodechar *chars, uint64_t len
 );
 
+// Set result to v1 + v2. The result may share v1's buffer or refer to
+// both values as a rope, so they must be heap values if the result is
+// at least VMSTRINGS_ROPEMINLEN chars long:
+int vmstrings_Concat(
+    h64vmthread *vthread, h64gcvalue *result,
+    h64gcvalue *v1, h64gcvalue *v2
+);
+
+// Turn a rope into a plain string. Anything accessing the chars of a
+// string that may be a rope must call this first:
+int vmstrings_Flatten(h64vmthread *vthread, h64stringval *v);
+
+int vmstrings_Equal(const h64stringval *v1, const h64stringval *v2);
+
+// (for ropes, the collector drops the references to the parts)
 void vmstrings_Free(h64vmthread *vthread, h64stringval *v);
 
+static inline unicodechar vmstrings_CharAt(
+        const h64stringval *v, uint64_t i
+        ) {
+    if (v->width == 1)
+        return ((const uint8_t *)v->s)[i];
+    else if (v->width == 2)
+        return ((const uint16_t *)v->s)[i];
+    return ((const unicodechar *)v->s)[i];
+}
+
 #endif  // HORSE64_VMSTRINGS_H_
@@ -0,0 +1,278 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler/operator.h"
+#include "vmvector.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define VMVECTOR_X86SIMD 1
+#include <immintrin.h>
+#else
+#define VMVECTOR_X86SIMD 0
+#endif
+
+// The kernels work on as many elements at once as the instruction set
+// allows, and the rest is done one by one. Elementwise results are the
+// same on every level, only sums may differ in the last bits since
+// they are added up in a different order.
+static int vmvector_simdlevel = -1;
+static int vmvector_simdlimit = VMVECTOR_SIMD_AVX2;
+
+int vmvector_GetSIMDLevel() {
+    if (vmvector_simdlevel < 0) {
+        int level = VMVECTOR_SIMD_NONE;
+        #if VMVECTOR_X86SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            level = VMVECTOR_SIMD_AVX2;
+        else if (__builtin_cpu_supports("sse2"))
+            level = VMVECTOR_SIMD_SSE2;
+        #endif
+        vmvector_simdlevel = level;
+    }
+    if (vmvector_simdlevel > vmvector_simdlimit)
+        return vmvector_simdlimit;
+    return vmvector_simdlevel;
+}
+
+void vmvector_LimitSIMDLevel(int level) {
+    vmvector_simdlimit = level;
+}
+
+int vmvector_Init(h64vectorval *v, int64_t count) {
+    memset(v, 0, sizeof(*v));
+    if (count < 0)
+        return 0;
+    if (count > VMVECTOR_MAXINLINE) {
+        v->values = calloc(count, sizeof(*v->values));
+        if (!v->values)
+            return 0;
+    }
+    v->count = count;
+    return 1;
+}
+
+void vmvector_Free(h64vectorval *v) {
+    if (v->count > VMVECTOR_MAXINLINE)
+        free(v->values);
+    memset(v, 0, sizeof(*v));
+}
+
+// Each kernel returns how many elements it did, with a scalar
+// ainc/binc of 0 broadcast into all lanes:
+#define VMVECTOR_SCALARKERNEL(name, OP) \
+    static void _vmvector_##name##_scalar( \
+            const double *a, int ainc, const double *b, int binc, \
+            double *out, int64_t count \
+            ) { \
+        int64_t i = 0; \
+        while (i < count) { \
+            out[i] = a[i * ainc] OP b[i * binc]; \
+            i++; \
+        } \
+    }
+
+#if VMVECTOR_X86SIMD
+#define VMVECTOR_SSE2KERNEL(name, INTRIN) \
+    __attribute__((target("sse2"))) \
+    static int64_t _vmvector_##name##_sse2( \
+            const double *a, int ainc, const double *b, int binc, \
+            double *out, int64_t count \
+            ) { \
+        if (count < 2) \
+            return 0; \
+        __m128d va = _mm_set1_pd(a[0]); \
+        __m128d vb = _mm_set1_pd(b[0]); \
+        int64_t i = 0; \
+        while (i + 2 <= count) { \
+            if (ainc) \
+                va = _mm_loadu_pd(a + i); \
+            if (binc) \
+                vb = _mm_loadu_pd(b + i); \
+            _mm_storeu_pd(out + i, INTRIN(va, vb)); \
+            i += 2; \
+        } \
+        return i; \
+    }
+
+#define VMVECTOR_AVX2KERNEL(name, INTRIN) \
+    __attribute__((target("avx2"))) \
+    static int64_t _vmvector_##name##_avx2( \
+            const double *a, int ainc, const double *b, int binc, \
+            double *out, int64_t count \
+            ) { \
+        if (count < 4) \
+            return 0; \
+        __m256d va = _mm256_set1_pd(a[0]); \
+        __m256d vb = _mm256_set1_pd(b[0]); \
+        int64_t i = 0; \
+        while (i + 4 <= count) { \
+            if (ainc) \
+                va = _mm256_loadu_pd(a + i); \
+            if (binc) \
+                vb = _mm256_loadu_pd(b + i); \
+            _mm256_storeu_pd(out + i, INTRIN(va, vb)); \
+            i += 4; \
+        } \
+        return i; \
+    }
+#endif
+
+#if VMVECTOR_X86SIMD
+#define VMVECTOR_KERNELS(name, OP, SSE2INTRIN, AVX2INTRIN) \
+    VMVECTOR_SCALARKERNEL(name, OP) \
+    VMVECTOR_SSE2KERNEL(name, SSE2INTRIN) \
+    VMVECTOR_AVX2KERNEL(name, AVX2INTRIN) \
+    static void _vmvector_##name( \
+            const double *a, int ainc, const double *b, int binc, \
+            double *out, int64_t count \
+            ) { \
+        int64_t done = 0; \
+        int level = vmvector_GetSIMDLevel(); \
+        if (level >= VMVECTOR_SIMD_AVX2) \
+            done = _vmvector_##name##_avx2( \
+                a, ainc, b, binc, out, count); \
+        else if (level >= VMVECTOR_SIMD_SSE2) \
+            done = _vmvector_##name##_sse2( \
+                a, ainc, b, binc, out, count); \
+        _vmvector_##name##_scalar( \
+            a + done * ainc, ainc, b + done * binc, binc, \
+            out + done, count - done); \
+    }
+#else
+#define VMVECTOR_KERNELS(name, OP, SSE2INTRIN, AVX2INTRIN) \
+    VMVECTOR_SCALARKERNEL(name, OP) \
+    static void _vmvector_##name( \
+            const double *a, int ainc, const double *b, int binc, \
+            double *out, int64_t count \
+            ) { \
+        _vmvector_##name##_scalar(a, ainc, b, binc, out, count); \
+    }
+#endif
+
+VMVECTOR_KERNELS(add, +, _mm_add_pd, _mm256_add_pd)
+VMVECTOR_KERNELS(sub, -, _mm_sub_pd, _mm256_sub_pd)
+VMVECTOR_KERNELS(mul, *, _mm_mul_pd, _mm256_mul_pd)
+VMVECTOR_KERNELS(div, /, _mm_div_pd, _mm256_div_pd)
+
+void vmvector_Arith(
+        int op, const double *a, int ainc, const double *b, int binc,
+        double *out, int64_t count
+        ) {
+    assert((ainc == 0 || ainc == 1) && (binc == 0 || binc == 1));
+    switch (op) {
+    case H64OP_MATH_ADD:
+        _vmvector_add(a, ainc, b, binc, out, count);
+        return;
+    case H64OP_MATH_SUBSTRACT:
+        _vmvector_sub(a, ainc, b, binc, out, count);
+        return;
+    case H64OP_MATH_MULTIPLY:
+        _vmvector_mul(a, ainc, b, binc, out, count);
+        return;
+    case H64OP_MATH_DIVIDE:
+        _vmvector_div(a, ainc, b, binc, out, count);
+        return;
+    default:
+        assert(0 && "unsupported vector operator");
+    }
+}
+
+static double _vmvector_Dot_scalar(
+        const double *a, const double *b, int64_t count, int64_t start
+        ) {
+    // (with a == b being NULL for a sum)
+    double result = 0;
+    int64_t i = start;
+    while (i < count) {
+        result += (b ? a[i] * b[i] : a[i]);
+        i++;
+    }
+    return result;
+}
+
+#if VMVECTOR_X86SIMD
+__attribute__((target("sse2")))
+static double _vmvector_Dot_sse2(
+        const double *a, const double *b, int64_t count, int64_t *done
+        ) {
+    __m128d acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd();
+    int64_t i = 0;
+    while (i + 4 <= count) {
+        __m128d a1 = _mm_loadu_pd(a + i);
+        __m128d a2 = _mm_loadu_pd(a + i + 2);
+        if (b) {
+            a1 = _mm_mul_pd(a1, _mm_loadu_pd(b + i));
+            a2 = _mm_mul_pd(a2, _mm_loadu_pd(b + i + 2));
+        }
+        acc1 = _mm_add_pd(acc1, a1);
+        acc2 = _mm_add_pd(acc2, a2);
+        i += 4;
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc1, acc2));
+    *done = i;
+    return lanes[0] + lanes[1];
+}
+
+__attribute__((target("avx2")))
+static double _vmvector_Dot_avx2(
+        const double *a, const double *b, int64_t count, int64_t *done
+        ) {
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd();
+    int64_t i = 0;
+    while (i + 8 <= count) {
+        __m256d a1 = _mm256_loadu_pd(a + i);
+        __m256d a2 = _mm256_loadu_pd(a + i + 4);
+        if (b) {
+            a1 = _mm256_mul_pd(a1, _mm256_loadu_pd(b + i));
+            a2 = _mm256_mul_pd(a2, _mm256_loadu_pd(b + i + 4));
+        }
+        acc1 = _mm256_add_pd(acc1, a1);
+        acc2 = _mm256_add_pd(acc2, a2);
+        i += 8;
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc1, acc2));
+    *done = i;
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+#endif
+
+static double _vmvector_Dot(
+        const double *a, const double *b, int64_t count
+        ) {
+    double result = 0;
+    int64_t done = 0;
+    #if VMVECTOR_X86SIMD
+    int level = vmvector_GetSIMDLevel();
+    if (level >= VMVECTOR_SIMD_AVX2)
+        result = _vmvector_Dot_avx2(a, b, count, &done);
+    else if (level >= VMVECTOR_SIMD_SSE2)
+        result = _vmvector_Dot_sse2(a, b, count, &done);
+    #endif
+    return result + _vmvector_Dot_scalar(a, b, count, done);
+}
+
+double vmvector_Sum(const double *a, int64_t count) {
+    return _vmvector_Dot(a, NULL, count);
+}
+
+double vmvector_Dot(const double *a, const double *b, int64_t count) {
+    assert(b != NULL);
+    return _vmvector_Dot(a, b, count);
+}
+
+double vmvector_Length(const double *a, int64_t count) {
+    return sqrt(_vmvector_Dot(a, a, count));
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef HORSE64_VMVECTOR_H_
+#define HORSE64_VMVECTOR_H_
+
+#include <stdint.h>
+
+// Vectorized arithmetic kernels, picked at runtime:
+#define VMVECTOR_SIMD_NONE 0
+#define VMVECTOR_SIMD_SSE2 1
+#define VMVECTOR_SIMD_AVX2 2
+
+int vmvector_GetSIMDLevel();
+
+// Use at most the given level, e.g. to compare the code paths:
+void vmvector_LimitSIMDLevel(int level);
+
+// Vectors are fixed size and store their numbers unboxed as doubles.
+// Up to VMVECTOR_MAXINLINE of them are stored inline, such that the
+// common 2d and 3d vectors need no allocation of their own:
+#define VMVECTOR_MAXINLINE 3
+
+typedef struct h64vectorval {
+    int64_t count;
+    union {
+        double *values;
+        double inlinevalues[VMVECTOR_MAXINLINE];
+    };
+} h64vectorval;
+
+static inline double *vmvector_Values(h64vectorval *v) {
+    if (v->count <= VMVECTOR_MAXINLINE)
+        return v->inlinevalues;
+    return v->values;
+}
+
+// Sets up a vector of count zeros:
+int vmvector_Init(h64vectorval *v, int64_t count);
+
+// Elementwise out[i] = a[i] op b[i] for op being one of H64OP_MATH_ADD,
+// H64OP_MATH_SUBSTRACT, H64OP_MATH_MULTIPLY and H64OP_MATH_DIVIDE.
+// With ainc or binc set to 0 instead of 1, that side is a scalar used
+// for every element. out may be the same as a or b:
+void vmvector_Arith(
+    int op, const double *a, int ainc, const double *b, int binc,
+    double *out, int64_t count
+);
+
+double vmvector_Sum(const double *a, int64_t count);
+
+double vmvector_Dot(const double *a, const double *b, int64_t count);
+
+// The euclidean length:
+double vmvector_Length(const double *a, int64_t count);
+
+void vmvector_Free(h64vectorval *v);
+
+#endif  // HORSE64_VMVECTOR_H_
@@ -0,0 +1,109 @@
+// Copyright (c) 2020, ellie/@ell1e & Horse64 Team (see AUTHORS.md),
+// also see LICENSE.md file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+// Measures UTF-8 <-> UTF-32 throughput for each SIMD level.
+// Build and run with: make bench-unicode
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "unicode.h"
+
+#define BENCH_INPUTBYTES (1024 * 1024)
+#define BENCH_ROUNDS 100
+
+static double _now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static char *_makeinput(const char *pattern) {
+    int64_t patternlen = strlen(pattern);
+    char *s = malloc(BENCH_INPUTBYTES + 1);
+    if (!s)
+        return NULL;
+    int64_t i = 0;
+    while (i + patternlen <= BENCH_INPUTBYTES) {
+        memcpy(s + i, pattern, patternlen);
+        i += patternlen;
+    }
+    s[i] = '\0';
+    return s;
+}
+
+static void _bench(const char *name, const char *input) {
+    int64_t input_len = strlen(input);
+    char *back = malloc(input_len + 1);
+    if (!back) {
+        fprintf(stderr, "bench-unicode: out of memory\n");
+        exit(1);
+    }
+    int maxlevel = unicode_GetSIMDLevel();
+    int level = UNICODE_SIMD_NONE;
+    while (level <= maxlevel) {
+        unicode_LimitSIMDLevel(level);
+        int64_t chars_len = 0;
+        double start = _now();
+        int i = 0;
+        while (i < BENCH_ROUNDS) {
+            free(utf8_to_utf32(
+                input, input_len, NULL, NULL, &chars_len
+            ));
+            i++;
+        }
+        double decodetime = _now() - start;
+
+        unicodechar *decoded = utf8_to_utf32(
+            input, input_len, NULL, NULL, &chars_len
+        );
+        int64_t back_len = 0;
+        start = _now();
+        i = 0;
+        while (i < BENCH_ROUNDS) {
+            utf32_to_utf8(
+                decoded, chars_len, back, input_len + 1, &back_len, 1
+            );
+            i++;
+        }
+        double encodetime = _now() - start;
+        free(decoded);
+
+        double mb = (double)input_len * BENCH_ROUNDS / 1000000.0;
+        printf("%-6s level=%s utf8->utf32: %8.1f MB/s  "
+               "utf32->utf8: %8.1f MB/s\n", name,
+               (level == UNICODE_SIMD_AVX2 ? "avx2" :
+                (level == UNICODE_SIMD_SSE2 ? "sse2" : "none")),
+               mb / decodetime, mb / encodetime);
+        level++;
+    }
+    unicode_LimitSIMDLevel(UNICODE_SIMD_AVX2);
+    free(back);
+}
+
+int main() {
+    char *ascii = _makeinput(
+        "The quick brown fox jumps over the lazy dog. "
+    );
+    char *mixed = _makeinput(
+        "Gr\xc3\xbc\xc3\x9f" "e aus K\xc3\xb6ln, das ist sch\xc3\xb6n. "
+    );
+    char *cjk = _makeinput(
+        "\xe4\xb8\xad\xe6\x96\x87\xe6\x96\x87\xe6\x9c\xac\xe3\x80\x82"
+    );
+    if (!ascii || !mixed || !cjk) {
+        fprintf(stderr, "bench-unicode: out of memory\n");
+        return 1;
+    }
+    _bench("ascii", ascii);
+    _bench("mixed", mixed);
+    _bench("cjk", cjk);
+    free(ascii);
+    free(mixed);
+    free(cjk);
+    return 0;
+}